@@ -508,6 +508,10 @@ _TIFFVSetField(TIFF* tif, uint32_t tag, va_list ap)
 		s = (char*) va_arg(ap, char*);
 		_TIFFsetString(&td->td_ndpifluorescence, s);
 		break;
+	case NDPITAG_MCUSTARTS:
+		td->td_ndpinmcustarts = va_arg(ap, uint32_t);
+		_TIFFsetLongArray(&td->td_ndpimcustarts, va_arg(ap, uint32_t*), (long) td->td_ndpinmcustarts);
+		break;
 	case TIFFTAG_PERSAMPLE:
 		v = (uint16_t) va_arg(ap, uint16_vap);
 		if( v == PERSAMPLE_MULTI )
@@ -1155,6 +1159,10 @@ _TIFFVGetField(TIFF* tif, uint32_t tag, va_list ap)
 		case NDPITAG_FLUORESCENCE:
 			*va_arg(ap, char**) = td->td_ndpifluorescence;
 			break;
+		case NDPITAG_MCUSTARTS:
+			*va_arg(ap, uint32_t*) = td->td_ndpinmcustarts;
+			*va_arg(ap, uint32_t**) = td->td_ndpimcustarts;
+			break;
 		default:
 			{
 				int i;
@@ -1364,6 +1372,7 @@ TIFFFreeDirectory(TIFF* tif)
 	CleanupField(td_transferfunction[2]);
 	CleanupField(td_stripoffset_p);
 	CleanupField(td_stripbytecount_p);
+	CleanupField(td_ndpimcustarts);
         td->td_stripoffsetbyteallocsize = 0;
 	TIFFClrFieldBit(tif, FIELD_YCBCRSUBSAMPLING);
 	TIFFClrFieldBit(tif, FIELD_YCBCRPOSITIONING);
@@ -1741,6 +1750,12 @@ int
 TIFFSetSubDirectory(TIFF* tif, uint64_t diroff)
 {
 	tif->tif_nextdiroff = diroff;
+	/*
+	 * diroff is a complete offset: TIFFReadDirectory mustn't complete
+	 * it from the offset of the current directory as it does for the
+	 * 32-bit offsets of next directories of NDPI files.
+	 */
+	tif->tif_diroff = 0;
 	/*
 	 * Reset tif_dirnumber counter and start new list of seen directories.
 	 * We need this to prevent IFD loops.
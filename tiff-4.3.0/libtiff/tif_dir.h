@@ -125,6 +125,8 @@ typedef struct {
 	uint32_t*	td_ndpiblanklanes;
 	char*	td_ndpicomments;
 	char*	td_ndpifluorescence;
+	uint32_t	td_ndpinmcustarts;
+	uint32_t*	td_ndpimcustarts;
 
 	int     td_customValueCount;
         TIFFTagValue *td_customValues;
@@ -188,6 +190,7 @@ typedef struct {
 #define FIELD_NDPIBLANKLANES           53
 #define FIELD_NDPICOMMENTS             54
 #define FIELD_NDPIFLUORESCENCE         55
+#define FIELD_NDPIMCUSTARTS            56
 /*      FIELD_CUSTOM (see tiffio.h)    65 */
 /* end of support for well-known tags; codec-private tags follow */
 #define FIELD_CODEC                    66  /* base of codec-private tags */
@@ -235,7 +235,7 @@ tiffFields[] = {
 	{ NDPITAG_65423, 0, 0, TIFF_SLONG, 0, TIFF_SETGET_UNDEFINED, TIFF_SETGET_UNDEFINED, FIELD_CUSTOM, TRUE, FALSE, "NDPI65423", NULL},
 	{ NDPITAG_ZOFFSET, 1, 1, TIFF_SLONG, 0, TIFF_SETGET_UINT32, TIFF_SETGET_UINT32, FIELD_NDPIZOFFSET, TRUE, FALSE, "NDPIZOffset", NULL},
 	{ NDPITAG_65425, 0, 0, TIFF_LONG, 0, TIFF_SETGET_UNDEFINED, TIFF_SETGET_UNDEFINED, FIELD_CUSTOM, TRUE, FALSE, "NDPI65425", NULL},
-	{ NDPITAG_65426, 0, 0, TIFF_LONG, 0, TIFF_SETGET_UNDEFINED, TIFF_SETGET_UNDEFINED, FIELD_CUSTOM, TRUE, FALSE, "NDPI65426", NULL},
+	{ NDPITAG_MCUSTARTS, -3, -3, TIFF_LONG, 0, TIFF_SETGET_C32_UINT32, TIFF_SETGET_C32_UINT32, FIELD_NDPIMCUSTARTS, TRUE, TRUE, "NDPIMCUStarts", NULL},
 	{ NDPITAG_USERGIVENSLIDELABEL, 0, 0, TIFF_ASCII, 0, TIFF_SETGET_ASCII, TIFF_SETGET_UNDEFINED, FIELD_NDPIUSERGIVENSLIDELABEL, TRUE, FALSE, "NDPIUserGivenSlideLabel", NULL},
 	{ NDPITAG_65428, 0, 0, TIFF_LONG, 0, TIFF_SETGET_UNDEFINED, TIFF_SETGET_UNDEFINED, FIELD_CUSTOM, TRUE, FALSE, "NDPI65428", NULL},
 	{ NDPITAG_65430, 0, 0, TIFF_FLOAT, 0, TIFF_SETGET_FLOAT, TIFF_SETGET_FLOAT, FIELD_CUSTOM, TRUE, FALSE, "NDPI65430", NULL},
@@ -29,6 +29,11 @@
 
 TIFFErrorHandlerExt _TIFFerrorHandlerExt = NULL;
 
+/*
+ * The handlers are shared by all threads. They should be set before
+ * threads using libtiff are started, and be safe to call from several
+ * threads at once.
+ */
 TIFFErrorHandler
 TIFFSetErrorHandler(TIFFErrorHandler handler)
 {
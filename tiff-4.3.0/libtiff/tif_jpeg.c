@@ -48,6 +48,8 @@ int TIFFFillStrip(TIFF* tif, uint32_t strip);
 int TIFFFillTile(TIFF* tif, uint32_t tile);
 int TIFFReInitJPEG_12( TIFF *tif, int scheme, int is_encode );
 int TIFFJPEGIsFullStripRequired_12(TIFF* tif);
+int TIFFJPEGSetDecodeWindow_12(TIFF* tif, uint32_t xoffset, uint32_t width);
+int TIFFNDPIHasUsableMCUStarts_12(TIFF* tif);
 
 /* We undefine FAR to avoid conflict with JPEG definition */
 
@@ -100,6 +102,21 @@ int TIFFJPEGIsFullStripRequired_12(TIFF* tif);
 #  define JPEG_LIB_MK1_OR_12BIT 1
 #endif
 
+/*
+ * libjpeg-turbo has jpeg_skip_scanlines() since version 1.5, which
+ * discards rows without the IDCT, upsampling and color conversion work
+ * done by jpeg_read_scanlines(): use it for forward seeks (JPEGSeek).
+ * The same version has jpeg_crop_scanline(), which restricts decoding
+ * to the columns asked for with TIFFJPEGSetDecodeWindow().
+ */
+#if defined(LIBJPEG_TURBO_VERSION_NUMBER) && \
+    LIBJPEG_TURBO_VERSION_NUMBER >= 1005000
+#  define JPEG_LIB_HAS_SKIP_SCANLINES 1
+#  if !JPEG_LIB_MK1_OR_12BIT
+#    define JPEG_LIB_HAS_CROP_SCANLINE 1
+#  endif
+#endif
+
 /*
  * We are using width_in_blocks which is supposed to be private to
  * libjpeg. Unfortunately, the libjpeg delivered with Cygwin has
@@ -179,6 +196,20 @@ typedef struct {
 
         int             ycbcrsampling_fetched;
         int             max_allowed_scan_number;
+
+	/* NDPI restart-interval index, see JPEGSeek() */
+	int		restartindexstate; /* 0 = not built, 1 = usable, -1 = not */
+	uint64_t*	restartoffsets;	/* offsets of the intervals in the strip */
+	uint32_t	nrestartoffsets;
+	uint8_t*	restartheader;	/* strip header up to the end of SOS */
+	uint32_t	restartheader_length;
+	uint32_t	restartheader_sofheight; /* offset of the SOF height */
+	int		restartbias;	/* RSTn numbering offset after a restart */
+
+	/* Horizontal decode window, see TIFFJPEGSetDecodeWindow() */
+	uint32_t	windowxoffset;
+	uint32_t	windowwidth;	/* 0 = whole width */
+	tmsize_t	windowbyteoffset; /* of the decoded columns in a row */
 } JPEGState;
 
 #define	JState(tif)	((JPEGState*)(tif)->tif_data)
@@ -189,6 +220,7 @@ static int JPEGEncode(TIFF* tif, uint8_t* buf, tmsize_t cc, uint16_t s);
 static int JPEGEncodeRaw(TIFF* tif, uint8_t* buf, tmsize_t cc, uint16_t s);
 static int JPEGInitializeLibJPEG(TIFF * tif, int decode );
 static int DecodeRowError(TIFF* tif, uint8_t* buf, tmsize_t cc, uint16_t s);
+static int JPEGSeek(TIFF* tif, uint32_t nrows);
 
 #define	FIELD_JPEGTABLES	(FIELD_CODEC+0)
 
@@ -395,6 +427,23 @@ TIFFjpeg_read_scanlines(JPEGState* sp, JSAMPARRAY scanlines, int max_lines)
 	    scanlines, (JDIMENSION) max_lines));
 }
 
+#ifdef JPEG_LIB_HAS_CROP_SCANLINE
+static int
+TIFFjpeg_crop_scanline(JPEGState* sp, JDIMENSION* xoffset, JDIMENSION* width)
+{
+	return CALLVJPEG(sp, jpeg_crop_scanline(&sp->cinfo.d, xoffset, width));
+}
+#endif
+
+#ifdef JPEG_LIB_HAS_SKIP_SCANLINES
+static int
+TIFFjpeg_skip_scanlines(JPEGState* sp, uint32_t num_lines)
+{
+	return CALLJPEG(sp, -1, (int) jpeg_skip_scanlines(&sp->cinfo.d,
+	    (JDIMENSION) num_lines));
+}
+#endif
+
 static int
 TIFFjpeg_read_raw_data(JPEGState* sp, JSAMPIMAGE data, int max_lines)
 {
@@ -669,6 +718,38 @@ TIFFjpeg_tables_src(JPEGState* sp)
 	sp->src.init_source = tables_init_source;
 }
 
+/*
+ * Alternate source manager used when restarting the decoder in the
+ * middle of a strip (see JPEGSeek): the header is read from a copy of
+ * the strip header, the entropy-coded data from the strip itself.
+ */
+
+static void
+restart_init_source(j_decompress_ptr cinfo)
+{
+	JPEGState* sp = (JPEGState*) cinfo;
+
+	sp->src.next_input_byte = (const JOCTET*) sp->restartheader;
+	sp->src.bytes_in_buffer = (size_t) sp->restartheader_length;
+}
+
+/*
+ * After a restart at interval k, libjpeg expects RST0 where the
+ * stream has RST(k mod 8): accept the marker shifted by restartbias.
+ */
+static boolean
+restart_resync_to_restart(j_decompress_ptr cinfo, int desired)
+{
+	JPEGState* sp = (JPEGState*) cinfo;
+
+	if (sp->restartbias != 0 &&
+	    cinfo->unread_marker == JPEG_RST0 + ((desired + sp->restartbias) & 7)) {
+		cinfo->unread_marker = 0;
+		return (TRUE);
+	}
+	return (jpeg_resync_to_restart(cinfo, desired));
+}
+
 /*
  * Allocate downsampled-data buffers needed for downsampled I/O.
  * We use values computed in jpeg_start_compress or jpeg_start_decompress.
@@ -1085,6 +1166,42 @@ int TIFFJPEGIsFullStripRequired(TIFF* tif)
     return ret;
 }
 
+/*
+ * Restrict decoding to the columns of the decode window, plus one iMCU
+ * column on each side so that fancy upsampling gives the same pixels as
+ * when decoding whole rows.  Called right after jpeg_start_decompress().
+ */
+static int
+JPEGApplyDecodeWindow(TIFF* tif)
+{
+	JPEGState* sp = JState(tif);
+#ifdef JPEG_LIB_HAS_CROP_SCANLINE
+	JDIMENSION xoffset, width, margin;
+#endif
+
+	sp->windowbyteoffset = 0;
+#ifdef JPEG_LIB_HAS_CROP_SCANLINE
+	if (sp->windowwidth == 0 || isTiled(tif) || sp->cinfo.d.raw_data_out ||
+	    sp->cinfo.d.output_width != tif->tif_dir.td_imagewidth)
+		return (1);
+	margin = DCTSIZE * sp->cinfo.d.max_h_samp_factor;
+	xoffset = sp->windowxoffset > margin ? sp->windowxoffset - margin : 0;
+	if (sp->windowxoffset >= sp->cinfo.d.output_width)
+		return (1);
+	width = sp->cinfo.d.output_width - xoffset;
+	if ((uint64_t) sp->windowxoffset + sp->windowwidth + margin <
+	    sp->cinfo.d.output_width)
+		width = sp->windowxoffset + sp->windowwidth + margin - xoffset;
+	if (width == sp->cinfo.d.output_width)
+		return (1);
+	if (!TIFFjpeg_crop_scanline(sp, &xoffset, &width))
+		return (0);
+	sp->windowbyteoffset = (tmsize_t) xoffset *
+	    sp->cinfo.d.output_components;
+#endif
+	return (1);
+}
+
 /*
  * Set up for decoding a strip or tile.
  */
@@ -1112,6 +1229,7 @@ JPEGPreDecode(TIFF* tif, uint16_t s)
 	 */
 	if (!TIFFjpeg_abort(sp))
 		return (0);
+	sp->restartbias = 0;
 
 	if (isTiled(tif)) {
                 segment_width = td->td_tilewidth;
@@ -1326,6 +1444,8 @@ JPEGPreDecode(TIFF* tif, uint16_t s)
 	/* Start JPEG decompressor */
 	if (!TIFFjpeg_start_decompress(sp))
 		return (0);
+	if (!JPEGApplyDecodeWindow(tif))
+		return (0);
 	/* Allocate downsampled-data buffers if needed */
 	if (downsampled_output) {
 		if (!alloc_downsampled_buffers(tif, sp->cinfo.d.comp_info,
@@ -1367,23 +1487,33 @@ JPEGDecode(TIFF* tif, uint8_t* buf, tmsize_t cc, uint16_t s)
 		nrows = sp->cinfo.d.image_height;
 
 	/* data is expected to be read in multiples of a scanline */
-	if (nrows)
+	while (nrows > 0)
         {
-                do
-                {
-                        /*
-                         * In the libjpeg6b-9a 8bit case.  We read directly into
-                         * the TIFF buffer.
-                         */
-                        JSAMPROW bufptr = (JSAMPROW)buf;
-
-                        if (TIFFjpeg_read_scanlines(sp, &bufptr, 1) != 1)
-                                return (0);
-
-                        ++tif->tif_row;
-                        buf += sp->bytesperline;
-                        cc -= sp->bytesperline;
-                } while (--nrows > 0);
+                /*
+                 * In the libjpeg6b-9a 8bit case.  We read directly into
+                 * the TIFF buffer, handing libjpeg up to a full iMCU row
+                 * group at a time when several rows are requested.
+                 */
+                JSAMPROW bufptrs[MAX_SAMP_FACTOR * DCTSIZE];
+                int i, n, nread;
+
+                n = sp->cinfo.d.max_v_samp_factor * DCTSIZE;
+                if (n > MAX_SAMP_FACTOR * DCTSIZE)
+                        n = MAX_SAMP_FACTOR * DCTSIZE;
+                if ((tmsize_t) n > nrows)
+                        n = (int) nrows;
+                for (i = 0; i < n; i++)
+                        bufptrs[i] = (JSAMPROW)(buf + sp->windowbyteoffset +
+                            i * sp->bytesperline);
+
+                nread = TIFFjpeg_read_scanlines(sp, bufptrs, n);
+                if (nread <= 0)
+                        return (0);
+
+                tif->tif_row += nread;
+                buf += nread * sp->bytesperline;
+                cc -= nread * sp->bytesperline;
+                nrows -= nread;
         }
 
         /* Update information on consumed data */
@@ -1515,6 +1645,515 @@ DecodeRowError(TIFF* tif, uint8_t* buf, tmsize_t cc, uint16_t s)
     return 0;
 }
 
+/*
+ * Random access within a strip.
+ *
+ * NDPI images are stored as one JPEG strip with a restart marker
+ * every few MCUs, and the NDPIMCUStarts tag gives the offset of each
+ * restart interval relative to the start of the strip.  Instead of
+ * decoding every row from the top of the strip, we restart libjpeg
+ * on a copy of the strip header (with the image height in SOF set to
+ * the number of remaining rows) followed by the restart interval
+ * beginning the MCU row which contains the wanted row, then decode
+ * forward from there.  Without a usable index, we just decode and
+ * discard the rows in between.
+ */
+
+/*
+ * Walk the markers of a JPEG header.  Returns the offset of the end
+ * of the SOS segment, where the entropy-coded data begins, and the
+ * offset of the image height in SOF, or 0 if no complete header with
+ * a SOF is found in the first size bytes.
+ */
+static uint32_t
+JPEGFindScanStart(const uint8_t* data, uint64_t size, uint32_t* sofheight)
+{
+	uint64_t pos = 2;
+
+	*sofheight = 0;
+	if (size < 4 || data[0] != 0xFF || data[1] != 0xD8)
+		return (0);
+	for (;;) {
+		uint8_t marker;
+		uint32_t length;
+
+		while (pos < size && data[pos] == 0xFF)
+			pos++;
+		if (pos + 3 > size || pos > 0xFFFFFFFFU)
+			return (0);
+		marker = data[pos];
+		length = ((uint32_t) data[pos+1] << 8) | data[pos+2];
+		if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 &&
+		    marker != 0xC8 && marker != 0xCC)
+			*sofheight = (uint32_t) pos + 4;
+		pos += 1 + length;
+		if (marker == 0xDA)		/* SOS */
+			break;
+		if (marker == JPEG_EOI)
+			return (0);
+	}
+	if (pos > size || pos > 0xFFFFFFFFU || *sofheight == 0)
+		return (0);
+	return ((uint32_t) pos);
+}
+
+/*
+ * Copy size bytes of the strip, from offset (relative to the start of
+ * the strip) on, into buf: from the raw data if they are loaded, from
+ * the file if not (the strip is then read in chunks).
+ */
+static int
+JPEGReadStripBytes(TIFF* tif, uint64_t offset, uint8_t* buf, tmsize_t size)
+{
+	uint64_t stripoffset = TIFFGetStrileOffset(tif, 0);
+
+	if (tif->tif_rawdata != NULL && tif->tif_curstrip == 0 &&
+	    offset >= (uint64_t) tif->tif_rawdataoff &&
+	    offset + size <= (uint64_t) tif->tif_rawdataoff +
+	    (uint64_t) tif->tif_rawdataloaded) {
+		_TIFFmemcpy(buf, tif->tif_rawdata +
+		    (offset - tif->tif_rawdataoff), size);
+		return (1);
+	}
+	if (isMapped(tif)) {
+		if (stripoffset + offset + size > (uint64_t) tif->tif_size)
+			return (0);
+		_TIFFmemcpy(buf, tif->tif_base + stripoffset + offset, size);
+		return (1);
+	}
+	return (SeekOK(tif, stripoffset + offset) && ReadOK(tif, buf, size));
+}
+
+/*
+ * Check the NDPIMCUStarts tag against the strip data and keep a copy
+ * of the strip header.  Sets restartindexstate to 1 if the index is
+ * usable, -1 otherwise.  The strip need not be loaded in whole.
+ */
+static void
+JPEGBuildRestartIndex(TIFF* tif)
+{
+	static const char module[] = "JPEGBuildRestartIndex";
+	JPEGState *sp = JState(tif);
+	TIFFDirectory *td = &tif->tif_dir;
+	uint64_t bytecount;
+	uint64_t high = 0;
+	uint32_t u, hdrlen, sofheight;
+	uint8_t* header;
+
+	sp->restartindexstate = -1;
+	if (!TIFFFieldSet(tif, FIELD_NDPIMCUSTARTS) ||
+	    td->td_ndpinmcustarts == 0 || isTiled(tif) ||
+	    td->td_nstrips != 1 ||
+	    td->td_planarconfig != PLANARCONFIG_CONTIG)
+		return;
+	bytecount = TIFFGetStrileByteCount(tif, 0);
+
+	if (sp->restartoffsets)
+		_TIFFfree(sp->restartoffsets);
+	sp->restartoffsets = (uint64_t*) _TIFFCheckMalloc(tif,
+	    td->td_ndpinmcustarts, sizeof(uint64_t), module);
+	if (sp->restartoffsets == NULL)
+		return;
+	sp->nrestartoffsets = td->td_ndpinmcustarts;
+
+	/*
+	 * The tag only holds the low 32 bits of the offsets: as they are
+	 * increasing, a decrease means we crossed a 4 GB boundary.
+	 */
+	for (u = 0; u < td->td_ndpinmcustarts; u++) {
+		uint64_t off = high + td->td_ndpimcustarts[u];
+
+		if (u > 0 && off <= sp->restartoffsets[u-1]) {
+			high += 0x100000000ULL;
+			off += 0x100000000ULL;
+		}
+		sp->restartoffsets[u] = off;
+	}
+	if (sp->restartoffsets[0] < 4 ||
+	    sp->restartoffsets[0] > 0xFFFFFFFFU ||
+	    sp->restartoffsets[sp->nrestartoffsets-1] >= bytecount)
+		goto bad;
+
+	/*
+	 * The header must run from SOI to the end of SOS, where the first
+	 * restart interval begins.
+	 */
+	hdrlen = (uint32_t) sp->restartoffsets[0];
+	header = (uint8_t*) _TIFFmalloc(hdrlen);
+	if (header == NULL)
+		return;
+	if (!JPEGReadStripBytes(tif, 0, header, hdrlen)) {
+		TIFFErrorExt(tif->tif_clientdata, module,
+		    "Can't read JPEG header of strip");
+		_TIFFfree(header);
+		return;
+	}
+	if (JPEGFindScanStart(header, hdrlen, &sofheight) != hdrlen) {
+		_TIFFfree(header);
+		goto bad;
+	}
+
+	if (sp->restartheader)
+		_TIFFfree(sp->restartheader);
+	sp->restartheader = header;
+	sp->restartheader_length = hdrlen;
+	sp->restartheader_sofheight = sofheight;
+	sp->restartindexstate = 1;
+	return;
+bad:
+	TIFFWarningExt(tif->tif_clientdata, module,
+	    "Ignoring NDPI MCU starts not matching the JPEG data");
+}
+
+/*
+ * Restart the decoder at the last restart interval beginning an
+ * MCU row not after row, when that is ahead of the current row.
+ * Leaves the decoder untouched if there is nothing to gain.
+ */
+static int
+JPEGRestartNear(TIFF* tif, uint32_t row)
+{
+	JPEGState *sp = JState(tif);
+	TIFFDirectory *td = &tif->tif_dir;
+	uint32_t mcuwidth, mcuheight, mcusperrow, restartinterval;
+	uint32_t mcurow, remaining;
+	uint64_t k, off;
+	uint8_t marker[2];
+	J_COLOR_SPACE jpeg_color_space, out_color_space;
+	int ret;
+
+	if (sp->restartindexstate == 0)
+		JPEGBuildRestartIndex(tif);
+	if (sp->restartindexstate < 0 || sp->cinfo.d.raw_data_out ||
+	    sp->cinfo.d.restart_interval == 0 ||
+	    TIFFjpeg_has_multiple_scans(sp))
+		return (1);
+
+	if (sp->cinfo.d.num_components == 1) {
+		mcuwidth = DCTSIZE;
+		mcuheight = DCTSIZE;
+	} else {
+		mcuwidth = sp->cinfo.d.max_h_samp_factor * DCTSIZE;
+		mcuheight = sp->cinfo.d.max_v_samp_factor * DCTSIZE;
+	}
+	mcusperrow = TIFFhowmany_32(td->td_imagewidth, mcuwidth);
+	restartinterval = sp->cinfo.d.restart_interval;
+
+	/*
+	 * Find an MCU row starting with a restart interval.  With vertical
+	 * fancy upsampling, the first row of an MCU row depends on the
+	 * chroma of the previous MCU row, so it can't be a restart point.
+	 */
+	mcurow = row / mcuheight;
+	if (sp->cinfo.d.do_fancy_upsampling &&
+	    sp->cinfo.d.max_v_samp_factor > 1 && row > 0)
+		mcurow = (row - 1) / mcuheight;
+	for (; mcurow > 0; mcurow--)
+		if (((uint64_t) mcurow * mcusperrow) % restartinterval == 0)
+			break;
+	if (mcurow == 0 || mcurow * mcuheight <= tif->tif_row)
+		return (1);
+	k = ((uint64_t) mcurow * mcusperrow) / restartinterval;
+	if (k >= sp->nrestartoffsets)
+		return (1);
+	off = sp->restartoffsets[k];
+	if (!JPEGReadStripBytes(tif, off - 2, marker, 2) ||
+	    marker[0] != 0xFF || marker[1] != JPEG_RST0 + ((k - 1) & 7)) {
+		TIFFWarningExt(tif->tif_clientdata, "JPEGSeek",
+		    "No restart marker at NDPI MCU start %"PRIu64", "
+		    "ignoring NDPI MCU starts", k);
+		sp->restartindexstate = -1;
+		return (1);
+	}
+
+	jpeg_color_space = sp->cinfo.d.jpeg_color_space;
+	out_color_space = sp->cinfo.d.out_color_space;
+	if (!TIFFjpeg_abort(sp))
+		return (0);
+
+	/*
+	 * When the strip is read in chunks, load it from the restart
+	 * interval on.
+	 */
+	if (off < (uint64_t) tif->tif_rawdataoff ||
+	    off >= (uint64_t) tif->tif_rawdataoff + tif->tif_rawdataloaded) {
+		if (!_TIFFFillStripPartialAt(tif, 0, off)) {
+			TIFFErrorExt(tif->tif_clientdata, "JPEGSeek",
+			    "Can't read strip data at NDPI MCU start %"PRIu64,
+			    k);
+			return (0);
+		}
+	}
+
+	remaining = td->td_imagelength - mcurow * mcuheight;
+	sp->restartheader[sp->restartheader_sofheight] =
+	    (uint8_t) (remaining >> 8);
+	sp->restartheader[sp->restartheader_sofheight+1] =
+	    (uint8_t) remaining;
+	sp->cinfo.d.image_width = 0;
+	sp->cinfo.d.image_height = 0;
+	if (td->td_imagewidth >= 65500L)
+		sp->cinfo.d.image_width = td->td_imagewidth;
+	if (remaining >= 65500L)
+		sp->cinfo.d.image_height = remaining;
+
+	sp->src.init_source = restart_init_source;
+	ret = TIFFjpeg_read_header(sp, TRUE);
+	sp->src.init_source = std_init_source;
+	if (ret != JPEG_HEADER_OK)
+		return (0);
+
+	sp->cinfo.d.jpeg_color_space = jpeg_color_space;
+	sp->cinfo.d.out_color_space = out_color_space;
+	sp->cinfo.d.raw_data_out = FALSE;
+	sp->restartbias = (int) (k & 7);
+	sp->src.resync_to_restart = restart_resync_to_restart;
+	sp->src.next_input_byte = (const JOCTET*) tif->tif_rawdata +
+	    (off - tif->tif_rawdataoff);
+	sp->src.bytes_in_buffer = (size_t) (tif->tif_rawdataloaded -
+	    (off - tif->tif_rawdataoff));
+	if (!TIFFjpeg_start_decompress(sp))
+		return (0);
+	if (!JPEGApplyDecodeWindow(tif))
+		return (0);
+
+	tif->tif_rawcp = (uint8_t*) sp->src.next_input_byte;
+	tif->tif_rawcc = sp->src.bytes_in_buffer;
+	tif->tif_row = mcurow * mcuheight;
+	return (1);
+}
+
+static int
+JPEGSeek(TIFF* tif, uint32_t nrows)
+{
+	JPEGState *sp = JState(tif);
+	uint32_t row = tif->tif_row + nrows;
+	uint8_t* scanline;
+	int status = 1;
+
+	if (!JPEGRestartNear(tif, row))
+		return (0);
+	if (tif->tif_row >= row)
+		return (1);
+
+#ifdef JPEG_LIB_HAS_SKIP_SCANLINES
+	/*
+	 * Rows past the end of the JPEG image are left to the decoder,
+	 * and so is the raw (downsampled) mode that has no scanlines.
+	 */
+	if (!sp->cinfo.d.raw_data_out &&
+	    sp->cinfo.d.output_scanline + (row - tif->tif_row) <
+	    sp->cinfo.d.output_height) {
+		uint32_t n = row - tif->tif_row;
+
+		sp->src.next_input_byte = (const JOCTET*) tif->tif_rawcp;
+		sp->src.bytes_in_buffer = (size_t) tif->tif_rawcc;
+		if (TIFFjpeg_skip_scanlines(sp, n) != (int) n)
+			return (0);
+		tif->tif_rawcp = (uint8_t*) sp->src.next_input_byte;
+		tif->tif_rawcc = sp->src.bytes_in_buffer;
+		tif->tif_row = row;
+		return (1);
+	}
+#endif
+
+	scanline = (uint8_t*) _TIFFmalloc(sp->bytesperline);
+	if (scanline == NULL) {
+		TIFFErrorExt(tif->tif_clientdata, "JPEGSeek",
+		    "No space for scanline buffer");
+		return (0);
+	}
+	while (tif->tif_row < row)
+		if ((*tif->tif_decoderow)(tif, scanline,
+		    sp->bytesperline, 0) <= 0) {
+			status = 0;
+			break;
+		}
+	_TIFFfree(scanline);
+	return (status);
+}
+
+/*
+ * Restrict the decoding of the scanlines of a strip-organized JPEG image
+ * to columns xoffset to xoffset+width-1 (width 0: whole rows), e.g. when
+ * only a narrow box of a very wide image is wanted. Scanlines keep their
+ * full size, but the contents of the other columns are then undefined.
+ * Has no effect when libjpeg can't crop scanlines (jpeg_crop_scanline()
+ * of libjpeg-turbo 1.5 or later). Returns 0 if the image is not
+ * JPEG-compressed.
+ */
+int
+TIFFJPEGSetDecodeWindow(TIFF* tif, uint32_t xoffset, uint32_t width)
+{
+	JPEGState* sp;
+
+#if defined(JPEG_DUAL_MODE_8_12) && !defined(TIFFJPEGSetDecodeWindow)
+	if (tif->tif_dir.td_bitspersample == 12)
+		return TIFFJPEGSetDecodeWindow_12(tif, xoffset, width);
+#endif
+	if (tif->tif_dir.td_compression != COMPRESSION_JPEG ||
+	    tif->tif_data == NULL)
+		return (0);
+	sp = JState(tif);
+	if (width == 0)
+		xoffset = 0;
+	if (sp->windowxoffset == xoffset && sp->windowwidth == width)
+		return (1);
+	sp->windowxoffset = xoffset;
+	sp->windowwidth = width;
+
+	/*
+	 * A decompression in progress uses the previous window: make
+	 * TIFFReadScanline restart the strip (see TIFFSeek) on next call.
+	 */
+	if (!isTiled(tif))
+		tif->tif_row = (uint32_t) -1;
+	return (1);
+}
+
+/*
+ * Tell whether the NDPIMCUStarts tag of the current directory is usable
+ * to seek within its JPEG strip, with the same checks as those made
+ * before seeking, e.g. to decide whether the strip must be scanned with
+ * TIFFNDPIScanRestartMarkers().  Reads the header of the strip.
+ */
+int
+TIFFNDPIHasUsableMCUStarts(TIFF* tif)
+{
+	JPEGState* sp;
+
+#if defined(JPEG_DUAL_MODE_8_12) && !defined(TIFFNDPIHasUsableMCUStarts)
+	if (tif->tif_dir.td_bitspersample == 12)
+		return TIFFNDPIHasUsableMCUStarts_12(tif);
+#endif
+	if (tif->tif_dir.td_compression != COMPRESSION_JPEG ||
+	    tif->tif_data == NULL)
+		return (0);
+	sp = JState(tif);
+	if (sp->restartindexstate == 0)
+		JPEGBuildRestartIndex(tif);
+	return (sp->restartindexstate > 0);
+}
+
+/*
+ * Scan the JPEG strip of the current directory for restart markers and
+ * return the offsets of the restart intervals relative to the start of
+ * the strip, in the form of the NDPIMCUStarts tag (low 32 bits only).
+ * This reads the whole strip: the result is meant to be saved and given
+ * back on later runs with TIFFSetField(tif, NDPITAG_MCUSTARTS, ...).
+ * The array is to be freed with _TIFFfree().
+ */
+int
+TIFFNDPIScanRestartMarkers(TIFF* tif, uint32_t* count, uint32_t** offsets)
+{
+	static const char module[] = "TIFFNDPIScanRestartMarkers";
+	TIFFDirectory *td = &tif->tif_dir;
+	const tmsize_t chunksize = 1024 * 1024;
+	uint64_t stripoffset, bytecount, done = 0;
+	uint32_t n = 0, allocated = 0, sofheight, hdrlen = 0;
+	uint32_t* starts = NULL;
+	uint8_t* buf;
+	int prevff = 0, eoi = 0, ok = 0;
+
+	*count = 0;
+	*offsets = NULL;
+	if (td->td_compression != COMPRESSION_JPEG || isTiled(tif) ||
+	    td->td_nstrips != 1) {
+		TIFFErrorExt(tif->tif_clientdata, module,
+		    "Image is not a single JPEG strip");
+		return (0);
+	}
+	stripoffset = TIFFGetStrileOffset(tif, 0);
+	bytecount = TIFFGetStrileByteCount(tif, 0);
+
+	buf = (uint8_t*) _TIFFmalloc(chunksize);
+	if (buf == NULL) {
+		TIFFErrorExt(tif->tif_clientdata, module,
+		    "No space for read buffer");
+		return (0);
+	}
+
+	while (done < bytecount && !eoi) {
+		tmsize_t toread = chunksize, i = 0;
+
+		if ((uint64_t) toread > bytecount - done)
+			toread = (tmsize_t) (bytecount - done);
+		if (!SeekOK(tif, stripoffset + done) ||
+		    !ReadOK(tif, buf, toread)) {
+			TIFFErrorExt(tif->tif_clientdata, module,
+			    "Read error at offset %"PRIu64,
+			    stripoffset + done);
+			goto done;
+		}
+		if (done == 0) {
+			hdrlen = JPEGFindScanStart(buf, (uint64_t) toread,
+			    &sofheight);
+			if (hdrlen == 0) {
+				TIFFErrorExt(tif->tif_clientdata, module,
+				    "Can't find start of JPEG scan");
+				goto done;
+			}
+			i = hdrlen;
+		}
+		while (i < toread) {
+			uint8_t b;
+
+			if (!prevff) {
+				const uint8_t* p = (const uint8_t*)
+				    memchr(buf + i, 0xFF, (size_t) (toread - i));
+
+				if (p == NULL)
+					break;
+				i = (p - buf) + 1;
+				prevff = 1;
+				continue;
+			}
+			b = buf[i++];
+			if (b == 0xFF)		/* fill byte */
+				continue;
+			prevff = 0;
+			if (b == JPEG_EOI) {
+				eoi = 1;
+				break;
+			}
+			if (b < JPEG_RST0 || b > JPEG_RST0 + 7)
+				continue;
+			if (n == allocated) {
+				uint32_t* newstarts;
+
+				allocated = allocated ? 2 * allocated : 4096;
+				newstarts = (uint32_t*) _TIFFCheckRealloc(tif,
+				    starts, allocated, sizeof(uint32_t),
+				    module);
+				if (newstarts == NULL)
+					goto done;
+				starts = newstarts;
+			}
+			if (n == 0)
+				starts[n++] = hdrlen;
+			starts[n++] = (uint32_t) (done + i);
+		}
+		done += toread;
+	}
+	if (n == 0) {
+		starts = (uint32_t*) _TIFFmalloc(sizeof(uint32_t));
+		if (starts == NULL)
+			goto done;
+		starts[n++] = hdrlen;
+	}
+	ok = 1;
+done:
+	_TIFFfree(buf);
+	if (!ok) {
+		if (starts)
+			_TIFFfree(starts);
+		return (0);
+	}
+	*count = n;
+	*offsets = starts;
+	return (1);
+}
+
 /*
  * Decode a chunk of pixels.
  * Returned data is downsampled per sampling factors.
@@ -2263,6 +2902,10 @@ JPEGCleanup(TIFF* tif)
                 TIFFjpeg_destroy(sp);	/* release libjpeg resources */
         if (sp->jpegtables)		/* tag value */
                 _TIFFfree(sp->jpegtables);
+	if (sp->restartoffsets)
+		_TIFFfree(sp->restartoffsets);
+	if (sp->restartheader)
+		_TIFFfree(sp->restartheader);
 	_TIFFfree(tif->tif_data);	/* release local state */
 	tif->tif_data = NULL;
 
@@ -2345,6 +2988,10 @@ JPEGVSetField(TIFF* tif, uint32_t tag, va_list ap)
 		sp->ycbcrsampling_fetched = 1;
 		/* should we be recomputing upsampling info here? */
 		return (*sp->vsetparent)(tif, tag, ap);
+	case NDPITAG_MCUSTARTS:
+		/* check the new index at the next seek */
+		sp->restartindexstate = 0;
+		return (*sp->vsetparent)(tif, tag, ap);
 	default:
 		return (*sp->vsetparent)(tif, tag, ap);
 	}
@@ -2559,6 +3206,7 @@ TIFFInitJPEG(TIFF* tif, int scheme)
 	tif->tif_decoderow = JPEGDecode;
 	tif->tif_decodestrip = JPEGDecode;
 	tif->tif_decodetile = JPEGDecode;
+	tif->tif_seek = JPEGSeek;
 	tif->tif_setupencode = JPEGSetupEncode;
 	tif->tif_preencode = JPEGPreEncode;
 	tif->tif_postencode = JPEGPostEncode;
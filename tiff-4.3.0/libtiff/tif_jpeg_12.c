@@ -5,6 +5,9 @@
 
 #  define TIFFInitJPEG TIFFInitJPEG_12
 #  define TIFFJPEGIsFullStripRequired TIFFJPEGIsFullStripRequired_12
+#  define TIFFNDPIScanRestartMarkers TIFFNDPIScanRestartMarkers_12
+#  define TIFFNDPIHasUsableMCUStarts TIFFNDPIHasUsableMCUStarts_12
+#  define TIFFJPEGSetDecodeWindow TIFFJPEGSetDecodeWindow_12
 
 int
 TIFFInitJPEG_12(TIFF* tif, int scheme);
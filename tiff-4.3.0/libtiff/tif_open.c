@@ -185,6 +185,7 @@ TIFFClientOpen(
 	 * '8' BigTIFF for creating a file
          * 'D' enable use of deferred strip/tile offset/bytecount array loading.
          * 'O' on-demand loading of values instead of whole array loading (implies D)
+	 * 'A' have the system read strip data ahead of its decoding when reading
 	 *
 	 * The use of the 'l' and 'b' flags is strongly discouraged.
 	 * These flags are provided solely because numerous vendors,
@@ -216,6 +217,12 @@ TIFFClientOpen(
 	 * application-transparent and as such can cause problems.  The 'c'
 	 * option permits applications that only want to look at the tags,
 	 * for example, to get the unadulterated TIFF tag information.
+	 *
+	 * The 'A' flag is provided for large strips read scanline after
+	 * scanline from slow storage: the data following the part being
+	 * decoded is then requested in advance, so that the system reads
+	 * it in the background (the whole strip when it is decoded in a
+	 * single call from the mapped file).
 	 */
 	for (cp = mode; *cp; cp++)
 		switch (*cp) {
@@ -273,6 +280,10 @@ TIFFClientOpen(
 				if( m == O_RDONLY )
 					tif->tif_flags |= (TIFF_LAZYSTRILELOAD | TIFF_DEFERSTRILELOAD);
 				break;
+			case 'A':
+				if (m == O_RDONLY)
+					tif->tif_flags |= TIFF_READAHEAD;
+				break;
 		}
 
 #ifdef DEFER_STRILE_LOAD
@@ -503,6 +514,123 @@ bad2:
 	return ((TIFF*)0);
 }
 
+/*
+ * Flags of the open mode that a clone inherits.
+ */
+#define	CLONED_FLAGS	(TIFF_FILLORDER|TIFF_STRIPCHOP|TIFF_READAHEAD|\
+			 TIFF_DEFERSTRILELOAD|TIFF_LAZYSTRILELOAD)
+
+/*
+ * Give clone copies of the strip/tile offset and bytecount arrays of
+ * tif, which are those of the same directory, already loaded (and
+ * corrected for NDPI files).
+ */
+static int
+TIFFCloneStrileArrays(TIFF* clone, TIFF* tif)
+{
+	static const char module[] = "TIFFCloneHandle";
+	TIFFDirectory *td = &tif->tif_dir;
+	TIFFDirectory *ctd = &clone->tif_dir;
+	uint64_t* offsets;
+	uint64_t* bytecounts;
+
+	offsets = (uint64_t*) _TIFFCheckMalloc(clone, td->td_nstrips,
+	    sizeof (uint64_t), module);
+	bytecounts = (uint64_t*) _TIFFCheckMalloc(clone, td->td_nstrips,
+	    sizeof (uint64_t), module);
+	if (offsets == NULL || bytecounts == NULL) {
+		_TIFFfree(offsets);
+		_TIFFfree(bytecounts);
+		return (0);
+	}
+	_TIFFmemcpy(offsets, td->td_stripoffset_p,
+	    (tmsize_t) td->td_nstrips * sizeof (uint64_t));
+	_TIFFmemcpy(bytecounts, td->td_stripbytecount_p,
+	    (tmsize_t) td->td_nstrips * sizeof (uint64_t));
+	_TIFFfree(ctd->td_stripoffset_p);
+	_TIFFfree(ctd->td_stripbytecount_p);
+	ctd->td_stripoffset_p = offsets;
+	ctd->td_stripbytecount_p = bytecounts;
+	_TIFFmemset(&ctd->td_stripoffset_entry, 0, sizeof (TIFFDirEntry));
+	_TIFFmemset(&ctd->td_stripbytecount_entry, 0, sizeof (TIFFDirEntry));
+	return (1);
+}
+
+/*
+ * Open a new read-only handle on the file of tif, through the given
+ * client data and procedures, and set it on the current directory of
+ * tif.  Only that directory is read again: the strip/tile arrays of tif
+ * are copied when they are loaded, and so are the settings that don't
+ * come from the file (NDPI MCU starts, JPEG color mode).  tif must not
+ * be used by another thread meanwhile.  Used by TIFFCloneHandle.  On
+ * failure, NULL is returned and the client data is left open.
+ */
+TIFF*
+_TIFFCloneHandle(TIFF* tif, thandle_t clientdata,
+	TIFFReadWriteProc readproc, TIFFReadWriteProc writeproc,
+	TIFFSeekProc seekproc, TIFFCloseProc closeproc,
+	TIFFSizeProc sizeproc,
+	TIFFMapFileProc mapproc, TIFFUnmapFileProc unmapproc)
+{
+	static const char module[] = "TIFFCloneHandle";
+	TIFFDirectory *td = &tif->tif_dir;
+	TIFF* clone;
+	int sharestriles;
+	uint32_t count;
+	uint32_t* offsets;
+	int colormode;
+
+	if (tif->tif_mode != O_RDONLY) {
+		TIFFErrorExt(tif->tif_clientdata, module,
+		    "%s: Only handles opened for reading can be cloned",
+		    tif->tif_name);
+		return ((TIFF*)0);
+	}
+	clone = TIFFClientOpen(tif->tif_name,
+	    (tif->tif_flags & TIFF_MAPPED) ? "rh" : "rhm", clientdata,
+	    readproc, writeproc, seekproc, closeproc, sizeproc,
+	    mapproc, unmapproc);
+	if (clone == NULL)
+		return ((TIFF*)0);
+
+	/*
+	 * Loaded strile arrays are copied instead of being read again:
+	 * have the directory read without them.
+	 */
+	sharestriles = td->td_stripoffset_p != NULL &&
+	    td->td_stripbytecount_p != NULL &&
+	    (tif->tif_flags & (TIFF_LAZYSTRILELOAD|TIFF_CHOPPEDUPARRAYS)) == 0;
+	clone->tif_flags = (clone->tif_flags & ~CLONED_FLAGS) |
+	    (tif->tif_flags & CLONED_FLAGS);
+	if (sharestriles)
+		clone->tif_flags |= TIFF_DEFERSTRILELOAD;
+
+	if (tif->tif_diroff == 0)
+		return (clone);		/* no directory read yet */
+	if (!TIFFSetSubDirectory(clone, tif->tif_diroff))
+		goto bad;
+	clone->tif_curdir = tif->tif_curdir;
+	if (sharestriles &&
+	    clone->tif_dir.td_nstrips == td->td_nstrips) {
+		if (!TIFFCloneStrileArrays(clone, tif))
+			goto bad;
+		clone->tif_flags = (clone->tif_flags & ~TIFF_DEFERSTRILELOAD) |
+		    (tif->tif_flags & TIFF_DEFERSTRILELOAD);
+	}
+
+	if (TIFFGetField(tif, NDPITAG_MCUSTARTS, &count, &offsets) &&
+	    !TIFFSetField(clone, NDPITAG_MCUSTARTS, count, offsets))
+		goto bad;
+	if (td->td_compression == COMPRESSION_JPEG &&
+	    TIFFGetField(tif, TIFFTAG_JPEGCOLORMODE, &colormode) &&
+	    !TIFFSetField(clone, TIFFTAG_JPEGCOLORMODE, colormode))
+		goto bad;
+	return (clone);
+bad:
+	TIFFCleanup(clone);
+	return ((TIFF*)0);
+}
+
 /*
  * Query functions to access private data.
  */
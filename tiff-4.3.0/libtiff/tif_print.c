@@ -555,6 +555,17 @@ TIFFPrintDirectory(TIFF* tif, FILE* fd, long flags)
 		fprintf(fd, "  NDPI Comments: \"%s\"\n", td->td_ndpicomments);
 	if (TIFFFieldSet(tif, FIELD_NDPIFLUORESCENCE))
 		fprintf(fd, "  NDPI Fluorescence: \"%s\"\n", td->td_ndpifluorescence);
+	if (TIFFFieldSet(tif, FIELD_NDPIMCUSTARTS)) {
+		fprintf(fd, "  NDPI MCU starts: %"PRIu32" entries\n",
+		    td->td_ndpinmcustarts);
+		if (flags & TIFFPRINT_STRIPS) {
+			uint32_t u;
+
+			for (u = 0; u < td->td_ndpinmcustarts; u++)
+				fprintf(fd, "    %3"PRIu32": [%10"PRIu32"]\n",
+				    u, td->td_ndpimcustarts[u]);
+		}
+	}
 
 	/*
 	** Custom tag support.
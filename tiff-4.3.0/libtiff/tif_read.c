@@ -33,6 +33,7 @@ int TIFFFillStrip(TIFF* tif, uint32_t strip);
 int TIFFFillTile(TIFF* tif, uint32_t tile);
 static int TIFFStartStrip(TIFF* tif, uint32_t strip);
 static int TIFFStartTile(TIFF* tif, uint32_t tile);
+static void TIFFReadAheadStrip(TIFF* tif, uint32_t strip);
 static int TIFFCheckRead(TIFF*, int);
 static tmsize_t
 TIFFReadRawStrip1(TIFF* tif, uint32_t strip, void* buf, tmsize_t size, const char* module);
@@ -43,6 +44,7 @@ TIFFReadRawTile1(TIFF* tif, uint32_t tile, void* buf, tmsize_t size, const char*
 #define NOTILE ((uint32_t)(-1))         /* undefined state */
 
 #define INITIAL_THRESHOLD (1024 * 1024)
+#define TIFF_READAHEAD_SIZE (8 * 1024 * 1024)
 #define THRESHOLD_MULTIPLIER 10
 #define MAX_THRESHOLD (THRESHOLD_MULTIPLIER * THRESHOLD_MULTIPLIER * THRESHOLD_MULTIPLIER * INITIAL_THRESHOLD)
 
@@ -294,6 +296,28 @@ TIFFFillStripPartial( TIFF *tif, int strip, tmsize_t read_ahead, int restart )
         }
 }
 
+/*
+ * Load the data of a strip from offset (relative to the start of the
+ * strip) on, when the strip is read in chunks, e.g. for a codec which
+ * resumes decoding further in the strip.  The data at offset is then at
+ * tif_rawdata, where tif_rawcp points.  Returns 0 if the strip is not
+ * read in chunks or can't be read.
+ */
+int
+_TIFFFillStripPartialAt(TIFF* tif, uint32_t strip, uint64_t offset)
+{
+	if (isMapped(tif) || tif->tif_rawdata == NULL ||
+	    tif->tif_rawdatasize < 2 || tif->tif_curstrip != strip ||
+	    offset >= TIFFGetStrileByteCount(tif, strip) ||
+	    offset > (uint64_t) TIFF_TMSIZE_T_MAX)
+		return (0);
+	tif->tif_rawdataoff = (tmsize_t) offset;
+	tif->tif_rawdataloaded = 0;
+	tif->tif_rawcp = tif->tif_rawdata;
+	return TIFFFillStripPartial(tif, (int) strip,
+	    tif->tif_rawdatasize / 2, 0);
+}
+
 /*
  * Seek to a random row+sample in a file.
  *
@@ -430,9 +454,44 @@ TIFFSeek(TIFF* tif, uint32_t row, uint16_t sample )
 		tif->tif_row = row;
 	}
 
+	if (tif->tif_flags & TIFF_READAHEAD)
+		TIFFReadAheadStrip(tif, strip);
+
 	return (1);
 }
 
+/*
+ * Have the system read, in the background, the part of the strip which
+ * follows the data being decoded, up to TIFF_READAHEAD_SIZE bytes (or
+ * twice the size of the buffer the strip is read into, if larger).
+ * Nothing is asked for until half of the part asked for is decoded.
+ */
+static void
+TIFFReadAheadStrip(TIFF* tif, uint32_t strip)
+{
+	uint64_t start = TIFFGetStrileOffset(tif, strip);
+	uint64_t end = start + TIFFGetStrileByteCount(tif, strip);
+	uint64_t position = start + (uint64_t) tif->tif_rawdataoff;
+	uint64_t size = TIFF_READAHEAD_SIZE;
+
+	if (tif->tif_rawdata != NULL && tif->tif_rawcp != NULL)
+		position += (uint64_t) (tif->tif_rawcp - tif->tif_rawdata);
+	if ((tif->tif_flags & TIFF_BUFFERMMAP) == 0 &&
+	    (uint64_t) tif->tif_rawdatasize > size / 2)
+		size = 2 * (uint64_t) tif->tif_rawdatasize;
+
+	if (tif->tif_readaheadend < position || tif->tif_readaheadend > end)
+		tif->tif_readaheadend = position;
+	if (tif->tif_readaheadend - position >= size / 2 ||
+	    tif->tif_readaheadend >= end)
+		return;
+	if (size > end - position)
+		size = end - position;
+	_TIFFReadAhead(tif, tif->tif_readaheadend,
+	    position + size - tif->tif_readaheadend);
+	tif->tif_readaheadend = position + size;
+}
+
 int
 TIFFReadScanline(TIFF* tif, void* buf, uint32_t row, uint16_t sample)
 {
@@ -457,6 +516,63 @@ TIFFReadScanline(TIFF* tif, void* buf, uint32_t row, uint16_t sample)
 	return (e > 0 ? 1 : -1);
 }
 
+/*
+ * Read nrows consecutive scanlines starting at row into buf, one after
+ * the other (TIFFScanlineSize() bytes each), for contiguous data. This
+ * is like calling TIFFReadScanline() for each row, but lets the codec
+ * decode many rows per call (e.g. whole iMCU row groups for JPEG).
+ */
+int
+TIFFReadScanlines(TIFF* tif, void* buf, uint32_t row, uint32_t nrows)
+{
+	static const char module[] = "TIFFReadScanlines";
+	TIFFDirectory *td = &tif->tif_dir;
+	uint8_t* bufp = (uint8_t*) buf;
+
+	if (!TIFFCheckRead(tif, 0))
+		return (-1);
+	if (td->td_planarconfig == PLANARCONFIG_SEPARATE &&
+	    td->td_samplesperpixel > 1) {
+		TIFFErrorExt(tif->tif_clientdata, module,
+		    "Can't read several scanlines of separate planes");
+		return (-1);
+	}
+	if (nrows > td->td_imagelength || row > td->td_imagelength - nrows) {
+		TIFFErrorExt(tif->tif_clientdata, module,
+		    "%"PRIu32": Rows out of range, max %"PRIu32"",
+		    row + nrows, td->td_imagelength);
+		return (-1);
+	}
+	while (nrows > 0) {
+		uint32_t n = td->td_rowsperstrip - row % td->td_rowsperstrip;
+		tmsize_t cc;
+		int e;
+
+		if (n > nrows)
+			n = nrows;
+		cc = _TIFFMultiplySSize(tif, (tmsize_t) n,
+		    tif->tif_scanlinesize, module);
+		if (cc == 0 || TIFFSeek(tif, row, 0) == 0)
+			return (-1);
+
+		/*
+		 * Decompress the rows of this strip into user buffer.
+		 */
+		e = (*tif->tif_decodestrip)(tif, bufp, cc, 0);
+
+		/* we are now poised at the beginning of the next row */
+		tif->tif_row = row + n;
+
+		if (e <= 0)
+			return (-1);
+		(*tif->tif_postdecode)(tif, bufp, cc);
+		bufp += cc;
+		row += n;
+		nrows -= n;
+	}
+	return (1);
+}
+
 /*
  * Calculate the strip size according to the number of
  * rows in the strip (check for truncated last strip on any
@@ -533,6 +649,14 @@ TIFFReadEncodedStrip(TIFF* tif, uint32_t strip, void* buf, tmsize_t size)
 		stripsize=size;
 	if (!TIFFFillStrip(tif,strip))
 		return((tmsize_t)(-1));
+	/*
+	 * A strip decoded in a single call straight from the mapped
+	 * file is read ahead as a whole.
+	 */
+	if ((tif->tif_flags & (TIFF_READAHEAD|TIFF_BUFFERMMAP)) ==
+	    (TIFF_READAHEAD|TIFF_BUFFERMMAP))
+		_TIFFReadAhead(tif, TIFFGetStrileOffset(tif, strip),
+		    TIFFGetStrileByteCount(tif, strip));
 	if ((*tif->tif_decodestrip)(tif,buf,stripsize,plane)<=0)
 		return((tmsize_t)(-1));
 	(*tif->tif_postdecode)(tif,buf,stripsize);
@@ -196,6 +196,117 @@ _tiffUnmapProc(thandle_t fd, void* base, toff_t size)
 }
 #endif /* !HAVE_MMAP */
 
+#ifdef HAVE_PREAD
+/*
+ * Procedures of the handles made by TIFFCloneHandle: they read with
+ * pread() at a file position of their own, so that handles sharing
+ * the file don't move the position of one another.
+ */
+typedef struct pread_handle_struct
+{
+	int fd;
+	uint64_t off;
+} pread_handle_t;
+
+static tmsize_t
+_tiffPreadProc(thandle_t h, void* buf, tmsize_t size)
+{
+	pread_handle_t* ph = (pread_handle_t*) h;
+	const size_t bytes_total = (size_t) size;
+	size_t bytes_read;
+	tmsize_t count = -1;
+	if ((tmsize_t) bytes_total != size)
+	{
+		errno=EINVAL;
+		return (tmsize_t) -1;
+	}
+	for (bytes_read=0; bytes_read < bytes_total; bytes_read+=count)
+	{
+		char *buf_offset = (char *) buf+bytes_read;
+		size_t io_size = bytes_total-bytes_read;
+		_TIFF_off_t off_io = (_TIFF_off_t) (ph->off + bytes_read);
+		if ((uint64_t) off_io != ph->off + bytes_read)
+		{
+			errno=EINVAL;
+			count = -1;
+			break;
+		}
+		if (io_size > TIFF_IO_MAX)
+			io_size = TIFF_IO_MAX;
+		count=pread(ph->fd, buf_offset, (TIFFIOSize_t) io_size, off_io);
+		if (count <= 0)
+			break;
+	}
+	ph->off += bytes_read;
+	if (count < 0)
+		return (tmsize_t)-1;
+	return (tmsize_t) bytes_read;
+}
+
+static tmsize_t
+_tiffPreadWriteProc(thandle_t h, void* buf, tmsize_t size)
+{
+	(void) h; (void) buf; (void) size;
+	errno=EBADF;
+	return (tmsize_t) -1;
+}
+
+static uint64_t
+_tiffPreadSeekProc(thandle_t h, uint64_t off, int whence)
+{
+	pread_handle_t* ph = (pread_handle_t*) h;
+	fd_as_handle_union_t fdh;
+	switch (whence)
+	{
+		case SEEK_SET:
+			ph->off = off;
+			break;
+		case SEEK_CUR:
+			ph->off += off;
+			break;
+		case SEEK_END:
+			fdh.fd = ph->fd;
+			ph->off = _tiffSizeProc(fdh.h) + off;
+			break;
+		default:
+			errno=EINVAL;
+			return (uint64_t) -1;
+	}
+	return (ph->off);
+}
+
+static int
+_tiffPreadCloseProc(thandle_t h)
+{
+	pread_handle_t* ph = (pread_handle_t*) h;
+	int ret = close(ph->fd);
+	_TIFFfree(ph);
+	return (ret);
+}
+
+static uint64_t
+_tiffPreadSizeProc(thandle_t h)
+{
+	fd_as_handle_union_t fdh;
+	fdh.fd = ((pread_handle_t*) h)->fd;
+	return (_tiffSizeProc(fdh.h));
+}
+
+static int
+_tiffPreadMapProc(thandle_t h, void** pbase, toff_t* psize)
+{
+	fd_as_handle_union_t fdh;
+	fdh.fd = ((pread_handle_t*) h)->fd;
+	return (_tiffMapProc(fdh.h, pbase, psize));
+}
+
+/* whether tif reads a file descriptor with the procedures above */
+#define	isFdHandle(tif)	((tif)->tif_readproc == _tiffReadProc || \
+			 (tif)->tif_readproc == _tiffPreadProc)
+#else
+#define	isFdHandle(tif)	((tif)->tif_readproc == _tiffReadProc)
+#endif /* HAVE_PREAD */
+
 /*
  * Open a TIFF file descriptor for read/writing.
  */
@@ -305,6 +416,80 @@ TIFFOpenW(const wchar_t* name, const char* mode)
 }
 #endif
 
+/*
+ * Open a new handle on the file of tif, set on the same directory (see
+ * _TIFFCloneHandle).  The new handle reads with pread() from a duplicate
+ * of the file descriptor of tif, so that it can be used by one thread
+ * while tif and its other clones are used by other threads.
+ */
+TIFF*
+TIFFCloneHandle(TIFF* tif)
+{
+	static const char module[] = "TIFFCloneHandle";
+#ifdef HAVE_PREAD
+	pread_handle_t* ph;
+	TIFF* clone;
+
+	if (!isFdHandle(tif)) {
+		TIFFErrorExt(tif->tif_clientdata, module,
+		    "%s: Cannot clone a handle with client procedures",
+		    tif->tif_name);
+		return ((TIFF*)0);
+	}
+	ph = (pread_handle_t*) _TIFFmalloc(sizeof (pread_handle_t));
+	if (ph == NULL) {
+		TIFFErrorExt(tif->tif_clientdata, module,
+		    "%s: Out of memory (file handle)", tif->tif_name);
+		return ((TIFF*)0);
+	}
+	ph->fd = dup(tif->tif_fd);
+	ph->off = 0;
+	if (ph->fd < 0) {
+		TIFFErrorExt(tif->tif_clientdata, module, "%s: %s",
+		    tif->tif_name, strerror(errno));
+		_TIFFfree(ph);
+		return ((TIFF*)0);
+	}
+	clone = _TIFFCloneHandle(tif, (thandle_t) ph,
+	    _tiffPreadProc, _tiffPreadWriteProc,
+	    _tiffPreadSeekProc, _tiffPreadCloseProc, _tiffPreadSizeProc,
+	    _tiffPreadMapProc, _tiffUnmapProc);
+	if (clone == NULL) {
+		(void) _tiffPreadCloseProc((thandle_t) ph);
+		return ((TIFF*)0);
+	}
+	clone->tif_fd = ph->fd;
+	return (clone);
+#else
+	TIFFErrorExt(tif->tif_clientdata, module,
+	    "%s: Cloning handles is not supported on this platform",
+	    tif->tif_name);
+	return ((TIFF*)0);
+#endif
+}
+
+/*
+ * Hint the system that size bytes at offset in the file will be read
+ * soon, so that it reads them into its cache in the background (open
+ * mode 'A').
+ */
+void
+_TIFFReadAhead(TIFF* tif, uint64_t offset, uint64_t size)
+{
+#ifdef POSIX_FADV_WILLNEED
+	if (!isFdHandle(tif) ||
+	    (uint64_t) (off_t) offset != offset ||
+	    (uint64_t) (off_t) size != size)
+		return;
+	(void) posix_fadvise(tif->tif_fd, (off_t) offset, (off_t) size,
+	    POSIX_FADV_WILLNEED);
+#else
+	(void) tif;
+	(void) offset;
+	(void) size;
+#endif
+}
+
 void*
 _TIFFmalloc(tmsize_t s)
 {
@@ -352,24 +537,33 @@ _TIFFmemcmp(const void* p1, const void* p2, tmsize_t c)
 	return (memcmp(p1, p2, (size_t) c));
 }
 
+/*
+ * The handlers may be called by several threads at once: each one writes
+ * its message while holding the lock of stderr, so that messages are not
+ * mixed.
+ */
 static void
 unixWarningHandler(const char* module, const char* fmt, va_list ap)
 {
+	flockfile(stderr);
 	if (module != NULL)
 		fprintf(stderr, "%s: ", module);
 	fprintf(stderr, "Warning, ");
 	vfprintf(stderr, fmt, ap);
 	fprintf(stderr, ".\n");
+	funlockfile(stderr);
 }
 TIFFErrorHandler _TIFFwarningHandler = unixWarningHandler;
 
 static void
 unixErrorHandler(const char* module, const char* fmt, va_list ap)
 {
+	flockfile(stderr);
 	if (module != NULL)
 		fprintf(stderr, "%s: ", module);
 	vfprintf(stderr, fmt, ap);
 	fprintf(stderr, ".\n");
+	funlockfile(stderr);
 }
 TIFFErrorHandler _TIFFerrorHandler = unixErrorHandler;
 
@@ -29,6 +29,11 @@
 
 TIFFErrorHandlerExt _TIFFwarningHandlerExt = NULL;
 
+/*
+ * The handlers are shared by all threads. They should be set before
+ * threads using libtiff are started, and be safe to call from several
+ * threads at once.
+ */
 TIFFErrorHandler
 TIFFSetWarningHandler(TIFFErrorHandler handler)
 {
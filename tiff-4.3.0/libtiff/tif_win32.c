@@ -355,6 +355,57 @@ TIFFOpenW(const wchar_t* name, const char* mode)
 
 #endif /* ndef _WIN32_WCE */
 
+/*
+ * Open a new handle on the file of tif, set on the same directory (see
+ * _TIFFCloneHandle).  The file is opened again with ReOpenFile(), which
+ * gives the new handle a file pointer of its own, so that it can be
+ * used by one thread while tif and its other clones are used by other
+ * threads.
+ */
+TIFF*
+TIFFCloneHandle(TIFF* tif)
+{
+	static const char module[] = "TIFFCloneHandle";
+	HANDLE fd;
+	TIFF* clone;
+
+	if (tif->tif_readproc != _tiffReadProc) {
+		TIFFErrorExt(tif->tif_clientdata, module,
+		    "%s: Cannot clone a handle with client procedures",
+		    tif->tif_name);
+		return ((TIFF*)0);
+	}
+	fd = ReOpenFile((HANDLE) tif->tif_clientdata, GENERIC_READ,
+	    FILE_SHARE_READ | FILE_SHARE_WRITE, 0);
+	if (fd == INVALID_HANDLE_VALUE) {
+		TIFFErrorExt(tif->tif_clientdata, module,
+		    "%s: Cannot open again", tif->tif_name);
+		return ((TIFF*)0);
+	}
+	clone = _TIFFCloneHandle(tif, (thandle_t) fd,
+	    _tiffReadProc, _tiffWriteProc,
+	    _tiffSeekProc, _tiffCloseProc, _tiffSizeProc,
+	    tif->tif_mapproc, tif->tif_unmapproc);
+	if (clone == NULL) {
+		CloseHandle(fd);
+		return ((TIFF*)0);
+	}
+	clone->tif_fd = thandle_to_int(fd);
+	return (clone);
+}
+
+/*
+ * Open mode 'A' asks the system to read strip data ahead of its
+ * decoding: there is no such hint here.
+ */
+void
+_TIFFReadAhead(TIFF* tif, uint64_t offset, uint64_t size)
+{
+	(void) tif;
+	(void) offset;
+	(void) size;
+}
+
 void*
 _TIFFmalloc(tmsize_t s)
 {
@@ -404,24 +455,33 @@ _TIFFmemcmp(const void* p1, const void* p2, tmsize_t c)
 
 #ifndef _WIN32_WCE
 
+/*
+ * The handlers may be called by several threads at once: each one writes
+ * its message while holding the lock of stderr, so that messages are not
+ * mixed.
+ */
 static void
 Win32WarningHandler(const char* module, const char* fmt, va_list ap)
 {
+	_lock_file(stderr);
 	if (module != NULL)
 		fprintf(stderr, "%s: ", module);
 	fprintf(stderr, "Warning, ");
 	vfprintf(stderr, fmt, ap);
 	fprintf(stderr, ".\n");
+	_unlock_file(stderr);
 }
 TIFFErrorHandler _TIFFwarningHandler = Win32WarningHandler;
 
 static void
 Win32ErrorHandler(const char* module, const char* fmt, va_list ap)
 {
+	_lock_file(stderr);
 	if (module != NULL)
 		fprintf(stderr, "%s: ", module);
 	vfprintf(stderr, fmt, ap);
 	fprintf(stderr, ".\n");
+	_unlock_file(stderr);
 }
 TIFFErrorHandler _TIFFerrorHandler = Win32ErrorHandler;
 
@@ -812,7 +812,7 @@ typedef enum {
 #define NDPITAG_65423		65423
 #define NDPITAG_ZOFFSET		65424
 #define NDPITAG_65425		65425
-#define NDPITAG_65426		65426
+#define NDPITAG_MCUSTARTS	65426	/* offsets of the restart intervals */
 #define NDPITAG_USERGIVENSLIDELABEL	65427
 #define NDPITAG_65428		65428
 #define NDPITAG_65430		65430
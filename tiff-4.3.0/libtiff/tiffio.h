@@ -423,6 +423,7 @@ extern int TIFFForceStrileArrayWriting(TIFF* );
 #if defined(c_plusplus) || defined(__cplusplus)
 extern void TIFFPrintDirectory(TIFF*, FILE*, long = 0);
 extern int TIFFReadScanline(TIFF* tif, void* buf, uint32_t row, uint16_t sample = 0);
+extern int TIFFReadScanlines(TIFF* tif, void* buf, uint32_t row, uint32_t nrows);
 extern int TIFFWriteScanline(TIFF* tif, void* buf, uint32_t row, uint16_t sample = 0);
 extern int TIFFReadRGBAImage(TIFF*, uint32_t, uint32_t, uint32_t*, int = 0);
 extern int TIFFReadRGBAImageOriented(TIFF*, uint32_t, uint32_t, uint32_t*,
@@ -430,6 +431,7 @@ extern int TIFFReadRGBAImageOriented(TIFF*, uint32_t, uint32_t, uint32_t*,
 #else
 extern void TIFFPrintDirectory(TIFF*, FILE*, long);
 extern int TIFFReadScanline(TIFF* tif, void* buf, uint32_t row, uint16_t sample);
+extern int TIFFReadScanlines(TIFF* tif, void* buf, uint32_t row, uint32_t nrows);
 extern int TIFFWriteScanline(TIFF* tif, void* buf, uint32_t row, uint16_t sample);
 extern int TIFFReadRGBAImage(TIFF*, uint32_t, uint32_t, uint32_t*, int);
 extern int TIFFReadRGBAImageOriented(TIFF*, uint32_t, uint32_t, uint32_t*, int, int);
@@ -448,6 +450,7 @@ extern TIFF* TIFFOpen(const char*, const char*);
 extern TIFF* TIFFOpenW(const wchar_t*, const char*);
 # endif /* __WIN32__ */
 extern TIFF* TIFFFdOpen(int, const char*, const char*);
+extern TIFF* TIFFCloneHandle(TIFF*);
 extern TIFF* TIFFClientOpen(const char*, const char*,
 	    thandle_t,
 	    TIFFReadWriteProc, TIFFReadWriteProc,
@@ -504,6 +507,10 @@ extern uint64_t TIFFGetStrileByteCount(TIFF *tif, uint32_t strile);
 extern uint64_t TIFFGetStrileOffsetWithErr(TIFF *tif, uint32_t strile, int *pbErr);
 extern uint64_t TIFFGetStrileByteCountWithErr(TIFF *tif, uint32_t strile, int *pbErr);
 
+extern int TIFFNDPIScanRestartMarkers(TIFF* tif, uint32_t* count, uint32_t** offsets);
+extern int TIFFNDPIHasUsableMCUStarts(TIFF* tif);
+extern int TIFFJPEGSetDecodeWindow(TIFF* tif, uint32_t xoffset, uint32_t width);
+
 #ifdef LOGLUV_PUBLIC
 #define U_NEU		0.210526316
 #define V_NEU		0.473684211
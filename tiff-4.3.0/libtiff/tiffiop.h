@@ -115,6 +115,7 @@ struct tiff {
         #define TIFF_DEFERSTRILELOAD 0x1000000U /* defer strip/tile offset/bytecount array loading. */
         #define TIFF_LAZYSTRILELOAD  0x2000000U /* lazy/ondemand loading of strip/tile offset/bytecount values. Only used if TIFF_DEFERSTRILELOAD is set and in read-only mode */
         #define TIFF_CHOPPEDUPARRAYS 0x4000000U /* set when allocChoppedUpStripArrays() has modified strip array */
+        #define TIFF_READAHEAD 0x8000000U /* have strip data read ahead of its decoding */
 	uint64_t               tif_diroff;       /* file offset of current directory */
 	uint64_t               tif_nextdiroff;   /* file offset of following directory */
 	uint64_t*              tif_dirlist;      /* list of offsets to already seen directories to prevent IFD looping */
@@ -170,6 +171,7 @@ struct tiff {
         tmsize_t             tif_rawdataloaded;/* amount of data in rawdata */
 	uint8_t*               tif_rawcp;        /* current spot in raw buffer */
 	tmsize_t             tif_rawcc;        /* bytes unread from raw buffer */
+	uint64_t               tif_readaheadend; /* file offset up to which data is being read ahead */
 	/* memory-mapped file support */
 	uint8_t*               tif_base;         /* base of mapped file */
 	tmsize_t             tif_size;         /* size of mapped file region (bytes, thus tmsize_t) */
@@ -316,6 +318,13 @@ typedef size_t TIFFIOSize_t;
 extern "C" {
 #endif
 extern int _TIFFgetMode(const char* mode, const char* module);
+extern void _TIFFReadAhead(TIFF* tif, uint64_t offset, uint64_t size);
+extern int _TIFFFillStripPartialAt(TIFF* tif, uint32_t strip, uint64_t offset);
+extern TIFF* _TIFFCloneHandle(TIFF* tif, thandle_t clientdata,
+	TIFFReadWriteProc readproc, TIFFReadWriteProc writeproc,
+	TIFFSeekProc seekproc, TIFFCloseProc closeproc,
+	TIFFSizeProc sizeproc,
+	TIFFMapFileProc mapproc, TIFFUnmapFileProc unmapproc);
 extern int _TIFFNoRowEncode(TIFF* tif, uint8_t* pp, tmsize_t cc, uint16_t s);
 extern int _TIFFNoStripEncode(TIFF* tif, uint8_t* pp, tmsize_t cc, uint16_t s);
 extern int _TIFFNoTileEncode(TIFF*, uint8_t* pp, tmsize_t cc, uint16_t s);
@@ -0,0 +1,195 @@
+/* checkdzi.c
+ Copyright (c) 2011-2021 Christophe Deroulers
+ Distributed under the GNU General Public License v3 -- contact the
+ author for commercial use */
+
+/*
+ * TIFF Library
+ *
+ * Checks the geometry of a Deep Zoom pyramid made by ndpisplit -Z: the
+ * number of levels, the number of tiles of each level, and the size of
+ * each tile, which overlaps its neighbours by the overlap of the .dzi
+ * file.
+ */
+
+#include "tif_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tiffio.h"
+
+#if defined(__BORLANDC__) || defined(__MINGW32__)
+# define XMD_H 1
+#endif
+#if defined(__WIN32__) && !defined(__MINGW32__)
+# ifndef __RPCNDR_H__            /* don't conflict if rpcndr.h already read */
+   typedef unsigned char boolean;
+# endif
+# define HAVE_BOOLEAN            /* prevent jmorecfg.h from redefining it */
+#endif
+#include "jpeglib.h"
+
+/*
+ * Reads the unsigned value of attribute name in the XML text.
+ */
+static int
+getAttribute(const char* xml, const char* name, uint32_t* value)
+{
+	char pattern[32];
+	const char * p;
+
+	snprintf(pattern, sizeof(pattern), " %s=\"", name);
+	p = strstr(xml, pattern);
+	if (p == NULL || sscanf(p + strlen(pattern), "%u", value) != 1) {
+		fprintf(stderr, "No attribute %s in the .dzi file\n", name);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Reads the dimensions of a JPEG file. Returns 0 if it can't be read.
+ */
+static int
+getJPEGDimensions(const char* filename, uint32_t* width, uint32_t* length)
+{
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	FILE * f = fopen(filename, "rb");
+
+	if (f == NULL)
+		return 0;
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_decompress(&cinfo);
+	jpeg_stdio_src(&cinfo, f);
+	jpeg_read_header(&cinfo, TRUE);
+	*width = cinfo.image_width;
+	*length = cinfo.image_height;
+	jpeg_destroy_decompress(&cinfo);
+	fclose(f);
+	return 1;
+}
+
+static int
+fileExists(const char* filename)
+{
+	FILE * f = fopen(filename, "rb");
+
+	if (f == NULL)
+		return 0;
+	fclose(f);
+	return 1;
+}
+
+/*
+ * Extent of tile n of a level of size "size" along one dimension.
+ */
+static uint32_t
+tileExtent(uint32_t n, uint32_t size, uint32_t tilesize, uint32_t overlap)
+{
+	uint32_t start = n * tilesize, end = start + tilesize + overlap;
+
+	if (start > overlap)
+		start -= overlap;
+	else
+		start = 0;
+	if (end > size)
+		end = size;
+	return end - start;
+}
+
+int
+main(int argc, char **argv)
+{
+	char xml[1024], path[1024];
+	FILE * f;
+	size_t n;
+	uint32_t tilesize, overlap, width, length;
+	unsigned numberoflevels, level, nerrors = 0;
+
+	if (argc != 2 || strlen(argv[1]) < 5 ||
+	    strcmp(argv[1] + strlen(argv[1]) - 4, ".dzi") != 0) {
+		fprintf(stderr, "usage: checkdzi file.dzi\n");
+		return 1;
+	}
+	f = fopen(argv[1], "rb");
+	if (f == NULL) {
+		fprintf(stderr, "Can't open %s\n", argv[1]);
+		return 1;
+	}
+	n = fread(xml, 1, sizeof(xml) - 1, f);
+	fclose(f);
+	xml[n] = 0;
+	if (strstr(xml, "Format=\"jpg\"") == NULL ||
+	    ! getAttribute(xml, "TileSize", &tilesize) ||
+	    ! getAttribute(xml, "Overlap", &overlap) ||
+	    ! getAttribute(xml, "Width", &width) ||
+	    ! getAttribute(xml, "Height", &length) || tilesize == 0) {
+		fprintf(stderr, "Unexpected .dzi file %s\n", argv[1]);
+		return 1;
+	}
+
+	/* Level 0 is 1x1, each level is twice as large as the one before */
+	numberoflevels = 1;
+	while (((width - 1) >> (numberoflevels - 1)) > 0 ||
+	    ((length - 1) >> (numberoflevels - 1)) > 0)
+		numberoflevels++;
+
+	argv[1][strlen(argv[1]) - 4] = 0;
+	for (level = numberoflevels ; level-- > 0 ; ) {
+		unsigned shift = numberoflevels - 1 - level;
+		uint32_t w = ((width - 1) >> shift) + 1;
+		uint32_t l = ((length - 1) >> shift) + 1;
+		uint32_t ncolumns = (w + tilesize - 1) / tilesize;
+		uint32_t nrows = (l + tilesize - 1) / tilesize;
+		uint32_t column, row;
+
+		for (column = 0 ; column <= ncolumns ; column++)
+			for (row = 0 ; row <= nrows ; row++) {
+				uint32_t tw, tl;
+				int isinlevel = column < ncolumns && row < nrows;
+
+				snprintf(path, sizeof(path), "%s_files/%u/%u_%u.jpg",
+				    argv[1], level, column, row);
+				if (! isinlevel) {
+					if ((column == ncolumns || row == nrows) &&
+					    fileExists(path)) {
+						fprintf(stderr, "Unexpected tile %s\n",
+						    path);
+						nerrors++;
+					}
+					continue;
+				}
+				if (! getJPEGDimensions(path, &tw, &tl)) {
+					fprintf(stderr, "Missing tile %s\n", path);
+					nerrors++;
+				} else if (tw != tileExtent(column, w, tilesize,
+				    overlap) || tl != tileExtent(row, l,
+				    tilesize, overlap)) {
+					fprintf(stderr, "Tile %s is %ux%u instead of %ux%u\n",
+					    path, tw, tl,
+					    tileExtent(column, w, tilesize, overlap),
+					    tileExtent(row, l, tilesize, overlap));
+					nerrors++;
+				}
+			}
+	}
+	snprintf(path, sizeof(path), "%s_files/%u/0_0.jpg", argv[1],
+	    numberoflevels);
+	if (fileExists(path)) {
+		fprintf(stderr, "Unexpected level %u\n", numberoflevels);
+		nerrors++;
+	}
+	return nerrors > 0 ? 1 : 0;
+}
+
+/* vim: set ts=8 sts=8 sw=8 noet: */
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 8
+ * fill-column: 78
+ * End:
+ */
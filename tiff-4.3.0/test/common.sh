@@ -30,6 +30,13 @@ TIFFINFO=${TOOLS}/tiffinfo
 TIFFMEDIAN=${TOOLS}/tiffmedian
 TIFFSET=${TOOLS}/tiffset
 TIFFSPLIT=${TOOLS}/tiffsplit
+NDPI2TIFF=${TOOLS}/ndpi2tiff
+NDPISPLIT=${TOOLS}/ndpisplit
+
+# Aliases for built test programs
+MKNDPI=${BUILDDIR}/mkndpi
+REGIONCMP=${BUILDDIR}/regioncmp
+CHECKDZI=${BUILDDIR}/checkdzi
 
 # Aliases for input test files
 IMG_MINISBLACK_1C_16B=${IMAGES}/minisblack-1c-16b.tiff
@@ -118,6 +125,60 @@ f_tiffinfo_validate ()
     f_test_reader "$TIFFINFO -D" $1
 }
 
+#
+# Execute a command whose input and output files are in its arguments
+#
+# f_test_exec command
+f_test_exec ()
+{
+  command=$1
+  echo "$MEMCHECK $command"
+  eval $MEMCHECK $command
+  status=$?
+  if [ $status != 0 ] ; then
+    echo "Returned failed status $status!"
+    exit $status
+  fi
+}
+
+#
+# Make an empty directory for the output files of a test, and copy into it
+# the input files of tools which write their output next to their input
+#
+# f_test_dir dir [infile...]
+f_test_dir ()
+{
+  testdir=$1
+  shift
+  rm -rf ${testdir}
+  mkdir ${testdir} || exit 1
+  for infile in "$@" ; do
+    cp ${infile} ${testdir}/ || exit 1
+  done
+}
+
+#
+# Check that two directories hold the same files with the same contents
+#
+# f_test_same_files dir1 dir2
+f_test_same_files ()
+{
+  dir1=$1
+  dir2=$2
+  echo "comparing the files of ${dir1} and ${dir2}"
+  if [ "`cd ${dir1} && find . -type f | sort`" != \
+       "`cd ${dir2} && find . -type f | sort`" ] ; then
+    echo "${dir1} and ${dir2} don't hold the same files!"
+    exit 1
+  fi
+  for file in `cd ${dir1} && find . -type f` ; do
+    if ! cmp -s ${dir1}/${file} ${dir2}/${file} ; then
+      echo "${dir1}/${file} and ${dir2}/${file} differ!"
+      exit 1
+    fi
+  done
+}
+
 if test "$VERBOSE" = TRUE
 then
   set -x
@@ -0,0 +1,367 @@
+/* mkndpi.c
+ Copyright (c) 2011-2021 Christophe Deroulers
+ Distributed under the GNU General Public License v3 -- contact the
+ author for commercial use */
+
+/*
+ * TIFF Library
+ *
+ * Writes a small synthetic NDPI file for the tests of ndpisplit and
+ * ndpi2tiff: for each z-offset, an image at magnification x20 and one
+ * at x5, each one a single JPEG strip with restart markers, then a
+ * macroscopic image. libtiff can't write the NDPI tags, so the file is
+ * written by hand.
+ */
+
+#include "tif_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#include "tiffio.h"
+
+#if defined(__BORLANDC__) || defined(__MINGW32__)
+# define XMD_H 1
+#endif
+#if defined(__WIN32__) && !defined(__MINGW32__)
+# ifndef __RPCNDR_H__            /* don't conflict if rpcndr.h already read */
+   typedef unsigned char boolean;
+# endif
+# define HAVE_BOOLEAN            /* prevent jmorecfg.h from redefining it */
+#endif
+#include "jpeglib.h"
+
+#ifndef HAVE_GETOPT
+extern int getopt(int argc, char * const argv[], const char *optstring);
+#endif
+
+#define MAX_IMAGES 32
+#define MAX_LANES 64
+#define NDPI_LANE_WIDTH 128
+#define MACRO_WIDTH 240
+#define MACRO_LENGTH 96
+
+typedef struct {
+	uint32_t width, length;
+	float magnification; /* -1 for the macroscopic image */
+	int32_t zoffset;
+	unsigned char * data; /* JPEG file */
+	unsigned long size;
+	uint32_t * mcustarts; /* offsets of the restart intervals in data */
+	uint32_t nmcustarts;
+} Image;
+
+static uint32_t blanklanes[MAX_LANES];
+static int nblanklanes = 0;
+static uint32_t fullwidth;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: mkndpi [-n] [-r interval] [-b lane[,lane...]] [-z offset[,offset...]] file.ndpi width length\n");
+	fprintf(stderr, " -n  leave out the NDPIMCUStarts tag\n");
+	fprintf(stderr, " -r  restart interval in MCUs (default 8)\n");
+	fprintf(stderr, " -b  blank lanes (columns of %d pixels at x20)\n",
+		NDPI_LANE_WIDTH);
+	fprintf(stderr, " -z  z-offsets (default 0)\n");
+	exit(1);
+}
+
+static int
+isInBlankLane(const Image* image, uint32_t x)
+{
+	int k;
+
+	for (k = 0 ; k < nblanklanes ; k++) {
+		double scale = (double) image->width / fullwidth;
+
+		if (x >= blanklanes[k] * NDPI_LANE_WIDTH * scale &&
+		    x < (blanklanes[k] + 1) * NDPI_LANE_WIDTH * scale)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Encodes a pattern with tissue, background and blank lanes into the
+ * JPEG file of the image, and finds the restart intervals in it.
+ */
+static int
+encodeImage(Image* image, int restartinterval, unsigned seed)
+{
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	unsigned char * row = malloc(3 * image->width);
+	unsigned long p;
+	uint32_t x, y;
+
+	if (row == NULL)
+		return 0;
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+	image->data = NULL;
+	image->size = 0;
+	jpeg_mem_dest(&cinfo, &image->data, &image->size);
+	cinfo.image_width = image->width;
+	cinfo.image_height = image->length;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, 90, TRUE);
+	cinfo.restart_interval = restartinterval;
+	jpeg_start_compress(&cinfo, TRUE);
+	for (y = 0 ; y < image->length ; y++) {
+		for (x = 0 ; x < image->width ; x++) {
+			unsigned v = (x * 2654435761u) ^ (y * 40503u) ^ seed;
+			unsigned char * pixel = row + 3 * x;
+
+			if (image->magnification > 0 &&
+			    isInBlankLane(image, x))
+				pixel[0] = pixel[1] = pixel[2] = 250;
+			else if ((x / 97 + y / 89) % 5 == 0) {
+				pixel[0] = 240;
+				pixel[1] = 238;
+				pixel[2] = 236;
+			} else {
+				pixel[0] = (unsigned char) ((x + y) * 3 + (v >> 28));
+				pixel[1] = (unsigned char) (x * 5 - y + ((v >> 20) & 15));
+				pixel[2] = (unsigned char) ((x ^ y) + ((v >> 12) & 31));
+			}
+		}
+		jpeg_write_scanlines(&cinfo, &row, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	free(row);
+
+	/* The first restart interval starts after the SOS segment, the
+	 * next ones after each RSTn marker */
+	image->mcustarts = malloc(sizeof(uint32_t) * (image->size / 2 + 1));
+	if (image->mcustarts == NULL)
+		return 0;
+	image->nmcustarts = 0;
+	for (p = 2 ; p + 3 < image->size ; ) {
+		unsigned marker = image->data[p+1];
+
+		p += 2 + ((image->data[p+2] << 8) | image->data[p+3]);
+		if (marker == 0xDA)
+			break;
+	}
+	image->mcustarts[image->nmcustarts++] = (uint32_t) p;
+	for ( ; p + 1 < image->size ; p++)
+		if (image->data[p] == 0xFF && image->data[p+1] >= 0xD0 &&
+		    image->data[p+1] <= 0xD7)
+			image->mcustarts[image->nmcustarts++] = (uint32_t) p + 2;
+	return 1;
+}
+
+static void
+put16(FILE* f, unsigned v)
+{
+	putc(v & 0xff, f);
+	putc((v >> 8) & 0xff, f);
+}
+
+static void
+put32(FILE* f, uint32_t v)
+{
+	put16(f, v & 0xffff);
+	put16(f, v >> 16);
+}
+
+static void
+putEntry(FILE* f, unsigned tag, unsigned type, uint32_t count, uint32_t value)
+{
+	put16(f, tag);
+	put16(f, type);
+	put32(f, count);
+	put32(f, value);
+}
+
+/*
+ * Writes the images into a little-endian classic TIFF file, each IFD
+ * followed by its values and its strip.
+ */
+static int
+writeNDPIFile(const char* filename, const Image* images, int nimages,
+	int shouldwritemcustarts)
+{
+	FILE * f = fopen(filename, "wb");
+	uint32_t position = 8;
+	int i;
+
+	if (f == NULL) {
+		fprintf(stderr, "Can't create %s\n", filename);
+		return 0;
+	}
+	fwrite("II*\0", 1, 4, f);
+	put32(f, position);
+	for (i = 0 ; i < nimages ; i++) {
+		const Image * image = &images[i];
+		int hasmcustarts = shouldwritemcustarts &&
+		    image->nmcustarts > 1;
+		int hasblanklanes = nblanklanes > 0 &&
+		    image->magnification > 0;
+		unsigned nentries = 19 + hasmcustarts + hasblanklanes;
+		uint32_t bitspersample = position + 2 + nentries * 12 + 4;
+		uint32_t xresolution = bitspersample + 6;
+		uint32_t yresolution = xresolution + 8;
+		uint32_t mcustarts = yresolution + 8;
+		uint32_t lanes = mcustarts +
+		    (hasmcustarts ? 4 * image->nmcustarts : 0);
+		uint32_t strip = lanes +
+		    (hasblanklanes && nblanklanes > 1 ? 4 * nblanklanes : 0);
+		uint32_t next = (strip + (uint32_t) image->size + 1) & ~1U;
+		uint32_t resolution = (uint32_t) (image->magnification > 0 ?
+		    2000 * image->magnification : 100);
+		union { float f; uint32_t u; } magnification;
+		uint32_t k;
+
+		magnification.f = image->magnification;
+		put16(f, nentries);
+		putEntry(f, TIFFTAG_IMAGEWIDTH, TIFF_LONG, 1, image->width);
+		putEntry(f, TIFFTAG_IMAGELENGTH, TIFF_LONG, 1, image->length);
+		putEntry(f, TIFFTAG_BITSPERSAMPLE, TIFF_SHORT, 3, bitspersample);
+		putEntry(f, TIFFTAG_COMPRESSION, TIFF_SHORT, 1, COMPRESSION_JPEG);
+		putEntry(f, TIFFTAG_PHOTOMETRIC, TIFF_SHORT, 1,
+		    PHOTOMETRIC_YCBCR);
+		putEntry(f, TIFFTAG_STRIPOFFSETS, TIFF_LONG, 1, strip);
+		putEntry(f, TIFFTAG_SAMPLESPERPIXEL, TIFF_SHORT, 1, 3);
+		putEntry(f, TIFFTAG_ROWSPERSTRIP, TIFF_LONG, 1, image->length);
+		putEntry(f, TIFFTAG_STRIPBYTECOUNTS, TIFF_LONG, 1,
+		    (uint32_t) image->size);
+		putEntry(f, TIFFTAG_XRESOLUTION, TIFF_RATIONAL, 1, xresolution);
+		putEntry(f, TIFFTAG_YRESOLUTION, TIFF_RATIONAL, 1, yresolution);
+		putEntry(f, TIFFTAG_RESOLUTIONUNIT, TIFF_SHORT, 1,
+		    RESUNIT_CENTIMETER);
+		putEntry(f, TIFFTAG_YCBCRSUBSAMPLING, TIFF_SHORT, 2,
+		    2 | (2 << 16));
+		putEntry(f, NDPITAG_65420, TIFF_SHORT, 1, 1);
+		putEntry(f, NDPITAG_MAGNIFICATION, TIFF_FLOAT, 1,
+		    magnification.u);
+		putEntry(f, NDPITAG_65422, TIFF_SLONG, 1, 0);
+		putEntry(f, NDPITAG_65423, TIFF_SLONG, 1, 0);
+		putEntry(f, NDPITAG_ZOFFSET, TIFF_SLONG, 1,
+		    (uint32_t) image->zoffset);
+		putEntry(f, NDPITAG_65425, TIFF_LONG, 1, 0);
+		if (hasmcustarts)
+			putEntry(f, NDPITAG_MCUSTARTS, TIFF_LONG,
+			    image->nmcustarts, mcustarts);
+		if (hasblanklanes)
+			putEntry(f, NDPITAG_BLANKLANES, TIFF_LONG, nblanklanes,
+			    nblanklanes == 1 ? blanklanes[0] : lanes);
+		put32(f, i + 1 < nimages ? next : 0);
+
+		put16(f, 8);
+		put16(f, 8);
+		put16(f, 8);
+		put32(f, resolution);
+		put32(f, 1);
+		put32(f, resolution);
+		put32(f, 1);
+		if (hasmcustarts)
+			for (k = 0 ; k < image->nmcustarts ; k++)
+				put32(f, image->mcustarts[k]);
+		if (hasblanklanes && nblanklanes > 1)
+			for (k = 0 ; k < (uint32_t) nblanklanes ; k++)
+				put32(f, blanklanes[k]);
+		fwrite(image->data, 1, image->size, f);
+		if ((strip + image->size) & 1)
+			putc(0, f);
+		position = next;
+	}
+	if (fclose(f) != 0) {
+		fprintf(stderr, "Error while writing %s\n", filename);
+		return 0;
+	}
+	return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+	Image images[MAX_IMAGES];
+	int32_t zoffsets[MAX_IMAGES / 2 - 1];
+	int nzoffsets = 0, nimages = 0, restartinterval = 8;
+	int shouldwritemcustarts = 1;
+	int c, i, status;
+	char * p;
+
+	while ((c = getopt(argc, argv, "nr:b:z:")) != -1)
+		switch (c) {
+		case 'n':
+			shouldwritemcustarts = 0;
+			break;
+		case 'r':
+			restartinterval = atoi(optarg);
+			break;
+		case 'b':
+			for (p = optarg ; *p && nblanklanes < MAX_LANES ; ) {
+				blanklanes[nblanklanes++] = strtoul(p, &p, 10);
+				if (*p == ',')
+					p++;
+			}
+			break;
+		case 'z':
+			for (p = optarg ; *p &&
+			    nzoffsets < MAX_IMAGES / 2 - 1 ; ) {
+				zoffsets[nzoffsets++] = strtol(p, &p, 10);
+				if (*p == ',')
+					p++;
+			}
+			break;
+		default:
+			usage();
+		}
+	if (argc - optind != 3 || restartinterval <= 0)
+		usage();
+	if (nzoffsets == 0)
+		zoffsets[nzoffsets++] = 0;
+	fullwidth = strtoul(argv[optind+1], NULL, 10);
+
+	for (i = 0 ; i < nzoffsets ; i++) {
+		images[nimages].width = fullwidth;
+		images[nimages].length = strtoul(argv[optind+2], NULL, 10);
+		images[nimages].magnification = 20;
+		images[nimages].zoffset = zoffsets[i];
+		nimages++;
+		images[nimages].width = fullwidth / 4;
+		images[nimages].length = images[nimages-1].length / 4;
+		images[nimages].magnification = 5;
+		images[nimages].zoffset = zoffsets[i];
+		nimages++;
+	}
+	images[nimages].width = MACRO_WIDTH;
+	images[nimages].length = MACRO_LENGTH;
+	images[nimages].magnification = -1;
+	images[nimages].zoffset = 0;
+	nimages++;
+
+	for (i = 0 ; i < nimages ; i++)
+		if (images[i].width == 0 || images[i].length == 0 ||
+		    ! encodeImage(&images[i], images[i].magnification > 0 ?
+		    restartinterval : 0, (unsigned) i)) {
+			fprintf(stderr, "Can't encode image %d\n", i);
+			return 1;
+		}
+	status = writeNDPIFile(argv[optind], images, nimages,
+	    shouldwritemcustarts);
+	for (i = 0 ; i < nimages ; i++) {
+		free(images[i].data);
+		free(images[i].mcustarts);
+	}
+	return status ? 0 : 1;
+}
+
+/* vim: set ts=8 sts=8 sw=8 noet: */
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 8
+ * fill-column: 78
+ * End:
+ */
@@ -0,0 +1,40 @@
+#!/bin/sh
+#
+# Check that the decoding threads of ndpi2tiff -j, which read the NDPI file
+# through clones of the input handle, make the same file as a single
+# thread, whether the positions of the restart markers come from the NDPI
+# MCU starts tag, from a restart marker index written by ndpisplit -R, or
+# are not known.
+#
+. ${srcdir:-.}/common.sh
+outdir=o-ndpi2tiff-clone
+f_test_dir ${outdir}
+cd ${outdir} || exit 1
+f_test_dir mcustarts
+f_test_dir nomcustarts
+f_test_dir rstidx
+f_test_exec "${MKNDPI} mcustarts/slide.ndpi 2048 1544"
+f_test_exec "${MKNDPI} -n nomcustarts/slide.ndpi 2048 1544"
+cp nomcustarts/slide.ndpi rstidx/ || exit 1
+cd rstidx || exit 1
+f_test_exec "${NDPISPLIT} -R -Ex20,0,0,8,8:x5,0,0,8,8 slide.ndpi"
+rm -f slide_*
+if [ ! -f slide.ndpi.rstidx ] ; then
+  echo "ndpisplit -R wrote no restart marker index!"
+  exit 1
+fi
+cd .. || exit 1
+
+for slide in mcustarts nomcustarts rstidx ; do
+  for options in "-t -c lzw" "-A -t -c lzw" ; do
+    f_test_dir j1 ${slide}/slide.ndpi*
+    f_test_dir j3 ${slide}/slide.ndpi*
+    cd j1 || exit 1
+    f_test_exec "${NDPI2TIFF} ${options} -j1 slide.ndpi"
+    cd ../j3 || exit 1
+    f_test_exec "${NDPI2TIFF} ${options} -j3 slide.ndpi"
+    cd .. || exit 1
+    f_test_same_files j1 j3
+  done
+  f_test_exec "${REGIONCMP} ${slide}/slide.ndpi j3/slide.tif"
+done
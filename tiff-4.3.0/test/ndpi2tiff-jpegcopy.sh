@@ -0,0 +1,55 @@
+#!/bin/sh
+#
+# Check that ndpi2tiff -J copies the JPEG data of NDPI images into tiles
+# which hold the pixels of the images, grouping small restart intervals into
+# tiles of at least 64x64 pixels, and that images whose restart intervals
+# are not aligned on rows or only fit smaller tiles are re-encoded with a
+# message.
+#
+. ${srcdir:-.}/common.sh
+outdir=o-ndpi2tiff-jpegcopy
+f_test_dir ${outdir}
+cd ${outdir} || exit 1
+
+# Tiles decoded on their own differ from the strip only at their edges,
+# through the upsampling of the chroma
+f_test_dir copied
+cd copied || exit 1
+f_test_exec "${MKNDPI} slide.ndpi 2048 1536"
+f_test_exec "${NDPI2TIFF} -J slide.ndpi"
+f_test_exec "${REGIONCMP} -a 1 slide.ndpi slide.tif"
+cd .. || exit 1
+
+# Restart intervals of one MCU, 16x16 pixels
+f_test_dir grouped
+cd grouped || exit 1
+f_test_exec "${MKNDPI} -r 1 slide.ndpi 2048 1536"
+f_test_exec "${NDPI2TIFF} -J slide.ndpi"
+if ! ${TIFFINFO} slide.tif | grep -q "Tile Width: 64 Tile Length: 64" ; then
+  echo "The restart intervals were not grouped into tiles of 64x64 pixels!"
+  exit 1
+fi
+f_test_exec "${REGIONCMP} -a 1 slide.ndpi slide.tif"
+cd .. || exit 1
+
+f_test_dir reencoded
+cd reencoded || exit 1
+f_test_exec "${MKNDPI} -r 3 slide.ndpi 2048 1536"
+f_test_exec "${NDPI2TIFF} -J slide.ndpi 2> stderr.txt"
+if ! grep -q "restart intervals not aligned on rows" stderr.txt ; then
+  echo "No message about the image re-encoded!"
+  exit 1
+fi
+f_test_exec "${REGIONCMP} -a 8 slide.ndpi slide.tif"
+cd .. || exit 1
+
+# 97 rows of MCUs can only be cut into tiles of 16 or 1552 pixels long
+f_test_dir tiny
+cd tiny || exit 1
+f_test_exec "${MKNDPI} -r 1 slide.ndpi 2048 1552"
+f_test_exec "${NDPI2TIFF} -J slide.ndpi 2> stderr.txt"
+if ! grep -q "TIFF tiles less than 64 pixels long" stderr.txt ; then
+  echo "No message about the image re-encoded!"
+  exit 1
+fi
+f_test_exec "${REGIONCMP} -a 8 slide.ndpi slide.tif"
@@ -0,0 +1,22 @@
+#!/bin/sh
+#
+# Check that ndpi2tiff writes the same file whatever the number of threads
+# decoding the image.
+#
+. ${srcdir:-.}/common.sh
+outdir=o-ndpi2tiff-threads
+f_test_dir ${outdir}
+cd ${outdir} || exit 1
+f_test_exec "${MKNDPI} slide.ndpi 2048 1544"
+
+for options in "-s" "-t" "-t -c jpeg" "-t -c lzw" ; do
+  f_test_dir j1 slide.ndpi
+  f_test_dir j3 slide.ndpi
+  cd j1 || exit 1
+  f_test_exec "${NDPI2TIFF} ${options} -j1 slide.ndpi"
+  cd ../j3 || exit 1
+  f_test_exec "${NDPI2TIFF} ${options} -j3 slide.ndpi"
+  cd .. || exit 1
+  f_test_same_files j1 j3
+done
+f_test_exec "${REGIONCMP} slide.ndpi j1/slide.tif"
@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# Check the tar archive of mosaic pieces written by ndpisplit -a: its
+# members, extracted by tar, must be the pieces written as files without
+# -a, including those whose names are too long for a ustar header, and its
+# index must give their offsets and sizes in the archive.
+#
+. ${srcdir:-.}/common.sh
+if ! command -v tar > /dev/null 2>&1 ; then
+  echo "tar is not available, skipping the test"
+  exit 77
+fi
+outdir=o-ndpisplit-archive
+f_test_dir ${outdir}
+cd ${outdir} || exit 1
+slide=slide-with-a-name-long-enough-that-the-names-of-its-mosaic-pieces-need-a-pax-extended-header
+f_test_exec "${MKNDPI} ${slide}.ndpi 2048 1544"
+
+f_test_dir files ${slide}.ndpi
+f_test_dir archive ${slide}.ndpi
+f_test_dir extracted
+cd files || exit 1
+f_test_exec "${NDPISPLIT} -x20 -M -g256x386 ${slide}.ndpi"
+rm -f ${slide}.ndpi ${slide}_x20_z0.tif ${slide}_x20_z0_mosaic.txt
+cd ../archive || exit 1
+f_test_exec "${NDPISPLIT} -x20 -M -g256x386 -a${slide}.tar ${slide}.ndpi"
+f_test_exec "${NDPISPLIT} -x20 -M -g256x386 -a- ${slide}.ndpi > stdout.tar"
+cd ../extracted || exit 1
+f_test_exec "tar xf ../archive/${slide}.tar"
+cd .. || exit 1
+
+# The index is the last member of the archive
+index=extracted/ndpisplit_mosaic_index.txt
+if [ "`tar tf archive/${slide}.tar | tail -n 1`" != "ndpisplit_mosaic_index.txt" ] ; then
+  echo "The index is not the last member of the archive!"
+  exit 1
+fi
+if [ "`tar tf archive/${slide}.tar`" != "`tar tf archive/stdout.tar`" ] ; then
+  echo "The archive written to stdout doesn't have the same members!"
+  exit 1
+fi
+mv ${index} index.txt || exit 1
+f_test_same_files files extracted
+
+# Each piece is found in the archive at the offset given by the index
+grep -v "^#" index.txt | while read offset x y width length size hash name ; do
+  if [ `expr ${offset} % 512` != 0 ] ; then
+    echo "Offset ${offset} of ${name} is not at a tar block!"
+    exit 1
+  fi
+  dd if=archive/${slide}.tar of=piece bs=512 skip=`expr ${offset} / 512` \
+    count=`expr \( ${size} + 511 \) / 512` 2> /dev/null
+  if ! cmp -s -n ${size} piece files/${name} ; then
+    echo "Offset ${offset} and size ${size} of ${name} are not right!"
+    exit 1
+  fi
+done || exit 1
+if [ `grep -v "^#" index.txt | wc -l` != `ls files | wc -l` ] ; then
+  echo "The index doesn't list all the pieces!"
+  exit 1
+fi
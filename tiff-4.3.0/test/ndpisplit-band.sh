@@ -0,0 +1,27 @@
+#!/bin/sh
+#
+# Check that ndpisplit cuts the mosaic pieces of a stripped image from a
+# band of decoded scanlines, and that the pieces, overlaps included, hold
+# the pixels of the image.
+#
+. ${srcdir:-.}/common.sh
+outdir=o-ndpisplit-band
+f_test_dir ${outdir}
+cd ${outdir} || exit 1
+f_test_exec "${MKNDPI} slide.ndpi 2048 1544"
+f_test_exec "${NDPISPLIT} -vvv -x20 -M2n -g256x386 -o10 slide.ndpi 2> band.log"
+if ! grep "using a band" band.log > /dev/null ; then
+  echo "The pieces were not cut from a band!"
+  exit 1
+fi
+
+# Pieces of 256x386 pixels with overlaps of 10 pixels on each side
+for i in 1 2 3 4 ; do
+  y=`expr \( ${i} - 1 \) \* 386`
+  [ ${i} = 1 ] || y=`expr ${y} - 10`
+  for j in 1 2 3 4 5 6 7 8 ; do
+    x=`expr \( ${j} - 1 \) \* 256`
+    [ ${j} = 1 ] || x=`expr ${x} - 10`
+    f_test_exec "${REGIONCMP} slide.ndpi slide_x20_z0_i${i}j${j}.tif ${x} ${y}"
+  done
+done
@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# Check that with -N, ndpisplit leaves out the mosaic pieces in the blank
+# lanes of an NDPI file and lists them with -K, and that ndpisplit and
+# ndpi2tiff write the tiles there as blank tiles, the other tiles being as
+# without -N.
+#
+. ${srcdir:-.}/common.sh
+outdir=o-ndpisplit-blanklanes
+f_test_dir ${outdir}
+cd ${outdir} || exit 1
+# Lanes 4 and 5 are columns 512 to 767 at x20, filled with 250s
+f_test_exec "${MKNDPI} -b 4,5 slide.ndpi 2048 1544"
+
+f_test_dir all slide.ndpi
+f_test_dir lanes slide.ndpi
+cd all || exit 1
+f_test_exec "${NDPISPLIT} -x20 -cn -M2n -g128x128 slide.ndpi"
+f_test_exec "${NDPI2TIFF} -t -c lzw slide.ndpi"
+cd ../lanes || exit 1
+f_test_exec "${NDPISPLIT} -K -N -x20 -cn -M2n -g128x128 slide.ndpi > ../keys.txt"
+f_test_exec "${NDPI2TIFF} -N -t -c lzw slide.ndpi"
+cd .. || exit 1
+
+pieces=`sed -n 's/^Mosaic piece in blank lanes, not made://p' keys.txt`
+if [ `echo ${pieces} | wc -w` -ne 26 ] ; then
+  echo "Not the 2 columns of 13 pieces in the blank lanes: ${pieces}"
+  exit 1
+fi
+for piece in ${pieces} ; do
+  if [ -f lanes/${piece} ] || [ ! -f all/${piece} ] ; then
+    echo "${piece} was listed but made, or is not a piece!"
+    exit 1
+  fi
+  rm -f all/${piece}
+  sed "/ ${piece}\$/d" all/slide_x20_z0_mosaic.txt > manifest.txt &&
+    mv manifest.txt all/slide_x20_z0_mosaic.txt || exit 1
+done
+
+# Blank tiles are white, and the blank lanes of the file 250 but for JPEG
+# ringing at their edges: the lanes being an eighth of the image, the mean
+# difference is at most 5/8
+for file in slide_x20_z0.tif slide.tif ; do
+  f_test_exec "${REGIONCMP} -a 0.7 all/${file} lanes/${file}"
+  if ${REGIONCMP} -t 4 all/${file} lanes/${file} 2> /dev/null ; then
+    echo "lanes/${file} has no blank tiles!"
+    exit 1
+  fi
+  rm -f all/${file} lanes/${file}
+done
+f_test_same_files all lanes
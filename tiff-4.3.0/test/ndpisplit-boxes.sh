@@ -0,0 +1,32 @@
+#!/bin/sh
+#
+# Check that the boxes of an image extracted by ndpisplit in a single pass,
+# overlapping or not, hold the pixels of the image, and that boxes given in
+# a file with -E@file are the same as on the command line.
+#
+. ${srcdir:-.}/common.sh
+outdir=o-ndpisplit-boxes
+f_test_dir ${outdir}
+cd ${outdir} || exit 1
+f_test_exec "${MKNDPI} slide.ndpi 2048 1544"
+
+f_test_dir args slide.ndpi
+f_test_dir file slide.ndpi
+cd args || exit 1
+f_test_exec "${NDPISPLIT} -cn -Ex20,900,1000,300,400,low:x20,100,50,700,600,high:x20,500,300,200,900,across:x5,10,20,100,100 slide.ndpi"
+for box in "low 900 1000" "high 100 50" "across 500 300" ; do
+  set -- ${box}
+  f_test_exec "${REGIONCMP} slide.ndpi slide_x20_z0_$1.tif $2 $3"
+done
+f_test_exec "${REGIONCMP} -d 1 slide.ndpi slide_x5_z0_1.tif 10 20"
+cd ../file || exit 1
+cat > boxes.txt <<EOB
+x20,900,1000,300,400,low
+x20,100,50,700,600,high
+x20,500,300,200,900,across
+x5,10,20,100,100
+EOB
+f_test_exec "${NDPISPLIT} -cn -E@boxes.txt slide.ndpi"
+rm -f boxes.txt
+cd .. || exit 1
+f_test_same_files args file
@@ -0,0 +1,20 @@
+#!/bin/sh
+#
+# Check that boxes extracted by ndpisplit from the JPEG images of an NDPI
+# file hold the pixels of the images, with the lossless codecs as with JPEG.
+#
+. ${srcdir:-.}/common.sh
+outdir=o-ndpisplit-codecs
+f_test_dir ${outdir}
+cd ${outdir} || exit 1
+f_test_exec "${MKNDPI} slide.ndpi 2048 1544"
+
+for compression in "n" "l" "j" ; do
+  f_test_dir ${compression} slide.ndpi
+  cd ${compression} || exit 1
+  f_test_exec "${NDPISPLIT} -c${compression} -Ex20,300,200,700,500 slide.ndpi"
+  cd .. || exit 1
+done
+f_test_exec "${REGIONCMP} slide.ndpi n/slide_x20_z0_1.tif 300 200"
+f_test_exec "${REGIONCMP} slide.ndpi l/slide_x20_z0_1.tif 300 200"
+f_test_exec "${REGIONCMP} -a 8 slide.ndpi j/slide_x20_z0_1.tif 300 200"
@@ -0,0 +1,22 @@
+#!/bin/sh
+#
+# Check that narrow boxes extracted by ndpisplit from the JPEG images of an
+# NDPI file, whose strips are decoded only over the columns of the boxes,
+# hold the pixels of the images, with and without the NDPI MCU starts tag.
+#
+. ${srcdir:-.}/common.sh
+outdir=o-ndpisplit-columns
+f_test_dir ${outdir}
+cd ${outdir} || exit 1
+
+boxes="-Ex20,1001,400,37,500:x20,2000,900,48,300:x5,3,20,17,200"
+for mkndpioptions in "" "-n" ; do
+  f_test_dir boxes
+  cd boxes || exit 1
+  f_test_exec "${MKNDPI} ${mkndpioptions} slide.ndpi 2048 1544"
+  f_test_exec "${NDPISPLIT} -cn ${boxes} slide.ndpi"
+  f_test_exec "${REGIONCMP} slide.ndpi slide_x20_z0_1.tif 1001 400"
+  f_test_exec "${REGIONCMP} slide.ndpi slide_x20_z0_2.tif 2000 900"
+  f_test_exec "${REGIONCMP} -d 1 slide.ndpi slide_x5_z0_1.tif 3 20"
+  cd .. || exit 1
+done
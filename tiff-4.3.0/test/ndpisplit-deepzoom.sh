@@ -0,0 +1,24 @@
+#!/bin/sh
+#
+# Check the levels and tiles of the Deep Zoom pyramids made by ndpisplit -Z,
+# and that they don't depend on the number of threads.
+#
+. ${srcdir:-.}/common.sh
+outdir=o-ndpisplit-deepzoom
+f_test_dir ${outdir}
+cd ${outdir} || exit 1
+f_test_exec "${MKNDPI} -z 0,1200 slide.ndpi 2048 1544"
+
+for options in "-Z" "-Z256,0" "-Z510,4" ; do
+  f_test_dir t1 slide.ndpi
+  f_test_dir t3 slide.ndpi
+  cd t1 || exit 1
+  f_test_exec "${NDPISPLIT} ${options} -t1 slide.ndpi"
+  cd ../t3 || exit 1
+  f_test_exec "${NDPISPLIT} ${options} -t3 slide.ndpi"
+  cd .. || exit 1
+  for dzi in t1/slide_x20_z0.dzi t1/slide_x20_z1200.dzi ; do
+    f_test_reader "${CHECKDZI}" ${dzi}
+  done
+  f_test_same_files t1 t3
+done
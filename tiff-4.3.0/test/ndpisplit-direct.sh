@@ -0,0 +1,31 @@
+#!/bin/sh
+#
+# Check that the mosaics of a whole image and of a box made by ndpisplit -d
+# straight from the NDPI file, without writing the split TIFF images, are
+# the same as those made from the split TIFF images.
+#
+. ${srcdir:-.}/common.sh
+outdir=o-ndpisplit-direct
+f_test_dir ${outdir}
+cd ${outdir} || exit 1
+f_test_exec "${MKNDPI} slide.ndpi 2048 1544"
+
+f_test_dir split slide.ndpi
+f_test_dir direct slide.ndpi
+cd split || exit 1
+f_test_exec "${NDPISPLIT} -cn -M2n -g256x386 -Ex20,100,200,700,500,box slide.ndpi"
+f_test_exec "${NDPISPLIT} -M2n -g256x386 -x20 slide.ndpi"
+rm -f slide_x20_z0.tif slide_x20_z0_box.tif
+cd ../direct || exit 1
+f_test_exec "${NDPISPLIT} -vvv -d -M2n -g256x386 -Ex20,100,200,700,500,box slide.ndpi 2> ../box.log"
+f_test_exec "${NDPISPLIT} -d -M2n -g256x386 -x20 slide.ndpi"
+cd .. || exit 1
+# The band holds rows of pieces of the box only: 386 rows of 700 pixels
+if ! grep "using a band of 810600 bytes" box.log > /dev/null ; then
+  echo "The band of the box mosaic is not as wide as the box!"
+  exit 1
+fi
+# The manifest of the box mosaic gives the position of the box in the image
+# the pieces were cut from, which is the split box or the NDPI image
+rm -f split/slide_x20_z0_box_mosaic.txt direct/slide_x20_z0_box_mosaic.txt
+f_test_same_files split direct
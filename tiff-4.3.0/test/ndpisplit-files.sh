@@ -0,0 +1,31 @@
+#!/bin/sh
+#
+# Check that ndpisplit -j, processing several NDPI files at once, makes the
+# same files and prints the same -K output as processing them one after
+# the other, also when the memory limit lets only one file run at a time.
+#
+. ${srcdir:-.}/common.sh
+outdir=o-ndpisplit-files
+f_test_dir ${outdir}
+cd ${outdir} || exit 1
+f_test_exec "${MKNDPI} slide1.ndpi 2048 1544"
+f_test_exec "${MKNDPI} -b 3 slide2.ndpi 1024 768"
+f_test_exec "${MKNDPI} -z 0,1200 slide3.ndpi 1536 1024"
+slides="slide1.ndpi slide2.ndpi slide3.ndpi"
+
+options="-K -N -M2 -g256x386"
+f_test_dir j1 ${slides}
+cd j1 || exit 1
+f_test_exec "${NDPISPLIT} ${options} ${slides} > ../j1.txt"
+cd .. || exit 1
+for jobs in "-j3" "-j3,1" ; do
+  f_test_dir j3 ${slides}
+  cd j3 || exit 1
+  f_test_exec "${NDPISPLIT} ${jobs} ${options} ${slides} > ../j3.txt"
+  cd .. || exit 1
+  if ! cmp -s j1.txt j3.txt ; then
+    echo "The -K output with ${jobs} is not the same!"
+    exit 1
+  fi
+  f_test_same_files j1 j3
+done
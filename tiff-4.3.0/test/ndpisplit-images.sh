@@ -0,0 +1,36 @@
+#!/bin/sh
+#
+# Check that ndpisplit -i, processing several images of an NDPI file at
+# once, makes the same files and prints the same -K output as processing
+# them one after the other, with synthesized magnifications and a restart
+# marker index being written and then reused.
+#
+. ${srcdir:-.}/common.sh
+outdir=o-ndpisplit-images
+f_test_dir ${outdir}
+cd ${outdir} || exit 1
+f_test_exec "${MKNDPI} -n -z 0,1200 slide.ndpi 2048 1544"
+
+options="-K -R -x20,10,5,2.5 -M2 -g256x386"
+f_test_dir i1 slide.ndpi
+cd i1 || exit 1
+f_test_exec "${NDPISPLIT} ${options} slide.ndpi > ../i1.txt"
+cd .. || exit 1
+f_test_dir i3 slide.ndpi
+cd i3 || exit 1
+f_test_exec "${NDPISPLIT} -i3 ${options} slide.ndpi > ../i3.txt"
+cd .. || exit 1
+if ! cmp -s i1.txt i3.txt ; then
+  echo "The -K output with -i3 is not the same!"
+  exit 1
+fi
+# The images are scanned for restart markers in another order, hence
+# the entries of the index too: the index written with -i3 must give the
+# same files when used by a run without -i
+f_test_dir reused slide.ndpi i3/slide.ndpi.rstidx
+cd reused || exit 1
+f_test_exec "${NDPISPLIT} ${options} slide.ndpi > ../reused.txt"
+cd .. || exit 1
+rm -f i1/slide.ndpi.rstidx i3/slide.ndpi.rstidx reused/slide.ndpi.rstidx
+f_test_same_files i1 i3
+f_test_same_files i1 reused
@@ -0,0 +1,21 @@
+#!/bin/sh
+#
+# Check that the JPEG mosaic pieces made by ndpisplit -J from the JPEG data
+# of an NDPI file, without re-encoding, hold the pixels of the image.
+#
+. ${srcdir:-.}/common.sh
+outdir=o-ndpisplit-jpegcopy
+f_test_dir ${outdir}
+cd ${outdir} || exit 1
+f_test_exec "${MKNDPI} slide.ndpi 2048 1536"
+f_test_exec "${NDPISPLIT} -M2J -J -x20 slide.ndpi"
+
+# Pieces of 512x192 pixels, short enough for the band of decoded scanlines
+# to fit into -M2 as well; decoded on their own, they differ from the image
+# only at their edges, through the upsampling of the chroma, whereas
+# re-encoded pieces would differ by about 5 on average
+for i in 1 2 3 4 5 6 7 8 ; do
+  for j in 1 2 3 4 ; do
+    f_test_exec "${REGIONCMP} -a 0.5 slide.ndpi slide_x20_z0_i${i}j${j}.jpg `expr \( ${j} - 1 \) \* 512` `expr \( ${i} - 1 \) \* 192`"
+  done
+done
@@ -0,0 +1,25 @@
+#!/bin/sh
+#
+# Check that boxes extracted far from the top of the images of an NDPI file
+# with the NDPI MCU starts tag, whose JPEG strips are decoded from the
+# nearest restart marker, are the same as from the same file without the
+# tag, whose strips are decoded from their first row.
+#
+. ${srcdir:-.}/common.sh
+outdir=o-ndpisplit-mcustarts
+f_test_dir ${outdir}
+cd ${outdir} || exit 1
+
+boxes="-Ex20,300,1100,700,400:x5,10,250,100,100"
+f_test_dir mcustarts
+f_test_dir nomcustarts
+cd mcustarts || exit 1
+f_test_exec "${MKNDPI} slide.ndpi 2048 1544"
+f_test_exec "${NDPISPLIT} ${boxes} slide.ndpi"
+cd ../nomcustarts || exit 1
+f_test_exec "${MKNDPI} -n slide.ndpi 2048 1544"
+f_test_exec "${NDPISPLIT} ${boxes} slide.ndpi"
+rm -f slide.ndpi
+cd .. || exit 1
+rm -f mcustarts/slide.ndpi
+f_test_same_files mcustarts nomcustarts
@@ -0,0 +1,18 @@
+#!/bin/sh
+#
+# Check that the pieces of a mosaic made by ndpisplit, whose rows are read
+# several at a time from the JPEG strips, hold the pixels of the image,
+# including the pieces at the right and bottom edges.
+#
+. ${srcdir:-.}/common.sh
+outdir=o-ndpisplit-mosaic
+f_test_dir ${outdir}
+cd ${outdir} || exit 1
+f_test_exec "${MKNDPI} slide.ndpi 2048 1544"
+f_test_exec "${NDPISPLIT} -M2n -g700x500 -x20 slide.ndpi"
+
+for i in 1 2 3 4 ; do
+  for j in 1 2 3 ; do
+    f_test_exec "${REGIONCMP} slide.ndpi slide_x20_z0_i${i}j${j}.tif `expr \( ${j} - 1 \) \* 700` `expr \( ${i} - 1 \) \* 500`"
+  done
+done
@@ -0,0 +1,29 @@
+#!/bin/sh
+#
+# Check that the mosaic pieces made by ndpisplit with overlaps, whose rows
+# shared with the previous row of pieces are kept instead of being decoded
+# again, hold the pixels of the image.
+#
+. ${srcdir:-.}/common.sh
+outdir=o-ndpisplit-overlap
+f_test_dir ${outdir}
+cd ${outdir} || exit 1
+f_test_exec "${MKNDPI} slide.ndpi 2048 1544"
+f_test_exec "${NDPISPLIT} -K -x20 -M2n -g256x386 -o100 slide.ndpi > keys.txt"
+
+# 2 overlaps of 100 rows as wide as the image are kept
+if ! grep "^Memory for overlap rows of mosaic pieces:1228800$" keys.txt > /dev/null ; then
+  echo "The rows of the overlaps were not kept!"
+  exit 1
+fi
+
+# Pieces of 256x386 pixels with overlaps of 100 pixels on each side
+for i in 1 2 3 4 ; do
+  y=`expr \( ${i} - 1 \) \* 386`
+  [ ${i} = 1 ] || y=`expr ${y} - 100`
+  for j in 1 2 3 4 5 6 7 8 ; do
+    x=`expr \( ${j} - 1 \) \* 256`
+    [ ${j} = 1 ] || x=`expr ${x} - 100`
+    f_test_exec "${REGIONCMP} slide.ndpi slide_x20_z0_i${i}j${j}.tif ${x} ${y}"
+  done
+done
@@ -0,0 +1,31 @@
+#!/bin/sh
+#
+# Check that ndpisplit and ndpi2tiff -A, reading the strips of the NDPI
+# file ahead of their decoding, make the same files as without -A, reading
+# the strips as a whole or from the nearest restart marker.
+#
+. ${srcdir:-.}/common.sh
+outdir=o-ndpisplit-readahead
+f_test_dir ${outdir}
+cd ${outdir} || exit 1
+f_test_exec "${MKNDPI} slide.ndpi 2048 1544"
+
+for options in "-x20 -M2 -g256x386" "-Ex20,300,1100,700,400:x5,10,250,100,100" ; do
+  f_test_dir plain slide.ndpi
+  f_test_dir ahead slide.ndpi
+  cd plain || exit 1
+  f_test_exec "${NDPISPLIT} ${options} slide.ndpi"
+  cd ../ahead || exit 1
+  f_test_exec "${NDPISPLIT} -A ${options} slide.ndpi"
+  cd .. || exit 1
+  f_test_same_files plain ahead
+done
+
+f_test_dir plain slide.ndpi
+f_test_dir ahead slide.ndpi
+cd plain || exit 1
+f_test_exec "${NDPI2TIFF} -t -j3 slide.ndpi"
+cd ../ahead || exit 1
+f_test_exec "${NDPI2TIFF} -A -t -j3 slide.ndpi"
+cd .. || exit 1
+f_test_same_files plain ahead
@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# Check that ndpisplit --resume keeps the mosaic pieces of a previous run
+# which are listed in its manifest and unchanged, and makes again only the
+# missing and altered ones, so that the mosaic is the same as after a
+# single run.
+#
+. ${srcdir:-.}/common.sh
+outdir=o-ndpisplit-resume
+f_test_dir ${outdir}
+cd ${outdir} || exit 1
+f_test_exec "${MKNDPI} slide.ndpi 2048 1544"
+
+for mosaic in "M" "M1J" "M1J -J" ; do
+  f_test_dir once slide.ndpi
+  f_test_dir resumed slide.ndpi
+  cd once || exit 1
+  f_test_exec "${NDPISPLIT} -x20 -${mosaic} -g256x386 slide.ndpi"
+  cd ../resumed || exit 1
+  f_test_exec "${NDPISPLIT} -x20 -${mosaic} -g256x386 slide.ndpi"
+  pieces=`ls slide_x20_z0_i*j* | wc -l`
+  rm -f `ls slide_x20_z0_i*j* | sed -n 3p`
+  piece=`ls slide_x20_z0_i*j* | sed -n 7p`
+  mv ${piece} piece
+  sed 's/./X/100' piece > ${piece}
+  rm -f piece
+  f_test_exec "${NDPISPLIT} -vvv -x20 -${mosaic} -g256x386 --resume slide.ndpi 2> ../resume.log"
+  cd .. || exit 1
+  if ! grep " kept `expr ${pieces} - 2` of ${pieces} pieces" resume.log > /dev/null ; then
+    echo "--resume didn't keep all the unchanged pieces!"
+    exit 1
+  fi
+  if [ `grep -c "Writing mosaic tile" resume.log` != 2 ] ; then
+    echo "--resume didn't make only the missing and altered pieces!"
+    exit 1
+  fi
+  rm -f once/slide_x20_z0_mosaic.txt resumed/slide_x20_z0_mosaic.txt
+  f_test_same_files once resumed
+done
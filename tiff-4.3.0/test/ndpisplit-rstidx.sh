@@ -0,0 +1,71 @@
+#!/bin/sh
+#
+# Check the sidecar file of restart marker positions written by ndpisplit -R
+# for images without the NDPI MCU starts tag: a later run of ndpisplit or
+# ndpi2tiff must reuse it instead of scanning the images again, unless the
+# NDPI file has changed, and make the same files as without it.
+#
+. ${srcdir:-.}/common.sh
+outdir=o-ndpisplit-rstidx
+f_test_dir ${outdir}
+cd ${outdir} || exit 1
+f_test_exec "${MKNDPI} -n slide.ndpi 2048 1544"
+
+boxes="-Ex20,300,200,700,500:x5,10,10,100,100"
+f_test_dir plain slide.ndpi
+f_test_dir scanned slide.ndpi
+f_test_dir reused
+cd plain || exit 1
+f_test_exec "${NDPISPLIT} ${boxes} slide.ndpi"
+f_test_exec "${NDPI2TIFF} slide.ndpi"
+cd ../scanned || exit 1
+f_test_exec "${NDPISPLIT} -v -R ${boxes} slide.ndpi 2> ../scan.log"
+if [ ! -f slide.ndpi.rstidx ] ; then
+  echo "-R didn't write slide.ndpi.rstidx!"
+  exit 1
+fi
+# The sidecar file is only valid for an NDPI file of the same date
+cp -p slide.ndpi slide.ndpi.rstidx ../reused/ || exit 1
+f_test_exec "${NDPI2TIFF} -R slide.ndpi"
+cd ../reused || exit 1
+f_test_exec "${NDPISPLIT} -v -R ${boxes} slide.ndpi 2> ../reuse.log"
+f_test_exec "${NDPI2TIFF} -R slide.ndpi"
+cd .. || exit 1
+if ! grep "Scanning image" scan.log > /dev/null ; then
+  echo "-R didn't scan the images for restart markers!"
+  exit 1
+fi
+if grep "Scanning image" reuse.log > /dev/null ; then
+  echo "-R scanned the images again instead of reading slide.ndpi.rstidx!"
+  exit 1
+fi
+if ! cmp -s scanned/slide.ndpi.rstidx reused/slide.ndpi.rstidx ; then
+  echo "slide.ndpi.rstidx was changed by the runs which reuse it!"
+  exit 1
+fi
+cp -p scanned/slide.ndpi.rstidx plain/ || exit 1
+f_test_same_files plain scanned
+f_test_same_files plain reused
+
+# A sidecar file made for another version of the NDPI file is not used
+cd reused || exit 1
+touch -t 202001010000 slide.ndpi
+f_test_exec "${NDPISPLIT} -v -R ${boxes} slide.ndpi 2> ../rescan.log"
+cd .. || exit 1
+if ! grep "Scanning image" rescan.log > /dev/null ; then
+  echo "-R used slide.ndpi.rstidx though slide.ndpi has changed!"
+  exit 1
+fi
+
+# Images with a usable NDPI MCU starts tag are not scanned, only the
+# macroscopic image which has none
+f_test_dir mcustarts
+cd mcustarts || exit 1
+f_test_exec "${MKNDPI} slide.ndpi 2048 1544"
+f_test_exec "${NDPISPLIT} -v -R ${boxes} slide.ndpi 2> ../mcustarts.log"
+cd .. || exit 1
+if [ `grep -c "Scanning image" scan.log` != 3 ] ||
+    [ `grep -c "Scanning image" mcustarts.log` != 1 ] ; then
+  echo "-R scanned images which have the NDPI MCU starts tag!"
+  exit 1
+fi
@@ -0,0 +1,15 @@
+#!/bin/sh
+#
+# Check that boxes extracted by ndpisplit far from the top of the JPEG
+# images of an NDPI file without the NDPI MCU starts tag, whose strips are
+# read from their first row skipping the rows above the boxes, hold the
+# pixels of the images.
+#
+. ${srcdir:-.}/common.sh
+outdir=o-ndpisplit-skiprows
+f_test_dir ${outdir}
+cd ${outdir} || exit 1
+f_test_exec "${MKNDPI} -n slide.ndpi 2048 1544"
+f_test_exec "${NDPISPLIT} -cn -Ex20,200,1300,600,200:x5,100,300,200,50 slide.ndpi"
+f_test_exec "${REGIONCMP} slide.ndpi slide_x20_z0_1.tif 200 1300"
+f_test_exec "${REGIONCMP} -d 1 slide.ndpi slide_x5_z0_1.tif 100 300"
@@ -0,0 +1,32 @@
+#!/bin/sh
+#
+# Check that the images and boxes at magnifications not stored in an NDPI
+# file, which ndpisplit synthesizes by scaled JPEG decoding of a larger
+# magnification, are close to that magnification scaled down.
+#
+. ${srcdir:-.}/common.sh
+outdir=o-ndpisplit-synthesize
+f_test_dir ${outdir}
+cd ${outdir} || exit 1
+f_test_exec "${MKNDPI} slide.ndpi 2048 1536"
+f_test_exec "${NDPISPLIT} -cn -x10,2.5 slide.ndpi"
+f_test_exec "${NDPISPLIT} -cn -Ex10,100,100,300,200 slide.ndpi"
+
+# The scaled inverse DCT does not average the pixels exactly; a box off by
+# one pixel would differ by about 14 on average
+f_test_exec "${REGIONCMP} -a 6 -s 2 slide.ndpi slide_x10_z0.tif"
+f_test_exec "${REGIONCMP} -a 6 -s 2 -d 1 slide.ndpi slide_x2.5_z0.tif"
+f_test_exec "${REGIONCMP} -a 6 -s 2 slide.ndpi slide_x10_z0_1.tif 100 100"
+
+# -p keeps to the stored x5 image (512x384 pixels) when it fits the preview
+# size limit, and synthesizes the x2.5 image (256x192) when it doesn't
+f_test_dir preview slide.ndpi
+cd preview || exit 1
+f_test_exec "${NDPISPLIT} -cn -p slide.ndpi"
+if [ ! -f slide_x5_z0.tif ] || [ -f slide_x10_z0.tif ] ; then
+  echo "-p did not extract the stored x5 image!"
+  exit 1
+fi
+rm -f slide_x5_z0.tif
+f_test_exec "${NDPISPLIT} -cn -p100000 slide.ndpi"
+f_test_exec "${REGIONCMP} -a 6 -s 2 -d 1 slide.ndpi slide_x2.5_z0.tif"
@@ -0,0 +1,58 @@
+#!/bin/sh
+#
+# Check that the files made by ndpisplit don't depend on the number of
+# threads encoding the mosaic pieces and the tiles of split images, nor on
+# whether the pieces are cut from a band of decoded scanlines or the image
+# is decoded once for each column of pieces.
+#
+. ${srcdir:-.}/common.sh
+outdir=o-ndpisplit-threads
+f_test_dir ${outdir}
+cd ${outdir} || exit 1
+f_test_exec "${MKNDPI} -b 5 slide.ndpi 2048 1544"
+
+# Pieces of 256x386 pixels: with -g256x0, -M0.5 leaves room for these
+# pieces but not for a band as wide as the image
+for compression in "" "J" ; do
+  f_test_dir band-t1 slide.ndpi
+  f_test_dir band-t3 slide.ndpi
+  f_test_dir columns slide.ndpi
+  cd band-t1 || exit 1
+  f_test_exec "${NDPISPLIT} -vvv -t1 -x20 -M${compression} -g256x386 slide.ndpi 2> ../band.log"
+  cd ../band-t3 || exit 1
+  f_test_exec "${NDPISPLIT} -t3 -x20 -M${compression} -g256x386 slide.ndpi"
+  cd ../columns || exit 1
+  f_test_exec "${NDPISPLIT} -vvv -t3 -x20 -M0.5${compression} -g256x0 slide.ndpi 2> ../columns.log"
+  cd .. || exit 1
+  if ! grep "using a band" band.log > /dev/null ; then
+    echo "The pieces of band-t1 were not cut from a band!"
+    exit 1
+  fi
+  if ! grep "decoded once for each column" columns.log > /dev/null ; then
+    echo "The pieces of columns were cut from a band!"
+    exit 1
+  fi
+  f_test_same_files band-t1 band-t3
+  # The manifest lists the pieces in the order they were made, row after
+  # row with a band and column after column without
+  for dir in band-t1 columns ; do
+    sort ${dir}/slide_x20_z0_mosaic.txt > sorted.txt &&
+      mv sorted.txt ${dir}/slide_x20_z0_mosaic.txt || exit 1
+  done
+  f_test_same_files band-t1 columns
+done
+
+# Pieces of 256x386 pixels: -M3.5 leaves room for the band they are cut
+# from and two of them, each one with its TIFF file, not three
+f_test_dir pool-t1 slide.ndpi
+f_test_dir pool-t3 slide.ndpi
+cd pool-t1 || exit 1
+f_test_exec "${NDPISPLIT} -t1 -x20 -M3.5n -g256x0 slide.ndpi"
+cd ../pool-t3 || exit 1
+f_test_exec "${NDPISPLIT} -vvv -t3 -x20 -M3.5n -g256x0 slide.ndpi 2> ../pool.log"
+cd .. || exit 1
+if ! grep "encoding at most 2 pieces" pool.log > /dev/null ; then
+  echo "The pieces held by the threads of pool-t3 don't fit into the memory limit!"
+  exit 1
+fi
+f_test_same_files pool-t1 pool-t3
@@ -0,0 +1,24 @@
+#!/bin/sh
+#
+# Check that the split images written by ndpisplit -t, whose rows of tiles
+# are encoded by several threads, are the same as with one thread, for
+# each codec of split images, with blank tiles (-N) among them, and with
+# the images and boxes that go through the same writer.
+#
+. ${srcdir:-.}/common.sh
+outdir=o-ndpisplit-tilethreads
+f_test_dir ${outdir}
+cd ${outdir} || exit 1
+f_test_exec "${MKNDPI} -b 5,9 slide.ndpi 2048 1544"
+
+for options in "-cn" "-cl" "-cj" "-cj -N" "-cl -N -Ex20,300,200,1500,500:x5,10,20,300,200" ; do
+  f_test_dir t1 slide.ndpi
+  f_test_dir t3 slide.ndpi
+  cd t1 || exit 1
+  f_test_exec "${NDPISPLIT} -t1 ${options} slide.ndpi"
+  cd ../t3 || exit 1
+  f_test_exec "${NDPISPLIT} -t3 ${options} slide.ndpi"
+  cd .. || exit 1
+  f_test_same_files t1 t3
+done
+f_test_exec "${REGIONCMP} slide.ndpi t3/slide_x20_z0_1.tif 300 200"
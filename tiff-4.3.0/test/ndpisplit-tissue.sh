@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Check that ndpisplit -B leaves out the mosaic pieces without tissue
+# according to the image at the lowest magnification, lists them with -K,
+# and makes the other pieces as without -B.
+#
+. ${srcdir:-.}/common.sh
+outdir=o-ndpisplit-tissue
+f_test_dir ${outdir}
+cd ${outdir} || exit 1
+f_test_exec "${MKNDPI} slide.ndpi 2048 1544"
+
+f_test_dir all slide.ndpi
+f_test_dir tissue slide.ndpi
+cd all || exit 1
+f_test_exec "${NDPISPLIT} -x20 -M2n -g128x128 slide.ndpi"
+cd ../tissue || exit 1
+f_test_exec "${NDPISPLIT} -vv -K -B -x20 -M2n -g128x128 slide.ndpi > ../keys.txt 2> ../tissue.log"
+cd .. || exit 1
+if ! grep "Finding tissue on the image at magnification x5 " tissue.log > /dev/null ; then
+  echo "The mask of tissue was not made from the image at x5!"
+  exit 1
+fi
+
+# The background of the image at x5 has squares of 97x89 pixels, which
+# hold whole pieces of 128x128 pixels at x20
+pieces=`sed -n 's/^Mosaic piece without tissue, not made://p' keys.txt`
+if [ -z "${pieces}" ] ; then
+  echo "No piece was left out!"
+  exit 1
+fi
+for piece in ${pieces} ; do
+  if [ -f tissue/${piece} ] || [ ! -f all/${piece} ] ; then
+    echo "${piece} was listed but made, or is not a piece!"
+    exit 1
+  fi
+  rm -f all/${piece}
+  sed "/ ${piece}\$/d" all/slide_x20_z0_mosaic.txt > manifest.txt &&
+    mv manifest.txt all/slide_x20_z0_mosaic.txt || exit 1
+done
+f_test_same_files all tissue
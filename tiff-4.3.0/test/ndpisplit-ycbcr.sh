@@ -0,0 +1,18 @@
+#!/bin/sh
+#
+# Check that the JPEG mosaic pieces made by ndpisplit from a box with
+# JPEG-compressed YCbCr tiles, which are copied as planar YCbCr without
+# color conversions, stay very close to the tiles.
+#
+. ${srcdir:-.}/common.sh
+outdir=o-ndpisplit-ycbcr
+f_test_dir ${outdir}
+cd ${outdir} || exit 1
+f_test_exec "${MKNDPI} slide.ndpi 2048 1536"
+f_test_exec "${NDPISPLIT} -cj -M2J -Ex20,256,128,1024,768 slide.ndpi"
+
+# The same DCT coefficients are found again with the same quantization
+# tables; converting to RGB and back would differ more
+f_test_exec "${REGIONCMP} -a 0.5 slide_x20_z0_1.tif slide_x20_z0_1_i1j1.jpg 0 0"
+f_test_exec "${REGIONCMP} -a 0.5 slide_x20_z0_1.tif slide_x20_z0_1_i1j2.jpg 512 0"
+f_test_exec "${REGIONCMP} -a 8 slide.ndpi slide_x20_z0_1_i1j2.jpg 768 128"
@@ -0,0 +1,282 @@
+/* regioncmp.c
+ Copyright (c) 2011-2021 Christophe Deroulers
+ Distributed under the GNU General Public License v3 -- contact the
+ author for commercial use */
+
+/*
+ * TIFF Library
+ *
+ * Checks for the tests of ndpisplit and ndpi2tiff that the pixels of an
+ * image, read from a TIFF or a JPEG file, are those of the region of
+ * another image whose top left corner is at x, y, within a tolerance on
+ * each RGB component or on their mean difference. The other image can be
+ * scaled down first, e.g. to check synthesized magnifications.
+ */
+
+#include "tif_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#include "tiffio.h"
+
+#if defined(__BORLANDC__) || defined(__MINGW32__)
+# define XMD_H 1
+#endif
+#if defined(__WIN32__) && !defined(__MINGW32__)
+# ifndef __RPCNDR_H__            /* don't conflict if rpcndr.h already read */
+   typedef unsigned char boolean;
+# endif
+# define HAVE_BOOLEAN            /* prevent jmorecfg.h from redefining it */
+#endif
+#include "jpeglib.h"
+
+#ifndef HAVE_GETOPT
+extern int getopt(int argc, char * const argv[], const char *optstring);
+#endif
+
+typedef struct {
+	uint32_t width, length;
+	unsigned char * rgb; /* 3 bytes per pixel */
+} Image;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: regioncmp [-t tolerance] [-a tolerance] [-d directory] [-s scale] image region [x y]\n");
+	fprintf(stderr, " -t  largest difference allowed between two components (default 0, or none with -a)\n");
+	fprintf(stderr, " -a  largest mean difference allowed between the components\n");
+	fprintf(stderr, " -d  directory of image if it is a TIFF file (default 0)\n");
+	fprintf(stderr, " -s  scale image down by this factor, averaging blocks of pixels, before comparing\n");
+	exit(1);
+}
+
+static int
+readJPEG(const char* filename, Image* image)
+{
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	FILE * f = fopen(filename, "rb");
+	uint32_t y;
+
+	if (f == NULL)
+		return 0;
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_decompress(&cinfo);
+	jpeg_stdio_src(&cinfo, f);
+	jpeg_read_header(&cinfo, TRUE);
+	cinfo.out_color_space = JCS_RGB;
+	jpeg_start_decompress(&cinfo);
+	image->width = cinfo.output_width;
+	image->length = cinfo.output_height;
+	image->rgb = malloc((size_t) 3 * image->width * image->length);
+	if (image->rgb == NULL) {
+		jpeg_destroy_decompress(&cinfo);
+		fclose(f);
+		return 0;
+	}
+	for (y = 0 ; y < image->length ; y++) {
+		JSAMPROW row = image->rgb + (size_t) 3 * image->width * y;
+
+		jpeg_read_scanlines(&cinfo, &row, 1);
+	}
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	fclose(f);
+	return 1;
+}
+
+static int
+readTIFF(const char* filename, tdir_t directory, Image* image)
+{
+	TIFF * tif = TIFFOpen(filename, "r");
+	uint32_t * raster;
+	size_t n, k;
+
+	if (tif == NULL)
+		return 0;
+	if (! TIFFSetDirectory(tif, directory)) {
+		TIFFClose(tif);
+		return 0;
+	}
+	TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &image->width);
+	TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &image->length);
+	n = (size_t) image->width * image->length;
+	raster = _TIFFmalloc(n * sizeof(uint32_t));
+	image->rgb = malloc(3 * n);
+	if (raster == NULL || image->rgb == NULL ||
+	    ! TIFFReadRGBAImageOriented(tif, image->width, image->length,
+	    raster, ORIENTATION_TOPLEFT, 0)) {
+		_TIFFfree(raster);
+		TIFFClose(tif);
+		return 0;
+	}
+	for (k = 0 ; k < n ; k++) {
+		image->rgb[3*k] = (unsigned char) TIFFGetR(raster[k]);
+		image->rgb[3*k+1] = (unsigned char) TIFFGetG(raster[k]);
+		image->rgb[3*k+2] = (unsigned char) TIFFGetB(raster[k]);
+	}
+	_TIFFfree(raster);
+	TIFFClose(tif);
+	return 1;
+}
+
+	/* Replaces image by its average over blocks of scale x scale pixels;
+	 * incomplete blocks on the right and bottom edges are left out */
+static int
+scaleDown(Image* image, uint32_t scale)
+{
+	uint32_t width = image->width / scale, length = image->length / scale;
+	uint32_t i, j, u, v;
+	unsigned char * rgb = malloc((size_t) 3 * width * length + 1);
+	int k;
+
+	if (rgb == NULL)
+		return 0;
+	for (j = 0 ; j < length ; j++)
+		for (i = 0 ; i < width ; i++)
+			for (k = 0 ; k < 3 ; k++) {
+				uint32_t sum = 0;
+
+				for (v = 0 ; v < scale ; v++)
+					for (u = 0 ; u < scale ; u++)
+						sum += image->rgb[3 * ((size_t)
+						    image->width * (scale * j + v)
+						    + scale * i + u) + k];
+				rgb[3 * ((size_t) width * j + i) + k] =
+				    (unsigned char) ((sum + scale * scale / 2)
+				    / (scale * scale));
+			}
+	free(image->rgb);
+	image->rgb = rgb;
+	image->width = width;
+	image->length = length;
+	return 1;
+}
+
+	/* Reads a JPEG file, or directory of a TIFF file, as RGB */
+static int
+readImage(const char* filename, tdir_t directory, Image* image)
+{
+	FILE * f = fopen(filename, "rb");
+	int c0, c1;
+
+	if (f == NULL) {
+		fprintf(stderr, "Can't open %s\n", filename);
+		return 0;
+	}
+	c0 = getc(f);
+	c1 = getc(f);
+	fclose(f);
+	image->rgb = NULL;
+	if (c0 == 0xFF && c1 == 0xD8 ? ! readJPEG(filename, image) :
+	    ! readTIFF(filename, directory, image)) {
+		fprintf(stderr, "Can't read %s\n", filename);
+		free(image->rgb);
+		return 0;
+	}
+	return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+	Image image, region;
+	uint32_t x = 0, y = 0, scale = 1, i, j;
+	tdir_t directory = 0;
+	int tolerance = -1, maxdifference = 0, c, k;
+	double meantolerance = -1, sumofdifferences = 0, meandifference;
+	uint32_t maxi = 0, maxj = 0;
+
+	while ((c = getopt(argc, argv, "t:a:d:s:")) != -1)
+		switch (c) {
+		case 't':
+			tolerance = atoi(optarg);
+			break;
+		case 'a':
+			meantolerance = atof(optarg);
+			break;
+		case 'd':
+			directory = (tdir_t) atoi(optarg);
+			break;
+		case 's':
+			scale = strtoul(optarg, NULL, 10);
+			if (scale == 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	if (argc - optind != 2 && argc - optind != 4)
+		usage();
+	if (tolerance < 0)
+		tolerance = meantolerance >= 0 ? 255 : 0;
+	if (argc - optind == 4) {
+		x = strtoul(argv[optind+2], NULL, 10);
+		y = strtoul(argv[optind+3], NULL, 10);
+	}
+	if (! readImage(argv[optind], directory, &image))
+		return 1;
+	if (scale > 1 && ! scaleDown(&image, scale)) {
+		fprintf(stderr, "Can't scale down %s\n", argv[optind]);
+		free(image.rgb);
+		return 1;
+	}
+	if (! readImage(argv[optind+1], 0, &region)) {
+		free(image.rgb);
+		return 1;
+	}
+	if (x + region.width > image.width ||
+	    y + region.length > image.length) {
+		fprintf(stderr, "%s (%ux%u) is not inside %s (%ux%u) at %u,%u\n",
+		    argv[optind+1], region.width, region.length,
+		    argv[optind], image.width, image.length, x, y);
+		free(image.rgb);
+		free(region.rgb);
+		return 1;
+	}
+	for (j = 0 ; j < region.length ; j++)
+		for (i = 0 ; i < region.width ; i++)
+			for (k = 0 ; k < 3 ; k++) {
+				int d = region.rgb[3 * ((size_t) region.width * j
+				    + i) + k] - image.rgb[3 * ((size_t)
+				    image.width * (y + j) + x + i) + k];
+
+				if (d < 0)
+					d = -d;
+				sumofdifferences += d;
+				if (d > maxdifference) {
+					maxdifference = d;
+					maxi = i;
+					maxj = j;
+				}
+			}
+	free(image.rgb);
+	free(region.rgb);
+	meandifference = sumofdifferences / 3 / region.width / region.length;
+	if (meantolerance >= 0 && meandifference > meantolerance) {
+		fprintf(stderr, "%s differs from %s at %u,%u by %g on average\n",
+		    argv[optind+1], argv[optind], x, y, meandifference);
+		return 1;
+	}
+	if (maxdifference > tolerance) {
+		fprintf(stderr, "%s differs from %s at %u,%u by up to %d, at %u,%u of the region\n",
+		    argv[optind+1], argv[optind], x, y, maxdifference,
+		    maxi, maxj);
+		return 1;
+	}
+	return 0;
+}
+
+/* vim: set ts=8 sts=8 sw=8 noet: */
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 8
+ * fill-column: 78
+ * End:
+ */
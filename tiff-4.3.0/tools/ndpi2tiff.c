@@ -57,7 +57,12 @@
 # include <unistd.h>
 #endif
 
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
 #include "tiffio.h"
+#include "ndpicommon.h"
 
 #ifndef HAVE_GETOPT
 extern int getopt(int, char**, char*);
@@ -106,6 +111,15 @@ static TIFF* bias = NULL;
 static int pageNum = 0;
 static int pageInSeq = 0;
 
+static int shouldscanrestartmarkers = FALSE;
+static int numberofthreads = 1;
+static int shouldcopyjpegdata = FALSE;
+static int shouldskipblanklanes = FALSE;
+static int shouldreadahead = FALSE;
+static float highestndpimagnification = 0;
+static BlankColumns blankcolumns = { NULL, NULL, 0 };
+static BlankTile blanktile = { 0, NULL, 0 };
+
 static const char TIFF_SUFFIX[] = ".tif";
 
 static void my_asprintf(char **ret, const char *format, ...)
@@ -148,6 +162,7 @@ static char* build_outfilename(const char* infilename)
 		exit(EXIT_FAILURE);
 	}
 	strncpy(outfilename, infilename, l);
+	outfilename[l] = '\0';
 	strcat(outfilename, TIFF_SUFFIX);
 	return outfilename;
 }
@@ -195,7 +210,7 @@ static TIFF* openSrcImage (char **imageSpec)
 	*imageSpec = strchr (fn, comma);
 	if (*imageSpec) {  /* there is at least one image number specifier */
 		**imageSpec = '\0';
-		tif = TIFFOpen (fn, "r");
+		tif = TIFFOpen (fn, shouldreadahead ? "rA" : "r");
 		/* but, ignore any single trailing comma */
 		if (!(*imageSpec)[1]) {*imageSpec = NULL; return tif;}
 		if (tif) {
@@ -206,7 +221,7 @@ static TIFF* openSrcImage (char **imageSpec)
 			}
 		}
 	}else
-		tif = TIFFOpen (fn, "r");
+		tif = TIFFOpen (fn, shouldreadahead ? "rA" : "r");
 	return tif;
 }
 
@@ -235,7 +250,7 @@ main(int argc, char* argv[])
 
 	*mp++ = 'w';
 	*mp = '\0';
-	while ((c = getopt(argc, argv, ",:b:c:f:l:o:z:p:r:w:T:aistBLMC8x")) != -1)
+	while ((c = getopt(argc, argv, ",:b:c:f:j:l:o:z:p:r:w:T:aistABJLMNC8xR")) != -1)
 		switch (c) {
 		case ',':
 			if (optarg[0] != '=') usage();
@@ -280,6 +295,15 @@ main(int argc, char* argv[])
 		case 'i':   /* ignore errors */
 			ignore = TRUE;
 			break;
+		case 'j':   /* number of decoding threads */
+			numberofthreads = atoi(optarg);
+			if (numberofthreads < 1)
+				usage();
+#ifndef HAVE_PTHREAD
+			if (numberofthreads > 1)
+				fprintf(stderr, "ndpi2tiff: compiled without thread support, ignoring -j\n");
+#endif
+			break;
 		case 'l':   /* tile length */
 			outtiled = TRUE;
 			deftilelength = atoi(optarg);
@@ -326,6 +350,18 @@ main(int argc, char* argv[])
 		case 'x':
 			pageInSeq = 1;
 			break;
+		case 'J':   /* copy JPEG data without re-encoding */
+			shouldcopyjpegdata = TRUE;
+			break;
+		case 'R':   /* scan for and save restart markers */
+			shouldscanrestartmarkers = TRUE;
+			break;
+		case 'N':   /* skip blank lanes */
+			shouldskipblanklanes = TRUE;
+			break;
+		case 'A':   /* read input ahead of decoding */
+			shouldreadahead = TRUE;
+			break;
 		case 'T':
 			switch (optarg[0]) {
 			case 'W':
@@ -352,16 +388,23 @@ main(int argc, char* argv[])
 	pageNum = -1;
 	for (; optind <= argc-1 ; optind++) {
 		char *imageCursor = argv[optind];
+		RestartMarkerIndex restartmarkerindex;
 		in = openSrcImage (&imageCursor);
 		if (in == NULL) {
 			(void) TIFFClose(out);
 			return (-3);
 		}
+		readRestartMarkerIndex(TIFFFileName(in), &restartmarkerindex,
+		    FALSE);
+		if (shouldskipblanklanes)
+			highestndpimagnification =
+			    getHighestNDPIMagnification(TIFFFileName(in));
 		if (diroff != 0 && !TIFFSetSubDirectory(in, diroff)) {
 			TIFFError(TIFFFileName(in),
 			    "Error, setting subdirectory at " TIFF_UINT64_FORMAT, diroff);
 			(void) TIFFClose(in);
 			(void) TIFFClose(out);
+			freeRestartMarkerIndex(&restartmarkerindex);
 			return (1);
 		}
 		for (;;) {
@@ -374,9 +417,12 @@ main(int argc, char* argv[])
 			tilewidth = deftilewidth;
 			tilelength = deftilelength;
 			g3opts = defg3opts;
+			useRestartMarkerIndex(in, &restartmarkerindex,
+			    shouldscanrestartmarkers, FALSE);
 			if (!tiffcp(in, out) || !TIFFWriteDirectory(out)) {
 				(void) TIFFClose(in);
 				(void) TIFFClose(out);
+				freeRestartMarkerIndex(&restartmarkerindex);
 				return (1);
 			}
 			if (imageCursor) { /* seek next image directory */
@@ -385,9 +431,12 @@ main(int argc, char* argv[])
 				if (!TIFFReadDirectory(in)) break;
 		}
 		(void) TIFFClose(in);
+		freeRestartMarkerIndex(&restartmarkerindex);
 	}
 
 	(void) TIFFClose(out);
+	freeBlankColumns(&blankcolumns);
+	freeBlankTile(&blanktile);
 	return (0);
 }
 
@@ -508,6 +557,20 @@ char* stuff[] = {
 " -c sgilog       compress output with SGILOG encoding",
 " -c none         use no compression algorithm on output",
 " -x              force the merged tiff pages in sequence",
+" -R              scan images without usable restart marker positions and save",
+"                 them in ndpi_input_file.rstidx for faster random access",
+" -j #            decode JPEG input with # threads, in bands starting at restart",
+"                 markers (needs their positions, see -R), and encode the tiles",
+"                 of each row of tiles of tiled output with # threads",
+" -J              copy JPEG data without re-encoding (lossless) into tiles made",
+"                 of restart intervals (needs their positions, see -R); images",
+"                 whose restart intervals can't make TIFF tiles of at least",
+"                 64x64 pixels are re-encoded",
+" -N              with tiled output, don't decode nor encode the tiles in the",
+"                 blank lanes of the NDPI file, where nothing was scanned: they",
+"                 are blank",
+" -A              have the system read the NDPI file ahead of the decoding of",
+"                 its images (for slow or network storage)",
 "",
 "Group 3 options:",
 " 1d              use default CCITT Group 3 1D-encoding",
@@ -661,6 +724,421 @@ static	copyFunc pickCopyFunc(TIFF*, TIFF*, uint16_t, uint16_t);
 
 /* PODD */
 
+/*
+ * Lossless copy of NDPI JPEG images (-J): the restart intervals of the
+ * single JPEG strip are MCU-aligned pieces of the bitstream which can
+ * be decoded independently, so that groups of them can be written as
+ * the tiles of a JPEG-compressed TIFF, under JPEGTables holding the
+ * quantization and Huffman tables of the NDPI image. A tile is made
+ * of the smallest group of adjacent restart intervals on a row whose
+ * width is a multiple of 16 pixels and at least MIN_COPIED_TILE_SIZE
+ * pixels, stacked over as many rows as needed to make the tile about
+ * square with a length multiple of 16; restart markers are renumbered
+ * inside each tile. Images whose tiles would still be smaller than
+ * MIN_COPIED_TILE_SIZE pixels in a dimension, other than the whole
+ * image, are re-encoded: so many tiny tiles would make a file larger
+ * and slower to read than re-encoding.
+ */
+#define	JPEGMARKER_SOI	0xD8
+#define	JPEGMARKER_EOI	0xD9
+#define	JPEGMARKER_RST0	0xD0
+#define	JPEGMARKER_SOS	0xDA
+#define	JPEGMARKER_DQT	0xDB
+#define	JPEGMARKER_DRI	0xDD
+#define	JPEGMARKER_DHT	0xC4
+#define	JPEGMARKER_SOF0	0xC0
+#define	JPEGMARKER_SOF1	0xC1
+#define	JPEGMARKER_APP14	0xEE
+
+#define	MIN_COPIED_TILE_SIZE	64
+
+typedef struct {
+	uint32_t tilewidth, tilelength;
+	uint32_t tilesacross, tilesdown;
+	uint32_t intervalsacross, intervalsdown;	/* per tile */
+	uint32_t intervalsperrow, nintervals;
+	uint16_t photometric, subsamplinghor, subsamplingver;
+	uint8_t* tables;	/* SOI, DQT and DHT segments, EOI */
+	uint32_t tableslength;
+	uint8_t* tileheader;	/* SOI, DRI, SOF and SOS segments */
+	uint32_t tileheaderlength;
+	uint64_t* offsets;	/* nintervals+1 file offsets */
+	const char* reason;	/* why the image can't be copied */
+} RestartIntervalTiling;
+
+static void
+freeRestartIntervalTiling(RestartIntervalTiling* rit)
+{
+	_TIFFfree(rit->tables);
+	_TIFFfree(rit->tileheader);
+	_TIFFfree(rit->offsets);
+	rit->tables = rit->tileheader = NULL;
+	rit->offsets = NULL;
+}
+
+static void
+appendBytes(uint8_t* dest, uint32_t* length, const uint8_t* src,
+	uint32_t n)
+{
+	_TIFFmemcpy(dest + *length, src, n);
+	*length += n;
+}
+
+/*
+ * Checks that the current image of "in" can be copied losslessly and
+ * computes the tiling; otherwise gives the reason and returns 0.
+ */
+static int
+getRestartIntervalTiling(TIFF* in, RestartIntervalTiling* rit)
+{
+	uint16_t input_compression;
+	uint32_t count, k, hdrlen, p;
+	uint32_t* mcustarts;
+	uint64_t stripoffset, stripbytecount, high = 0;
+	uint8_t* header = NULL;
+	uint8_t tail[16];
+	uint32_t width = 0, height = 0, restartinterval = 0;
+	uint32_t mcuwidth, mcuheight, mcusperrow, mcurows;
+	uint32_t sofpos = 0, soflength = 0, sospos = 0, soslength = 0;
+	int ncomponents = 0, hmax = 1, vmax = 1, isrgb = 0, c;
+	const char* reason = NULL;
+
+	memset(rit, 0, sizeof(RestartIntervalTiling));
+	TIFFGetFieldDefaulted(in, TIFFTAG_COMPRESSION, &input_compression);
+	if (input_compression != COMPRESSION_JPEG || TIFFIsTiled(in) ||
+	    TIFFNumberOfStrips(in) != 1) {
+		reason = "not a single JPEG strip";
+		goto bad;
+	}
+	if (!TIFFGetField(in, NDPITAG_MCUSTARTS, &count, &mcustarts) ||
+	    count < 2) {
+		reason = "no known restart marker positions, see -R";
+		goto bad;
+	}
+	stripoffset = TIFFGetStrileOffset(in, 0);
+	stripbytecount = TIFFGetStrileByteCount(in, 0);
+	hdrlen = mcustarts[0];
+	if (hdrlen < 4 || hdrlen > (1 << 20) || hdrlen >= stripbytecount) {
+		reason = "unexpected JPEG header";
+		goto bad;
+	}
+
+	/* Read and parse the JPEG header */
+	header = (uint8_t*) _TIFFmalloc(hdrlen);
+	rit->tables = (uint8_t*) _TIFFmalloc(hdrlen + 4);
+	rit->tileheader = (uint8_t*) _TIFFmalloc(hdrlen + 8);
+	rit->offsets = (uint64_t*) _TIFFmalloc(
+		((uint64_t) count + 1) * sizeof(uint64_t));
+	if (header == NULL || rit->tables == NULL ||
+	    rit->tileheader == NULL || rit->offsets == NULL) {
+		reason = "insufficient memory";
+		goto bad;
+	}
+	if (!readRawBytes(in, stripoffset, header, hdrlen) ||
+	    header[0] != 0xFF || header[1] != JPEGMARKER_SOI) {
+		reason = "unexpected JPEG header";
+		goto bad;
+	}
+	rit->tables[0] = 0xFF;
+	rit->tables[1] = JPEGMARKER_SOI;
+	rit->tableslength = 2;
+	for (p = 2; p + 4 <= hdrlen && sospos == 0; ) {
+		uint8_t marker = header[p+1];
+		uint32_t seglength = 2 + ((header[p+2] << 8) | header[p+3]);
+
+		if (header[p] != 0xFF || p + seglength > hdrlen) {
+			reason = "unexpected JPEG header";
+			goto bad;
+		}
+		switch (marker) {
+		case JPEGMARKER_DQT:
+		case JPEGMARKER_DHT:
+			appendBytes(rit->tables, &rit->tableslength,
+				header + p, seglength);
+			break;
+		case JPEGMARKER_DRI:
+			if (seglength >= 6)
+				restartinterval = (header[p+4] << 8) |
+					header[p+5];
+			break;
+		case JPEGMARKER_SOF0:
+		case JPEGMARKER_SOF1:
+			if (seglength < 10 || header[p+4] != 8) {
+				reason = "not an 8-bit JPEG image";
+				goto bad;
+			}
+			height = (header[p+5] << 8) | header[p+6];
+			width = (header[p+7] << 8) | header[p+8];
+			ncomponents = header[p+9];
+			if (seglength != 10 + 3 * (uint32_t) ncomponents ||
+			    (ncomponents != 1 && ncomponents != 3)) {
+				reason = "unsupported JPEG components";
+				goto bad;
+			}
+			for (c = 0; c < ncomponents; c++) {
+				int h = header[p+11+3*c] >> 4;
+				int v = header[p+11+3*c] & 15;
+				if (c == 0) {
+					hmax = h;
+					vmax = v;
+				} else if (h != 1 || v != 1) {
+					reason = "unsupported JPEG subsampling";
+					goto bad;
+				}
+			}
+			sofpos = p;
+			soflength = seglength;
+			break;
+		case JPEGMARKER_APP14:
+			/* Adobe transform 0: RGB components */
+			if (seglength >= 16 &&
+			    memcmp(header + p + 4, "Adobe", 5) == 0 &&
+			    header[p+15] == 0)
+				isrgb = 1;
+			break;
+		case JPEGMARKER_SOS:
+			sospos = p;
+			soslength = seglength;
+			break;
+		default:
+			if (marker >= 0xC0 && marker <= 0xCF &&
+			    marker != 0xC4 && marker != 0xC8 &&
+			    marker != 0xCC) {
+				reason = "not a baseline JPEG image";
+				goto bad;
+			}
+			break;
+		}
+		p += seglength;
+	}
+	if (sofpos == 0 || sospos == 0 || sospos + soslength != hdrlen) {
+		reason = "unexpected JPEG header";
+		goto bad;
+	}
+	if (isrgb && ncomponents == 3) {
+		reason = "RGB JPEG data";
+		goto bad;
+	}
+	if (restartinterval == 0) {
+		reason = "no restart intervals";
+		goto bad;
+	}
+	rit->tables[rit->tableslength++] = 0xFF;
+	rit->tables[rit->tableslength++] = JPEGMARKER_EOI;
+
+	/* Compute the tiling */
+	if (ncomponents == 1) {
+		mcuwidth = mcuheight = 8;
+		hmax = vmax = 1;
+	} else {
+		mcuwidth = 8 * hmax;
+		mcuheight = 8 * vmax;
+	}
+	mcusperrow = (width + mcuwidth - 1) / mcuwidth;
+	mcurows = (height + mcuheight - 1) / mcuheight;
+	if (mcusperrow % restartinterval != 0) {
+		reason = "restart intervals not aligned on rows";
+		goto bad;
+	}
+	rit->intervalsperrow = mcusperrow / restartinterval;
+	rit->nintervals = rit->intervalsperrow * mcurows;
+	if (count != rit->nintervals) {
+		reason = "restart marker positions not matching the image";
+		goto bad;
+	}
+	for (k = 1; k <= rit->intervalsperrow; k++)
+		if (rit->intervalsperrow % k == 0 &&
+		    (k * restartinterval * mcuwidth) % 16 == 0 &&
+		    (k * restartinterval * mcuwidth >= MIN_COPIED_TILE_SIZE ||
+		     k == rit->intervalsperrow))
+			break;
+	if (k > rit->intervalsperrow ||
+	    k * restartinterval * mcuwidth >= 65500) {
+		reason = "restart intervals not fitting TIFF tiles";
+		goto bad;
+	}
+	rit->intervalsacross = k;
+	rit->tilewidth = k * restartinterval * mcuwidth;
+	rit->intervalsdown = 0;
+	for (k = 1; k <= mcurows && k * mcuheight <= 1024; k++)
+		if (mcurows % k == 0 && (k * mcuheight) % 16 == 0 &&
+		    (rit->intervalsdown == 0 ||
+		     k * mcuheight <= rit->tilewidth))
+			rit->intervalsdown = k;
+	if (rit->intervalsdown == 0) {
+		reason = "restart intervals not fitting TIFF tiles";
+		goto bad;
+	}
+	if (rit->intervalsdown * mcuheight < MIN_COPIED_TILE_SIZE &&
+	    rit->intervalsdown < mcurows) {
+		reason = "restart intervals only fitting TIFF tiles less than 64 pixels long";
+		goto bad;
+	}
+	rit->tilelength = rit->intervalsdown * mcuheight;
+	rit->tilesacross = rit->intervalsperrow / rit->intervalsacross;
+	rit->tilesdown = mcurows / rit->intervalsdown;
+	rit->photometric = ncomponents == 1 ?
+		PHOTOMETRIC_MINISBLACK : PHOTOMETRIC_YCBCR;
+	rit->subsamplinghor = (uint16_t) hmax;
+	rit->subsamplingver = (uint16_t) vmax;
+
+	/* Header of each tile */
+	rit->tileheader[0] = 0xFF;
+	rit->tileheader[1] = JPEGMARKER_SOI;
+	rit->tileheaderlength = 2;
+	if (rit->intervalsacross * rit->intervalsdown > 1) {
+		uint8_t dri[6] = { 0xFF, JPEGMARKER_DRI, 0, 4, 0, 0 };
+		dri[4] = (uint8_t) (restartinterval >> 8);
+		dri[5] = (uint8_t) restartinterval;
+		appendBytes(rit->tileheader, &rit->tileheaderlength, dri, 6);
+	}
+	p = rit->tileheaderlength;
+	appendBytes(rit->tileheader, &rit->tileheaderlength,
+		header + sofpos, soflength);
+	rit->tileheader[p+5] = (uint8_t) (rit->tilelength >> 8);
+	rit->tileheader[p+6] = (uint8_t) rit->tilelength;
+	rit->tileheader[p+7] = (uint8_t) (rit->tilewidth >> 8);
+	rit->tileheader[p+8] = (uint8_t) rit->tilewidth;
+	appendBytes(rit->tileheader, &rit->tileheaderlength,
+		header + sospos, soslength);
+
+	/*
+	 * File offsets of the restart intervals: the tag holds their
+	 * 32 low-order bits relative to the strip, in increasing order.
+	 * The last interval ends with EOI, possibly before some padding.
+	 */
+	for (k = 0; k < count; k++) {
+		if (k > 0 && mcustarts[k] <= mcustarts[k-1])
+			high += (uint64_t) 1 << 32;
+		rit->offsets[k] = stripoffset + high + mcustarts[k];
+	}
+	if (rit->offsets[count-1] + sizeof(tail) > stripoffset + stripbytecount ||
+	    !readRawBytes(in, stripoffset + stripbytecount - sizeof(tail),
+		tail, sizeof(tail))) {
+		reason = "restart marker positions not matching the image";
+		goto bad;
+	}
+	for (k = sizeof(tail) - 1; k > 0; k--)
+		if (tail[k-1] == 0xFF && tail[k] == JPEGMARKER_EOI)
+			break;
+	if (k == 0) {
+		reason = "no end of JPEG data";
+		goto bad;
+	}
+	rit->offsets[count] = stripoffset + stripbytecount -
+		sizeof(tail) + k + 1;
+	_TIFFfree(header);
+	return 1;
+
+bad:
+	_TIFFfree(header);
+	freeRestartIntervalTiling(rit);
+	rit->reason = reason;
+	return 0;
+}
+
+/*
+ * Writes each tile as the tile header, the restart intervals of the
+ * tile separated by renumbered restart markers, and EOI.
+ */
+static int
+cpRestartIntervals2Tiles(TIFF* in, TIFF* out, RestartIntervalTiling* rit)
+{
+	uint8_t* buf = NULL;
+	uint64_t bufsize = 0;
+	uint32_t tr, tc, j, i;
+	int status = 1;
+
+	for (tr = 0; status && tr < rit->tilesdown; tr++)
+	    for (tc = 0; status && tc < rit->tilesacross; tc++) {
+		uint64_t size = rit->tileheaderlength;
+		uint32_t q = 0;
+
+		for (j = 0; status && j < rit->intervalsdown; j++) {
+			uint32_t first = (tr * rit->intervalsdown + j) *
+				rit->intervalsperrow + tc * rit->intervalsacross;
+			uint64_t start = rit->offsets[first];
+			uint64_t end = rit->offsets[first + rit->intervalsacross];
+
+			if (end <= start + 2 ||
+			    (uint64_t) (tmsize_t) (end - start) != end - start) {
+				status = 0;
+				break;
+			}
+			if (size + (end - start) > bufsize) {
+				uint8_t* newbuf;
+
+				bufsize = 2 * (size + (end - start));
+				newbuf = (uint8_t*) _TIFFrealloc(buf,
+					(tmsize_t) bufsize);
+				if (newbuf == NULL) {
+					TIFFError(TIFFFileName(in),
+					    "Error, can't allocate space for tile buffer");
+					status = 0;
+					break;
+				}
+				buf = newbuf;
+			}
+			if (!readRawBytes(in, start, buf + size,
+			    (tmsize_t) (end - start))) {
+				TIFFError(TIFFFileName(in),
+				    "Error, can't read JPEG data at "
+				    TIFF_UINT64_FORMAT, start);
+				status = 0;
+				break;
+			}
+			for (i = 0; i < rit->intervalsacross; i++, q++) {
+				uint32_t n = first + i;
+				uint8_t* marker = buf + size +
+					(rit->offsets[n+1] - start) - 2;
+
+				if (marker[0] != 0xFF || marker[1] !=
+				    (n + 1 == rit->nintervals ? JPEGMARKER_EOI :
+				    JPEGMARKER_RST0 + (n & 7))) {
+					TIFFError(TIFFFileName(in),
+					    "Error, restart interval "
+					    TIFF_UINT32_FORMAT
+					    " does not end with a marker", n);
+					status = 0;
+					break;
+				}
+				marker[1] = JPEGMARKER_RST0 + (q & 7);
+			}
+			size += end - start;
+		}
+		if (!status)
+			break;
+		_TIFFmemcpy(buf, rit->tileheader, rit->tileheaderlength);
+		buf[size-1] = JPEGMARKER_EOI;
+		if (TIFFWriteRawTile(out, TIFFComputeTile(out,
+		    tc * rit->tilewidth, tr * rit->tilelength, 0, 0),
+		    buf, (tmsize_t) size) < 0) {
+			TIFFError(TIFFFileName(out),
+			    "Error, can't write tile at "
+			    TIFF_UINT32_FORMAT " " TIFF_UINT32_FORMAT,
+			    tc * rit->tilewidth, tr * rit->tilelength);
+			status = 0;
+		}
+	    }
+	_TIFFfree(buf);
+	return status;
+}
+
+/*
+ * Restricts the decoding of the current image of "in", of width
+ * imagewidth, so as to leave out the tiles at both ends that are in
+ * blank lanes (they are not read by writeBufferToContigTiles).
+ */
+static void
+setDecodeWindowWithoutBlankTiles(TIFF* in, uint32_t imagewidth)
+{
+	uint32_t x = 0, width = imagewidth;
+
+	leaveOutBlankTiles(&blankcolumns, tilewidth, &x, &width);
+	if (width < imagewidth)
+		TIFFJPEGSetDecodeWindow(in, x, width);
+}
+
 static int
 tiffcp(TIFF* in, TIFF* out)
 {
@@ -673,12 +1151,22 @@ tiffcp(TIFF* in, TIFF* out)
 	int32_t ndpi_zoffset;
 	float ndpi_magnification;
 	char* imagedescription;
+	RestartIntervalTiling rit;
+	int iscopyingjpegdata;
+
+	rit.reason = "other output compression requested";
+	iscopyingjpegdata = shouldcopyjpegdata &&
+	    (compression == (uint16_t) -1 || compression == COMPRESSION_JPEG) &&
+	    getRestartIntervalTiling(in, &rit);
 
 	CopyField(TIFFTAG_IMAGEWIDTH, width);
 	CopyField(TIFFTAG_IMAGELENGTH, length);
 	CopyField(TIFFTAG_BITSPERSAMPLE, bitspersample);
 	CopyField(TIFFTAG_SAMPLESPERPIXEL, samplesperpixel);
-	if (compression != (uint16_t)-1)
+	if (iscopyingjpegdata)
+		TIFFSetField(out, TIFFTAG_COMPRESSION,
+		    compression = COMPRESSION_JPEG);
+	else if (compression != (uint16_t)-1)
 		TIFFSetField(out, TIFFTAG_COMPRESSION, compression);
 	else
 		CopyField(TIFFTAG_COMPRESSION, compression);
@@ -699,7 +1187,9 @@ tiffcp(TIFF* in, TIFF* out)
 			return FALSE;
 		}
 	}
-	if (compression == COMPRESSION_JPEG) {
+	if (iscopyingjpegdata)
+		TIFFSetField(out, TIFFTAG_PHOTOMETRIC, rit.photometric);
+	else if (compression == COMPRESSION_JPEG) {
 		if (input_photometric == PHOTOMETRIC_RGB &&
 		    jpegcolormode == JPEGCOLORMODE_RGB)
 		  TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_YCBCR);
@@ -711,6 +1201,12 @@ tiffcp(TIFF* in, TIFF* out)
 		TIFFSetField(out, TIFFTAG_PHOTOMETRIC,
 		    samplesperpixel == 1 ?
 		    PHOTOMETRIC_LOGL : PHOTOMETRIC_LOGLUV);
+	else if (input_compression == COMPRESSION_JPEG &&
+	    samplesperpixel == 3) {
+		/* RGB conversion was forced above
+		hence the output will be of the same type */
+		TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+	}
 	else
 		CopyTag(TIFFTAG_PHOTOMETRIC, 1, TIFF_SHORT);
 	if (fillorder != 0)
@@ -758,6 +1254,8 @@ tiffcp(TIFF* in, TIFF* out)
 		if (! TIFFGetField(in, NDPITAG_ZOFFSET, &ndpi_zoffset)) {
 			TIFFError(TIFFFileName(in),
 				"Error, z-Offset not found in NDPI file subdirectory");
+			if (iscopyingjpegdata)
+				freeRestartIntervalTiling(&rit);
 			return (0);
 		}
 		my_asprintf(&imagedescription, "x%g z" TIFF_INT32_FORMAT,
@@ -767,6 +1265,17 @@ tiffcp(TIFF* in, TIFF* out)
 	}
 	TIFFSetField(out, TIFFTAG_IMAGEDESCRIPTION, imagedescription);
 	_TIFFfree(imagedescription);
+	freeBlankColumns(&blankcolumns);
+	freeBlankTile(&blanktile);
+	if (highestndpimagnification > 0 && ndpi_magnification > 0 &&
+	    !iscopyingjpegdata && !getBlankColumns(in, width,
+	    NDPI_LANE_WIDTH * ndpi_magnification / highestndpimagnification,
+	    &blankcolumns))
+		return (0);
+	if (shouldcopyjpegdata && !iscopyingjpegdata &&
+	    input_compression == COMPRESSION_JPEG)
+		fprintf(stderr, "ndpi2tiff: %s: Can't copy JPEG data without re-encoding (%s).\n",
+			TIFFFileName(in), rit.reason);
 	/*
 	 * Choose tiles/strip for the output image according to
 	 * the command line arguments (-tiles, -strips) and the
@@ -779,7 +1288,13 @@ tiffcp(TIFF* in, TIFF* out)
 		thisouttiled = TRUE;
 	if (thisouttiled == -1)
 		thisouttiled = TIFFIsTiled(in);
-	if (thisouttiled) {
+	if (iscopyingjpegdata) {
+		/* Tiles are imposed by the restart intervals */
+		tilewidth = rit.tilewidth;
+		tilelength = rit.tilelength;
+		TIFFSetField(out, TIFFTAG_TILEWIDTH, tilewidth);
+		TIFFSetField(out, TIFFTAG_TILELENGTH, tilelength);
+	} else if (thisouttiled) {
 		/*
 		 * Setup output file's tile width&height.  If either
 		 * is not specified, use either the value from the
@@ -822,6 +1337,11 @@ tiffcp(TIFF* in, TIFF* out)
 /* SMinSampleValue & SMaxSampleValue */
 	switch (compression) {
 		case COMPRESSION_JPEG:
+			if (iscopyingjpegdata) {
+				TIFFSetField(out, TIFFTAG_JPEGTABLES,
+				    rit.tableslength, rit.tables);
+				break;
+			}
 			TIFFSetField(out, TIFFTAG_JPEGQUALITY, quality);
 			TIFFSetField(out, TIFFTAG_JPEGCOLORMODE, jpegcolormode);
 			break;
@@ -912,6 +1432,17 @@ tiffcp(TIFF* in, TIFF* out)
 	for (p = tags; p < &tags[NTAGS]; p++)
 		CopyTag(p->tag, p->count, p->type);
 
+	if (iscopyingjpegdata) {
+		int status;
+
+		if (rit.photometric == PHOTOMETRIC_YCBCR)
+			TIFFSetField(out, TIFFTAG_YCBCRSUBSAMPLING,
+			    rit.subsamplinghor, rit.subsamplingver);
+		status = cpRestartIntervals2Tiles(in, out, &rit);
+		freeRestartIntervalTiling(&rit);
+		return status;
+	}
+
 	cf = pickCopyFunc(in, out, bitspersample, samplesperpixel);
 	return (cf ? (*cf)(in, out, length, width, samplesperpixel) : FALSE);
 }
@@ -1330,6 +1861,211 @@ cpSeparateBufToContigBuf(uint8_t* out, uint8_t* in,
 	}
 }
 
+#ifdef HAVE_PTHREAD
+DECLAREreadFunc(readContigStripsIntoBuffer);
+DECLAREwriteFunc(writeBufferToContigTiles);
+
+/*
+ * Parallel decoding of JPEG images whose restart marker positions are
+ * known (from the NDPI MCU starts tag or from a -R index): the image is
+ * read by chunks of numberofthreads bands, each band being decoded by
+ * a thread with its own clone of the input handle (which seeks to the
+ * nearest restart marker). The next chunk is decoded while the current
+ * one is written out. Decoded rows are the same as with a serial read.
+ */
+typedef struct {
+	TIFF* in;
+	uint8_t* buf;
+	uint32_t firstrow, length, imagewidth;
+	tsample_t spp;
+	int status, isrunning;
+	pthread_t thread;
+} DecodingBand;
+
+static int
+canDecodeInParallel(TIFF* in)
+{
+	uint16_t input_compression;
+	uint32_t count;
+	uint32_t* offsets;
+
+	if (numberofthreads <= 1 || TIFFIsTiled(in))
+		return FALSE;
+	TIFFGetFieldDefaulted(in, TIFFTAG_COMPRESSION, &input_compression);
+	if (input_compression != COMPRESSION_JPEG)
+		return FALSE;
+	return TIFFGetField(in, NDPITAG_MCUSTARTS, &count, &offsets) &&
+		count > 1;
+}
+
+static void*
+decodeBand(void* arg)
+{
+	DecodingBand* band = (DecodingBand*) arg;
+
+	band->status = readContigStripsIntoBuffer(band->in, band->buf,
+		band->firstrow, band->length, band->imagewidth, band->spp);
+	return NULL;
+}
+
+static int
+startDecodingChunk(DecodingBand* bands, TIFF** inputs, uint8_t* buf,
+	uint32_t firstrow, uint32_t length, uint32_t bandlength,
+	tsize_t scanlinesize, uint32_t imagewidth, tsample_t spp)
+{
+	int t;
+
+	for (t = 0; t < numberofthreads; t++) {
+		DecodingBand* band = &bands[t];
+		uint32_t offset = (uint32_t) t * bandlength;
+
+		band->isrunning = FALSE;
+		band->status = 1;
+		if (offset >= length)
+			continue;
+		band->in = inputs[t];
+		band->buf = buf + offset * scanlinesize;
+		band->firstrow = firstrow + offset;
+		band->length = length - offset < bandlength ?
+			length - offset : bandlength;
+		band->imagewidth = imagewidth;
+		band->spp = spp;
+		if (pthread_create(&band->thread, NULL, decodeBand, band) != 0) {
+			TIFFError(TIFFFileName(inputs[t]),
+			    "Error, can't create decoding thread");
+			return 0;
+		}
+		band->isrunning = TRUE;
+	}
+	return 1;
+}
+
+static int
+finishDecodingChunk(DecodingBand* bands)
+{
+	int t, status = 1;
+
+	for (t = 0; t < numberofthreads; t++) {
+		if (bands[t].isrunning) {
+			pthread_join(bands[t].thread, NULL);
+			bands[t].isrunning = FALSE;
+		}
+		if (!bands[t].status)
+			status = 0;
+	}
+	return status;
+}
+
+static int
+cpImageDecodedInParallel(TIFF* in, TIFF* out, writeFunc fout,
+	uint32_t imagelength, uint32_t imagewidth, tsample_t spp)
+{
+	int status = 0;
+	tsize_t scanlinesize = TIFFRasterScanlineSize(in);
+	uint32_t bandlength, chunklength, firstrow, offset;
+	uint32_t writelength = tilelength == (uint32_t) -1 ?
+		imagelength : tilelength;
+	tdata_t buf[2] = { NULL, NULL };
+	TIFF** inputs;
+	DecodingBand* bands;
+	int t, cur = 0, nbufs;
+
+	/*
+	 * Tiled output is written by rows of tiles, so that each thread
+	 * decodes one of them; stripped output is written at once, as by
+	 * cpImage, so that the image is shared between the threads.
+	 */
+	if (tilelength != (uint32_t) -1)
+		bandlength = tilelength;
+	else {
+		bandlength = (imagelength + numberofthreads - 1) /
+			numberofthreads;
+		bandlength = (bandlength + 15) & ~(uint32_t) 15;
+	}
+	chunklength = bandlength * numberofthreads;
+	if (tilelength == (uint32_t) -1 || chunklength >= imagelength ||
+	    chunklength / numberofthreads != bandlength) {
+		chunklength = imagelength;
+		nbufs = 1;
+	} else
+		nbufs = 2;
+	if (scanlinesize == 0 || chunklength == 0 ||
+	    (scanlinesize * (tsize_t) chunklength) / chunklength != scanlinesize) {
+		TIFFError(TIFFFileName(in), "Error, no space for image buffer");
+		return 0;
+	}
+
+	inputs = (TIFF**) _TIFFmalloc(numberofthreads * sizeof(TIFF*));
+	bands = (DecodingBand*) _TIFFmalloc(
+		2 * numberofthreads * sizeof(DecodingBand));
+	if (inputs == NULL || bands == NULL) {
+		TIFFError(TIFFFileName(in),
+		    "Error, can't allocate space for decoding threads");
+		_TIFFfree(inputs);
+		_TIFFfree(bands);
+		return 0;
+	}
+	_TIFFmemset(inputs, 0, numberofthreads * sizeof(TIFF*));
+	_TIFFmemset(bands, 0, 2 * numberofthreads * sizeof(DecodingBand));
+	for (t = 0; t < numberofthreads; t++) {
+		if ((inputs[t] = TIFFCloneHandle(in)) == NULL) {
+			TIFFError(TIFFFileName(in),
+			    "Error, can't clone input handle for decoding threads");
+			goto done;
+		}
+		if (fout == writeBufferToContigTiles)
+			setDecodeWindowWithoutBlankTiles(inputs[t], imagewidth);
+	}
+	for (t = 0; t < nbufs; t++)
+		if ((buf[t] = _TIFFmalloc(scanlinesize * chunklength)) == NULL) {
+			TIFFError(TIFFFileName(in),
+			    "Error, can't allocate space for image buffer");
+			goto done;
+		}
+
+	status = startDecodingChunk(bands, inputs, (uint8_t*) buf[0], 0,
+		chunklength < imagelength ? chunklength : imagelength,
+		bandlength, scanlinesize, imagewidth, spp);
+	for (firstrow = 0; status && firstrow < imagelength;
+	    firstrow += chunklength) {
+		uint32_t length = imagelength - firstrow < chunklength ?
+			imagelength - firstrow : chunklength;
+		uint32_t nextrow = firstrow + length;
+
+		status = finishDecodingChunk(&bands[cur * numberofthreads]);
+		if (status && nextrow < imagelength)
+			status = startDecodingChunk(
+			    &bands[(1 - cur) * numberofthreads], inputs,
+			    (uint8_t*) buf[1 - cur], nextrow,
+			    imagelength - nextrow < chunklength ?
+				imagelength - nextrow : chunklength,
+			    bandlength, scanlinesize, imagewidth, spp);
+		/* Same calls to fout as from cpImage, for identical output */
+		for (offset = 0; status && offset < length;
+		    offset += writelength)
+			status = (*fout)(out,
+			    (uint8_t*) buf[cur] + offset * scanlinesize,
+			    firstrow + offset, length - offset < writelength ?
+				length - offset : writelength,
+			    imagewidth, spp);
+		if (nbufs == 2)
+			cur = 1 - cur;
+	}
+	(void) finishDecodingChunk(bands);
+	(void) finishDecodingChunk(&bands[numberofthreads]);
+
+done:
+	for (t = 0; t < numberofthreads; t++)
+		if (inputs[t] != NULL)
+			TIFFClose(inputs[t]);
+	_TIFFfree(inputs);
+	_TIFFfree(bands);
+	_TIFFfree(buf[0]);
+	_TIFFfree(buf[1]);
+	return status;
+}
+#endif
+
 static int
 cpImage(TIFF* in, TIFF* out, readFunc fin, writeFunc fout,
 	uint32_t imagelength, uint32_t imagewidth, tsample_t spp)
@@ -1340,6 +2076,12 @@ cpImage(TIFF* in, TIFF* out, readFunc fin, writeFunc fout,
 	/* tilelength is != -1 if and only if the output image is tiled */
 	tsize_t bufferlength = tilelength == (uint32_t) -1 ? imagelength : tilelength;
 	tsize_t bytes = scanlinesize * bufferlength;
+
+#ifdef HAVE_PTHREAD
+	if (fin == readContigStripsIntoBuffer && canDecodeInParallel(in))
+		return cpImageDecodedInParallel(in, out, fout,
+			imagelength, imagewidth, spp);
+#endif
 	/*
 	 * XXX: Check for integer overflow.
 	 */
@@ -1349,22 +2091,27 @@ cpImage(TIFF* in, TIFF* out, readFunc fin, writeFunc fout,
 		buf = _TIFFmalloc(bytes);
 		if (buf) {
 			tsize_t lengthtodo= imagelength;
-			for (; lengthtodo >= bufferlength ; lengthtodo -= bufferlength)
+			/* An image shorter than a tile has only the last part */
+			status = 1;
+			for (; status && lengthtodo >= bufferlength ; lengthtodo -= bufferlength)
 				if ((*fin)(in, (uint8_t*)buf, 
 					imagelength-lengthtodo,
 					bufferlength, imagewidth, spp)) {
 					status = (*fout)(out, (uint8_t*)buf,
 						imagelength-lengthtodo,
 						bufferlength, imagewidth, spp);
-				}
-			if (status && lengthtodo > 0)
+				} else
+					status = 0;
+			if (status && lengthtodo > 0) {
 				if ((*fin)(in, (uint8_t*)buf,
 					imagelength-lengthtodo,
 					lengthtodo, imagewidth, spp)) {
 					status = (*fout)(out, (uint8_t*)buf,
 						imagelength-lengthtodo,
 						lengthtodo, imagewidth, spp);
-				}
+				} else
+					status = 0;
+			}
 			_TIFFfree(buf);
 		} else {
 			TIFFError(TIFFFileName(in),
@@ -1384,6 +2131,9 @@ DECLAREreadFunc(readContigStripsIntoBuffer)
 	uint32_t row;
 
 	(void) imagewidth; (void) spp;
+	if (TIFFReadScanlines(in, buf, firstrow, lengthtoread) >= 0)
+		return 1;
+	/* Go on row per row, to get as many rows as possible with -i */
 	for (row = firstrow; row < firstrow + lengthtoread; row++) {
 		if (TIFFReadScanline(in, (tdata_t) bufp, row, 0) < 0
 		    && !ignore) {
@@ -1650,6 +2400,7 @@ DECLAREwriteFunc(writeBufferToContigTiles)
 	uint8_t* bufp = (uint8_t*) buf;
 	uint32_t tl, tw;
 	uint32_t row;
+	TileRowEncoder encoder;
 
 	(void) spp;
 
@@ -1659,6 +2410,8 @@ DECLAREwriteFunc(writeBufferToContigTiles)
 	_TIFFmemset(obuf, 0, tilesize);
 	(void) TIFFGetField(out, TIFFTAG_TILELENGTH, &tl);
 	(void) TIFFGetField(out, TIFFTAG_TILEWIDTH, &tw);
+	initTileRowEncoder(&encoder, out, (imagewidth + tw - 1) / tw,
+	    numberofthreads);
 	for (row = firstrow; row < firstrow+lengthtowrite; row += tilelength) {
 		uint32_t nrow = (row+tl > firstrow+lengthtowrite) ?
 			firstrow+lengthtowrite-row : tl;
@@ -1666,6 +2419,17 @@ DECLAREwriteFunc(writeBufferToContigTiles)
 		uint32_t col;
 
 		for (col = 0; col < imagewidth; col += tw) {
+			if (isInBlankColumns(&blankcolumns, col,
+			    col + tw > imagewidth ? imagewidth - col : tw)) {
+				if (!holdTile(&encoder, NULL, col, row,
+				    &blanktile)) {
+					freeTileRowEncoder(&encoder);
+					_TIFFfree(obuf);
+					return 0;
+				}
+				colb += tilew;
+				continue;
+			}
 			/*
 			 * Tile is clipped horizontally.  Calculate
 			 * visible portion and skewing factors.
@@ -1678,19 +2442,22 @@ DECLAREwriteFunc(writeBufferToContigTiles)
 			} else
 				cpStripToTile(obuf, bufp + colb, nrow, tilew,
 				    0, iskew);
-			if (TIFFWriteTile(out, obuf, col, row, 0, 0) < 0) {
-				TIFFError(TIFFFileName(out),
-				    "Error, can't write tile at "
-				    TIFF_UINT32_FORMAT " " 
-				    TIFF_UINT32_FORMAT,
-				    col, row);
+			if (!holdTile(&encoder, (uint8_t*) obuf, col, row,
+			    &blanktile)) {
+				freeTileRowEncoder(&encoder);
 				_TIFFfree(obuf);
 				return 0;
 			}
 			colb += tilew;
 		}
+		if (!writeHeldTiles(&encoder, row, &blanktile)) {
+			freeTileRowEncoder(&encoder);
+			_TIFFfree(obuf);
+			return 0;
+		}
 		bufp += nrow * imagew;
 	}
+	freeTileRowEncoder(&encoder);
 	_TIFFfree(obuf);
 	return 1;
 }
@@ -1769,10 +2536,15 @@ DECLAREwriteFunc(writeBufferToSeparateTiles)
  */
 DECLAREcpFunc(cpContigStrips2ContigTiles)
 {
-	return cpImage(in, out,
+	int status;
+
+	setDecodeWindowWithoutBlankTiles(in, imagewidth);
+	status = cpImage(in, out,
 	    readContigStripsIntoBuffer,
 	    writeBufferToContigTiles,
 	    imagelength, imagewidth, spp);
+	TIFFJPEGSetDecodeWindow(in, 0, 0);
+	return status;
 }
 
 /*
@@ -0,0 +1,957 @@
+/* ndpicommon.c
+ Copyright (c) 2011-2021 Christophe Deroulers
+ Distributed under the GNU General Public License v3 -- contact the
+ author for commercial use
+ Code shared by ndpi2tiff and ndpisplit: raw reads, restart marker
+ index files, files written in memory, blank lanes of NDPI files and
+ tiles encoded by several threads */
+
+#include "tif_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "ndpicommon.h"
+
+#define TIFF_UINT32_FORMAT "%"PRIu32
+#define TIFF_UINT64_FORMAT "%"PRIu64
+
+const char RESTART_INDEX_SUFFIX[] = ".rstidx";
+
+	/* Restart marker index: for NDPI files without (usable) MCU
+	 * starts, the offsets of the restart intervals of each image
+	 * found by scanning its JPEG data are stored in a sidecar file
+	 * next to the NDPI file, so as to seek in the images on later
+	 * runs without scanning again. The sidecar file is only used if
+	 * the size and modification time of the NDPI file did not change.
+	 * Format: "NDPIRST1", size (8 bytes), mtime (8 bytes), number of
+	 * images (4 bytes), then for each image: offset of its IFD (8
+	 * bytes), number of offsets (4 bytes) and the offsets as
+	 * differences from the previous one in LEB128 form. Numbers are
+	 * little-endian. */
+static const char RESTART_INDEX_MAGIC[8] = { 'N', 'D', 'P', 'I', 'R', 'S', 'T', '1' };
+
+static	void putLittleEndian(FILE*, uint64_t, int);
+static	int getLittleEndian(FILE*, uint64_t*, int);
+static	int getLEB128(FILE*, uint32_t*);
+static	RestartMarkerIndexEntry* addRestartMarkerIndexEntry(RestartMarkerIndex*);
+static	void freeRestartMarkerIndexEntries(RestartMarkerIndex*);
+static	tmsize_t readMemoryTIFF(thandle_t, void*, tmsize_t);
+static	tmsize_t writeMemoryTIFF(thandle_t, void*, tmsize_t);
+static	uint64_t seekMemoryTIFF(thandle_t, uint64_t, int);
+static	int closeMemoryTIFF(thandle_t);
+static	uint64_t sizeMemoryTIFF(thandle_t);
+static	int mapMemoryTIFF(thandle_t, void**, toff_t*);
+static	void unmapMemoryTIFF(thandle_t, void*, toff_t);
+static	int compareUint32s(const void*, const void*);
+static	void* encodeHeldTiles(void*);
+
+	/* Reads size bytes of the file of "in" at offset into buf. Returns
+	 * 1 on success, 0 on failure. */
+int
+readRawBytes(TIFF* in, uint64_t offset, uint8_t* buf, tmsize_t size)
+{
+	thandle_t fd = TIFFClientdata(in);
+
+	if ((*TIFFGetSeekProc(in))(fd, (toff_t) offset, SEEK_SET) !=
+	    (toff_t) offset)
+		return 0;
+	return (*TIFFGetReadProc(in))(fd, buf, size) == size;
+}
+
+static void
+putLittleEndian(FILE* f, uint64_t u, int nbytes)
+{
+	int i;
+	for (i = 0 ; i < nbytes ; i++, u >>= 8)
+		putc((int) (u & 0xff), f);
+}
+
+static int
+getLittleEndian(FILE* f, uint64_t* u, int nbytes)
+{
+	int i;
+	*u = 0;
+	for (i = 0 ; i < nbytes ; i++) {
+		int c = getc(f);
+		if (c == EOF)
+			return 1;
+		*u |= ((uint64_t) c) << (8*i);
+	}
+	return 0;
+}
+
+static int
+getLEB128(FILE* f, uint32_t* u)
+{
+	int shift, c;
+	*u = 0;
+	for (shift = 0 ; shift < 35 ; shift += 7) {
+		if ((c = getc(f)) == EOF)
+			return 1;
+		*u |= ((uint32_t) (c & 0x7f)) << shift;
+		if (! (c & 0x80))
+			return 0;
+	}
+	return 1;
+}
+
+	/* Allocates memory for a new entry at the end of the index and
+	 * returns a pointer to it (or NULL if no memory, the index being
+	 * then left unchanged) */
+static RestartMarkerIndexEntry*
+addRestartMarkerIndexEntry(RestartMarkerIndex* index)
+{
+	RestartMarkerIndexEntry * entries = _TIFFrealloc(index->entries,
+	    sizeof(RestartMarkerIndexEntry) * (index->numberofentries + 1));
+
+	if (entries == NULL) {
+		fprintf(stderr, "Error: insufficient memory for restart marker index.\n");
+		return NULL;
+	}
+	index->entries = entries;
+	return &(entries[index->numberofentries++]);
+}
+
+static void
+freeRestartMarkerIndexEntries(RestartMarkerIndex* index)
+{
+	unsigned u;
+	for (u = 0 ; u < index->numberofentries ; u++)
+		_TIFFfree(index->entries[u].offsets);
+	if (index->entries != NULL)
+		_TIFFfree(index->entries);
+	index->entries = NULL;
+	index->numberofentries = 0;
+}
+
+	/* Reads the sidecar file of NDPIfilename into index, which is left
+	 * empty if there is none or if it was made for another version of
+	 * the NDPI file. The name of the sidecar file is kept in index, to
+	 * be written later. */
+void
+readRestartMarkerIndex(const char* NDPIfilename, RestartMarkerIndex* index,
+	int verbose)
+{
+	struct stat st;
+	FILE* f;
+	char magic[sizeof(RESTART_INDEX_MAGIC)];
+	uint64_t size, mtime, n, u;
+
+	index->numberofentries = 0;
+	index->entries = NULL;
+	index->filename = _TIFFmalloc(strlen(NDPIfilename) +
+	    sizeof(RESTART_INDEX_SUFFIX));
+	if (index->filename == NULL) {
+		perror("Insufficient memory for a character string ");
+		exit(EXIT_FAILURE);
+	}
+	strcpy(index->filename, NDPIfilename);
+	strcat(index->filename, RESTART_INDEX_SUFFIX);
+	if (stat(NDPIfilename, &st) != 0) {
+		index->ndpifilesize = 0;
+		index->ndpifilemtime = 0;
+		return;
+	}
+	index->ndpifilesize = (uint64_t) st.st_size;
+	index->ndpifilemtime = (int64_t) st.st_mtime;
+
+	f = fopen(index->filename, "rb");
+	if (f == NULL)
+		return;
+	if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+	    memcmp(magic, RESTART_INDEX_MAGIC, sizeof(magic)) != 0 ||
+	    getLittleEndian(f, &size, 8) || getLittleEndian(f, &mtime, 8) ||
+	    getLittleEndian(f, &n, 4))
+		goto bad;
+	if (size != index->ndpifilesize ||
+	    (int64_t) mtime != index->ndpifilemtime) {
+		if (verbose)
+			fprintf(stderr, "Ignoring restart marker index \"%s\" made for another version of the NDPI file\n",
+				index->filename);
+		fclose(f);
+		return;
+	}
+	for (u = 0 ; u < n ; u++) {
+		RestartMarkerIndexEntry* entry;
+		uint64_t diroffset, count;
+		uint32_t k, offset = 0;
+
+		if (getLittleEndian(f, &diroffset, 8) ||
+		    getLittleEndian(f, &count, 4))
+			goto bad;
+		entry = addRestartMarkerIndexEntry(index);
+		if (entry == NULL) {
+			freeRestartMarkerIndexEntries(index);
+			fclose(f);
+			return;
+		}
+		entry->diroffset = diroffset;
+		entry->count = (uint32_t) count;
+		entry->offsets = _TIFFmalloc(count * sizeof(uint32_t));
+		if (entry->offsets == NULL) {
+			index->numberofentries--;
+			goto bad;
+		}
+		for (k = 0 ; k < entry->count ; k++) {
+			uint32_t delta;
+			if (getLEB128(f, &delta))
+				goto bad;
+			offset += delta;
+			entry->offsets[k] = offset;
+		}
+	}
+	fclose(f);
+	if (verbose >= 2)
+		fprintf(stderr, "Read restart marker index \"%s\" for %u image(s)\n",
+			index->filename, index->numberofentries);
+	return;
+bad:
+	fprintf(stderr, "Ignoring corrupted restart marker index \"%s\"\n",
+		index->filename);
+	fclose(f);
+	freeRestartMarkerIndexEntries(index);
+}
+
+	/* Writes index into its sidecar file. Returns 1 on success, 0 on
+	 * failure. */
+int
+writeRestartMarkerIndex(RestartMarkerIndex* index)
+{
+	FILE* f = fopen(index->filename, "wb");
+	unsigned u;
+	int error;
+
+	if (f == NULL)
+		return 0;
+	fwrite(RESTART_INDEX_MAGIC, 1, sizeof(RESTART_INDEX_MAGIC), f);
+	putLittleEndian(f, index->ndpifilesize, 8);
+	putLittleEndian(f, (uint64_t) index->ndpifilemtime, 8);
+	putLittleEndian(f, index->numberofentries, 4);
+	for (u = 0 ; u < index->numberofentries ; u++) {
+		RestartMarkerIndexEntry* entry = &(index->entries[u]);
+		uint32_t k, previous = 0;
+
+		putLittleEndian(f, entry->diroffset, 8);
+		putLittleEndian(f, entry->count, 4);
+		for (k = 0 ; k < entry->count ; k++) {
+			uint32_t delta = entry->offsets[k] - previous;
+
+			previous = entry->offsets[k];
+			while (delta >= 0x80) {
+				putc((int) ((delta & 0x7f) | 0x80), f);
+				delta >>= 7;
+			}
+			putc((int) delta, f);
+		}
+	}
+	error = ferror(f);
+	return (fclose(f) == 0 && ! error);
+}
+
+	/* Gives the restart marker index of the current image of "in" to
+	 * the JPEG codec if there is one in index; if not,
+	 * shouldscanrestartmarkers is set and the NDPIMCUStarts tag of the
+	 * image is missing or unusable, builds it (this reads the whole
+	 * image) and saves it into the sidecar file. */
+void
+useRestartMarkerIndex(TIFF* in, RestartMarkerIndex* index,
+	int shouldscanrestartmarkers, int verbose)
+{
+	uint64_t diroffset = TIFFCurrentDirOffset(in);
+	RestartMarkerIndexEntry* entry = NULL;
+	unsigned u;
+
+	for (u = 0 ; u < index->numberofentries ; u++)
+		if (index->entries[u].diroffset == diroffset) {
+			entry = &(index->entries[u]);
+			break;
+		}
+
+	if (entry == NULL && shouldscanrestartmarkers) {
+		uint16_t compression;
+		uint32_t count;
+		uint32_t* offsets;
+
+		TIFFGetFieldDefaulted(in, TIFFTAG_COMPRESSION, &compression);
+		if (compression != COMPRESSION_JPEG || TIFFIsTiled(in) ||
+		    TIFFNumberOfStrips(in) != 1 ||
+		    TIFFNDPIHasUsableMCUStarts(in))
+			return;
+		if (verbose)
+			fprintf(stderr, "Scanning image at offset "
+				TIFF_UINT64_FORMAT " for restart markers\n",
+				diroffset);
+		if (! TIFFNDPIScanRestartMarkers(in, &count, &offsets))
+			return;
+		entry = addRestartMarkerIndexEntry(index);
+		if (entry == NULL) {
+			_TIFFfree(offsets);
+			return;
+		}
+		entry->diroffset = diroffset;
+		entry->count = count;
+		entry->offsets = offsets;
+		if (! writeRestartMarkerIndex(index))
+			fprintf(stderr, "Unable to write restart marker index \"%s\"\n",
+				index->filename);
+	}
+
+	if (entry != NULL && entry->count > 1)
+		TIFFSetField(in, NDPITAG_MCUSTARTS, entry->count,
+			entry->offsets);
+}
+
+	/* Frees the entries of index and the name of its sidecar file */
+void
+freeRestartMarkerIndex(RestartMarkerIndex* index)
+{
+	freeRestartMarkerIndexEntries(index);
+	if (index->filename != NULL)
+		_TIFFfree(index->filename);
+	index->filename = NULL;
+}
+
+MemoryFile*
+newMemoryFile(void)
+{
+	MemoryFile * memfile = _TIFFmalloc(sizeof(MemoryFile));
+
+	if (memfile == NULL) {
+		fprintf(stderr, "Error: insufficient memory for a file in memory.\n");
+		return NULL;
+	}
+	_TIFFmemset(memfile, 0, sizeof(MemoryFile));
+	return memfile;
+}
+
+	/* Makes the buffer of memfile hold at least capacity bytes.
+	 * Returns 1 on success, 0 if out of memory. */
+int
+growMemoryFile(MemoryFile* memfile, tmsize_t capacity)
+{
+	tmsize_t newcapacity = memfile->capacity > 0 ?
+		memfile->capacity : 65536;
+	uint8_t * data;
+
+	if (capacity <= memfile->capacity)
+		return 1;
+	while (newcapacity < capacity)
+		newcapacity *= 2;
+	data = _TIFFrealloc(memfile->data, newcapacity);
+	if (data == NULL)
+		return 0;
+	memfile->data = data;
+	memfile->capacity = newcapacity;
+	return 1;
+}
+
+	/* Writes n bytes at the position of memfile, which grows if
+	 * needed. Returns 1 on success, 0 if out of memory. */
+int
+writeToMemoryFile(MemoryFile* memfile, const void* buf, tmsize_t n)
+{
+	if (! growMemoryFile(memfile, memfile->position + n))
+		return 0;
+	if (memfile->position > memfile->size) /* after a seek */
+		_TIFFmemset(memfile->data + memfile->size, 0,
+		    memfile->position - memfile->size);
+	_TIFFmemcpy(memfile->data + memfile->position, buf, n);
+	memfile->position += n;
+	if (memfile->position > memfile->size)
+		memfile->size = memfile->position;
+	return 1;
+}
+
+void
+freeMemoryFile(MemoryFile* memfile)
+{
+	if (memfile == NULL)
+		return;
+	if (memfile->data != NULL)
+		_TIFFfree(memfile->data);
+	_TIFFfree(memfile);
+}
+
+static tmsize_t
+readMemoryTIFF(thandle_t fd, void* buf, tmsize_t size)
+{
+	MemoryFile * memfile = (MemoryFile *) fd;
+
+	if (memfile->position >= memfile->size)
+		return 0;
+	if (size > memfile->size - memfile->position)
+		size = memfile->size - memfile->position;
+	_TIFFmemcpy(buf, memfile->data + memfile->position, size);
+	memfile->position += size;
+	return size;
+}
+
+static tmsize_t
+writeMemoryTIFF(thandle_t fd, void* buf, tmsize_t size)
+{
+	return writeToMemoryFile((MemoryFile *) fd, buf, size) ? size : -1;
+}
+
+static uint64_t
+seekMemoryTIFF(thandle_t fd, uint64_t off, int whence)
+{
+	MemoryFile * memfile = (MemoryFile *) fd;
+	int64_t position = (int64_t) off;
+
+	if (whence == SEEK_CUR)
+		position += memfile->position;
+	else if (whence == SEEK_END)
+		position += memfile->size;
+	if (position < 0 || (uint64_t) position != (uint64_t) (tmsize_t) position)
+		return (uint64_t) -1;
+	memfile->position = (tmsize_t) position;
+	return (uint64_t) position;
+}
+
+static int
+closeMemoryTIFF(thandle_t fd)
+{
+	(void) fd; /* the MemoryFile is freed by its owner */
+	return 0;
+}
+
+static uint64_t
+sizeMemoryTIFF(thandle_t fd)
+{
+	return (uint64_t) ((MemoryFile *) fd)->size;
+}
+
+static int
+mapMemoryTIFF(thandle_t fd, void** base, toff_t* size)
+{
+	(void) fd; (void) base; (void) size;
+	return 0;
+}
+
+static void
+unmapMemoryTIFF(thandle_t fd, void* base, toff_t size)
+{
+	(void) fd; (void) base; (void) size;
+}
+
+	/* Opens a TIFF file named name which is written into memfile */
+TIFF*
+openMemoryTIFF(const char* name, const char* mode, MemoryFile* memfile)
+{
+	return TIFFClientOpen(name, mode, (thandle_t) memfile,
+	    readMemoryTIFF, writeMemoryTIFF, seekMemoryTIFF, closeMemoryTIFF,
+	    sizeMemoryTIFF, mapMemoryTIFF, unmapMemoryTIFF);
+}
+
+	/* Returns the highest magnification of the images of the NDPI file,
+	 * read with a handle of its own, or 0 */
+float
+getHighestNDPIMagnification(const char* filename)
+{
+	TIFF* t = TIFFOpen(filename, "r");
+	float highest = 0;
+
+	if (t == NULL)
+		return 0;
+	do {
+		float f;
+
+		if (TIFFGetField(t, NDPITAG_MAGNIFICATION, &f) && f > highest)
+			highest = f;
+	} while (TIFFReadDirectory(t));
+	TIFFClose(t);
+	return highest;
+}
+
+static int
+compareUint32s(const void* a, const void* b)
+{
+	uint32_t u = *(const uint32_t*) a, v = *(const uint32_t*) b;
+
+	return u < v ? -1 : u > v;
+}
+
+	/* Finds the columns of the current image of "in", of width
+	 * imagewidth, that are entirely in its blank lanes, lanes being
+	 * lanewidth columns wide on this image. For some files, where
+	 * scanned regions were delimited with freehand draws,
+	 * NDPITAG_BLANKLANES holds a single value which is not a lane
+	 * number: lane numbers beyond the image are ignored. Returns 1 on
+	 * success, 0 on error. */
+int
+getBlankColumns(TIFF* in, uint32_t imagewidth, double lanewidth,
+	BlankColumns* bc)
+{
+	uint32_t nblanklanes, n, first;
+	uint32_t *blanklanes, *lanes;
+
+	freeBlankColumns(bc);
+	if (! TIFFGetField(in, NDPITAG_BLANKLANES, &nblanklanes, &blanklanes)
+	    || nblanklanes == 0 || lanewidth <= 0)
+		return 1;
+	lanes = _TIFFmalloc(nblanklanes * sizeof(uint32_t));
+	bc->start = _TIFFmalloc(nblanklanes * sizeof(uint32_t));
+	bc->end = _TIFFmalloc(nblanklanes * sizeof(uint32_t));
+	if (lanes == NULL || bc->start == NULL || bc->end == NULL) {
+		TIFFError(TIFFFileName(in),
+		    "Error, can't allocate memory for the blank lanes");
+		if (lanes != NULL)
+			_TIFFfree(lanes);
+		freeBlankColumns(bc);
+		return 0;
+	}
+	_TIFFmemcpy(lanes, blanklanes, nblanklanes * sizeof(uint32_t));
+	qsort(lanes, nblanklanes, sizeof(uint32_t), compareUint32s);
+
+		/* Each run of consecutive lanes gives a span of columns */
+	for (n = 0 ; n < nblanklanes && lanes[n] * lanewidth < imagewidth ;
+	    n++) {
+		uint32_t start, end;
+
+		first = n;
+		while (n+1 < nblanklanes && lanes[n+1] <= lanes[n] + 1)
+			n++;
+		/* rounded inwards, but not by a rounding error */
+		start = (uint32_t) ceil(lanes[first] * lanewidth - 0.001);
+		end = (lanes[n] + 1) * lanewidth >= imagewidth ? imagewidth :
+			(uint32_t) floor((lanes[n] + 1) * lanewidth + 0.001);
+		if (start < end) {
+			bc->start[bc->count] = start;
+			bc->end[bc->count] = end;
+			bc->count++;
+		}
+	}
+	_TIFFfree(lanes);
+	return 1;
+}
+
+	/* Returns 1 if the columns x to x+width-1 of the current image are
+	 * all in the blank columns bc */
+int
+isInBlankColumns(const BlankColumns* bc, uint32_t x, uint32_t width)
+{
+	unsigned n;
+
+	for (n = 0 ; n < bc->count ; n++)
+		if (bc->start[n] <= x && x + width <= bc->end[n])
+			return 1;
+	return 0;
+}
+
+	/* Narrows columns x to x+width-1 of the current image, that are
+	 * copied into tiles tilewidth wide from x on, so as to leave out
+	 * the tiles at both ends that are in the blank columns bc */
+void
+leaveOutBlankTiles(const BlankColumns* bc, uint32_t tilewidth, uint32_t* x,
+	uint32_t* width)
+{
+	while (*width > tilewidth && isInBlankColumns(bc, *x, tilewidth)) {
+		*x += tilewidth;
+		*width -= tilewidth;
+	}
+	while (*width > tilewidth) {
+		uint32_t last = (*width - 1) / tilewidth * tilewidth;
+
+		if (! isInBlankColumns(bc, *x + last, *width - last))
+			break;
+		*width = last;
+	}
+}
+
+void
+freeBlankColumns(BlankColumns* bc)
+{
+	if (bc->start != NULL)
+		_TIFFfree(bc->start);
+	if (bc->end != NULL)
+		_TIFFfree(bc->end);
+	bc->start = bc->end = NULL;
+	bc->count = 0;
+}
+
+	/* Writes the tile of out at col, row as a tile of the blank color.
+	 * The tile is encoded the first time, then read back from the file
+	 * to be copied into the next ones. */
+int
+writeBlankTile(TIFF* out, uint32_t col, uint32_t row, BlankTile* blanktile)
+{
+	ttile_t tile = TIFFComputeTile(out, col, row, 0, 0);
+	tmsize_t tilesize;
+	uint8_t * buf;
+	uint64_t size;
+
+	if (blanktile->data != NULL) {
+		if (TIFFWriteRawTile(out, tile, blanktile->data,
+		    blanktile->size) < 0) {
+			TIFFError(TIFFFileName(out),
+			    "Error, can't write blank tile at "
+			    TIFF_UINT32_FORMAT " " TIFF_UINT32_FORMAT,
+			    col, row);
+			return 0;
+		}
+		return 1;
+	}
+
+	tilesize = TIFFTileSize(out);
+	buf = _TIFFmalloc(tilesize);
+	if (buf == NULL) {
+		TIFFError(TIFFFileName(out),
+		    "Error, can't allocate space for blank tile");
+		return 0;
+	}
+	_TIFFmemset(buf, 0xFF, tilesize);
+	if (TIFFWriteEncodedTile(out, tile, buf, tilesize) < 0) {
+		TIFFError(TIFFFileName(out),
+		    "Error, can't write blank tile at "
+		    TIFF_UINT32_FORMAT " " TIFF_UINT32_FORMAT,
+		    col, row);
+		_TIFFfree(buf);
+		return 0;
+	}
+	_TIFFfree(buf);
+
+	/* If the file can't be read back, blank tiles are encoded each
+	 * time */
+	size = TIFFGetStrileByteCount(out, tile);
+	if (size == 0 || (uint64_t) (tmsize_t) size != size)
+		return 1;
+	blanktile->data = _TIFFmalloc((tmsize_t) size);
+	if (blanktile->data == NULL)
+		return 1;
+	if (! readRawBytes(out, TIFFGetStrileOffset(out, tile),
+	    blanktile->data, (tmsize_t) size)) {
+		_TIFFfree(blanktile->data);
+		blanktile->data = NULL;
+		return 1;
+	}
+	blanktile->size = (tmsize_t) size;
+	return 1;
+}
+
+void
+freeBlankTile(BlankTile* blanktile)
+{
+	if (blanktile->data != NULL)
+		_TIFFfree(blanktile->data);
+	blanktile->data = NULL;
+	blanktile->size = 0;
+}
+
+	/* Prepares encoder to hold rows of up to capacity tiles of out if
+	 * there are several encoding threads. Otherwise, or if memory is
+	 * short, the tiles will be written at once. The memory held is
+	 * capacity tiles of out. */
+void
+initTileRowEncoder(TileRowEncoder* encoder, TIFF* out, uint32_t capacity,
+	int numberofthreads)
+{
+	encoder->out = out;
+	(void) TIFFGetField(out, TIFFTAG_TILEWIDTH, &encoder->tilewidth);
+	encoder->tilesize = TIFFTileSize(out);
+	encoder->tiles = NULL;
+	encoder->kinds = NULL;
+	encoder->capacity = capacity;
+	encoder->numberoftiles = 0;
+	encoder->numberofthreads = 0;
+	encoder->threads = NULL;
+	if (numberofthreads <= 1 || capacity <= 1)
+		return;
+	encoder->tiles = _TIFFmalloc(encoder->tilesize * capacity);
+	encoder->kinds = _TIFFmalloc(capacity);
+	encoder->threads = _TIFFmalloc(numberofthreads *
+	    sizeof(TileEncodingThread));
+	if (encoder->tiles == NULL || encoder->kinds == NULL ||
+	    encoder->threads == NULL) {
+		fprintf(stderr, "Not enough memory for encoding threads, tiles will be encoded one by one.\n");
+		freeTileRowEncoder(encoder);
+		return;
+	}
+	_TIFFmemset(encoder->kinds, TILE_NOT_HELD, capacity);
+	encoder->numberofthreads = numberofthreads;
+}
+
+void
+freeTileRowEncoder(TileRowEncoder* encoder)
+{
+	if (encoder->tiles != NULL)
+		_TIFFfree(encoder->tiles);
+	if (encoder->kinds != NULL)
+		_TIFFfree(encoder->kinds);
+	if (encoder->threads != NULL)
+		_TIFFfree(encoder->threads);
+	encoder->tiles = NULL;
+	encoder->kinds = NULL;
+	encoder->threads = NULL;
+	encoder->numberofthreads = 0;
+}
+
+	/* Writes the tile of out at col, row from the pixels of tile, or
+	 * as blanktile if tile is NULL, or holds it in encoder until its
+	 * row is written. The first tile of out is always written at once,
+	 * so that the codec of out is set up as with one thread (its
+	 * JPEGTables in particular). */
+int
+holdTile(TileRowEncoder* encoder, const uint8_t* tile, uint32_t col,
+	uint32_t row, BlankTile* blanktile)
+{
+	uint32_t n = col / encoder->tilewidth;
+
+	if (encoder->numberofthreads == 0 || (col == 0 && row == 0)) {
+		if (tile == NULL)
+			return writeBlankTile(encoder->out, col, row,
+			    blanktile);
+		if (TIFFWriteTile(encoder->out, (tdata_t) tile, col, row,
+		    0, 0) < 0) {
+			TIFFError(TIFFFileName(encoder->out),
+			    "Error, can't write tile at "
+			    TIFF_UINT32_FORMAT " " TIFF_UINT32_FORMAT,
+			    col, row);
+			return 0;
+		}
+		return 1;
+	}
+	if (tile == NULL)
+		encoder->kinds[n] = TILE_BLANK;
+	else {
+		encoder->kinds[n] = TILE_TO_ENCODE;
+		_TIFFmemcpy(encoder->tiles + n * encoder->tilesize, tile,
+		    encoder->tilesize);
+	}
+	encoder->numberoftiles = n + 1;
+	return 1;
+}
+
+	/* Encodes the tiles held by encoder with its threads, each one
+	 * into a TIFF file in memory, then appends them and the blank tiles
+	 * to out in the order of the row, so that out is the same as with
+	 * one thread. Returns 0 if a tile could not be written. */
+int
+writeHeldTiles(TileRowEncoder* encoder, uint32_t row, BlankTile* blanktile)
+{
+	TileEncodingThread * threads = encoder->threads;
+	unsigned numberofthreads = 0, u;
+	uint32_t n, numberoftilestoencode = 0, rank = 0;
+	int status = 1;
+
+	if (encoder->numberoftiles == 0)
+		return 1;
+	for (n = 0 ; n < encoder->numberoftiles ; n++)
+		if (encoder->kinds[n] == TILE_TO_ENCODE)
+			numberoftilestoencode++;
+	if (numberoftilestoencode > 0)
+		numberofthreads = numberoftilestoencode <
+			encoder->numberofthreads ? numberoftilestoencode :
+			encoder->numberofthreads;
+	for (u = 0 ; u < numberofthreads ; u++) {
+		TileEncodingThread * t = &threads[u];
+
+		t->tiles = encoder->tiles;
+		t->kinds = encoder->kinds;
+		t->numberoftiles = encoder->numberoftiles;
+		t->tilesize = encoder->tilesize;
+		t->index = u;
+		t->status = 1;
+		t->isrunning = 0;
+		t->tiff = NULL;
+		t->memfile = newMemoryFile();
+		if (t->memfile != NULL)
+			t->tiff = openMemoryTileRow(encoder->out,
+			    encoder->numberoftiles, t->memfile);
+		if (t->tiff == NULL) {
+			/* the tiles are then encoded by fewer threads, or
+			 * written one at a time */
+			freeMemoryFile(t->memfile);
+			numberofthreads = u;
+			break;
+		}
+	}
+	for (u = 0 ; u < numberofthreads ; u++) {
+		threads[u].numberofthreads = numberofthreads;
+#ifdef HAVE_PTHREAD
+		if (u > 0 && pthread_create(&threads[u].thread, NULL,
+		    encodeHeldTiles, &threads[u]) == 0) {
+			threads[u].isrunning = 1;
+			continue;
+		}
+#endif
+		if (u > 0)
+			encodeHeldTiles(&threads[u]);
+	}
+	/* the first share is encoded while the other threads run */
+	if (numberofthreads > 0)
+		encodeHeldTiles(&threads[0]);
+	for (u = 0 ; u < numberofthreads ; u++) {
+#ifdef HAVE_PTHREAD
+		if (threads[u].isrunning)
+			pthread_join(threads[u].thread, NULL);
+#endif
+		threads[u].isrunning = 0;
+	}
+
+	for (n = 0 ; status && n < encoder->numberoftiles ; n++) {
+		uint32_t col = n * encoder->tilewidth;
+
+		if (encoder->kinds[n] == TILE_BLANK)
+			status = writeBlankTile(encoder->out, col, row,
+			    blanktile);
+		else if (encoder->kinds[n] == TILE_TO_ENCODE) {
+			TileEncodingThread * t = numberofthreads > 0 ?
+				&threads[rank++ % numberofthreads] : NULL;
+			uint8_t * tile = encoder->tiles + n * encoder->tilesize;
+
+			if (t == NULL)
+				status = TIFFWriteTile(encoder->out, tile, col,
+				    row, 0, 0) >= 0;
+			else
+				status = t->status && TIFFWriteRawTile(
+				    encoder->out, TIFFComputeTile(encoder->out,
+				    col, row, 0, 0), t->memfile->data +
+				    TIFFGetStrileOffset(t->tiff, n),
+				    (tmsize_t) TIFFGetStrileByteCount(t->tiff,
+				    n)) >= 0;
+			if (!status)
+				TIFFError(TIFFFileName(encoder->out),
+				    "Error, can't write tile at "
+				    TIFF_UINT32_FORMAT " " TIFF_UINT32_FORMAT,
+				    col, row);
+		}
+	}
+
+	for (u = 0 ; u < numberofthreads ; u++) {
+		TIFFClose(threads[u].tiff);
+		freeMemoryFile(threads[u].memfile);
+	}
+	_TIFFmemset(encoder->kinds, TILE_NOT_HELD, encoder->capacity);
+	encoder->numberoftiles = 0;
+	return status;
+}
+
+	/* Opens a TIFF file in memory with the fields of out that the
+	 * encoding of its tiles depends on, numberoftiles tiles wide and
+	 * one tile high, into which the tiles of a row of out can be
+	 * encoded. Returns NULL if the tiles of out can't be encoded that
+	 * way (with codecs having settings not copied here). */
+TIFF*
+openMemoryTileRow(TIFF* out, uint32_t numberoftiles, MemoryFile* memfile)
+{
+	TIFF * tiff;
+	uint32_t tilewidth, tilelength;
+	uint16_t bitspersample, samplesperpixel, sampleformat, planarconfig;
+	uint16_t photometric, compression, predictor, fillorder;
+	uint16_t hsamp, vsamp, nextrasamples, *extrasamples;
+	int jpegquality, jpegcolormode, jpegtablesmode, preset;
+
+	(void) TIFFGetFieldDefaulted(out, TIFFTAG_COMPRESSION, &compression);
+	switch (compression) {
+		case COMPRESSION_NONE:
+		case COMPRESSION_PACKBITS:
+		case COMPRESSION_LZW:
+		case COMPRESSION_ADOBE_DEFLATE:
+		case COMPRESSION_DEFLATE:
+		case COMPRESSION_LZMA:
+		case COMPRESSION_JPEG:
+			break;
+		default:
+			return NULL;
+	}
+	tiff = openMemoryTIFF(TIFFFileName(out), "w", memfile);
+	if (tiff == NULL)
+		return NULL;
+	(void) TIFFGetField(out, TIFFTAG_TILEWIDTH, &tilewidth);
+	(void) TIFFGetField(out, TIFFTAG_TILELENGTH, &tilelength);
+	TIFFSetField(tiff, TIFFTAG_IMAGEWIDTH, tilewidth * numberoftiles);
+	TIFFSetField(tiff, TIFFTAG_IMAGELENGTH, tilelength);
+	TIFFSetField(tiff, TIFFTAG_TILEWIDTH, tilewidth);
+	TIFFSetField(tiff, TIFFTAG_TILELENGTH, tilelength);
+	(void) TIFFGetFieldDefaulted(out, TIFFTAG_BITSPERSAMPLE,
+	    &bitspersample);
+	TIFFSetField(tiff, TIFFTAG_BITSPERSAMPLE, bitspersample);
+	(void) TIFFGetFieldDefaulted(out, TIFFTAG_SAMPLESPERPIXEL,
+	    &samplesperpixel);
+	TIFFSetField(tiff, TIFFTAG_SAMPLESPERPIXEL, samplesperpixel);
+	(void) TIFFGetFieldDefaulted(out, TIFFTAG_SAMPLEFORMAT, &sampleformat);
+	TIFFSetField(tiff, TIFFTAG_SAMPLEFORMAT, sampleformat);
+	(void) TIFFGetFieldDefaulted(out, TIFFTAG_PLANARCONFIG, &planarconfig);
+	TIFFSetField(tiff, TIFFTAG_PLANARCONFIG, planarconfig);
+	(void) TIFFGetFieldDefaulted(out, TIFFTAG_FILLORDER, &fillorder);
+	TIFFSetField(tiff, TIFFTAG_FILLORDER, fillorder);
+	if (TIFFGetField(out, TIFFTAG_EXTRASAMPLES, &nextrasamples,
+	    &extrasamples))
+		TIFFSetField(tiff, TIFFTAG_EXTRASAMPLES, nextrasamples,
+		    extrasamples);
+	TIFFSetField(tiff, TIFFTAG_COMPRESSION, compression);
+	if (TIFFGetField(out, TIFFTAG_PHOTOMETRIC, &photometric)) {
+		TIFFSetField(tiff, TIFFTAG_PHOTOMETRIC, photometric);
+		if (photometric == PHOTOMETRIC_YCBCR) {
+			(void) TIFFGetFieldDefaulted(out,
+			    TIFFTAG_YCBCRSUBSAMPLING, &hsamp, &vsamp);
+			TIFFSetField(tiff, TIFFTAG_YCBCRSUBSAMPLING,
+			    hsamp, vsamp);
+		}
+	}
+	switch (compression) {
+		case COMPRESSION_JPEG:
+			(void) TIFFGetField(out, TIFFTAG_JPEGQUALITY,
+			    &jpegquality);
+			(void) TIFFGetField(out, TIFFTAG_JPEGCOLORMODE,
+			    &jpegcolormode);
+			(void) TIFFGetField(out, TIFFTAG_JPEGTABLESMODE,
+			    &jpegtablesmode);
+			TIFFSetField(tiff, TIFFTAG_JPEGQUALITY, jpegquality);
+			TIFFSetField(tiff, TIFFTAG_JPEGCOLORMODE,
+			    jpegcolormode);
+			TIFFSetField(tiff, TIFFTAG_JPEGTABLESMODE,
+			    jpegtablesmode);
+			break;
+		case COMPRESSION_ADOBE_DEFLATE:
+		case COMPRESSION_DEFLATE:
+			(void) TIFFGetField(out, TIFFTAG_ZIPQUALITY, &preset);
+			TIFFSetField(tiff, TIFFTAG_ZIPQUALITY, preset);
+			break;
+		case COMPRESSION_LZMA:
+			(void) TIFFGetField(out, TIFFTAG_LZMAPRESET, &preset);
+			TIFFSetField(tiff, TIFFTAG_LZMAPRESET, preset);
+			break;
+	}
+	if (TIFFGetField(out, TIFFTAG_PREDICTOR, &predictor))
+		TIFFSetField(tiff, TIFFTAG_PREDICTOR, predictor);
+	if (TIFFTileSize(tiff) != TIFFTileSize(out)) {
+		TIFFClose(tiff);
+		return NULL;
+	}
+	return tiff;
+}
+
+static void*
+encodeHeldTiles(void* arg)
+{
+	TileEncodingThread * t = (TileEncodingThread *) arg;
+	uint32_t n, rank = 0;
+
+	for (n = 0 ; n < t->numberoftiles ; n++) {
+		if (t->kinds[n] != TILE_TO_ENCODE)
+			continue;
+		if (rank++ % t->numberofthreads != t->index)
+			continue;
+		if (TIFFWriteEncodedTile(t->tiff, n, (void *) (t->tiles +
+		    n * t->tilesize), t->tilesize) < 0) {
+			t->status = 0;
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* vim: set ts=8 sts=8 sw=8 noet: */
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 8
+ * fill-column: 78
+ * End:
+ */
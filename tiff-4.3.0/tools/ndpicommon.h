@@ -0,0 +1,126 @@
+/* ndpicommon.h
+ Copyright (c) 2011-2021 Christophe Deroulers
+ Distributed under the GNU General Public License v3 -- contact the
+ author for commercial use
+ Declarations of the code shared by ndpi2tiff and ndpisplit */
+
+#ifndef _NDPICOMMON_H_
+#define _NDPICOMMON_H_
+
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
+#include "tiffio.h"
+
+	/* NDPI images are acquired through lanes of 128 pixel-wide columns
+	 at the highest magnification */
+#define NDPI_LANE_WIDTH 128
+
+	/* Offsets of the restart intervals of the JPEG image whose IFD is
+	 * at diroffset, as in the NDPIMCUStarts tag */
+typedef struct {
+	uint64_t diroffset;
+	uint32_t count;
+	uint32_t * offsets;
+} RestartMarkerIndexEntry;
+
+	/* Restart marker index of an NDPI file, kept in the sidecar file
+	 * filename */
+typedef struct {
+	char * filename;
+	uint64_t ndpifilesize;
+	int64_t ndpifilemtime;
+	unsigned numberofentries;
+	RestartMarkerIndexEntry * entries;
+} RestartMarkerIndex;
+
+	/* Growable buffer into which a file is written in memory */
+typedef struct {
+	uint8_t * data;
+	tmsize_t size, capacity, position;
+} MemoryFile;
+
+	/* Columns of the current image that are in the blank lanes of the
+	 * NDPI file, where nothing was scanned: count spans from start[n]
+	 * (included) to end[n] (excluded), in increasing order */
+typedef struct {
+	uint32_t * start;
+	uint32_t * end;
+	unsigned count;
+} BlankColumns;
+
+	/* Tile of the blank color, encoded the first time it is written
+	 * into a tiled file, then copied as raw data. Column 0 of the file
+	 * is column ndpixmin of the current image. */
+typedef struct {
+	uint32_t ndpixmin;
+	uint8_t * data; /* encoded tile, or NULL */
+	tmsize_t size;
+} BlankTile;
+
+	/* Kinds of the tiles of a row held by a TileRowEncoder */
+#define TILE_NOT_HELD 0 /* already written */
+#define TILE_BLANK 1
+#define TILE_TO_ENCODE 2
+
+	/* Thread encoding, into a TIFF file in memory as wide as the row,
+	 * the tiles to encode of a row held by a TileRowEncoder whose rank
+	 * among them is index modulo numberofthreads */
+typedef struct {
+	const uint8_t * tiles;
+	const uint8_t * kinds;
+	uint32_t numberoftiles;
+	tmsize_t tilesize;
+	unsigned index, numberofthreads;
+	MemoryFile * memfile;
+	TIFF * tiff;
+	int status, isrunning;
+#ifdef HAVE_PTHREAD
+	pthread_t thread;
+#endif
+} TileEncodingThread;
+
+	/* Tiles of a row of tiles of out, held until the row is complete
+	 * to be encoded by numberofthreads threads, then appended to out
+	 * in order. Tile n of the row starts at column n * tilewidth. */
+typedef struct {
+	TIFF * out;
+	uint32_t tilewidth;
+	tmsize_t tilesize;
+	uint8_t * tiles; /* capacity tiles, one after the other */
+	uint8_t * kinds;
+	uint32_t capacity, numberoftiles;
+	unsigned numberofthreads; /* 0 if tiles are written at once */
+	TileEncodingThread * threads;
+} TileRowEncoder;
+
+extern	MemoryFile* newMemoryFile(void);
+extern	int growMemoryFile(MemoryFile*, tmsize_t);
+extern	int writeToMemoryFile(MemoryFile*, const void*, tmsize_t);
+extern	void freeMemoryFile(MemoryFile*);
+extern	TIFF* openMemoryTIFF(const char*, const char*, MemoryFile*);
+
+extern	const char RESTART_INDEX_SUFFIX[];
+
+extern	int readRawBytes(TIFF*, uint64_t, uint8_t*, tmsize_t);
+extern	void readRestartMarkerIndex(const char*, RestartMarkerIndex*, int);
+extern	int writeRestartMarkerIndex(RestartMarkerIndex*);
+extern	void useRestartMarkerIndex(TIFF*, RestartMarkerIndex*, int, int);
+extern	void freeRestartMarkerIndex(RestartMarkerIndex*);
+
+extern	float getHighestNDPIMagnification(const char*);
+extern	int getBlankColumns(TIFF*, uint32_t, double, BlankColumns*);
+extern	int isInBlankColumns(const BlankColumns*, uint32_t, uint32_t);
+extern	void leaveOutBlankTiles(const BlankColumns*, uint32_t, uint32_t*, uint32_t*);
+extern	void freeBlankColumns(BlankColumns*);
+extern	int writeBlankTile(TIFF*, uint32_t, uint32_t, BlankTile*);
+extern	void freeBlankTile(BlankTile*);
+
+extern	void initTileRowEncoder(TileRowEncoder*, TIFF*, uint32_t, int);
+extern	void freeTileRowEncoder(TileRowEncoder*);
+extern	int holdTile(TileRowEncoder*, const uint8_t*, uint32_t, uint32_t, BlankTile*);
+extern	int writeHeldTiles(TileRowEncoder*, uint32_t, BlankTile*);
+extern	TIFF* openMemoryTileRow(TIFF*, uint32_t, MemoryFile*);
+
+#endif /* _NDPICOMMON_H_ */
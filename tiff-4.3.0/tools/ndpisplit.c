@@ -44,13 +44,37 @@
 #include <sys/stat.h>
 #include <ctype.h>
 #include <stdarg.h>
+#include <time.h>
+
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
+#if defined(_WIN32) && !defined(__CYGWIN__)
+# include <direct.h>
+#endif
+
+	/* The state kept in global variables while an NDPI file is
+	 * processed is per thread when several files are processed at
+	 * once (-j) */
+#if defined(HAVE_PTHREAD) && (defined(__GNUC__) || defined(__clang__))
+# define PER_FILE __thread
+# define HAVE_FILE_WORKERS
+#else
+# define PER_FILE
+#endif
 
 #include "tiffio.h"
+#include "ndpicommon.h"
 
 #include "jpeglib.h"
+#include "jerror.h"
 
 #define COMPRESSION_JPEG_IN_JPEG_FILE ((uint16_t) -2)
 #define ORDINARY_JPEG_MAX_DIMENSION  65500L
+	/* 64-bit FNV-1a hash of the content of mosaic pieces */
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
 
 #define TIFF_INT32_FORMAT "%"PRId32
 #define TIFF_UINT32_FORMAT "%"PRIu32
@@ -61,6 +85,12 @@ typedef struct {
 	uint32_t width, length;
 } MagnificationDescription;
 
+typedef struct {
+	float magnification; /* not available in the NDPI file */
+	float sourcemagnification; /* available, decoded to produce it */
+	unsigned scaledenom; /* 2, 4 or 8 */
+} SynthesizedMagnification;
+
 typedef struct {
 	int isempty;
 	uint32_t map_xmin, map_ymin, map_xmax, map_ymax;
@@ -77,6 +107,254 @@ typedef struct {
 	char * label;
 } BoxToExtract;
 
+	/* Box of an image cropped by cropBoxesFromStrips along with the
+	 * other boxes of the same image */
+typedef struct {
+	char * path;
+	uint32_t xmin, ymin, width, length;
+	TIFF * out; /* while its rows are being decoded */
+	uint32_t tilelength;
+	BlankTile blanktile;
+	unsigned char * buf; /* rows not yet written, up to tilelength */
+	uint32_t rowsdone, rowsinbuf;
+	int status; /* as returned by writeOutTIFF */
+} BoxCrop;
+
+	/* Which pixels of the image at the lowest magnification show tissue
+	 * rather than empty glass. The pieces of a mosaic of an image whose
+	 * dimensions are imagewidth x imagelength are mapped to it. */
+typedef struct {
+	unsigned char * istissue; /* width x length, 1 for tissue */
+	uint32_t width, length;
+	uint32_t imagewidth, imagelength;
+} TissueMask;
+
+typedef struct {
+	uint8_t * header; /* from SOI to the end of SOS */
+	uint32_t headerlength;
+	uint32_t sofposition;
+	int hmax, vmax;
+	uint32_t imagewidth, imagelength;
+	uint32_t intervalwidth, mculength;
+	uint32_t intervalsperrow, nintervals;
+	uint64_t * offsets; /* nintervals+1 file offsets */
+} RestartIntervalGrid;
+
+#define STRIP_SOURCE_BUFFER_SIZE 65536
+
+	/* libjpeg source manager reading a strip of a TIFF file piece by
+	 * piece, so that the huge strips of NDPI files need not be held
+	 * in memory */
+typedef struct {
+	struct jpeg_source_mgr pub;
+	TIFF * in;
+	uint64_t offset, remaining;
+	JOCTET buffer[STRIP_SOURCE_BUFFER_SIZE];
+} StripSourceManager;
+
+	/* Mosaic piece as recorded in the manifest of the mosaic once its
+	 * file is complete */
+typedef struct {
+	char * name; /* of its file */
+	uint32_t x, y, width, length; /* in the image, with overlaps */
+	uint64_t size, hash; /* of its file */
+} MosaicPieceRecord;
+
+	/* Manifest of a mosaic, written along with its pieces: a first
+	 * line with the parameters of the mosaic, then one line per piece
+	 * made. The records are those of a previous run, read with
+	 * --resume, sorted by name. */
+typedef struct {
+	char * filename;
+	FILE * f; /* open for appending records */
+	MosaicPieceRecord * records;
+	unsigned numberofrecords;
+} MosaicManifest;
+
+	/* Mosaic piece handed by tiffMakeMosaic, which has opened it and
+	 * decoded its pixels, to a thread that encodes and writes it. The
+	 * rows are either in buf or in a band of decoded scanlines. */
+typedef struct {
+	struct jpeg_compress_struct cinfo; /* if jpegout != NULL */
+	struct jpeg_error_mgr jerr;
+	FILE * jpegout;
+	TIFF * tiffout;
+	const unsigned char * rows;
+	tmsize_t rowsizeinbytes; /* distance between rows */
+	uint32_t length;
+	const unsigned char * band; /* that rows point into, or NULL */
+	unsigned char * buf;
+	MosaicPieceRecord record; /* its size and hash are computed by the
+				   * thread; name is NULL if not recorded */
+	MemoryFile * memout; /* file of the piece if it goes to the
+			      * archive, or NULL */
+	int status, isrunning;
+#ifdef HAVE_PTHREAD
+	pthread_t thread;
+#endif
+} EncodingPiece;
+
+	/* The last decoded rows of a column of mosaic pieces, kept so that
+	 * the rows of the next piece which overlap them need not be decoded
+	 * again. Row y is in slot y % capacity. */
+typedef struct {
+	unsigned char * rows;
+	uint32_t capacity; /* in rows */
+	tmsize_t rowsizeinbytes; /* of a slot */
+	uint16_t bytesperpixel;
+	uint32_t xmin, width; /* of the rows held */
+	uint32_t firstrow, count;
+} DecodedRowRing;
+
+	/* At most numberofpieces pieces are being encoded at once, each
+	 * one in a slot of the pool holding its own buffer */
+typedef struct {
+	EncodingPiece * pieces;
+	unsigned numberofpieces, next;
+	tmsize_t bufsize;
+	int status; /* 0 once a piece could not be written */
+	MosaicManifest * manifest; /* where finished pieces are recorded */
+} EncodingPool;
+
+	/* libjpeg destination manager writing into a MemoryFile */
+typedef struct {
+	struct jpeg_destination_mgr pub;
+	MemoryFile * memfile;
+} MemoryDestinationManager;
+
+	/* libjpeg destination manager writing into a file, which computes
+	 * the size and hash of the file for the record of its piece */
+typedef struct {
+	struct jpeg_destination_mgr pub;
+	FILE * f;
+	uint64_t size, hash;
+	JOCTET buffer[STRIP_SOURCE_BUFFER_SIZE];
+} HashingDestinationManager;
+
+	/* Uncompressed tar archive (ustar format) into which the mosaic
+	 * pieces are written one after the other, so that it can be a
+	 * pipe. The last member is an index giving the offset in the
+	 * archive of the data of each piece. */
+typedef struct {
+	const char * filename; /* "-" for stdout */
+	FILE * f;
+	uint64_t offset; /* number of bytes written */
+	time_t mtime;
+	MemoryFile index; /* text of the index */
+	unsigned numberofpieces;
+	int status; /* 0 after a write error */
+} MosaicArchive;
+
+	/* Image of the NDPI file from which a level of a Deep Zoom pyramid
+	 * may be read */
+typedef struct {
+	unsigned dirnumber; /* number of its directory in the file */
+	float magnification;
+	int32_t zoffset;
+	uint32_t width, length;
+} DeepZoomSource;
+
+	/* Level of a Deep Zoom pyramid being made. Its rows are read from
+	 * an image of the NDPI file of the same size, or are averages of
+	 * 2x2 pixels of the level above. They are gathered into a band as
+	 * wide as the level and as high as a row of tiles with their
+	 * overlaps, from which the tiles are cut; the overlap rows are
+	 * carried into the next band. */
+typedef struct {
+	const DeepZoomSource * source; /* or NULL if synthesized */
+	uint32_t width, length;
+	tmsize_t rowsizeinbytes;
+	unsigned char * band, * otherband; /* otherband may be NULL */
+	uint32_t bandfirstrow, bandlength;
+	uint32_t numberofrows; /* received so far */
+	uint32_t tilerow; /* of the tiles being gathered into band */
+	unsigned char * halfrow; /* row waiting for the next one to be
+				  * averaged with it into the level below */
+	int hashalfrow;
+} DeepZoomLevel;
+
+typedef struct {
+	char * filesdirectory; /* where the levels are written */
+	uint32_t tilesize, overlap;
+	uint16_t bytesperpixel;
+	int quality;
+	DeepZoomLevel * levels; /* levels[0] is 1x1 pixel */
+	unsigned numberoflevels;
+	EncodingPool pool;
+	int status; /* 0 after an error */
+} DeepZoomPyramid;
+
+	/* NDPI files of the command line, taken in turn by
+	 * numberoffileworkers threads. The memory that a file may need is
+	 * reserved, in the order of the files, before processing it, so
+	 * that the files being processed need no more than memorylimit. */
+typedef struct {
+	char ** filenames;
+	unsigned numberoffiles;
+	unsigned next; /* first file not taken by a worker */
+	unsigned nexttoreserve; /* first file without reserved memory */
+	unsigned nexttoprint; /* first file whose -K output isn't printed */
+	int * errorcodes;
+	int * isdone;
+	MemoryFile ** controldata; /* -K output of the files done */
+	tmsize_t memorylimit; /* 0 for no limit */
+	tmsize_t memoryinuse;
+	/* arguments of processNDPIFile */
+	int shouldmakepreviewonly, shouldsubdivideintoscannedzones;
+	unsigned numberofboxestoextract;
+	BoxToExtract * boxestoextract;
+	int shouldmakemosaicoffiles;
+	uint16_t mosaiccompressionformat, splitimagecompressionformat;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t mutex;
+	pthread_cond_t changed;
+#endif
+} FileQueue;
+
+	/* What processNDPIFile found out about an NDPI file and needs to
+	 * process each of its images */
+typedef struct {
+	char * NDPIfilename; /* without its suffix */
+	int shouldmakepreviewonly;
+	float ndpimagnificationofpreviewimage;
+	unsigned numberofboxestoextract;
+	BoxToExtract * boxestoextract;
+	int shouldmakemosaicoffiles;
+	uint16_t mosaiccompressionformat, splitimagecompressionformat;
+	float highestndpimagnification; /* 0 if blank lanes aren't skipped */
+	unsigned int nscannedzones;
+	const ScannedZoneBox * scannedzoneboxes;
+	uint32_t map_xmin, map_ymin;
+	double ximagetomapratio, yimagetomapratio;
+} NDPIImageContext;
+
+	/* Image of an NDPI file to process at 1 / scaledenom scale */
+typedef struct {
+	uint64_t diroffset; /* of its directory */
+	unsigned scaledenom;
+	uint64_t numberofpixels;
+	int errorcode;
+	MemoryFile * controldata; /* its -K output */
+} ImageTask;
+
+	/* Images of an NDPI file, taken in turn by numberofimageworkers
+	 * threads, the largest first. The tasks are in the order of the
+	 * file. */
+typedef struct {
+	TIFF * in; /* cloned by each thread */
+	const NDPIImageContext * context;
+	RestartMarkerIndex * restartmarkerindex;
+	TissueMask tissuemask; /* read by all threads */
+	ImageTask * tasks;
+	unsigned numberoftasks;
+	ImageTask ** schedule; /* the tasks, the largest first */
+	unsigned next; /* first task of schedule not taken */
+	int haserror;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t mutex;
+#endif
+} ImageQueue;
+
 #ifndef HAVE_GETOPT
 extern int getopt(int, char**, char*);
 #endif
@@ -95,6 +373,10 @@ extern int getopt(int, char**, char*);
 
 static	const char TIFF_SUFFIX[] = ".tif";
 static	const char JPEG_SUFFIX[] = ".jpg";
+static	const char MOSAIC_MANIFEST_SUFFIX[] = "_mosaic.txt";
+static	const char MOSAIC_ARCHIVE_INDEX_NAME[] = "ndpisplit_mosaic_index.txt";
+static	const char DEEPZOOM_SUFFIX[] = ".dzi";
+static	const char DEEPZOOM_DIRECTORY_SUFFIX[] = "_files";
 static	float * magnificationstoextract = NULL;
 static	unsigned numberofmagnificationstoextract = (unsigned) -1;
 static	int32_t * zoffsetstoextract = NULL;
@@ -114,37 +396,139 @@ static	int mosaic_JPEG_quality = -1, splitimage_JPEG_quality = -1, default_JPEG_
 #endif
 static	int verbose = NDPISPLIT_VERBOSE;
 static	int printcontroldata = 0;
-
+static	double tissuefractionthreshold = 0; /* 0: make all pieces */
+static	PER_FILE TissueMask tissuemask = {NULL, 0, 0, 0, 0};
+static	int shouldskipblanklanes = 0;
+static	PER_FILE BlankColumns blankcolumns = {NULL, NULL, 0};
+static	int shouldscanrestartmarkers = 0;
+static	int shouldreadahead = 0;
+static	int shouldcopyjpegdataintomosaic = 0;
+static	int shouldmakemosaicdirectly = 0;
+static	int numberofencodingthreads = 1;
+static	int shouldresumemosaic = 0;
+static	MosaicArchive mosaicarchive = {NULL, NULL, 0, 0, {NULL, 0, 0, 0}, 0, 1};
+static	uint32_t deepzoomtilesize = 0; /* 0: no Deep Zoom pyramid */
+static	uint32_t deepzoomoverlap = 1;
+static	unsigned numberoffileworkers = 1;
+static	tmsize_t fileworkersmemorylimit = -1; /* -1: from -m, -t and -c */
+static	unsigned numberofimageworkers = 1;
+static	PER_FILE char ** reservedfilenames = NULL;
+static	PER_FILE unsigned numberofreservedfilenames = 0;
+static	PER_FILE MemoryFile * controldata = NULL; /* where -K output goes
+						   * if not NULL */
+
+static	int parseBoxInPixels(const char *, BoxToExtract **, unsigned *);
 static	int parseBoxLabel(const char *, const char *, BoxToExtract *);
+static	int processNDPIFiles(FileQueue*);
+static	void* processFilesOfQueue(void*);
+static	tmsize_t estimateMemoryOfNDPIFile(const char*, tmsize_t);
+static	void lockFileQueue(FileQueue*);
+static	void unlockFileQueue(FileQueue*);
+static	void printControlData(const char*, ...);
 static	int processNDPIFile(char*, int, int, unsigned, BoxToExtract*, int, uint16_t, uint16_t);
+static	int processNDPIImages(TIFF*, const NDPIImageContext*, RestartMarkerIndex*, const SynthesizedMagnification*, unsigned);
+static	void* processImagesOfQueue(void*);
+static	int compareImageTasksBySize(const void*, const void*);
+static	void lockImageQueue(ImageQueue*);
+static	void unlockImageQueue(ImageQueue*);
+static	int processNDPIImage(TIFF*, const NDPIImageContext*, unsigned);
+static	int makeDeepZoomPyramids(const char*);
+static	int makeDeepZoomPyramid(const char*, const char*, const DeepZoomSource*, unsigned, const DeepZoomSource*);
+static	int readDeepZoomSource(DeepZoomPyramid*, const char*, unsigned);
+static	void addRowToDeepZoomLevel(DeepZoomPyramid*, unsigned, const unsigned char*);
+static	void finishDeepZoomLevel(DeepZoomPyramid*, unsigned);
+static	void writeDeepZoomTileRow(DeepZoomPyramid*, unsigned);
+static	void averageRowsBy2x2(unsigned char*, const unsigned char*, uint32_t, uint16_t);
+static	TIFF* openNDPIDirectory(const char*, unsigned);
+static	int makeDirectory(const char*);
 static	int magnificationShouldNotBeExtracted(float, unsigned, const float *);
 static	int zoffsetShouldNotBeExtracted(int32_t, unsigned, const int32_t *);
 static	int rewindToBeginningOfTIFF(TIFF*);
-static	int cropNDPI2TIFF(TIFF*, TIFF*, uint32_t, uint32_t, uint32_t, uint32_t, uint16_t);
-static	void tiffMakeMosaic(TIFF*, uint16_t, int);
-static	void computeMaxPieceMemorySize(uint32_t, uint32_t, uint16_t, uint16_t, uint32_t, uint32_t, uint32_t, long double, tmsize_t*, tmsize_t*, uint32_t*, uint32_t*, uint32_t*, uint32_t*);
+static	int cropNDPI2TIFF(TIFF*, TIFF*, uint32_t, uint32_t, uint32_t, uint32_t, unsigned, uint16_t);
+static	int cropBoxesFromStrips(TIFF*, BoxCrop*, unsigned, uint16_t);
+static	int compareBoxCropsByYmin(const void*, const void*);
+static	int openBoxCrop(TIFF*, BoxCrop*, uint16_t, uint16_t);
+static	int copyRowsToBoxCrop(BoxCrop*, const unsigned char*, uint32_t, uint32_t, tmsize_t, uint16_t);
+static	int tiffMakeMosaic(TIFF*, const char*, uint32_t, uint32_t, uint32_t, uint32_t, uint16_t, int, TIFF*, uint32_t, uint32_t);
+static	void computeMaxPieceMemorySize(uint32_t, uint32_t, uint16_t, uint16_t, uint32_t, uint32_t, uint32_t, long double, uint32_t, uint32_t, tmsize_t*, tmsize_t*, tmsize_t*, uint32_t*, uint32_t*, uint32_t*, uint32_t*);
+static	int getRestartIntervalGrid(TIFF*, RestartIntervalGrid*);
+static	int isOnRestartIntervalGrid(const RestartIntervalGrid*, uint32_t, uint32_t, uint32_t, uint32_t);
+static	int writeJPEGFromRestartIntervals(TIFF*, const RestartIntervalGrid*, FILE*, MemoryFile*, MosaicPieceRecord*, uint32_t, uint32_t, uint32_t, uint32_t);
+static	void freeRestartIntervalGrid(RestartIntervalGrid*);
 static	void tiffCopyFieldsButDimensions(TIFF*, TIFF*);
 static	int cpStrips(TIFF*, TIFF*, uint32_t, uint32_t, uint32_t, uint32_t, uint16_t);
 static	int cpStripsNoClipping(TIFF*, TIFF*, uint32_t, uint32_t, uint32_t, uint32_t, uint16_t);
 static	int cpTiles(TIFF*, TIFF*, uint32_t, uint32_t, uint32_t, uint32_t, uint16_t);
+static	uint32_t setUpStrips2Tiles(TIFF*, TIFF*, uint16_t);
+static	int writeBufferToContigTiles(TIFF*, uint8_t*, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, uint16_t, BlankTile*);
 static	int cpStrips2Tiles(TIFF*, TIFF*, uint32_t, uint32_t, uint32_t, uint32_t, uint16_t);
+static	void setMosaicPieceCompression(TIFF*, TIFF*, uint16_t);
+static	int readTilesIntoBuffer(TIFF*, uint32_t, uint32_t, uint32_t, uint32_t, unsigned char*, tmsize_t);
 static	int cpTiles2Strip(TIFF*, void*, int, uint32_t, uint32_t, uint32_t, uint32_t, unsigned char*, uint16_t);
-static	int cpStrips2Strip(TIFF*, void*, int, uint32_t, uint32_t, uint32_t, uint32_t, unsigned char*, uint16_t, uint32_t*, uint32_t);
+static	int canCopyYCbCrTiles2JPEG(TIFF*, uint32_t, uint32_t, uint16_t*, uint16_t*);
+static	int cpYCbCrTiles2JPEG(TIFF*, struct jpeg_compress_struct*, uint32_t, uint32_t, uint32_t, uint32_t);
+static	int readContigStripsIntoBuffer(TIFF*, uint8_t*, uint32_t, uint32_t, tmsize_t);
+static	int readContigStripColumnsIntoBuffer(TIFF*, uint8_t*, uint32_t, uint32_t, uint32_t, uint32_t, tmsize_t);
+static	uint32_t carryOverlapRows(unsigned char*, uint32_t, uint32_t, const unsigned char*, uint32_t, uint32_t, tmsize_t);
+static	int cpStrips2Strip(TIFF*, void*, int, uint32_t, uint32_t, uint32_t, uint32_t, unsigned char*, uint16_t, uint32_t*, uint32_t, const unsigned char*, uint32_t, uint32_t, tmsize_t, DecodedRowRing*);
+static	int getRowFromRing(DecodedRowRing*, uint32_t, uint32_t, uint32_t, unsigned char*);
+static	void putRowIntoRing(DecodedRowRing*, uint32_t, uint32_t, uint32_t, const unsigned char*);
+static	void initEncodingPool(EncodingPool*, unsigned, tmsize_t, MosaicManifest*);
+static	int freeEncodingPool(EncodingPool*);
+static	EncodingPiece* acquireEncodingPiece(EncodingPool*, int);
+static	int fillEncodingPiece(EncodingPiece*, TIFF*, uint32_t, uint32_t, uint32_t, uint32_t, const unsigned char*, uint32_t, uint32_t, tmsize_t, uint16_t);
+static	void* encodeMosaicPiece(void*);
+static	void startEncodingPiece(EncodingPiece*);
+static	int finishEncodingPieces(EncodingPool*, const unsigned char*);
+static	int openMosaicManifest(MosaicManifest*, const char*, const char*);
+static	int isMosaicPieceAlreadyMade(const MosaicManifest*, const MosaicPieceRecord*);
+static	void recordMosaicPiece(MosaicManifest*, const MosaicPieceRecord*, const MemoryFile*);
+static	int completeMosaicPiece(MosaicPieceRecord*, const MemoryFile*);
+static	void closeMosaicManifest(MosaicManifest*);
+static	int compareMosaicPieceRecords(const void*, const void*);
+static	int hashFile(const char*, uint64_t*, uint64_t*);
+static	uint64_t hashBytes(uint64_t, const uint8_t*, tmsize_t);
+static	int openMosaicArchive(void);
+static	int addToMosaicArchive(const MosaicPieceRecord*, const MemoryFile*);
+static	int closeMosaicArchive(void);
+static	int writeTarHeader(const char*, uint64_t, char);
+static	int writeToMosaicArchive(const void*, tmsize_t);
+static	void setMemoryDestination(j_compress_ptr, MemoryFile*);
+static	void setHashingDestination(j_compress_ptr, FILE*);
+static	void getHashingDestinationHash(j_compress_ptr, MosaicPieceRecord*);
+static	int writeToPieceFile(FILE*, MemoryFile*, MosaicPieceRecord*, const void*, tmsize_t);
+static	int canDecodeScaledStrips(TIFF*, unsigned);
+static	int cpScaledStrips2Tiles(TIFF*, TIFF*, unsigned, uint32_t, uint32_t, uint32_t, uint32_t, uint16_t);
 static	int getNumberOfBlankLanes(TIFF*);
 static	float getNDPIMagnification(TIFF*);
 static	int getWidthAndLength(TIFF*, uint32_t*, uint32_t*, float);
+static	int fitsPreviewLimits(uint32_t, uint32_t);
+static	int findAvailableMagnifications(TIFF*, MagnificationDescription**, unsigned*);
+static	int addToSetOfSynthesizedMagnifications(SynthesizedMagnification**, unsigned*, const MagnificationDescription*, unsigned, float);
+static	int nextSynthesizedMagnification(TIFF*, const SynthesizedMagnification*, unsigned, unsigned*);
 static	unsigned int getScannedZonesFromMap(TIFF*, ScannedZoneBox **);
-static	int writeOutTIFF(TIFF*, char*, int, uint32_t, uint32_t, uint32_t, uint32_t, int, uint16_t, uint16_t);
+static	int buildTissueMask(TIFF*, float, TissueMask*);
+static	int showsTissue(const TissueMask*, uint32_t, uint32_t, uint32_t, uint32_t);
+static	void freeTissueMask(TissueMask*);
+static	int writeOutTIFF(TIFF*, char*, int, uint32_t, uint32_t, uint32_t, uint32_t, unsigned, int, uint16_t, uint16_t);
+static	int makeMosaicOfSplitImage(TIFF*, TIFF*, const char*, uint32_t, uint32_t, uint32_t, unsigned, int, uint16_t);
 static	void findUnitsAtMagnification(TIFF*, float, uint32_t*, uint32_t*);
 static	float* extendArrayOfFloats(float**, unsigned*, const char*);
 static	MagnificationDescription* extendArrayOfMagnificationDescriptions(MagnificationDescription**, unsigned*, const char*);
+static	SynthesizedMagnification* extendArrayOfSynthesizedMagnifications(SynthesizedMagnification**, unsigned*, const char*);
 static	int32_t* extendArrayOfInt32s(int32_t**, unsigned*, const char*);
 static	BoxToExtract* extendArrayOfBoxes(BoxToExtract**, unsigned*, const char*);
+static	BoxCrop* extendArrayOfBoxCrops(BoxCrop**, unsigned*, const char*);
+static	char** extendArrayOfStrings(char***, unsigned*, const char*);
+static	MosaicPieceRecord* extendArrayOfMosaicPieceRecords(MosaicPieceRecord**, unsigned*, const char*);
+static	DeepZoomSource* extendArrayOfDeepZoomSources(DeepZoomSource**, unsigned*, const char*);
+static	ImageTask* extendArrayOfImageTasks(ImageTask**, unsigned*, const char*);
 /*static	int addToSetOfFloats(float**, unsigned*, const char*, float);*/
 static	int addToSetOfMagnificationDescriptions(MagnificationDescription**, unsigned*, const char*, MagnificationDescription);
 static	int addToSetOfInt32s(int32_t**, unsigned*, const char*, int32_t);
 static	int searchNumberOfDigits(uint32_t);
 static	int buildFileNameForExtract(const char *, float, int32_t, const char *, char **);
+static	void releaseReservedFileNames(void);
 static	void my_asprintf(char** ret, const char* format, ...);
 static	uint32_t my_floor(double);
 static	uint32_t my_ceil(double);
@@ -197,6 +581,118 @@ main(int argc, char* argv[])
 		}
 		else if (argv[arg][1] == 'K')
 			printcontroldata = 1;
+		else if (argv[arg][1] == 'R')
+			shouldscanrestartmarkers = 1;
+		else if (argv[arg][1] == 'A')
+			shouldreadahead = 1;
+		else if (argv[arg][1] == 'J')
+			shouldcopyjpegdataintomosaic = 1;
+		else if (argv[arg][1] == 'd')
+			shouldmakemosaicdirectly = 1;
+		else if (argv[arg][1] == 't') {
+			long l = strtol(argv[arg]+2, NULL, 10);
+
+			if (errno || l < 1) {
+				usage("number of threads not understood.\n"); return (-3);
+			}
+			numberofencodingthreads = l;
+#ifndef HAVE_PTHREAD
+			if (numberofencodingthreads > 1)
+				fprintf(stderr, "ndpisplit: compiled without thread support, ignoring -t\n");
+			numberofencodingthreads = 1;
+#endif
+		}
+		else if (argv[arg][1] == 'j') {
+			char * p = argv[arg]+2;
+			long l = strtol(p, &p, 10);
+
+			if (errno || l < 1) {
+				usage("number of files to process at once not understood.\n"); return (-3);
+			}
+			numberoffileworkers = l;
+			if (*p == ',') {
+				double memorylimit_in_MiB = strtod(p+1, &p);
+
+				if (errno || memorylimit_in_MiB < 0 ||
+				    !isfinite(memorylimit_in_MiB)) {
+					usage("Syntax error in maximum memory argument to option '-j'.\n");
+					return (-3);
+				}
+				fileworkersmemorylimit = (tmsize_t) (1024. *
+					memorylimit_in_MiB) * 1024;
+			}
+			if (*p != 0) {
+				usage("Syntax error in argument to option '-j'.\n");
+				return (-3);
+			}
+#ifndef HAVE_FILE_WORKERS
+			if (numberoffileworkers > 1)
+				fprintf(stderr, "ndpisplit: compiled without thread support, ignoring -j\n");
+			numberoffileworkers = 1;
+#endif
+		}
+		else if (argv[arg][1] == 'i') {
+			long l = strtol(argv[arg]+2, NULL, 10);
+
+			if (errno || l < 1) {
+				usage("number of images to process at once not understood.\n"); return (-3);
+			}
+			numberofimageworkers = l;
+#ifndef HAVE_FILE_WORKERS
+			if (numberofimageworkers > 1)
+				fprintf(stderr, "ndpisplit: compiled without thread support, ignoring -i\n");
+			numberofimageworkers = 1;
+#endif
+		}
+		else if (argv[arg][1] == 'B') {
+			double percent = 5;
+
+			if (argv[arg][2] != 0)
+				percent = strtod(argv[arg]+2, NULL);
+			if (errno || percent <= 0 || percent > 100) {
+				usage("Syntax error in tissue percentage argument to option '-B'.\n");
+				return (-3);
+			}
+			tissuefractionthreshold = percent / 100;
+		}
+		else if (argv[arg][1] == 'N')
+			shouldskipblanklanes = 1;
+		else if (strcmp(argv[arg], "--resume") == 0)
+			shouldresumemosaic = 1;
+		else if (argv[arg][1] == 'Z') {
+			char * p = argv[arg]+2;
+
+			deepzoomtilesize = 254;
+			if (*p != 0 && *p != ',') {
+				unsigned long ul = strtoul(p, &p, 10);
+
+				if (errno || ul == 0) {
+					usage("Syntax error in tile size argument to option '-Z'.\n");
+					return (-3);
+				}
+				deepzoomtilesize = ul;
+			}
+			if (*p == ',') {
+				unsigned long ul = strtoul(p+1, &p, 10);
+
+				if (errno) {
+					usage("Syntax error in overlap argument to option '-Z'.\n");
+					return (-3);
+				}
+				deepzoomoverlap = ul;
+			}
+			if (*p != 0) {
+				usage("Syntax error in argument to option '-Z'.\n");
+				return (-3);
+			}
+		}
+		else if (argv[arg][1] == 'a') {
+			if (argv[arg][2] == 0) {
+				usage("Option '-a' requires a file name.\n");
+				return (-3);
+			}
+			mosaicarchive.filename = argv[arg]+2;
+		}
 		else if (argv[arg][1] == 'T' && argv[arg][2] == 'E') {
 			TIFFSetErrorHandler(oerror);
 		}
@@ -467,93 +963,43 @@ read_mosaic_JPEG_quality:
 		} else if (argv[arg][1] == 'E') {
 			char * p = argv[arg]+2;
 
-			p = strtok(p, ":");
-			while (p != NULL) {
-				BoxToExtract * box;
-				char * r;
-				int consumedcharacters;
-
-				box = extendArrayOfBoxes(
-				    &boxestoextract,
-				    &numberofboxestoextract,
-				    "specifications of boxes to extract.\n");
-				if (box == NULL)
-					return (-3);
+			if (*p == '@') {
+				/* One box per line of the file, as many as
+				 * needed (lines starting with '#' are comments) */
+				FILE * f = fopen(p+1, "r");
+				char line[4096];
 
-				box->magnificationstoextract = _TIFFmalloc(
-				    sizeof(*(box->magnificationstoextract)));
-				if (box->magnificationstoextract == NULL) {
-					fprintf(stderr, "Error: insufficient memory for specifications of boxes to extract.\n");
+				if (f == NULL) {
+					usage("unable to open file of boxes to extract \"%s\".\n", p+1);
 					return (-3);
 				}
-				box->numberofmagnificationstoextract = 1;
-				box->numberofzoffsetstoextract = -1;
-				box->zoffsetstoextract = NULL;
-				box->relwidth = 0;
-				box->rellength = 0;
+				while (fgets(line, sizeof(line), f) != NULL) {
+					int error;
 
-				if (*p != 'x' && *p != 'X') {
-					usage("syntax error: magnification specification should start with an 'x' in box to extract \"%s\".\n", p);
-					return (-3);
-				}
-				if (sscanf(p+1, "%f%n",
-				    &(box->magnificationstoextract[0]),
-				    &consumedcharacters) != 1) {
-					usage("unable to parse magnification for box to extract \"%s\".\n", p);
-					return (-3);
-				}
-				r = p + 1 + consumedcharacters;
-				while (*r == ',' &&
-				    (*(r+1) == 'z' || *(r+1) == 'Z')) {
-					int32_t * p_zoffset;
-					r += 2;
-					p_zoffset = extendArrayOfInt32s(
-					    &(box->zoffsetstoextract),
-					    &(box->numberofzoffsetstoextract),
-					    "specifications of boxes to extract.\n");
-					if (p_zoffset == NULL)
-						return (-3);
-					if (sscanf(r, TIFF_INT32_FORMAT "%n",
-					    p_zoffset,
-					    &consumedcharacters) != 1) {
-						usage("unable to parse z-offset for box to extract \"%s\".\n", p);
-						return (-3);
+					line[strcspn(line, "\r\n")] = 0;
+					if (line[0] == 0 || line[0] == '#')
+						continue;
+					error = parseBoxInPixels(line,
+					    &boxestoextract,
+					    &numberofboxestoextract);
+					if (error) {
+						fclose(f);
+						return error;
 					}
-					r += consumedcharacters;
-				}
-				if (sscanf(r, "," TIFF_UINT32_FORMAT
-				    "," TIFF_UINT32_FORMAT ","
-				    TIFF_UINT32_FORMAT ","
-				    TIFF_UINT32_FORMAT "%n",
-				    &(box->xmin), &(box->ymin),
-				    &(box->width), &(box->length),
-				    &consumedcharacters) != 4) {
-					usage("unable to parse coordinates for box to extract \"%s\".\n", p);
-					return (-3);
-				}
-
-				r += consumedcharacters;
-				{
-				int error = parseBoxLabel(r, p, box);
-				if (error)
-					return error;
 				}
-
-				p= strtok(NULL, ":");
-				if (verbose >= 4) {
-					fprintf(stderr, "Finished parsing box"
-						" to extract " 
-						TIFF_INT32_FORMAT ","
-						TIFF_INT32_FORMAT ","
-						TIFF_INT32_FORMAT ","
-						TIFF_INT32_FORMAT ", ",
-					    box->xmin, box->ymin,
-					    box->width, box->length);
-					if (box->label == NULL)
-						fprintf(stderr, "no specified label.\n");
-					else
-						fprintf(stderr, "label \"%s\".\n",
-						    box->label);
+				fclose(f);
+				if (verbose >= 2)
+					fprintf(stderr, "%u boxes to extract after reading \"%s\"\n",
+					    numberofboxestoextract, p+1);
+			} else {
+				p = strtok(p, ":");
+				while (p != NULL) {
+					int error = parseBoxInPixels(p,
+					    &boxestoextract,
+					    &numberofboxestoextract);
+					if (error)
+						return error;
+					p= strtok(NULL, ":");
 				}
 			}
 		} else if (argv[arg][1] == 'c') {
@@ -616,6 +1062,37 @@ read_mosaic_JPEG_quality:
 	if (numberofboxestoextract > 0)
 		shouldsubdivideintoscannedzones= 0;
 
+	if (mosaicarchive.filename != NULL) {
+		if (deepzoomtilesize > 0) {
+			usage("Option '-a' doesn't apply to Deep Zoom pyramids made with '-Z'.\n");
+			return (-3);
+		}
+		if (printcontroldata &&
+		    strcmp(mosaicarchive.filename, "-") == 0) {
+			usage("Options '-a-' and '-K' both write to stdout.\n");
+			return (-3);
+		}
+		if (shouldresumemosaic) {
+			fprintf(stderr, "Mosaic pieces written into an archive can't be kept, ignoring --resume.\n");
+			shouldresumemosaic = 0;
+		}
+		if (numberoffileworkers > 1) {
+			fprintf(stderr, "Files are processed one by one when mosaic pieces are written into an archive, ignoring -j.\n");
+			numberoffileworkers = 1;
+		}
+		if (numberofimageworkers > 1) {
+			fprintf(stderr, "Images are processed one by one when mosaic pieces are written into an archive, ignoring -i.\n");
+			numberofimageworkers = 1;
+		}
+		if (! openMosaicArchive()) {
+			fprintf(stderr, "Unable to open archive \"%s\" for mosaic pieces.\n",
+				mosaicarchive.filename);
+			return (1);
+		}
+	}
+
+	/* The handlers are shared by the threads processing files: they
+	 * are set before the threads start and never changed afterwards */
 	if (verbose) {
 		TIFFSetErrorHandler(stderrErrorHandler);
 	}
@@ -623,19 +1100,119 @@ read_mosaic_JPEG_quality:
 		TIFFSetWarningHandler(stderrWarningHandler);
 	}
 
-	for (; arg < argc ; arg++) {
-		int r = processNDPIFile(argv[arg],
-		    shouldmakepreviewonly,
-		    shouldsubdivideintoscannedzones,
-		    numberofboxestoextract, boxestoextract,
-		    shouldmakemosaicoffiles, mosaiccompressionformat,
-		    splitimagecompressionformat);
-		if (r)
-			errorcode = r;
+	{
+		FileQueue queue;
+
+		_TIFFmemset(&queue, 0, sizeof(queue));
+		queue.filenames = argv + arg;
+		queue.numberoffiles = argc - arg;
+		queue.shouldmakepreviewonly = shouldmakepreviewonly;
+		queue.shouldsubdivideintoscannedzones =
+		    shouldsubdivideintoscannedzones;
+		queue.numberofboxestoextract = numberofboxestoextract;
+		queue.boxestoextract = boxestoextract;
+		queue.shouldmakemosaicoffiles = shouldmakemosaicoffiles;
+		queue.mosaiccompressionformat = mosaiccompressionformat;
+		queue.splitimagecompressionformat =
+		    splitimagecompressionformat;
+		errorcode = processNDPIFiles(&queue);
 	}
+	if (mosaicarchive.f != NULL && ! closeMosaicArchive() &&
+	    errorcode == 0)
+		errorcode = 1;
 	return errorcode;
 }
 
+	/* Parses the specification of a box to extract with -E (in
+	 * pixels, at a given magnification) and appends it to boxes */
+static int
+parseBoxInPixels(const char * p, BoxToExtract ** boxes,
+	unsigned * numberofboxes)
+{
+	BoxToExtract * box;
+	const char * r;
+	int consumedcharacters, error;
+
+	box = extendArrayOfBoxes(boxes, numberofboxes,
+	    "specifications of boxes to extract.\n");
+	if (box == NULL)
+		return (-3);
+
+	box->magnificationstoextract = _TIFFmalloc(
+	    sizeof(*(box->magnificationstoextract)));
+	if (box->magnificationstoextract == NULL) {
+		fprintf(stderr, "Error: insufficient memory for specifications of boxes to extract.\n");
+		return (-3);
+	}
+	box->numberofmagnificationstoextract = 1;
+	box->numberofzoffsetstoextract = -1;
+	box->zoffsetstoextract = NULL;
+	box->relwidth = 0;
+	box->rellength = 0;
+
+	if (*p != 'x' && *p != 'X') {
+		usage("syntax error: magnification specification should start with an 'x' in box to extract \"%s\".\n", p);
+		return (-3);
+	}
+	if (sscanf(p+1, "%f%n",
+	    &(box->magnificationstoextract[0]),
+	    &consumedcharacters) != 1) {
+		usage("unable to parse magnification for box to extract \"%s\".\n", p);
+		return (-3);
+	}
+	r = p + 1 + consumedcharacters;
+	while (*r == ',' &&
+	    (*(r+1) == 'z' || *(r+1) == 'Z')) {
+		int32_t * p_zoffset;
+		r += 2;
+		p_zoffset = extendArrayOfInt32s(
+		    &(box->zoffsetstoextract),
+		    &(box->numberofzoffsetstoextract),
+		    "specifications of boxes to extract.\n");
+		if (p_zoffset == NULL)
+			return (-3);
+		if (sscanf(r, TIFF_INT32_FORMAT "%n",
+		    p_zoffset,
+		    &consumedcharacters) != 1) {
+			usage("unable to parse z-offset for box to extract \"%s\".\n", p);
+			return (-3);
+		}
+		r += consumedcharacters;
+	}
+	if (sscanf(r, "," TIFF_UINT32_FORMAT
+	    "," TIFF_UINT32_FORMAT ","
+	    TIFF_UINT32_FORMAT ","
+	    TIFF_UINT32_FORMAT "%n",
+	    &(box->xmin), &(box->ymin),
+	    &(box->width), &(box->length),
+	    &consumedcharacters) != 4) {
+		usage("unable to parse coordinates for box to extract \"%s\".\n", p);
+		return (-3);
+	}
+
+	r += consumedcharacters;
+	error = parseBoxLabel(r, p, box);
+	if (error)
+		return error;
+
+	if (verbose >= 4) {
+		fprintf(stderr, "Finished parsing box"
+			" to extract " 
+			TIFF_INT32_FORMAT ","
+			TIFF_INT32_FORMAT ","
+			TIFF_INT32_FORMAT ","
+			TIFF_INT32_FORMAT ", ",
+		    box->xmin, box->ymin,
+		    box->width, box->length);
+		if (box->label == NULL)
+			fprintf(stderr, "no specified label.\n");
+		else
+			fprintf(stderr, "label \"%s\".\n",
+			    box->label);
+	}
+	return 0;
+}
+
 static int parseBoxLabel(const char * r, const char * p, BoxToExtract * box)
 {
 	if (*r == 0)
@@ -661,6 +1238,273 @@ static int parseBoxLabel(const char * r, const char * p, BoxToExtract * box)
 	return 0;
 }
 
+	/* Processes the files of the queue, with numberoffileworkers
+	 * threads if there are several files. Returns the error code of
+	 * the last file which failed, or 0, as if the files had been
+	 * processed one after the other. */
+static int
+processNDPIFiles(FileQueue * queue)
+{
+	unsigned numberofworkers = numberoffileworkers, u;
+	int errorcode = 0;
+#ifdef HAVE_PTHREAD
+	pthread_t * workers = NULL;
+#endif
+
+	if (numberofworkers > queue->numberoffiles)
+		numberofworkers = queue->numberoffiles;
+	queue->errorcodes = _TIFFmalloc(queue->numberoffiles * sizeof(int));
+	queue->isdone = _TIFFmalloc(queue->numberoffiles * sizeof(int));
+	queue->controldata = _TIFFmalloc(queue->numberoffiles *
+	    sizeof(MemoryFile*));
+	if (queue->errorcodes == NULL || queue->isdone == NULL ||
+	    queue->controldata == NULL) {
+		fprintf(stderr, "Error: insufficient memory for the list of files.\n");
+		return (1);
+	}
+	for (u = 0 ; u < queue->numberoffiles ; u++) {
+		queue->errorcodes[u] = 0;
+		queue->isdone[u] = 0;
+		queue->controldata[u] = NULL;
+	}
+
+	/* By default, the files being processed may need as much memory
+	 * as one file is allowed to: the mosaic pieces being encoded with
+	 * the band they are cut from, which fit into the limit of -m
+	 * whatever the number of threads, or the buffer to change the
+	 * compression format of images */
+	queue->memorylimit = fileworkersmemorylimit;
+	if (queue->memorylimit < 0) {
+		queue->memorylimit = mosaicpiecesizelimit;
+		if (mosaicpiecesizelimit == 0 ||
+		    compressionformatchangebuffersizelimit == 0)
+			queue->memorylimit = 0;
+		else
+			MAX(queue->memorylimit,
+			    compressionformatchangebuffersizelimit);
+	}
+
+#ifdef HAVE_PTHREAD
+	if (numberofworkers > 1) {
+		pthread_mutex_init(&queue->mutex, NULL);
+		pthread_cond_init(&queue->changed, NULL);
+		workers = _TIFFmalloc(numberofworkers * sizeof(pthread_t));
+		if (workers == NULL)
+			numberofworkers = 1;
+		for (u = 0 ; u < numberofworkers && workers != NULL ; u++)
+			if (pthread_create(&workers[u], NULL,
+			    processFilesOfQueue, queue) != 0)
+				break;
+		if (verbose >= 2 && u > 1)
+			fprintf(stderr, "Processing up to %u files at once\n",
+				u);
+		/* Whatever the number of workers started, this thread
+		 * also takes files */
+		processFilesOfQueue(queue);
+		while (u-- > 0)
+			pthread_join(workers[u], NULL);
+		if (workers != NULL)
+			_TIFFfree(workers);
+		pthread_cond_destroy(&queue->changed);
+		pthread_mutex_destroy(&queue->mutex);
+	} else
+#endif
+		processFilesOfQueue(queue);
+
+	for (u = 0 ; u < queue->numberoffiles ; u++)
+		if (queue->errorcodes[u])
+			errorcode = queue->errorcodes[u];
+	_TIFFfree(queue->errorcodes);
+	_TIFFfree(queue->isdone);
+	_TIFFfree(queue->controldata);
+	return errorcode;
+}
+
+	/* Takes the next file of the queue and processes it, until there
+	 * are no more files. With several workers, the -K output of a
+	 * file is kept until the files before it have been done, then
+	 * printed at once. */
+static void*
+processFilesOfQueue(void * arg)
+{
+	FileQueue * queue = (FileQueue*) arg;
+
+	for (;;) {
+		unsigned u;
+		tmsize_t memory = 0;
+		int r;
+
+		lockFileQueue(queue);
+		u = queue->next;
+		if (u < queue->numberoffiles)
+			queue->next++;
+		unlockFileQueue(queue);
+		if (u >= queue->numberoffiles)
+			break;
+
+		if (numberoffileworkers > 1) {
+			memory = estimateMemoryOfNDPIFile(queue->filenames[u],
+			    queue->memorylimit);
+			controldata = newMemoryFile();
+		}
+		lockFileQueue(queue);
+#ifdef HAVE_PTHREAD
+		while (numberoffileworkers > 1 &&
+		    (queue->nexttoreserve != u || (queue->memorylimit > 0 &&
+		    queue->memoryinuse > 0 &&
+		    queue->memoryinuse + memory > queue->memorylimit)))
+			pthread_cond_wait(&queue->changed, &queue->mutex);
+#endif
+		queue->memoryinuse += memory;
+		queue->nexttoreserve++;
+#ifdef HAVE_PTHREAD
+		if (numberoffileworkers > 1)
+			pthread_cond_broadcast(&queue->changed);
+#endif
+		if (verbose >= 2 && numberoffileworkers > 1)
+			fprintf(stderr, "File \"%s\" may need " TIFF_UINT64_FORMAT
+				" bytes, " TIFF_UINT64_FORMAT
+				" reserved for all files being processed\n",
+				queue->filenames[u], (uint64_t) memory,
+				(uint64_t) queue->memoryinuse);
+		unlockFileQueue(queue);
+
+		r = deepzoomtilesize > 0 ?
+		    makeDeepZoomPyramids(queue->filenames[u]) :
+		    processNDPIFile(queue->filenames[u],
+		    queue->shouldmakepreviewonly,
+		    queue->shouldsubdivideintoscannedzones,
+		    queue->numberofboxestoextract, queue->boxestoextract,
+		    queue->shouldmakemosaicoffiles,
+		    queue->mosaiccompressionformat,
+		    queue->splitimagecompressionformat);
+		releaseReservedFileNames();
+
+		lockFileQueue(queue);
+		queue->memoryinuse -= memory;
+		queue->errorcodes[u] = r;
+		queue->controldata[u] = controldata;
+		controldata = NULL;
+		queue->isdone[u] = 1;
+		while (queue->nexttoprint < queue->numberoffiles &&
+		    queue->isdone[queue->nexttoprint]) {
+			MemoryFile * memfile =
+			    queue->controldata[queue->nexttoprint];
+
+			if (memfile != NULL) {
+				if (memfile->size > 0)
+					fwrite(memfile->data, 1,
+					    memfile->size, stdout);
+				fflush(stdout);
+				freeMemoryFile(memfile);
+				queue->controldata[queue->nexttoprint] = NULL;
+			}
+			queue->nexttoprint++;
+		}
+#ifdef HAVE_PTHREAD
+		if (numberoffileworkers > 1)
+			pthread_cond_broadcast(&queue->changed);
+#endif
+		unlockFileQueue(queue);
+	}
+	return NULL;
+}
+
+	/* Returns the memory needed to hold the decoded image at the
+	 * highest magnification of the NDPI file, as many times as images
+	 * are processed at once, up to limit (if not 0).
+	 * Returns 0 if the file can't be read. */
+static tmsize_t
+estimateMemoryOfNDPIFile(const char* filename, tmsize_t limit)
+{
+	TIFF* t = TIFFOpen(filename, "r");
+	uint64_t memory = 0;
+
+	if (t == NULL)
+		return 0;
+	do {
+		float f;
+		uint32_t width, length;
+		uint64_t m;
+
+		if (! TIFFGetField(t, NDPITAG_MAGNIFICATION, &f) || f <= 0 ||
+		    ! TIFFGetField(t, TIFFTAG_IMAGEWIDTH, &width) ||
+		    ! TIFFGetField(t, TIFFTAG_IMAGELENGTH, &length) ||
+		    width == 0)
+			continue;
+		m = TIFFRasterScanlineSize64(t) * length;
+		if (numberofencodingthreads > 1) {
+			/* the TileRowEncoder of tiled output holds a row of
+			 * tiles, as set up by setUpStrips2Tiles */
+			uint32_t tilewidth = NDPI_LANE_WIDTH,
+			    tilelength = (uint32_t) -1;
+
+			TIFFDefaultTileSize(t, &tilewidth, &tilelength);
+			m += TIFFRasterScanlineSize64(t) / width *
+			    ((width + NDPI_LANE_WIDTH - 1) / NDPI_LANE_WIDTH *
+			    NDPI_LANE_WIDTH) * tilelength;
+		}
+		if (m > memory)
+			memory = m;
+	} while (TIFFReadDirectory(t));
+	TIFFClose(t);
+	memory *= numberofimageworkers;
+	if (limit > 0 && memory > (uint64_t) limit)
+		return limit;
+	return (tmsize_t) memory;
+}
+
+static void
+lockFileQueue(FileQueue * queue)
+{
+#ifdef HAVE_PTHREAD
+	if (numberoffileworkers > 1)
+		pthread_mutex_lock(&queue->mutex);
+#else
+	(void) queue;
+#endif
+}
+
+static void
+unlockFileQueue(FileQueue * queue)
+{
+#ifdef HAVE_PTHREAD
+	if (numberoffileworkers > 1)
+		pthread_mutex_unlock(&queue->mutex);
+#else
+	(void) queue;
+#endif
+}
+
+	/* Prints control data (-K) on stdout, or into the buffer of the
+	 * file being processed if several files are processed at once */
+static void
+printControlData(const char* format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	if (controldata == NULL)
+		vprintf(format, ap);
+	else {
+		char * s;
+		va_list aq;
+		int n;
+
+		va_copy(aq, ap);
+		n = vsnprintf(NULL, 0, format, aq);
+		va_end(aq);
+		s = n >= 0 ? _TIFFmalloc(n+1) : NULL;
+		if (s != NULL) {
+			vsnprintf(s, n+1, format, ap);
+			if (! writeToMemoryFile(controldata, s, n))
+				fprintf(stderr, "Error: insufficient memory for control data.\n");
+			_TIFFfree(s);
+		}
+	}
+	va_end(ap);
+}
+
 static int
 processNDPIFile(char * NDPIfilename, int shouldmakepreviewonly,
 	int shouldsubdivideintoscannedzones,
@@ -685,13 +1529,20 @@ processNDPIFile(char * NDPIfilename, int shouldmakepreviewonly,
 	int32_t * availablendpizoffsets = NULL;
 	unsigned numberofavailablendpimagnifications = 0,
 	    numberofavailablendpizoffsets = 0;
-
-	in = TIFFOpen(NDPIfilename, "r");
+	SynthesizedMagnification * synthesizedmagnifications = NULL;
+	unsigned numberofsynthesizedmagnifications = 0, scaledenom = 1;
+	RestartMarkerIndex restartmarkerindex;
+	float highestndpimagnification = 0;
+	NDPIImageContext context;
+	int l, errorcode = 0;
+
+	in = TIFFOpen(NDPIfilename, shouldreadahead ? "rA" : "r");
 	if (in == NULL) {
 		fprintf(stderr, "Unable to open file \"%s\", ignoring it.\n",
 			NDPIfilename);
 		return 1;
 	}
+	readRestartMarkerIndex(NDPIfilename, &restartmarkerindex, verbose);
 
 	if (verbose)
 		fprintf(stderr, "Processing file \"%s\"\n",
@@ -743,14 +1594,7 @@ processNDPIFile(char * NDPIfilename, int shouldmakepreviewonly,
 					return (1);
 
 				imagesize = (tmsize_t) d.width * d.length;
-				if (previewimagesizelimit &&
-				    imagesize > previewimagesizelimit)
-					continue;
-				if (previewimagewidthlimit &&
-				    d.width > previewimagewidthlimit)
-					continue;
-				if (previewimagelengthlimit &&
-				    d.length > previewimagelengthlimit)
+				if (! fitsPreviewLimits(d.width, d.length))
 					continue;
 				if (imagesize >
 				    previewimagesize) {
@@ -779,34 +1623,71 @@ processNDPIFile(char * NDPIfilename, int shouldmakepreviewonly,
 		if (rewindToBeginningOfTIFF(in))
 			return (1);
 
+		if (shouldmakepreviewonly && previewimagesize == 0) {
+			/* If no available magnification fits the preview
+			 limits, one which is not available but can be
+			 synthesized by decoding an available one at 1/2, 1/4
+			 or 1/8 scale may make the preview image */
+			unsigned u, k;
+			float previewsourcemagnification = 0;
+
+			for (u = 0 ; u < numberofavailablendpimagnifications ;
+			    u++)
+				for (k = 2 ; k <= 8 ; k *= 2) {
+					MagnificationDescription * d =
+					    &availablendpimagnifications[u];
+					uint32_t width = (d->width + k-1) / k,
+					    length = (d->length + k-1) / k;
+					tmsize_t imagesize =
+					    (tmsize_t) width * length;
+
+					if (! fitsPreviewLimits(width, length) ||
+					    imagesize <= previewimagesize)
+						continue;
+					previewimagesize = imagesize;
+					ndpimagnificationofpreviewimage =
+					    d->magnification / k;
+					previewsourcemagnification =
+					    d->magnification;
+				}
+			if (previewsourcemagnification > 0 &&
+			    addToSetOfSynthesizedMagnifications(
+			    &synthesizedmagnifications,
+			    &numberofsynthesizedmagnifications,
+			    availablendpimagnifications,
+			    numberofavailablendpimagnifications,
+			    ndpimagnificationofpreviewimage))
+				return (1);
+		}
+
 		if (shouldmakepreviewonly && printcontroldata) {
-			printf("Factor from preview image to largest image:%f\n",
+			printControlData("Factor from preview image to largest image:%f\n",
 			    ndpimagnificationofpreviewimage ?
 				maxndpimagnification /
 				ndpimagnificationofpreviewimage :
 				0); /* todo: treat case when preview ==
 				      macro */
 			if (ndpimagnificationofpreviewimage)
-				printf("Type of preview image:%gx\n",
+				printControlData("Type of preview image:%gx\n",
 				    ndpimagnificationofpreviewimage);
 		}
 
 		if (printcontroldata) {
 			unsigned u;
-			printf("Found images at magnifications:");
+			printControlData("Found images at magnifications:");
 			for (u = 0 ; u < numberofavailablendpimagnifications ; u++)
-				printf("%gx,",
+				printControlData("%gx,",
 				    availablendpimagnifications[u].magnification);
-			printf("\nFound images of sizes:");
+			printControlData("\nFound images of sizes:");
 			for (u = 0 ; u < numberofavailablendpimagnifications ; u++)
-				printf("%ux%u,",
+				printControlData("%ux%u,",
 				    availablendpimagnifications[u].width,
 				    availablendpimagnifications[u].length);
-			printf("\nFound images at z-offsets:");
+			printControlData("\nFound images at z-offsets:");
 			for (u = 0 ; u < numberofavailablendpizoffsets ; u++)
-				printf(TIFF_INT32_FORMAT ",",
+				printControlData(TIFF_INT32_FORMAT ",",
 				    availablendpizoffsets[u]);
-			printf("\n");
+			printControlData("\n");
 		}
 
 	} else
@@ -895,301 +1776,1297 @@ processNDPIFile(char * NDPIfilename, int shouldmakepreviewonly,
 				yimagetomapratio);
 	}
 
-	do {
-		float ndpimagnification= getNDPIMagnification(in);
-		char *path;
-		int l;
-
-		l = strlen(NDPIfilename);
-		if ((NDPIfilename[l-1] == 'i' ||
-		     NDPIfilename[l-1] == 'I') &&
-		    (NDPIfilename[l-2] == 'p' ||
-		     NDPIfilename[l-2] == 'P') &&
-		    (NDPIfilename[l-3] == 'd' ||
-		     NDPIfilename[l-3] == 'D') &&
-		    (NDPIfilename[l-4] == 'n' ||
-		     NDPIfilename[l-4] == 'N') &&
-		    (NDPIfilename[l-5] == '.'))
-			NDPIfilename[l-5] = 0;
-
-		if (ndpimagnification == -1) {
-			int r;
-
-			if (shouldmakepreviewonly &&
-			    ndpimagnificationofpreviewimage != 0)
-				continue;
-			if (magnificationShouldNotBeExtracted(ndpimagnification,
-			    numberofmagnificationstoextract,
-			    magnificationstoextract))
-				continue;
-			if (numberofboxestoextract > 0)
-				continue;
-			/* TODO: if macroimagesize >
-			 previewimagesizelimit, create e.g. a black
-			 image with the right proportions */
-			my_asprintf(&path, "%s_macro%s",
-				NDPIfilename,
-				TIFF_SUFFIX);
-			if (verbose)
-				fprintf(stderr, "Extracting macroscopic image\n");
-			if (printcontroldata) {
-				printf("File containing macroscopic image:%s\n",
-				    path);
-				if (shouldmakepreviewonly)
-					printf(
-				    "Type of preview image:macroscopic\n"
-				    "File containing a preview image:%s\n",
-					    path);
-			}
-			r = writeOutTIFF(in, path, -2, 0, 0, 0, 0, 0,
-				(uint16_t) -1, splitimagecompressionformat);
-			if (r)
-				return r;
-		} else if (ndpimagnification == -2) {
-			int r;
-			if (magnificationShouldNotBeExtracted(ndpimagnification,
-			    numberofmagnificationstoextract,
-			    magnificationstoextract))
-				continue;
-			if (numberofboxestoextract > 0)
-				continue;
-			my_asprintf(&path, "%s_map%s",
-				NDPIfilename,
-				TIFF_SUFFIX);
-			if (verbose)
-				fprintf(stderr, "Extracting map of scanned zones\n");
-			if (printcontroldata)
-				printf("File containing map:%s\n",
-					path);
-			r = writeOutTIFF(in, path, -2, 0, 0, 0, 0, 0,
-				(uint16_t) -1, splitimagecompressionformat);
-			if (r)
-				return r;
-		} else if (! isnan(ndpimagnification)) {
-			int r;
-			uint32_t xunit, yunit;
-			int32_t ndpizoffset=0;
+	if (numberofmagnificationstoextract != (unsigned) -1 ||
+	    numberofboxestoextract > 0) {
+		/* Find which of the requested magnifications are not
+		 available and must be synthesized */
+		unsigned u, n;
 
-			if (shouldmakepreviewonly &&
-			    ndpimagnificationofpreviewimage !=
-			    ndpimagnification)
-				continue;
-			if (magnificationShouldNotBeExtracted(ndpimagnification,
-			    numberofmagnificationstoextract,
-			    magnificationstoextract))
-				continue;
+		if (numberofavailablendpimagnifications == 0 &&
+		    findAvailableMagnifications(in,
+		    &availablendpimagnifications,
+		    &numberofavailablendpimagnifications))
+			return (1);
 
-			if (! TIFFGetField(in, NDPITAG_ZOFFSET,
-				&ndpizoffset)) {
-				TIFFError(TIFFFileName(in),
-				"Error, z-Offset not found in NDPI file subdirectory");
-				(void) TIFFClose(in);
+		for (u = 0 ; numberofmagnificationstoextract !=
+		    (unsigned) -1 && u < numberofmagnificationstoextract ;
+		    u++)
+			if (addToSetOfSynthesizedMagnifications(
+			    &synthesizedmagnifications,
+			    &numberofsynthesizedmagnifications,
+			    availablendpimagnifications,
+			    numberofavailablendpimagnifications,
+			    magnificationstoextract[u]))
 				return (1);
-			}
+		for (n = 0 ; n < numberofboxestoextract ; n++) {
+			BoxToExtract * box= &(boxestoextract[n]);
+
+			for (u = 0 ; box->numberofmagnificationstoextract !=
+			    (unsigned) -1 &&
+			    u < box->numberofmagnificationstoextract ; u++)
+				if (addToSetOfSynthesizedMagnifications(
+				    &synthesizedmagnifications,
+				    &numberofsynthesizedmagnifications,
+				    availablendpimagnifications,
+				    numberofavailablendpimagnifications,
+				    box->magnificationstoextract[u]))
+					return (1);
+		}
+	}
 
-			if (zoffsetShouldNotBeExtracted(ndpizoffset,
-			    numberofzoffsetstoextract, zoffsetstoextract))
-				continue;
+	/* The pieces of mosaics that show no tissue are not made */
+	freeTissueMask(&tissuemask);
+	if (tissuefractionthreshold > 0 && shouldmakemosaicoffiles) {
+		float lowestndpimagnification = 0;
+		unsigned u;
+		int r;
+
+		if (numberofavailablendpimagnifications == 0 &&
+		    findAvailableMagnifications(in,
+		    &availablendpimagnifications,
+		    &numberofavailablendpimagnifications))
+			return (1);
+		for (u = 0 ; u < numberofavailablendpimagnifications ; u++)
+			if (lowestndpimagnification == 0 ||
+			    availablendpimagnifications[u].magnification <
+			    lowestndpimagnification)
+				lowestndpimagnification =
+				    availablendpimagnifications[u].magnification;
+		r = buildTissueMask(in, lowestndpimagnification, &tissuemask);
+		if (r < 0) {
+			if (availablendpimagnifications != NULL)
+				_TIFFfree(availablendpimagnifications);
+			if (availablendpizoffsets != NULL)
+				_TIFFfree(availablendpizoffsets);
+			if (scannedzoneboxes != NULL)
+				_TIFFfree(scannedzoneboxes);
+			if (synthesizedmagnifications != NULL)
+				_TIFFfree(synthesizedmagnifications);
+			freeRestartMarkerIndex(&restartmarkerindex);
+			return (1);
+		}
+		if (r > 0)
+			fprintf(stderr, "Unable to find tissue on the image at the lowest magnification of file \"%s\", all mosaic pieces will be made.\n",
+				NDPIfilename);
+	}
 
-			if (verbose)
-				fprintf(stderr, "Processing slice at magnification x%g at z-offset "
-					TIFF_INT32_FORMAT "\n",
-					ndpimagnification, ndpizoffset);
-
-			findUnitsAtMagnification(in, ndpimagnification, &xunit, &yunit);
-
-			if (numberofboxestoextract == 0 &&
-				(nscannedzones == 0 || xunit == 0 ||
-				yunit == 0)) {
-				/* If the image is so small compared to
-				 the largest available image that its
-				 dimensions are not divisors of the
-				 largest dimensions, or if there was an
-				 error during computation of the
-				 "units", don't subdivide, thus avoid
-				 rounding problems */
-				my_asprintf(&path, "%s_x%g_z"
-				    TIFF_INT32_FORMAT "%s",
-				    NDPIfilename,
-				    ndpimagnification,
-				    ndpizoffset, TIFF_SUFFIX);
-				r = writeOutTIFF(in, path, -2, 0, 0, 0, 0,
-					shouldmakemosaicoffiles,
-					mosaiccompressionformat,
-					splitimagecompressionformat);
-				if (printcontroldata)
-					printf(
-					    shouldmakepreviewonly ?
-				"File containing a preview image:%s\n" :
-				"File containing a TIFF scanned image:%s\n",
-						    path);
-				if (r)
-					return r;
-			} else if (numberofboxestoextract > 0) {
-				unsigned int n;
-				uint32_t width, length;
+	/* Blank lanes are given in lanes of the image at the highest
+	 * magnification */
+	if (shouldskipblanklanes)
+		highestndpimagnification =
+		    getHighestNDPIMagnification(NDPIfilename);
+
+	/* The names of the files written start with the name of the NDPI
+	 file without its suffix */
+	l = strlen(NDPIfilename);
+	if ((NDPIfilename[l-1] == 'i' ||
+	     NDPIfilename[l-1] == 'I') &&
+	    (NDPIfilename[l-2] == 'p' ||
+	     NDPIfilename[l-2] == 'P') &&
+	    (NDPIfilename[l-3] == 'd' ||
+	     NDPIfilename[l-3] == 'D') &&
+	    (NDPIfilename[l-4] == 'n' ||
+	     NDPIfilename[l-4] == 'N') &&
+	    (NDPIfilename[l-5] == '.'))
+		NDPIfilename[l-5] = 0;
+
+	context.NDPIfilename = NDPIfilename;
+	context.shouldmakepreviewonly = shouldmakepreviewonly;
+	context.ndpimagnificationofpreviewimage =
+	    ndpimagnificationofpreviewimage;
+	context.numberofboxestoextract = numberofboxestoextract;
+	context.boxestoextract = boxestoextract;
+	context.shouldmakemosaicoffiles = shouldmakemosaicoffiles;
+	context.mosaiccompressionformat = mosaiccompressionformat;
+	context.splitimagecompressionformat = splitimagecompressionformat;
+	context.highestndpimagnification = highestndpimagnification;
+	context.nscannedzones = nscannedzones;
+	context.scannedzoneboxes = scannedzoneboxes;
+	context.map_xmin = map_xmin;
+	context.map_ymin = map_ymin;
+	context.ximagetomapratio = ximagetomapratio;
+	context.yimagetomapratio = yimagetomapratio;
+
+	if (numberofimageworkers > 1)
+		errorcode = processNDPIImages(in, &context,
+		    &restartmarkerindex, synthesizedmagnifications,
+		    numberofsynthesizedmagnifications);
+	else
+		do {
+			useRestartMarkerIndex(in, &restartmarkerindex,
+			    shouldscanrestartmarkers, verbose);
+			errorcode = processNDPIImage(in, &context, scaledenom);
+			if (errorcode)
+				break;
+		} while (nextSynthesizedMagnification(in,
+		    synthesizedmagnifications,
+		    numberofsynthesizedmagnifications, &scaledenom) ||
+		    TIFFReadDirectory(in));
+	(void) TIFFClose(in);
+	freeTissueMask(&tissuemask);
+	freeBlankColumns(&blankcolumns);
+	if (availablendpimagnifications != NULL)
+		_TIFFfree(availablendpimagnifications);
+	if (availablendpizoffsets != NULL)
+		_TIFFfree(availablendpizoffsets);
+	if (scannedzoneboxes != NULL)
+		_TIFFfree(scannedzoneboxes);
+	if (synthesizedmagnifications != NULL)
+		_TIFFfree(synthesizedmagnifications);
+	freeRestartMarkerIndex(&restartmarkerindex);
+	return errorcode;
+}
 
-				if (getWidthAndLength(in, &width,
-					&length, ndpimagnification)) {
-					(void) TIFFClose(in);
-					return (1);
-				}
+	/* Processes the images of "in", from its current directory on,
+	 * with up to numberofimageworkers threads. The directories are
+	 * enumerated once, here; each thread clones "in" and reads
+	 * directly, at their offsets, the directories of the images it
+	 * takes, the largest first. Returns the error code of the first
+	 * image, in the order of the file, which failed, or 0. */
+static int
+processNDPIImages(TIFF * in, const NDPIImageContext * context,
+	RestartMarkerIndex * restartmarkerindex,
+	const SynthesizedMagnification * synthesizedmagnifications,
+	unsigned numberofsynthesizedmagnifications)
+{
+	ImageQueue queue;
+	unsigned numberofworkers = numberofimageworkers, u;
+	int errorcode = 0;
+#ifdef HAVE_PTHREAD
+	pthread_t * workers = NULL;
+#endif
 
-				for (n = 0 ; n < numberofboxestoextract ; n++) {
-					uint32_t xmin, xnextmax, ymin, ynextmax;
-					int fd;
-					BoxToExtract * box=
-						&(boxestoextract[n]);
+	_TIFFmemset(&queue, 0, sizeof(ImageQueue));
+	queue.in = in;
+	queue.context = context;
+	queue.restartmarkerindex = restartmarkerindex;
 
-					if (magnificationShouldNotBeExtracted(
-					    ndpimagnification,
-			    		    box->numberofmagnificationstoextract,
-					    box->magnificationstoextract))
-						continue;
-					if (zoffsetShouldNotBeExtracted(
-					    ndpizoffset,
-			    		    box->numberofzoffsetstoextract,
-					    box->zoffsetstoextract))
-						continue;
+	do {
+		uint32_t width = 0, length = 0;
+		unsigned scaledenom = 1;
 
-					if (box->relwidth == 0 &&
-					    box->rellength == 0) {
-						xmin = box->xmin;
-						xnextmax = box->xmin+box->width;
-						ymin = box->ymin;
-						ynextmax = box->ymin+box->length;
-					} else {
-						xmin= my_floor(width*box->relxmin);
-						xnextmax= my_ceil(width*
-						    (box->relxmin+box->relwidth));
-						ymin= my_floor(length*box->relymin);
-						ynextmax= my_ceil(length*
-						    (box->relymin+box->rellength));
-					}
+		TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &width);
+		TIFFGetField(in, TIFFTAG_IMAGELENGTH, &length);
+		do {
+			ImageTask * task = extendArrayOfImageTasks(
+			    &queue.tasks, &queue.numberoftasks,
+			    "images to process");
 
-					if (xmin >= width || ymin >= length) {
-						if (verbose >= 3)
-							fprintf(stderr,
-							    " Box to extract is outside of the image -- no extraction done.\n");
-						continue;
-					}
+			if (task == NULL)
+				return (1);
+			task->diroffset = TIFFCurrentDirOffset(in);
+			task->scaledenom = scaledenom;
+			task->numberofpixels = (uint64_t)
+			    ((width + scaledenom-1) / scaledenom) *
+			    ((length + scaledenom-1) / scaledenom);
+			task->errorcode = 0;
+			task->controldata = NULL;
+		} while (nextSynthesizedMagnification(in,
+		    synthesizedmagnifications,
+		    numberofsynthesizedmagnifications, &scaledenom));
+	} while (TIFFReadDirectory(in));
+
+	queue.schedule = _TIFFmalloc(queue.numberoftasks *
+	    sizeof(ImageTask*));
+	if (queue.schedule == NULL) {
+		fprintf(stderr, "Error: insufficient memory for images to process.\n");
+		_TIFFfree(queue.tasks);
+		return (1);
+	}
+	for (u = 0 ; u < queue.numberoftasks ; u++)
+		queue.schedule[u] = &(queue.tasks[u]);
+	qsort(queue.schedule, queue.numberoftasks, sizeof(ImageTask*),
+	    compareImageTasksBySize);
+
+	/* The tissue mask is only read by the threads */
+	queue.tissuemask = tissuemask;
+	tissuemask.istissue = NULL;
+
+	if (numberofworkers > queue.numberoftasks)
+		numberofworkers = queue.numberoftasks;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&queue.mutex, NULL);
+	if (numberofworkers > 1)
+		workers = _TIFFmalloc(numberofworkers * sizeof(pthread_t));
+	for (u = 0 ; u+1 < numberofworkers && workers != NULL ; u++)
+		if (pthread_create(&workers[u], NULL,
+		    processImagesOfQueue, &queue) != 0)
+			break;
+	if (verbose >= 2 && u > 0)
+		fprintf(stderr, "Processing up to %u images at once\n",
+			u+1);
+	processImagesOfQueue(&queue);
+	while (u-- > 0)
+		pthread_join(workers[u], NULL);
+	if (workers != NULL)
+		_TIFFfree(workers);
+	pthread_mutex_destroy(&queue.mutex);
+#else
+	processImagesOfQueue(&queue);
+#endif
+	tissuemask = queue.tissuemask;
+
+	/* The -K output is given in the order of the file */
+	for (u = 0 ; u < queue.numberoftasks ; u++) {
+		MemoryFile * memfile = queue.tasks[u].controldata;
+
+		if (memfile != NULL) {
+			if (controldata != NULL)
+				(void) writeToMemoryFile(controldata,
+				    memfile->data, memfile->size);
+			else if (memfile->size > 0)
+				fwrite(memfile->data, 1, memfile->size,
+				    stdout);
+			freeMemoryFile(memfile);
+		}
+		if (errorcode == 0)
+			errorcode = queue.tasks[u].errorcode;
+	}
+	_TIFFfree(queue.schedule);
+	_TIFFfree(queue.tasks);
+	return errorcode;
+}
+
+	/* Takes the next image of the queue and processes it, until there
+	 * are no more images or one of them failed */
+static void*
+processImagesOfQueue(void * arg)
+{
+	ImageQueue * queue = (ImageQueue*) arg;
+	MemoryFile * filecontroldata = controldata;
+	TIFF * in = NULL;
+
+	tissuemask = queue->tissuemask;
+	for (;;) {
+		ImageTask * task = NULL;
+
+		lockImageQueue(queue);
+		if (queue->next < queue->numberoftasks && ! queue->haserror)
+			task = queue->schedule[queue->next++];
+		unlockImageQueue(queue);
+		if (task == NULL)
+			break;
+
+		if (in == NULL) {
+			lockImageQueue(queue);
+			in = TIFFCloneHandle(queue->in);
+			unlockImageQueue(queue);
+		}
+		if (in == NULL || ! TIFFSetSubDirectory(in, task->diroffset)) {
+			fprintf(stderr, "Unable to read the image at offset "
+				TIFF_UINT64_FORMAT " of file \"%s\".\n",
+				task->diroffset, TIFFFileName(queue->in));
+			task->errorcode = 1;
+		} else {
+			/* The index may be completed and written again */
+			lockImageQueue(queue);
+			useRestartMarkerIndex(in, queue->restartmarkerindex,
+			    shouldscanrestartmarkers, verbose);
+			unlockImageQueue(queue);
+
+			if (printcontroldata)
+				controldata = task->controldata =
+				    newMemoryFile();
+			task->errorcode = processNDPIImage(in, queue->context,
+			    task->scaledenom);
+			controldata = filecontroldata;
+			/* The names reserved for the boxes of the image
+			 * can't be taken by the other images */
+			releaseReservedFileNames();
+		}
+
+		if (task->errorcode) {
+			lockImageQueue(queue);
+			queue->haserror = 1;
+			unlockImageQueue(queue);
+		}
+	}
+	if (in != NULL)
+		(void) TIFFClose(in);
+	freeBlankColumns(&blankcolumns);
+	tissuemask.istissue = NULL;
+	return NULL;
+}
+
+static int
+compareImageTasksBySize(const void * a, const void * b)
+{
+	const ImageTask * ta = *(const ImageTask * const *) a;
+	const ImageTask * tb = *(const ImageTask * const *) b;
+
+	if (ta->numberofpixels != tb->numberofpixels)
+		return ta->numberofpixels > tb->numberofpixels ? -1 : 1;
+	return ta < tb ? -1 : ta > tb ? 1 : 0;
+}
+
+static void
+lockImageQueue(ImageQueue * queue)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&queue->mutex);
+#else
+	(void) queue;
+#endif
+}
+
+static void
+unlockImageQueue(ImageQueue * queue)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&queue->mutex);
+#else
+	(void) queue;
+#endif
+}
+
+	/* Extracts what is required from the current image of "in", at 1 /
+	 * scaledenom scale. Returns 0 if it was done or not required,
+	 * otherwise an error code for processNDPIFile to return. */
+static int
+processNDPIImage(TIFF * in, const NDPIImageContext * context,
+	unsigned scaledenom)
+{
+	/* scaledenom > 1 when synthesizing a magnification which
+	 is not available from the current image */
+	float ndpimagnification= getNDPIMagnification(in) /
+		scaledenom;
+	char *path;
+	char * NDPIfilename = context->NDPIfilename;
+	int shouldmakepreviewonly = context->shouldmakepreviewonly;
+	float ndpimagnificationofpreviewimage =
+	    context->ndpimagnificationofpreviewimage;
+	unsigned numberofboxestoextract = context->numberofboxestoextract;
+	BoxToExtract * boxestoextract = context->boxestoextract;
+	int shouldmakemosaicoffiles = context->shouldmakemosaicoffiles;
+	uint16_t mosaiccompressionformat = context->mosaiccompressionformat,
+	    splitimagecompressionformat = context->splitimagecompressionformat;
+	float highestndpimagnification = context->highestndpimagnification;
+	unsigned int nscannedzones = context->nscannedzones;
+	const ScannedZoneBox * scannedzoneboxes = context->scannedzoneboxes;
+	uint32_t map_xmin = context->map_xmin, map_ymin = context->map_ymin;
+	double ximagetomapratio = context->ximagetomapratio,
+	    yimagetomapratio = context->yimagetomapratio;
+
+	freeBlankColumns(&blankcolumns);
+
+	if (ndpimagnification == -1) {
+		int r;
+
+		if (shouldmakepreviewonly &&
+		    ndpimagnificationofpreviewimage != 0)
+			return (0);
+		if (magnificationShouldNotBeExtracted(ndpimagnification,
+		    numberofmagnificationstoextract,
+		    magnificationstoextract))
+			return (0);
+		if (numberofboxestoextract > 0)
+			return (0);
+		/* TODO: if macroimagesize >
+		 previewimagesizelimit, create e.g. a black
+		 image with the right proportions */
+		my_asprintf(&path, "%s_macro%s",
+			NDPIfilename,
+			TIFF_SUFFIX);
+		if (verbose)
+			fprintf(stderr, "Extracting macroscopic image\n");
+		if (printcontroldata) {
+			printControlData("File containing macroscopic image:%s\n",
+			    path);
+			if (shouldmakepreviewonly)
+				printControlData(
+			    "Type of preview image:macroscopic\n"
+			    "File containing a preview image:%s\n",
+				    path);
+		}
+		r = writeOutTIFF(in, path, -2, 0, 0, 0, 0, 1, 0,
+			(uint16_t) -1, splitimagecompressionformat);
+		if (r)
+			return r;
+	} else if (ndpimagnification == -2) {
+		int r;
+		if (magnificationShouldNotBeExtracted(ndpimagnification,
+		    numberofmagnificationstoextract,
+		    magnificationstoextract))
+			return (0);
+		if (numberofboxestoextract > 0)
+			return (0);
+		my_asprintf(&path, "%s_map%s",
+			NDPIfilename,
+			TIFF_SUFFIX);
+		if (verbose)
+			fprintf(stderr, "Extracting map of scanned zones\n");
+		if (printcontroldata)
+			printControlData("File containing map:%s\n",
+				path);
+		r = writeOutTIFF(in, path, -2, 0, 0, 0, 0, 1, 0,
+			(uint16_t) -1, splitimagecompressionformat);
+		if (r)
+			return r;
+	} else if (! isnan(ndpimagnification)) {
+		int r;
+		uint32_t xunit, yunit;
+		int32_t ndpizoffset=0;
+
+		if (shouldmakepreviewonly &&
+		    ndpimagnificationofpreviewimage !=
+		    ndpimagnification)
+			return (0);
+		if (magnificationShouldNotBeExtracted(ndpimagnification,
+		    numberofmagnificationstoextract,
+		    magnificationstoextract))
+			return (0);
 
-					if (verbose >= 3) {
-						fprintf(stderr, " Box to extract %u, ",
-							n);
+		if (! TIFFGetField(in, NDPITAG_ZOFFSET,
+			&ndpizoffset)) {
+			TIFFError(TIFFFileName(in),
+			"Error, z-Offset not found in NDPI file subdirectory");
+			return (1);
+		}
 
-						if (box->label == NULL)
-							fprintf(stderr,
-								"no label");
-						else
-							fprintf(stderr,
-								"label=\"%s\"",
-								box->label);
+		if (zoffsetShouldNotBeExtracted(ndpizoffset,
+		    numberofzoffsetstoextract, zoffsetstoextract))
+			return (0);
 
+		if (scaledenom > 1 &&
+		    ! canDecodeScaledStrips(in, scaledenom)) {
+			fprintf(stderr, "Unable to synthesize magnification x%g from the image at magnification x%g of file \"%s\", ignoring it.\n",
+				ndpimagnification,
+				ndpimagnification * scaledenom,
+				NDPIfilename);
+			return (0);
+		}
+
+		if (verbose)
+			fprintf(stderr, scaledenom > 1 ?
+				"Processing slice at magnification x%g at z-offset "
+				TIFF_INT32_FORMAT " (synthesized from x%g)\n" :
+				"Processing slice at magnification x%g at z-offset "
+				TIFF_INT32_FORMAT "\n",
+				ndpimagnification, ndpizoffset,
+				ndpimagnification * scaledenom);
+
+		findUnitsAtMagnification(in, ndpimagnification, &xunit, &yunit);
+
+		if (tissuemask.istissue != NULL) {
+			if (getWidthAndLength(in,
+			    &tissuemask.imagewidth,
+			    &tissuemask.imagelength,
+			    ndpimagnification)) {
+				return (1);
+			}
+			tissuemask.imagewidth = (tissuemask.imagewidth +
+			    scaledenom-1) / scaledenom;
+			tissuemask.imagelength =
+			    (tissuemask.imagelength + scaledenom-1) /
+			    scaledenom;
+		}
+
+		if (highestndpimagnification > 0) {
+			uint32_t width, length;
+
+			if (getWidthAndLength(in, &width, &length,
+			    ndpimagnification) ||
+			    !getBlankColumns(in,
+			    (width + scaledenom-1) / scaledenom,
+			    NDPI_LANE_WIDTH * ndpimagnification /
+			    highestndpimagnification, &blankcolumns)) {
+				return (1);
+			}
+			if (verbose >= 2 && blankcolumns.count > 0)
+				fprintf(stderr, "Skipping %u span(s) of columns in blank lanes\n",
+					blankcolumns.count);
+		}
+
+		if (numberofboxestoextract == 0 &&
+			(nscannedzones == 0 || xunit == 0 ||
+			yunit == 0)) {
+			/* If the image is so small compared to
+			 the largest available image that its
+			 dimensions are not divisors of the
+			 largest dimensions, or if there was an
+			 error during computation of the
+			 "units", don't subdivide, thus avoid
+			 rounding problems */
+			my_asprintf(&path, "%s_x%g_z"
+			    TIFF_INT32_FORMAT "%s",
+			    NDPIfilename,
+			    ndpimagnification,
+			    ndpizoffset, TIFF_SUFFIX);
+			r = writeOutTIFF(in, path, -2, 0, 0, 0, 0,
+				scaledenom, shouldmakemosaicoffiles,
+				mosaiccompressionformat,
+				splitimagecompressionformat);
+			if (printcontroldata && r == 0)
+				printControlData(
+				    shouldmakepreviewonly ?
+			"File containing a preview image:%s\n" :
+			"File containing a TIFF scanned image:%s\n",
+					    path);
+			if (r < 0)
+				return r;
+		} else if (numberofboxestoextract > 0) {
+			unsigned int n;
+			uint32_t width, length;
+			/* The boxes of an image that is not tiled are
+			 * cropped together, in one pass */
+			int shouldcropboxestogether = scaledenom == 1 &&
+			    ! TIFFIsTiled(in) &&
+			    ! (shouldmakemosaicoffiles &&
+			    shouldmakemosaicdirectly);
+			unsigned numberofcrops = 0;
+			BoxCrop * crops = NULL;
+
+			if (getWidthAndLength(in, &width,
+				&length, ndpimagnification)) {
+				return (1);
+			}
+			width = (width + scaledenom-1) / scaledenom;
+			length = (length + scaledenom-1) / scaledenom;
+
+			for (n = 0 ; n < numberofboxestoextract ; n++) {
+				uint32_t xmin, xnextmax, ymin, ynextmax;
+				int fd;
+				BoxToExtract * box=
+					&(boxestoextract[n]);
+
+				if (magnificationShouldNotBeExtracted(
+				    ndpimagnification,
+		    		    box->numberofmagnificationstoextract,
+				    box->magnificationstoextract))
+					continue;
+				if (zoffsetShouldNotBeExtracted(
+				    ndpizoffset,
+		    		    box->numberofzoffsetstoextract,
+				    box->zoffsetstoextract))
+					continue;
+
+				if (box->relwidth == 0 &&
+				    box->rellength == 0) {
+					xmin = box->xmin;
+					xnextmax = box->xmin+box->width;
+					ymin = box->ymin;
+					ynextmax = box->ymin+box->length;
+				} else {
+					xmin= my_floor(width*box->relxmin);
+					xnextmax= my_ceil(width*
+					    (box->relxmin+box->relwidth));
+					ymin= my_floor(length*box->relymin);
+					ynextmax= my_ceil(length*
+					    (box->relymin+box->rellength));
+				}
+
+				if (xmin >= width || ymin >= length) {
+					if (verbose >= 3)
 						fprintf(stderr,
-							", relxmin=%f relymin=%f"
-							" relwidth=%f rellength=%f"
-							" -> xmin=" TIFF_UINT32_FORMAT
-							" xmax=" TIFF_UINT32_FORMAT
-							", ymin=" TIFF_UINT32_FORMAT
-							" ymax=" TIFF_UINT32_FORMAT
-							"\n",
-							box->relxmin,
-							box->relymin,
-							box->relwidth,
-							box->rellength,
-							xmin, xnextmax-1, ymin, ynextmax-1);
-					}
+						    " Box to extract is outside of the image -- no extraction done.\n");
+					continue;
+				}
+
+				if (verbose >= 3) {
+					fprintf(stderr, " Box to extract %u, ",
+						n);
 
-					fd= buildFileNameForExtract(
-						NDPIfilename,
-						ndpimagnification,
-						ndpizoffset,
-						box->label, &path);
-
-					if (verbose >= 2)
-						fprintf(stderr, "  Writing to \"%s\"...\n",
-							path);
-
-					r = writeOutTIFF(in, path, fd,
-					    xmin, ymin,
- 					    xnextmax-xmin, ynextmax-ymin,
-					    shouldmakemosaicoffiles,
-					    mosaiccompressionformat,
-					    splitimagecompressionformat);
-					if (printcontroldata)
-						printf(
-				"File containing a TIFF scanned image:%s\n",
-						    path);
-					_TIFFfree(path);
-					if (r)
-						return r;
+					if (box->label == NULL)
+						fprintf(stderr,
+							"no label");
+					else
+						fprintf(stderr,
+							"label=\"%s\"",
+							box->label);
+
+					fprintf(stderr,
+						", relxmin=%f relymin=%f"
+						" relwidth=%f rellength=%f"
+						" -> xmin=" TIFF_UINT32_FORMAT
+						" xmax=" TIFF_UINT32_FORMAT
+						", ymin=" TIFF_UINT32_FORMAT
+						" ymax=" TIFF_UINT32_FORMAT
+						"\n",
+						box->relxmin,
+						box->relymin,
+						box->relwidth,
+						box->rellength,
+						xmin, xnextmax-1, ymin, ynextmax-1);
 				}
-			} else {
-				unsigned int n;
 
-				for (n = 0 ; n < nscannedzones ; n++) {
-					uint32_t xmin, xnextmax, ymin, ynextmax;
+				fd= buildFileNameForExtract(
+					NDPIfilename,
+					ndpimagnification,
+					ndpizoffset,
+					box->label, &path);
 
-					if (scannedzoneboxes[n].isempty)
-						continue;
+				if (verbose >= 2)
+					fprintf(stderr, "  Writing to \"%s\"...\n",
+						path);
+
+				if (shouldcropboxestogether &&
+				    xnextmax > xmin && ynextmax > ymin) {
+					BoxCrop * crop =
+					    extendArrayOfBoxCrops(
+					    &crops, &numberofcrops,
+					    "boxes to extract");
+					if (crop == NULL)
+						return (-4);
+					if (fd >= 0)
+						close(fd);
+					crop->path = path;
+					crop->xmin = xmin;
+					crop->ymin = ymin;
+					crop->width = xnextmax-xmin;
+					crop->length = ynextmax-ymin;
+					continue;
+				}
+
+				r = writeOutTIFF(in, path, fd,
+				    xmin, ymin,
+ 				    xnextmax-xmin, ynextmax-ymin,
+				    scaledenom, shouldmakemosaicoffiles,
+				    mosaiccompressionformat,
+				    splitimagecompressionformat);
+				if (printcontroldata && r == 0)
+					printControlData(
+			"File containing a TIFF scanned image:%s\n",
+					    path);
+				_TIFFfree(path);
+				if (r < 0)
+					return r;
+			}
 
-					xmin= floor(ximagetomapratio*(scannedzoneboxes[n].map_xmin - map_xmin)) * 31 * xunit;
-					xnextmax= ceil(ximagetomapratio*(scannedzoneboxes[n].map_xmax+1 - map_xmin)) * 31 * xunit;
-					ymin= floor(yimagetomapratio*(scannedzoneboxes[n].map_ymin - map_ymin)) * yunit;
-					ynextmax= ceil(yimagetomapratio*(scannedzoneboxes[n].map_ymax+1 - map_ymin)) * yunit;
-
-					if (verbose >= 3) {
-						fprintf(stderr, "  Scanned zone %u, "
-							"map_xmin=" TIFF_UINT32_FORMAT " map_xmax=" TIFF_UINT32_FORMAT
-							" map_ymin=" TIFF_UINT32_FORMAT " map_ymax=" TIFF_UINT32_FORMAT
-							" -> xmin=" TIFF_UINT32_FORMAT " xmax=" TIFF_UINT32_FORMAT
-							", ymin=" TIFF_UINT32_FORMAT " ymax=" TIFF_UINT32_FORMAT "\n",
-							n,
-							scannedzoneboxes[n].map_xmin,
-							scannedzoneboxes[n].map_xmax,
-							scannedzoneboxes[n].map_ymin,
-							scannedzoneboxes[n].map_ymax,
-							xmin, xnextmax-1, ymin, ynextmax-1);
-
-						fprintf(stderr, "  (xunit=" TIFF_UINT32_FORMAT " xmin=floor(%f)*xunit xnextmax=ceil(%f)*xunit)\n",
-							xunit, 1./7*(scannedzoneboxes[n].map_xmin - map_xmin),
-							1./7*(scannedzoneboxes[n].map_xmax+1 - map_xmin) );
-						fprintf(stderr, "  (yunit=" TIFF_UINT32_FORMAT " ymin=floor(%f)*yunit ynextmax=ceil(%f)*yunit)\n",
-							yunit, 2.25*(scannedzoneboxes[n].map_ymin - map_ymin),
-							2.25*(scannedzoneboxes[n].map_ymax+1 - map_ymin) );
+			if (numberofcrops > 0) {
+				r = 0;
+				(void) cropBoxesFromStrips(in, crops,
+				    numberofcrops,
+				    splitimagecompressionformat);
+				for (n = 0 ; n < numberofcrops ; n++) {
+					BoxCrop * crop = &(crops[n]);
+
+					if (r == 0) {
+						r = crop->status;
+						if (r == 0 &&
+						    shouldmakemosaicoffiles)
+							r = makeMosaicOfSplitImage(
+							    in, NULL,
+							    crop->path,
+							    crop->xmin,
+							    crop->ymin,
+							    crop->length,
+							    scaledenom,
+							    shouldmakemosaicoffiles,
+							    mosaiccompressionformat);
+						if (printcontroldata &&
+						    r == 0)
+							printControlData(
+			"File containing a TIFF scanned image:%s\n",
+							    crop->path);
 					}
+					_TIFFfree(crop->path);
+				}
+				_TIFFfree(crops);
+				if (r < 0)
+					return r;
+			}
+		} else {
+			unsigned int n;
+
+			for (n = 0 ; n < nscannedzones ; n++) {
+				uint32_t xmin, xnextmax, ymin, ynextmax;
+
+				if (scannedzoneboxes[n].isempty)
+					continue;
 
-					my_asprintf(&path, "%s_x%g_z" TIFF_INT32_FORMAT
-					    "_roi%u%s",
-					    NDPIfilename,
-					    ndpimagnification,
-					    ndpizoffset, n+1,
-					    TIFF_SUFFIX);
-
-					if (verbose >= 2)
-						fprintf(stderr, "  Writing to \"%s\"...\n",
-							path);
-
-					r = writeOutTIFF(in, path, -2,
-					    xmin, ymin,
- 					    xnextmax-xmin, ynextmax-ymin,
-					    shouldmakemosaicoffiles,
-					    mosaiccompressionformat,
-					    splitimagecompressionformat);
-					if (printcontroldata)
-						printf(
-				"File containing a TIFF scanned image:%s\n",
-						    path);
-					_TIFFfree(path);
-					if (r)
-						return r;
+				xmin= floor(ximagetomapratio*(scannedzoneboxes[n].map_xmin - map_xmin)) * 31 * xunit;
+				xnextmax= ceil(ximagetomapratio*(scannedzoneboxes[n].map_xmax+1 - map_xmin)) * 31 * xunit;
+				ymin= floor(yimagetomapratio*(scannedzoneboxes[n].map_ymin - map_ymin)) * yunit;
+				ynextmax= ceil(yimagetomapratio*(scannedzoneboxes[n].map_ymax+1 - map_ymin)) * yunit;
+
+				if (verbose >= 3) {
+					fprintf(stderr, "  Scanned zone %u, "
+						"map_xmin=" TIFF_UINT32_FORMAT " map_xmax=" TIFF_UINT32_FORMAT
+						" map_ymin=" TIFF_UINT32_FORMAT " map_ymax=" TIFF_UINT32_FORMAT
+						" -> xmin=" TIFF_UINT32_FORMAT " xmax=" TIFF_UINT32_FORMAT
+						", ymin=" TIFF_UINT32_FORMAT " ymax=" TIFF_UINT32_FORMAT "\n",
+						n,
+						scannedzoneboxes[n].map_xmin,
+						scannedzoneboxes[n].map_xmax,
+						scannedzoneboxes[n].map_ymin,
+						scannedzoneboxes[n].map_ymax,
+						xmin, xnextmax-1, ymin, ynextmax-1);
+
+					fprintf(stderr, "  (xunit=" TIFF_UINT32_FORMAT " xmin=floor(%f)*xunit xnextmax=ceil(%f)*xunit)\n",
+						xunit, 1./7*(scannedzoneboxes[n].map_xmin - map_xmin),
+						1./7*(scannedzoneboxes[n].map_xmax+1 - map_xmin) );
+					fprintf(stderr, "  (yunit=" TIFF_UINT32_FORMAT " ymin=floor(%f)*yunit ynextmax=ceil(%f)*yunit)\n",
+						yunit, 2.25*(scannedzoneboxes[n].map_ymin - map_ymin),
+						2.25*(scannedzoneboxes[n].map_ymax+1 - map_ymin) );
 				}
+
+				my_asprintf(&path, "%s_x%g_z" TIFF_INT32_FORMAT
+				    "_roi%u%s",
+				    NDPIfilename,
+				    ndpimagnification,
+				    ndpizoffset, n+1,
+				    TIFF_SUFFIX);
+
+				if (verbose >= 2)
+					fprintf(stderr, "  Writing to \"%s\"...\n",
+						path);
+
+				r = writeOutTIFF(in, path, -2,
+				    xmin, ymin,
+ 				    xnextmax-xmin, ynextmax-ymin,
+				    scaledenom, shouldmakemosaicoffiles,
+				    mosaiccompressionformat,
+				    splitimagecompressionformat);
+				if (printcontroldata && r == 0)
+					printControlData(
+			"File containing a TIFF scanned image:%s\n",
+					    path);
+				_TIFFfree(path);
+				if (r < 0)
+					return r;
 			}
 		}
+	}
+	return (0);
+}
+
+	/* Makes, for each z-offset to extract, the Deep Zoom pyramid of the
+	 * image at the highest magnification. The images of the NDPI file
+	 * are read with handles of their own. */
+static int
+makeDeepZoomPyramids(const char * NDPIfilename)
+{
+	TIFF * in;
+	DeepZoomSource * sources = NULL;
+	unsigned numberofsources = 0, dirnumber = 0, u, v;
+	char * stem;
+	int l, errorcode = 0;
+
+	in = TIFFOpen(NDPIfilename, shouldreadahead ? "rA" : "r");
+	if (in == NULL) {
+		fprintf(stderr, "Unable to open file \"%s\", ignoring it.\n",
+			NDPIfilename);
+		return 1;
+	}
+
+	if (verbose)
+		fprintf(stderr, "Processing file \"%s\"\n",
+			NDPIfilename);
+
+	do {
+		DeepZoomSource s;
+
+		s.dirnumber = dirnumber++;
+		if (! TIFFGetField(in, NDPITAG_MAGNIFICATION,
+		    &s.magnification) || s.magnification <= 0)
+			continue;
+		if (getWidthAndLength(in, &s.width, &s.length,
+		    s.magnification)) {
+			errorcode = 1;
+			break;
+		}
+		if (! TIFFGetField(in, NDPITAG_ZOFFSET, &s.zoffset)) {
+			TIFFError(TIFFFileName(in),
+			"Error, z-Offset not found in NDPI file subdirectory");
+			errorcode = 1;
+			break;
+		}
+		if (extendArrayOfDeepZoomSources(&sources, &numberofsources,
+		    "images of the NDPI file") == NULL) {
+			errorcode = 1;
+			break;
+		}
+		sources[numberofsources-1] = s;
 	} while (TIFFReadDirectory(in));
 	(void) TIFFClose(in);
-	return (0);
+
+	my_asprintf(&stem, "%s", NDPIfilename);
+	l = strlen(stem);
+	if (l >= 5 && strcasecmp(stem + l - 5, ".ndpi") == 0)
+		stem[l-5] = 0;
+
+	for (u = 0 ; errorcode == 0 && u < numberofsources ; u++) {
+		const DeepZoomSource * top = &sources[u];
+		char * basename;
+
+		if (zoffsetShouldNotBeExtracted(top->zoffset,
+		    numberofzoffsetstoextract, zoffsetstoextract))
+			continue;
+		/* Only the first image at the highest magnification of
+		 * each z-offset makes a pyramid */
+		for (v = 0 ; v < numberofsources ; v++)
+			if (sources[v].zoffset == top->zoffset &&
+			    (sources[v].magnification > top->magnification ||
+			    (sources[v].magnification == top->magnification &&
+			    v < u)))
+				break;
+		if (v < numberofsources)
+			continue;
+
+		my_asprintf(&basename, "%s_x%g_z" TIFF_INT32_FORMAT, stem,
+			top->magnification, top->zoffset);
+		if (! makeDeepZoomPyramid(NDPIfilename, basename, sources,
+		    numberofsources, top))
+			errorcode = 1;
+		_TIFFfree(basename);
+	}
+
+	_TIFFfree(stem);
+	if (sources != NULL)
+		_TIFFfree(sources);
+	return errorcode;
+}
+
+	/* Makes the Deep Zoom pyramid of image top into the descriptor
+	 * basename.dzi and the directory basename_files, which holds one
+	 * directory of tiles per level. A level is read from an image of
+	 * the same z-offset and size (up to one pixel more) if there is
+	 * one; otherwise it is made, as the rows of the level above come,
+	 * by averaging them 2x2 pixels at a time. Returns 1 on success, 0
+	 * on error. */
+static int
+makeDeepZoomPyramid(const char * NDPIfilename, const char * basename,
+	const DeepZoomSource * sources, unsigned numberofsources,
+	const DeepZoomSource * top)
+{
+	DeepZoomPyramid pyramid;
+	TIFF * in;
+	uint16_t spp = 0, bitspersample = 0, planarconfig = 0, compression;
+	uint32_t width, length;
+	unsigned k, u;
+	char * path;
+	FILE * f;
+
+	in = openNDPIDirectory(NDPIfilename, top->dirnumber);
+	if (in == NULL) {
+		fprintf(stderr, "Unable to read the image at magnification %gx of file \"%s\".\n",
+			top->magnification, NDPIfilename);
+		return 0;
+	}
+	(void) TIFFGetFieldDefaulted(in, TIFFTAG_SAMPLESPERPIXEL, &spp);
+	(void) TIFFGetFieldDefaulted(in, TIFFTAG_BITSPERSAMPLE,
+	    &bitspersample);
+	(void) TIFFGetFieldDefaulted(in, TIFFTAG_PLANARCONFIG,
+	    &planarconfig);
+	(void) TIFFGetField(in, TIFFTAG_COMPRESSION, &compression);
+	pyramid.quality = mosaic_JPEG_quality;
+	if (pyramid.quality <= 0) {
+		pyramid.quality = default_JPEG_quality;
+		if (compression == COMPRESSION_JPEG)
+			TIFFGetField(in, TIFFTAG_JPEGQUALITY,
+			    &pyramid.quality);
+	}
+	(void) TIFFClose(in);
+	if (bitspersample != 8 || (spp != 1 && spp != 3) ||
+	    (spp > 1 && planarconfig != PLANARCONFIG_CONTIG)) {
+		fprintf(stderr, "Unable to make a Deep Zoom pyramid of the image at magnification %gx of file \"%s\": only 8-bit gray or contiguous RGB images are supported.\n",
+			top->magnification, NDPIfilename);
+		return 0;
+	}
+
+	pyramid.tilesize = deepzoomtilesize;
+	pyramid.overlap = deepzoomoverlap;
+	pyramid.bytesperpixel = spp;
+	pyramid.status = 1;
+	pyramid.numberoflevels = 1;
+	for (width = top->width, length = top->length ;
+	    width > 1 || length > 1 ; pyramid.numberoflevels++) {
+		width = (width + 1) / 2;
+		length = (length + 1) / 2;
+	}
+	pyramid.levels = _TIFFmalloc(pyramid.numberoflevels *
+	    sizeof(DeepZoomLevel));
+	if (pyramid.levels == NULL) {
+		fprintf(stderr, "Not enough memory for the Deep Zoom pyramid \"%s\".\n",
+			basename);
+		return 0;
+	}
+	_TIFFmemset(pyramid.levels, 0, pyramid.numberoflevels *
+	    sizeof(DeepZoomLevel));
+	my_asprintf(&pyramid.filesdirectory, "%s%s", basename,
+		DEEPZOOM_DIRECTORY_SUFFIX);
+	if (! makeDirectory(pyramid.filesdirectory))
+		pyramid.status = 0;
+
+	if (verbose)
+		fprintf(stderr, "Making Deep Zoom pyramid \"%s%s\" of %u levels from the image at magnification %gx, z-offset " TIFF_INT32_FORMAT "\n",
+			basename, DEEPZOOM_SUFFIX, pyramid.numberoflevels,
+			top->magnification, top->zoffset);
+
+	width = top->width;
+	length = top->length;
+	for (k = pyramid.numberoflevels ; k-- > 0 ; ) {
+		DeepZoomLevel * level = &pyramid.levels[k];
+		uint32_t bandlength = pyramid.tilesize + 2 * pyramid.overlap;
+
+		MIN(bandlength, length);
+		level->width = width;
+		level->length = length;
+		level->rowsizeinbytes = (tmsize_t) width * spp;
+		for (u = 0 ; u < numberofsources ; u++)
+			if (sources[u].zoffset == top->zoffset &&
+			    sources[u].width - width <= 1 &&
+			    sources[u].length - length <= 1 &&
+			    sources[u].width >= width &&
+			    sources[u].length >= length) {
+				level->source = &sources[u];
+				break;
+			}
+		if (verbose >= 2) {
+			fprintf(stderr, " level %u (" TIFF_UINT32_FORMAT "x"
+				TIFF_UINT32_FORMAT "): ", k, width, length);
+			if (level->source != NULL)
+				fprintf(stderr, "image at magnification %gx\n",
+					level->source->magnification);
+			else
+				fprintf(stderr, "halved from level %u\n",
+					k+1);
+		}
+
+		level->band = _TIFFmalloc(level->rowsizeinbytes * bandlength);
+		if (k > 0)
+			level->halfrow = _TIFFmalloc(level->rowsizeinbytes);
+		if (level->band == NULL || (k > 0 && level->halfrow == NULL)) {
+			fprintf(stderr, "Not enough memory for level %u of the Deep Zoom pyramid \"%s\".\n",
+				k, basename);
+			pyramid.status = 0;
+		}
+		/* A second band allows to gather the next row of tiles
+		 * while the tiles of a row are encoded */
+		if (numberofencodingthreads > 1)
+			level->otherband = _TIFFmalloc(level->rowsizeinbytes *
+			    bandlength);
+
+		my_asprintf(&path, "%s/%u", pyramid.filesdirectory, k);
+		if (pyramid.status && ! makeDirectory(path))
+			pyramid.status = 0;
+		_TIFFfree(path);
+
+		width = (width + 1) / 2;
+		length = (length + 1) / 2;
+	}
+
+	initEncodingPool(&pyramid.pool, numberofencodingthreads, 0, NULL);
+	if (verbose >= 3 && pyramid.pool.numberofpieces > 0)
+		fprintf(stderr, " encoding up to %u tiles at once\n",
+			pyramid.pool.numberofpieces);
+
+	for (k = pyramid.numberoflevels ; pyramid.status && k-- > 0 ; )
+		if (pyramid.levels[k].source != NULL &&
+		    ! readDeepZoomSource(&pyramid, NDPIfilename, k))
+			pyramid.status = 0;
+	if (! finishEncodingPieces(&pyramid.pool, NULL))
+		pyramid.status = 0;
+	freeEncodingPool(&pyramid.pool);
+
+	for (k = 0 ; k < pyramid.numberoflevels ; k++) {
+		DeepZoomLevel * level = &pyramid.levels[k];
+
+		if (level->band != NULL)
+			_TIFFfree(level->band);
+		if (level->otherband != NULL)
+			_TIFFfree(level->otherband);
+		if (level->halfrow != NULL)
+			_TIFFfree(level->halfrow);
+	}
+	_TIFFfree(pyramid.levels);
+	_TIFFfree(pyramid.filesdirectory);
+
+	/* The descriptor is written last, so that it only exists when
+	 * the pyramid is complete */
+	if (! pyramid.status) {
+		fprintf(stderr, "Unable to make the Deep Zoom pyramid \"%s%s\".\n",
+			basename, DEEPZOOM_SUFFIX);
+		return 0;
+	}
+	my_asprintf(&path, "%s%s", basename, DEEPZOOM_SUFFIX);
+	f = fopen(path, "w");
+	if (f == NULL ||
+	    fprintf(f, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\"\n"
+		"  Format=\"%s\" Overlap=\"" TIFF_UINT32_FORMAT
+		"\" TileSize=\"" TIFF_UINT32_FORMAT "\">\n"
+		"  <Size Width=\"" TIFF_UINT32_FORMAT "\" Height=\""
+		TIFF_UINT32_FORMAT "\"/>\n"
+		"</Image>\n", JPEG_SUFFIX + 1, pyramid.overlap,
+		pyramid.tilesize, top->width, top->length) < 0 ||
+	    fclose(f) != 0) {
+		fprintf(stderr, "Unable to write Deep Zoom descriptor \"%s\".\n",
+			path);
+		_TIFFfree(path);
+		return 0;
+	}
+	if (printcontroldata)
+		printControlData("File containing a Deep Zoom descriptor:%s\n", path);
+	_TIFFfree(path);
+	return 1;
+}
+
+	/* Reads the rows of level k from its image in the NDPI file, then
+	 * makes the rows of the levels below which are halved from it */
+static int
+readDeepZoomSource(DeepZoomPyramid * pyramid, const char * NDPIfilename,
+	unsigned k)
+{
+	DeepZoomLevel * level = &pyramid->levels[k];
+	TIFF * in = openNDPIDirectory(NDPIfilename, level->source->dirnumber);
+	uint16_t compression, spp;
+	uint32_t y, n, rowsperread = 16;
+	tmsize_t scanlinesize, bufsize;
+	unsigned char * buf;
+	int success = 1;
+
+	if (in == NULL) {
+		fprintf(stderr, "Unable to read the image at magnification %gx of file \"%s\".\n",
+			level->source->magnification, NDPIfilename);
+		return 0;
+	}
+	(void) TIFFGetFieldDefaulted(in, TIFFTAG_SAMPLESPERPIXEL, &spp);
+	if (spp != pyramid->bytesperpixel) {
+		fprintf(stderr, "The images of file \"%s\" at magnifications %gx and %gx have different numbers of samples per pixel.\n",
+			NDPIfilename, level->source->magnification,
+			pyramid->levels[pyramid->numberoflevels-1].source->magnification);
+		(void) TIFFClose(in);
+		return 0;
+	}
+	TIFFGetField(in, TIFFTAG_COMPRESSION, &compression);
+	if (compression == COMPRESSION_JPEG)
+		TIFFSetField(in, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
+	if (TIFFIsTiled(in))
+		TIFFGetField(in, TIFFTAG_TILELENGTH, &rowsperread);
+	scanlinesize = TIFFIsTiled(in) ? level->rowsizeinbytes :
+	    TIFFRasterScanlineSize(in);
+	bufsize = scanlinesize * rowsperread;
+	buf = _TIFFmalloc(bufsize);
+	if (buf == NULL) {
+		TIFFError(TIFFFileName(in),
+		    "Error, can't allocate memory buffer of size "
+		    "%"TIFF_SSIZE_FORMAT " to read scanlines", bufsize);
+		(void) TIFFClose(in);
+		return 0;
+	}
+
+	if (verbose >= 2)
+		fprintf(stderr, " reading level %u from the image at magnification %gx\n",
+			k, level->source->magnification);
+	for (y = 0 ; y < level->length && pyramid->status ; y += n) {
+		uint32_t u;
+
+		n = rowsperread;
+		MIN(n, level->length - y);
+		if (TIFFIsTiled(in) ?
+		    ! readTilesIntoBuffer(in, 0, y, level->width, n, buf,
+		    scanlinesize) :
+		    ! readContigStripsIntoBuffer(in, buf, y, n, bufsize)) {
+			success = 0;
+			break;
+		}
+		for (u = 0 ; u < n ; u++)
+			addRowToDeepZoomLevel(pyramid, k,
+			    buf + u * scanlinesize);
+	}
+	_TIFFfree(buf);
+	(void) TIFFClose(in);
+	if (success)
+		finishDeepZoomLevel(pyramid, k);
+	return success;
+}
+
+	/* Appends a row to level k, writes its tiles once the band holds
+	 * a row of them, and makes a row of the level below from each pair
+	 * of rows if that level is halved from this one */
+static void
+addRowToDeepZoomLevel(DeepZoomPyramid * pyramid, unsigned k,
+	const unsigned char * row)
+{
+	DeepZoomLevel * level = &pyramid->levels[k];
+	unsigned char * bandrow;
+
+	if (level->numberofrows >= level->length)
+		return;
+	bandrow = level->band + (tmsize_t) (level->numberofrows -
+	    level->bandfirstrow) * level->rowsizeinbytes;
+	_TIFFmemcpy(bandrow, row, level->rowsizeinbytes);
+	level->numberofrows++;
+	level->bandlength++;
+
+	if (k > 0 && pyramid->levels[k-1].source == NULL) {
+		if (! level->hashalfrow) {
+			_TIFFmemcpy(level->halfrow, bandrow,
+			    level->rowsizeinbytes);
+			level->hashalfrow = 1;
+		} else {
+			averageRowsBy2x2(level->halfrow, bandrow, level->width,
+			    pyramid->bytesperpixel);
+			level->hashalfrow = 0;
+			addRowToDeepZoomLevel(pyramid, k-1, level->halfrow);
+		}
+	}
+
+	if (level->numberofrows == level->length ||
+	    level->numberofrows == (level->tilerow + 1) * pyramid->tilesize +
+	    pyramid->overlap)
+		writeDeepZoomTileRow(pyramid, k);
+}
+
+	/* Once all the rows of level k have come, makes the last row of
+	 * the level below from the last row of level k alone if their
+	 * number is odd, and so on down to the next level read from the
+	 * NDPI file */
+static void
+finishDeepZoomLevel(DeepZoomPyramid * pyramid, unsigned k)
+{
+	DeepZoomLevel * level = &pyramid->levels[k];
+
+	if (k == 0 || pyramid->levels[k-1].source != NULL)
+		return;
+	if (level->hashalfrow) {
+		averageRowsBy2x2(level->halfrow, level->halfrow, level->width,
+		    pyramid->bytesperpixel);
+		level->hashalfrow = 0;
+		addRowToDeepZoomLevel(pyramid, k-1, level->halfrow);
+	}
+	finishDeepZoomLevel(pyramid, k-1);
+}
+
+	/* Cuts the tiles of the current row of tiles of level k from its
+	 * band and hands them to the encoding threads, then carries the
+	 * overlap rows into the next band */
+static void
+writeDeepZoomTileRow(DeepZoomPyramid * pyramid, unsigned k)
+{
+	DeepZoomLevel * level = &pyramid->levels[k];
+	uint32_t tilesize = pyramid->tilesize, overlap = pyramid->overlap;
+	uint32_t x, column, y, firstrow;
+	unsigned char * nextband;
+
+	for (x = 0, column = 0 ; x < level->width && pyramid->status ;
+	    x += tilesize, column++) {
+		uint32_t xmin = x > overlap ? x - overlap : 0;
+		uint32_t xmax = level->width - x > tilesize + overlap ?
+		    x + tilesize + overlap : level->width;
+		EncodingPiece ownpiece, * piece =
+		    acquireEncodingPiece(&pyramid->pool, 0);
+		char * path;
+		FILE * out;
+
+		my_asprintf(&path, "%s/%u/" TIFF_UINT32_FORMAT "_"
+			TIFF_UINT32_FORMAT "%s", pyramid->filesdirectory, k,
+			column, level->tilerow, JPEG_SUFFIX);
+		out = fopen(path, "wb");
+		if (out == NULL) {
+			fprintf(stderr, "Unable to create file \"%s\".\n",
+				path);
+			_TIFFfree(path);
+			pyramid->status = 0;
+			break;
+		}
+		if (verbose >= 4)
+			fprintf(stderr, "Writing tile \"%s\"\n", path);
+		_TIFFfree(path);
+
+		if (piece == NULL) {
+			piece = &ownpiece;
+			_TIFFmemset(piece, 0, sizeof(EncodingPiece));
+		}
+		piece->cinfo.err = jpeg_std_error(&piece->jerr);
+		jpeg_create_compress(&piece->cinfo);
+		jpeg_stdio_dest(&piece->cinfo, out);
+		piece->cinfo.image_width = xmax - xmin;
+		piece->cinfo.image_height = level->numberofrows -
+		    level->bandfirstrow;
+		piece->cinfo.input_components = pyramid->bytesperpixel;
+		piece->cinfo.in_color_space = pyramid->bytesperpixel == 1 ?
+		    JCS_GRAYSCALE : JCS_RGB;
+		jpeg_set_defaults(&piece->cinfo);
+		jpeg_set_quality(&piece->cinfo, pyramid->quality,
+		    TRUE /* limit to baseline-JPEG values */);
+		jpeg_start_compress(&piece->cinfo, TRUE);
+		piece->jpegout = out;
+		(void) fillEncodingPiece(piece, NULL, xmin, level->bandfirstrow,
+		    xmax - xmin, level->numberofrows - level->bandfirstrow,
+		    level->band, level->bandfirstrow, 0, level->rowsizeinbytes,
+		    pyramid->bytesperpixel);
+		if (piece == &ownpiece) {
+			encodeMosaicPiece(piece);
+			if (! piece->status)
+				pyramid->status = 0;
+		} else
+			startEncodingPiece(piece);
+	}
+
+	/* The next row of tiles starts with the bottom overlap rows of
+	 * this one */
+	y = (level->tilerow + 1) * tilesize;
+	if (y >= level->length)
+		return;
+	firstrow = y > overlap ? y - overlap : 0;
+	nextband = level->otherband != NULL ? level->otherband : level->band;
+	if (! finishEncodingPieces(&pyramid->pool, nextband))
+		pyramid->status = 0;
+	level->bandlength = carryOverlapRows(nextband, firstrow,
+	    tilesize + 2 * overlap, level->band, level->bandfirstrow,
+	    level->bandlength, level->rowsizeinbytes);
+	if (level->otherband != NULL) {
+		level->otherband = level->band;
+		level->band = nextband;
+	}
+	level->bandfirstrow = firstrow;
+	level->tilerow++;
+	/* The rows of the last row of tiles may all have come as the
+	 * bottom overlap of this one */
+	if (level->numberofrows == level->length)
+		writeDeepZoomTileRow(pyramid, k);
+}
+
+	/* Averages each 2x2 pixels of rows "first" and "second" into one
+	 * pixel of a row half as wide (rounded up), written over first.
+	 * The last column is averaged with itself if width is odd. */
+static void
+averageRowsBy2x2(unsigned char * first, const unsigned char * second,
+	uint32_t width, uint16_t bytesperpixel)
+{
+	uint32_t x;
+	uint16_t c;
+
+	for (x = 0 ; x < width ; x += 2) {
+		tmsize_t left = (tmsize_t) x * bytesperpixel;
+		tmsize_t right = x + 1 < width ? left + bytesperpixel : left;
+
+		for (c = 0 ; c < bytesperpixel ; c++)
+			first[left / 2 + c] = (first[left + c] +
+			    first[right + c] + second[left + c] +
+			    second[right + c] + 2) / 4;
+	}
+}
+
+	/* Opens the NDPI file and reads its directories up to the one
+	 * numbered dirnumber (the first one is numbered 0) */
+static TIFF*
+openNDPIDirectory(const char* filename, unsigned dirnumber)
+{
+	TIFF* t = TIFFOpen(filename, shouldreadahead ? "rA" : "r");
+
+	while (t != NULL && dirnumber-- > 0)
+		if (! TIFFReadDirectory(t)) {
+			TIFFClose(t);
+			return NULL;
+		}
+	return t;
+}
+
+	/* Creates the directory unless it already exists */
+static int
+makeDirectory(const char* path)
+{
+#if defined(_WIN32) && !defined(__CYGWIN__)
+	if (_mkdir(path) == 0 || errno == EEXIST)
+#else
+	if (mkdir(path, 0777) == 0 || errno == EEXIST)
+#endif
+		return 1;
+	fprintf(stderr, "Unable to create directory \"%s\".\n", path);
+	return 0;
 }
 
 static int magnificationShouldNotBeExtracted(float magnification,
@@ -1205,6 +3082,111 @@ static int magnificationShouldNotBeExtracted(float magnification,
 	return 1;
 }
 
+static int fitsPreviewLimits(uint32_t width, uint32_t length)
+{
+	if (previewimagesizelimit &&
+	    (tmsize_t) width * length > previewimagesizelimit)
+		return 0;
+	if (previewimagewidthlimit && width > previewimagewidthlimit)
+		return 0;
+	if (previewimagelengthlimit && length > previewimagelengthlimit)
+		return 0;
+	return 1;
+}
+
+	/* Makes the list of the magnifications available in the NDPI
+	 * file (macroscopic image and map excepted) */
+static int findAvailableMagnifications(TIFF* in,
+	MagnificationDescription ** set, unsigned * numberofelems)
+{
+	do {
+		float f;
+
+		if (TIFFGetField(in, NDPITAG_MAGNIFICATION, &f) && f > 0) {
+			MagnificationDescription d = {f, 0, 0};
+
+			if (getWidthAndLength(in, &d.width, &d.length, f)) {
+				(void) TIFFClose(in);
+				return (1);
+			}
+			if (addToSetOfMagnificationDescriptions(set,
+			    numberofelems, "available magnifications", d))
+				return (1);
+		}
+	} while (TIFFReadDirectory(in));
+
+	return rewindToBeginningOfTIFF(in);
+}
+
+	/* If magnification m is not available, adds it to the set of
+	 * magnifications to synthesize, together with the nearest larger
+	 * available magnification from which it can be obtained by
+	 * decoding at 1/2, 1/4 or 1/8 scale. */
+static int addToSetOfSynthesizedMagnifications(
+	SynthesizedMagnification ** set, unsigned * numberofelems,
+	const MagnificationDescription * available,
+	unsigned numberofavailable, float m)
+{
+	unsigned u, scaledenom;
+
+	if (! (m > 0))
+		return 0;
+	for (u = 0 ; u < numberofavailable ; u++)
+		if (available[u].magnification == m)
+			return 0;
+	for (u = 0 ; u < *numberofelems ; u++)
+		if ((*set)[u].magnification == m)
+			return 0;
+
+	for (scaledenom = 2 ; scaledenom <= 8 ; scaledenom *= 2)
+		for (u = 0 ; u < numberofavailable ; u++)
+			if (available[u].magnification == m * scaledenom) {
+				SynthesizedMagnification * p_new =
+				    extendArrayOfSynthesizedMagnifications(set,
+				    numberofelems,
+				    "synthesized magnifications");
+
+				if (p_new == NULL)
+					return 1;
+				p_new->magnification = m;
+				p_new->sourcemagnification =
+				    available[u].magnification;
+				p_new->scaledenom = scaledenom;
+				if (verbose >= 2)
+					fprintf(stderr, "Magnification x%g will be synthesized from magnification x%g.\n",
+						m, p_new->sourcemagnification);
+				return 0;
+			}
+
+	if (verbose)
+		fprintf(stderr, "Magnification x%g is not available and can't be obtained by scaling down an available magnification by 2, 4 or 8.\n",
+			m);
+	return 0;
+}
+
+	/* Called when the current image of "in" has been processed at
+	 * 1 / *scaledenom scale. Returns 1 and sets *scaledenom if a
+	 * magnification should be synthesized from the same image at
+	 * a smaller scale, otherwise resets *scaledenom to 1 and returns 0 */
+static int nextSynthesizedMagnification(TIFF* in,
+	const SynthesizedMagnification * set, unsigned numberofelems,
+	unsigned * scaledenom)
+{
+	unsigned u, next = 0;
+	float f;
+
+	if (numberofelems > 0 &&
+	    TIFFGetField(in, NDPITAG_MAGNIFICATION, &f) && f > 0)
+		for (u = 0 ; u < numberofelems ; u++)
+			if (set[u].sourcemagnification == f &&
+			    set[u].scaledenom > *scaledenom &&
+			    (next == 0 || set[u].scaledenom < next))
+				next = set[u].scaledenom;
+
+	*scaledenom = next ? next : 1;
+	return next != 0;
+}
+
 static int zoffsetShouldNotBeExtracted(int32_t zoffset,
 	unsigned numberofzoffsetstoextract, const int32_t * zoffsetstoextract)
 {
@@ -1228,23 +3210,55 @@ static int rewindToBeginningOfTIFF(TIFF* in)
 	return 0;
 }
 
+	/* Writes the portion of the current image of "in" into the TIFF
+	 * file "path" (opened as "fd" if fd >= 0) and makes its mosaic if
+	 * required. Returns 0, or 1 if the mosaic was made directly from
+	 * "in" and no TIFF file was written, or a negative value on error */
 static int
 writeOutTIFF(TIFF* in, char* path, int fd, uint32_t xmin, uint32_t ymin,
-	uint32_t width, uint32_t length, int shouldmakemosaicoffiles,
-	uint16_t mosaiccompressionformat, uint16_t splitimagecompressionformat)
+	uint32_t width, uint32_t length, unsigned scaledenom,
+	int shouldmakemosaicoffiles, uint16_t mosaiccompressionformat,
+	uint16_t splitimagecompressionformat)
 {
-	TIFF* out= fd < 0 ?
+	TIFF* out;
+	int shouldmakemosaicdirectlyhere = shouldmakemosaicoffiles &&
+		shouldmakemosaicdirectly && scaledenom == 1 &&
+		! TIFFIsTiled(in);
+
+	if (shouldmakemosaicdirectlyhere) {
+		int r = tiffMakeMosaic(in, path, xmin, ymin, width, length,
+			mosaiccompressionformat, shouldmakemosaicoffiles,
+			in, length > 0 ? xmin : 0, length > 0 ? ymin : 0);
+		if (r < 0)
+			return (-4);
+		if (r > 0) {
+			if (fd >= 0) {
+				/* Keep the name reserved until the end */
+				char ** p_path = extendArrayOfStrings(
+					&reservedfilenames,
+					&numberofreservedfilenames,
+					"list of reserved file names");
+				close(fd);
+				if (p_path == NULL)
+					return (-4);
+				my_asprintf(p_path, "%s", path);
+			}
+			return 1;
+		}
+	}
+
+	out= fd < 0 ?
 		TIFFOpen(path, TIFFIsBigEndian(in)?"wb":"wl") :
 		TIFFFdOpen(fd, path, TIFFIsBigEndian(in)?"wb":"wl");
 
 	if (out == NULL)
 		return (-2);
-	if (!cropNDPI2TIFF(in, out, xmin, ymin, width, length,
+	if (!cropNDPI2TIFF(in, out, xmin, ymin, width, length, scaledenom,
 	    splitimagecompressionformat) ||
 	    !TIFFWriteDirectory(out))
 		return (-1);
 
-	if (shouldmakemosaicoffiles) {
+	if (shouldmakemosaicoffiles && ! shouldmakemosaicdirectlyhere) {
 	/* If the output file that has just been written is not tiled,
 	 * there seems to be no easy way to re-read it without closing
 	 * and reopening it: even resetting the current directory fails
@@ -1264,19 +3278,43 @@ fprintf(stderr, "$ have flushed.\n");
 				fprintf(stderr, " Closing and reopening \"%s\"\n",
 					TIFFFileName(out));
 			TIFFClose(out);
-
-			out = TIFFOpen(path, TIFFIsBigEndian(in)?"rb":"rl");
-			if (out == NULL)
-				return (-3);
-			if (TIFFReadDirectory(out) == 0 &&
-			    TIFFCurrentDirectory(out) != 0)
-				return (-3);
+			out = NULL;
 		}
+		return makeMosaicOfSplitImage(in, out, path, xmin, ymin,
+			length, scaledenom, shouldmakemosaicoffiles,
+			mosaiccompressionformat);
+	}
+
+	TIFFClose(out);
 
-		tiffMakeMosaic(out, mosaiccompressionformat,
-				shouldmakemosaicoffiles);
+	return 0;
+}
+
+	/* Makes the mosaic of the image cropped from in at xmin, ymin and
+	 * written to path, which is still open as out or, if out is NULL,
+	 * has been closed. Closes it. */
+static int
+makeMosaicOfSplitImage(TIFF* in, TIFF* out, const char* path,
+	uint32_t xmin, uint32_t ymin, uint32_t length, unsigned scaledenom,
+	int shouldmakemosaicoffiles, uint16_t mosaiccompressionformat)
+{
+	if (out == NULL) {
+		out = TIFFOpen(path, TIFFIsBigEndian(in)?"rb":"rl");
+		if (out == NULL)
+			return (-3);
+		if (TIFFReadDirectory(out) == 0 &&
+		    TIFFCurrentDirectory(out) != 0)
+			return (-3);
 	}
 
+	/* The JPEG data of the NDPI file can't be copied into
+	 the pieces of a synthesized magnification */
+	tiffMakeMosaic(out, path, 0, 0, 0, 0,
+			mosaiccompressionformat,
+			shouldmakemosaicoffiles,
+			scaledenom > 1 ? NULL : in,
+			length > 0 ? xmin : 0, length > 0 ? ymin : 0);
+
 	TIFFClose(out);
 
 	return 0;
@@ -1284,7 +3322,8 @@ fprintf(stderr, "$ have flushed.\n");
 
 static int
 cropNDPI2TIFF(TIFF* in, TIFF* out, uint32_t xmin, uint32_t ymin,
-	uint32_t width, uint32_t length, uint16_t splitimagecompressionformat)
+	uint32_t width, uint32_t length, unsigned scaledenom,
+	uint16_t splitimagecompressionformat)
 {
 	uint32_t imagewidth, imagelength;
 	int clipping= 1;
@@ -1296,6 +3335,22 @@ cropNDPI2TIFF(TIFF* in, TIFF* out, uint32_t xmin, uint32_t ymin,
 	  * length directly rather than calling getWidthAndLength */
 	CopyField(TIFFTAG_IMAGEWIDTH, imagewidth);
 	CopyField(TIFFTAG_IMAGELENGTH, imagelength);
+	if (scaledenom > 1) {
+		/* Synthesized magnification: the dimensions are those
+		 of the image decoded at 1/scaledenom scale */
+		float resolution;
+
+		imagewidth = (imagewidth + scaledenom-1) / scaledenom;
+		imagelength = (imagelength + scaledenom-1) / scaledenom;
+		TIFFSetField(out, TIFFTAG_IMAGEWIDTH, imagewidth);
+		TIFFSetField(out, TIFFTAG_IMAGELENGTH, imagelength);
+		if (TIFFGetField(in, TIFFTAG_XRESOLUTION, &resolution))
+			TIFFSetField(out, TIFFTAG_XRESOLUTION,
+			    resolution / scaledenom);
+		if (TIFFGetField(in, TIFFTAG_YRESOLUTION, &resolution))
+			TIFFSetField(out, TIFFTAG_YRESOLUTION,
+			    resolution / scaledenom);
+	}
 	if (length > 0) { /* convention: length=0 <=> ignore x/ymin, width, length */
 		if (xmin+width > imagewidth ) width= imagewidth-xmin;
 		if (ymin+length > imagelength) length= imagelength-ymin;
@@ -1312,6 +3367,9 @@ cropNDPI2TIFF(TIFF* in, TIFF* out, uint32_t xmin, uint32_t ymin,
 	if (splitimagecompressionformat == (uint16_t) -1)
 		TIFFGetField(in, TIFFTAG_COMPRESSION, &splitimagecompressionformat);
 
+	if (scaledenom > 1)
+		return (cpScaledStrips2Tiles(in, out, scaledenom, xmin, ymin,
+		    width, length, splitimagecompressionformat));
 	if (TIFFIsTiled(in))
 		return (cpTiles(in, out, xmin, ymin, width, length, splitimagecompressionformat));
 	else
@@ -1324,24 +3382,289 @@ cropNDPI2TIFF(TIFF* in, TIFF* out, uint32_t xmin, uint32_t ymin,
 				return (cpStrips(in, out, xmin, ymin, width, length, splitimagecompressionformat));
 }
 
-static void
-tiffMakeMosaic(TIFF* in, uint16_t mosaiccompressionformat,
-		int shouldmakemosaicoffile)
+	/* Crops the boxes of the current image of in, which is not tiled, in
+	 * a single pass over its scanlines rather than decoding it once per
+	 * box: the boxes are taken in order of ymin, and each band of
+	 * scanlines that is decoded is copied into all the boxes it crosses.
+	 * A box is open only from its first row to its last one. The files
+	 * are the same as those written by cropNDPI2TIFF. Sets the status of
+	 * each box, returns 0 if some box could not be cropped. */
+static int
+cropBoxesFromStrips(TIFF* in, BoxCrop* crops, unsigned numberofcrops,
+	uint16_t splitimagecompressionformat)
+{
+	BoxCrop ** sorted, ** active;
+	unsigned u, next = 0, numberofactive = 0;
+	uint32_t imagewidth, imagelength, xmin = (uint32_t) -1, xmax = 0;
+	uint32_t y, bandlength;
+	uint16_t spp, bitspersample, bytesperpixel, incompression;
+	tmsize_t rowsizeinbytes = TIFFRasterScanlineSize(in);
+	unsigned char * band = NULL;
+	int success = 0;
+
+	TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &imagewidth);
+	TIFFGetField(in, TIFFTAG_IMAGELENGTH, &imagelength);
+	TIFFGetField(in, TIFFTAG_SAMPLESPERPIXEL, &spp);
+	TIFFGetField(in, TIFFTAG_BITSPERSAMPLE, &bitspersample);
+	assert( bitspersample % 8 == 0 );
+	bytesperpixel = (bitspersample/8) * spp;
+	TIFFGetFieldDefaulted(in, TIFFTAG_COMPRESSION, &incompression);
+	if (splitimagecompressionformat == (uint16_t) -1)
+		splitimagecompressionformat = incompression;
+
+	sorted = _TIFFmalloc(2 * numberofcrops * sizeof(BoxCrop *));
+	if (sorted == NULL) {
+		TIFFError(TIFFFileName(in),
+		    "Error, can't allocate space for boxes to extract");
+		return (0);
+	}
+	active = sorted + numberofcrops;
+	for (u = 0 ; u < numberofcrops ; u++) {
+		BoxCrop * crop = &(crops[u]);
+		uint32_t x, width;
+
+		/* as in cropNDPI2TIFF */
+		if (crop->xmin + crop->width > imagewidth)
+			crop->width = imagewidth - crop->xmin;
+		if (crop->ymin + crop->length > imagelength)
+			crop->length = imagelength - crop->ymin;
+		crop->out = NULL;
+		crop->buf = NULL;
+		crop->rowsdone = 0;
+		crop->rowsinbuf = 0;
+		crop->status = -1;
+		crop->blanktile.ndpixmin = crop->xmin;
+		crop->blanktile.data = NULL;
+		crop->blanktile.size = 0;
+		/* the tiles of the box in blank lanes are not decoded */
+		x = crop->xmin;
+		width = crop->width;
+		leaveOutBlankTiles(&blankcolumns, NDPI_LANE_WIDTH, &x, &width);
+		MIN(xmin, x);
+		MAX(xmax, x + width);
+		sorted[u] = crop;
+	}
+	qsort(sorted, numberofcrops, sizeof(*sorted), compareBoxCropsByYmin);
+
+	/* The band is as long as the tiles of the boxes, like the buffer
+	 * of cpStrips2Tiles */
+	if (!openBoxCrop(in, sorted[0], splitimagecompressionformat,
+	    bytesperpixel))
+		goto done;
+	active[numberofactive++] = sorted[next++];
+	bandlength = sorted[0]->tilelength;
+	band = _TIFFmalloc(bandlength * rowsizeinbytes);
+	if (band == NULL) {
+		TIFFError(TIFFFileName(in),
+		    "Error, can't allocate space for image buffer");
+		goto done;
+	}
+
+	/* Only decode the columns of the boxes (if JPEG-compressed) */
+	TIFFJPEGSetDecodeWindow(in, xmin, xmax - xmin);
+
+	/* Other compression methods than JPEG don't support random
+	 * access: read all lines from the top, as cpStrips2Tiles does */
+	y = incompression == COMPRESSION_JPEG ? sorted[0]->ymin : 0;
+	while (numberofactive > 0 || next < numberofcrops) {
+		uint32_t end = y;
+		unsigned v, w;
+
+		if (numberofactive == 0 &&
+		    incompression == COMPRESSION_JPEG &&
+		    sorted[next]->ymin > y)
+			y = sorted[next]->ymin;
+		while (next < numberofcrops &&
+		    sorted[next]->ymin < y + bandlength) {
+			if (!openBoxCrop(in, sorted[next],
+			    splitimagecompressionformat, bytesperpixel))
+				goto done;
+			active[numberofactive++] = sorted[next++];
+		}
+
+		/* Decode no further than needed */
+		for (v = 0 ; v < numberofactive ; v++)
+			MAX(end, active[v]->ymin + active[v]->length);
+		if (numberofactive == 0)
+			end = sorted[next]->ymin;
+		MIN(end, y + bandlength);
+		if (verbose >= 4)
+			fprintf(stderr, "  Reading scanlines " TIFF_UINT32_FORMAT
+			    " to " TIFF_UINT32_FORMAT " for %u box(es)\n",
+			    y, end - 1, numberofactive);
+		if (!readContigStripsIntoBuffer(in, band, y, end - y,
+		    bandlength * rowsizeinbytes))
+			goto done;
+
+		for (v = 0, w = 0 ; v < numberofactive ; v++) {
+			BoxCrop * crop = active[v];
+
+			if (!copyRowsToBoxCrop(crop, band, y, end - y,
+			    rowsizeinbytes, bytesperpixel))
+				goto done;
+			if (crop->rowsdone < crop->length) {
+				active[w++] = crop;
+				continue;
+			}
+			crop->status = TIFFWriteDirectory(crop->out) ? 0 : -1;
+			TIFFClose(crop->out);
+			crop->out = NULL;
+			_TIFFfree(crop->buf);
+			crop->buf = NULL;
+			freeBlankTile(&crop->blanktile);
+			if (crop->status < 0)
+				goto done;
+		}
+		numberofactive = w;
+		y = end;
+	}
+	success = 1;
+
+done:
+	for (u = 0 ; u < numberofcrops ; u++) {
+		if (crops[u].out != NULL)
+			TIFFClose(crops[u].out);
+		if (crops[u].buf != NULL)
+			_TIFFfree(crops[u].buf);
+		freeBlankTile(&crops[u].blanktile);
+	}
+	if (band != NULL)
+		_TIFFfree(band);
+	_TIFFfree(sorted);
+	TIFFJPEGSetDecodeWindow(in, 0, 0);
+	return (success);
+}
+
+static int
+compareBoxCropsByYmin(const void * a, const void * b)
+{
+	const BoxCrop * crop1 = *(const BoxCrop * const *) a;
+	const BoxCrop * crop2 = *(const BoxCrop * const *) b;
+
+	if (crop1->ymin != crop2->ymin)
+		return crop1->ymin < crop2->ymin ? -1 : 1;
+	/* keep the order of the boxes on the command line */
+	return crop1 < crop2 ? -1 : crop1 > crop2;
+}
+
+	/* Opens the file of a box cropped by cropBoxesFromStrips and sets
+	 * it up as cropNDPI2TIFF would */
+static int
+openBoxCrop(TIFF* in, BoxCrop* crop, uint16_t splitimagecompressionformat,
+	uint16_t bytesperpixel)
+{
+	if (verbose >= 3)
+		fprintf(stderr, "  Starting box \"%s\" at scanline "
+		    TIFF_UINT32_FORMAT "\n", crop->path, crop->ymin);
+	crop->out = TIFFOpen(crop->path, TIFFIsBigEndian(in)?"wb":"wl");
+	if (crop->out == NULL) {
+		crop->status = -2;
+		return (0);
+	}
+	tiffCopyFieldsButDimensions(in, crop->out);
+	TIFFSetField(crop->out, TIFFTAG_IMAGEWIDTH, crop->width);
+	TIFFSetField(crop->out, TIFFTAG_IMAGELENGTH, crop->length);
+	crop->tilelength = setUpStrips2Tiles(in, crop->out,
+	    splitimagecompressionformat);
+	crop->buf = _TIFFmalloc((tmsize_t) crop->tilelength * crop->width *
+	    bytesperpixel);
+	if (crop->buf == NULL) {
+		TIFFError(TIFFFileName(in),
+		    "Error, can't allocate space for image buffer");
+		return (0);
+	}
+	return (1);
+}
+
+	/* Copies the rows of the box that are in the band, which holds
+	 * bandlength scanlines from bandfirstrow on, writing them out by
+	 * tilelength rows as cpStrips2Tiles does */
+static int
+copyRowsToBoxCrop(BoxCrop* crop, const unsigned char * band,
+	uint32_t bandfirstrow, uint32_t bandlength, tmsize_t bandrowsizeinbytes,
+	uint16_t bytesperpixel)
+{
+	tmsize_t widthinbytes = (tmsize_t) crop->width * bytesperpixel;
+	uint32_t y = crop->ymin + crop->rowsdone + crop->rowsinbuf;
+
+	while (y < bandfirstrow + bandlength && y < crop->ymin + crop->length) {
+		_TIFFmemcpy(crop->buf + crop->rowsinbuf * widthinbytes,
+		    band + (y - bandfirstrow) * bandrowsizeinbytes +
+		    (tmsize_t) crop->xmin * bytesperpixel, widthinbytes);
+		crop->rowsinbuf++;
+		y++;
+		if (crop->rowsinbuf == crop->tilelength ||
+		    y == crop->ymin + crop->length) {
+			if (!writeBufferToContigTiles(crop->out, crop->buf,
+			    widthinbytes, crop->rowsdone, crop->rowsinbuf, 0,
+			    crop->width, bytesperpixel, &crop->blanktile))
+				return (0);
+			crop->rowsdone += crop->rowsinbuf;
+			crop->rowsinbuf = 0;
+		}
+	}
+	return (1);
+}
+
+	/* Makes a mosaic of the part of "in" at inxmin, inymin of size
+	 * inimagewidth x inimagelength (the whole image if inimagelength is
+	 * 0), naming the pieces after inpath. Returns 1 if the pieces have
+	 * been made, 0 if not or if one of them could not be written. */
+static int
+tiffMakeMosaic(TIFF* in, const char* inpath, uint32_t inxmin,
+		uint32_t inymin, uint32_t inimagewidth, uint32_t inimagelength,
+		uint16_t mosaiccompressionformat,
+		int shouldmakemosaicoffile, TIFF* ndpi, uint32_t ndpixmin,
+		uint32_t ndpiymin)
 {
 	char * infilename;
-	uint32_t inimagewidth, inimagelength, outwidth, outlength;
+	uint32_t infilewidth, infilelength, outwidth, outlength;
 	uint32_t hoverlap, voverlap;
 	uint32_t hnpieces, vnpieces;
 	uint32_t ndigitshpiecenumber, ndigitsvpiecenumber, x, y;
 	uint16_t spp, bitspersample;
 	tmsize_t outmemorysize, ouroutmemorysize;
-	unsigned char * outbuf = NULL;
-
-	TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &inimagewidth);
-	TIFFGetField(in, TIFFTAG_IMAGELENGTH, &inimagelength);
+	tmsize_t bandmemorysize;
+	int useband, status = 1;
+	uint32_t outlengthwithoutband = 0;
+	unsigned numberofpieces;
+	tmsize_t piecememorysize, poolmemorysize, memorylimit;
+	unsigned char * outbuf = NULL, * band = NULL, * otherband = NULL;
+	uint32_t i, j, bandy = (uint32_t) -1, otherbandy = (uint32_t) -1;
+	uint32_t bandlength = 0, otherbandlength = 0;
+	tmsize_t bandrowsizeinbytes;
+	uint16_t bytesperpixel;
+	EncodingPool pool;
+	DecodedRowRing ring;
+	tmsize_t overlapmemorysize = 0;
+	RestartIntervalGrid grid;
+	int hasgrid = 0, copyjpegdata;
+	uint32_t hunit = 1, vunit = 1;
+	uint32_t numberofpieceswithouttissue = 0;
+	uint32_t numberofpiecesinblanklanes = 0;
+	uint32_t numberofpiecesalreadymade = 0;
+	MosaicManifest manifest;
+	char * manifestheader;
+	int quality = mosaic_JPEG_quality;
+
+	TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &infilewidth);
+	TIFFGetField(in, TIFFTAG_IMAGELENGTH, &infilelength);
+	if (inimagelength > 0) {
+		if (inxmin + inimagewidth > infilewidth)
+			inimagewidth = infilewidth - inxmin;
+		if (inymin + inimagelength > infilelength)
+			inimagelength = infilelength - inymin;
+	} else {
+		inxmin = 0;
+		inymin = 0;
+		inimagewidth = infilewidth;
+		inimagelength = infilelength;
+	}
 	TIFFGetField(in, TIFFTAG_SAMPLESPERPIXEL, &spp);
 	TIFFGetField(in, TIFFTAG_BITSPERSAMPLE, &bitspersample);
 	assert( bitspersample % 8 == 0 );
+	bytesperpixel = (bitspersample/8) * spp;
+	bandrowsizeinbytes = (tmsize_t) inimagewidth * bytesperpixel;
 
 	if (verbose >= 5)
 		fprintf(stderr, " tiffMakeMosaic, infile \"%s\" has "
@@ -1350,21 +3673,36 @@ tiffMakeMosaic(TIFF* in, uint16_t mosaiccompressionformat,
 			TIFFFileName(in), inimagewidth, inimagelength,
 			spp, bitspersample);
 
+	if (shouldcopyjpegdataintomosaic &&
+	    mosaiccompressionformat == COMPRESSION_JPEG_IN_JPEG_FILE)
+		hasgrid = ndpi != NULL && getRestartIntervalGrid(ndpi, &grid);
+	if (hasgrid) {
+		if (requestedpiecewidth == 0 &&
+		    ndpixmin % grid.intervalwidth == 0)
+			hunit = grid.intervalwidth;
+		if (requestedpiecelength == 0 &&
+		    ndpiymin % grid.mculength == 0)
+			vunit = grid.mculength;
+	}
+
 	outwidth= requestedpiecewidth ? requestedpiecewidth : inimagewidth;
 	outlength= requestedpiecelength ? requestedpiecelength :
 		inimagelength;
 	computeMaxPieceMemorySize(inimagewidth, inimagelength, spp,
 		bitspersample, outwidth, outlength, overlapinpixels,
-		overlapinpercent,
-		&outmemorysize, &ouroutmemorysize, &hnpieces, &vnpieces,
-		&hoverlap, &voverlap);
+		overlapinpercent, hunit, vunit,
+		&outmemorysize, &ouroutmemorysize, &bandmemorysize,
+		&hnpieces, &vnpieces, &hoverlap, &voverlap);
 	if (shouldmakemosaicoffile <= 1 &&
 	    (requestedpiecewidth == 0 || inimagewidth <= requestedpiecewidth) &&
 	    (requestedpiecelength == 0 ||
 	     inimagelength <= requestedpiecelength) &&
 	    (mosaicpiecesizelimit == 0 ||
-	     outmemorysize <= mosaicpiecesizelimit))
-		return; /* Nothing to do */
+	     outmemorysize <= mosaicpiecesizelimit)) {
+		if (hasgrid)
+			freeRestartIntervalGrid(&grid);
+		return 0; /* Nothing to do */
+	}
 
 	{
 		uint16_t planarconfig;
@@ -1382,31 +3720,57 @@ tiffMakeMosaic(TIFF* in, uint16_t mosaiccompressionformat,
 		fprintf(stderr, "File \"%s\": at least one requested "
 			"piece dimension is too large for JPEG "
 			"files.\n", TIFFFileName(in));
-		return;
+		if (hasgrid)
+			freeRestartIntervalGrid(&grid);
+		return 0;
 	}
 
+	/* The band of decoded scanlines (see below) must fit into the
+	 * memory limit as well: pieces are made shorter until it does, or,
+	 * if they can't be, the image is decoded once for each column of
+	 * pieces instead */
+	useband = ! TIFFIsTiled(in);
 	if (requestedpiecewidth == 0 || requestedpiecelength == 0)
 		while ( (mosaicpiecesizelimit &&
+		    outmemorysize > mosaicpiecesizelimit) ||
+		    (mosaiccompressionformat == COMPRESSION_JPEG_IN_JPEG_FILE &&
+		    (outwidth > ORDINARY_JPEG_MAX_DIMENSION ||
+		    outlength > ORDINARY_JPEG_MAX_DIMENSION)) ||
+		    (useband && mosaicpiecesizelimit &&
+		    bandmemorysize > mosaicpiecesizelimit)) {
+		if ( (mosaicpiecesizelimit &&
 		    outmemorysize > mosaicpiecesizelimit) ||
 		    (mosaiccompressionformat == COMPRESSION_JPEG_IN_JPEG_FILE &&
 		    (outwidth > ORDINARY_JPEG_MAX_DIMENSION ||
 		    outlength > ORDINARY_JPEG_MAX_DIMENSION))) {
-		if (outlength > outwidth && outlength % 2 == 0 &&
-		    requestedpiecelength == 0)
+			if (outlength > outwidth && outlength % 2 == 0 &&
+			    requestedpiecelength == 0)
+				outlength /= 2;
+			else if (outwidth % 2 == 0 && requestedpiecewidth == 0)
+				outwidth /= 2;
+			else { /* can't divide any dimension by 2 */
+				outwidth = 0;
+				outlength = 0;
+				break;
+			}
+		} else if (outlength % 2 == 0 && outlength / 2 >= vunit &&
+		    requestedpiecelength == 0) {
+			/* only the band is too large */
+			if (outlengthwithoutband == 0)
+				outlengthwithoutband = outlength;
 			outlength /= 2;
-		else if (outwidth % 2 == 0 && requestedpiecewidth == 0)
-			outwidth /= 2;
-		else { /* can't divide any dimension by 2 */
-			outwidth = 0;
-			outlength = 0;
-			break;
+		} else {
+			/* back to the pieces as they were without a band */
+			useband = 0;
+			if (outlengthwithoutband != 0)
+				outlength = outlengthwithoutband;
 		}
 
 		computeMaxPieceMemorySize(inimagewidth,
 		    inimagelength, spp, bitspersample,
 		    outwidth, outlength, overlapinpixels,
-		    overlapinpercent,
-		    &outmemorysize, &ouroutmemorysize,
+		    overlapinpercent, hunit, vunit,
+		    &outmemorysize, &ouroutmemorysize, &bandmemorysize,
 		    &hnpieces, &vnpieces, &hoverlap, &voverlap);
 	}
 
@@ -1414,7 +3778,24 @@ tiffMakeMosaic(TIFF* in, uint16_t mosaiccompressionformat,
 		if (verbose)
 			fprintf(stderr, "File \"%s\": impossible to find suitable width and length for mosaic pieces. Maybe you requested too small a memory size?\n",
 			TIFFFileName(in));
-		return;
+		if (hasgrid)
+			freeRestartIntervalGrid(&grid);
+		return 0;
+	}
+
+	if (hunit > 1 || vunit > 1) {
+		if (outwidth < inimagewidth)
+			outwidth = outwidth > hunit ?
+				outwidth / hunit * hunit : hunit;
+		if (outlength < inimagelength)
+			outlength = outlength > vunit ?
+				outlength / vunit * vunit : vunit;
+		computeMaxPieceMemorySize(inimagewidth,
+		    inimagelength, spp, bitspersample,
+		    outwidth, outlength, overlapinpixels,
+		    overlapinpercent, hunit, vunit,
+		    &outmemorysize, &ouroutmemorysize, &bandmemorysize,
+		    &hnpieces, &vnpieces, &hoverlap, &voverlap);
 	}
 
 	outbuf= _TIFFmalloc(ouroutmemorysize);
@@ -1429,8 +3810,8 @@ tiffMakeMosaic(TIFF* in, uint16_t mosaiccompressionformat,
 		computeMaxPieceMemorySize(inimagewidth,
 		    inimagelength, spp, bitspersample,
 		    outwidth, outlength, overlapinpixels,
-		    overlapinpercent,
-		    &outmemorysize, &ouroutmemorysize,
+		    overlapinpercent, hunit, vunit,
+		    &outmemorysize, &ouroutmemorysize, &bandmemorysize,
 		    &hnpieces, &vnpieces, &hoverlap, &voverlap);
 
 		outbuf= _TIFFmalloc(ouroutmemorysize);
@@ -1439,7 +3820,9 @@ tiffMakeMosaic(TIFF* in, uint16_t mosaiccompressionformat,
 		if (verbose && outmemorysize > mosaicpiecesizelimit)
 			fprintf(stderr, "File \"%s\": unable to find width and length of mosaic pieces that will suit into memory during mosaic creation.\n",
 				TIFFFileName(in));
-		return;
+		if (hasgrid)
+			freeRestartIntervalGrid(&grid);
+		return 0;
 	}
 
 	if (verbose) {
@@ -1469,7 +3852,7 @@ tiffMakeMosaic(TIFF* in, uint16_t mosaiccompressionformat,
 		}
 	}
 
-	my_asprintf(&infilename, "%s", TIFFFileName(in));
+	my_asprintf(&infilename, "%s", inpath);
 	{
 		int l = strlen(infilename);
 		if (infilename[l-sizeof(TIFF_SUFFIX)+1] == '.')
@@ -1478,38 +3861,189 @@ tiffMakeMosaic(TIFF* in, uint16_t mosaiccompressionformat,
 
 	ndigitshpiecenumber= searchNumberOfDigits(hnpieces);
 	ndigitsvpiecenumber= searchNumberOfDigits(vnpieces);
-	/* Loop over x, loop over y in that order, so that, when in is 
-	 * not tiled, TIFFReadScanline calls are done sequentially from 
-	 * 0 to H-1 then 0 to H-1 then... Otherwise (0 to h-1 then 0 to 
-	 * h-1 then h to 2*h-1 then... with h<H),, reading fails. */
-	for (x = 0 ; x < inimagewidth ; x += outwidth) {
-		uint32_t outwidthwithoverlap;
-		uint32_t y_of_last_read_scanline= 0;
 
-		uint32_t leftoverlap = x < hoverlap ? x : hoverlap;
-		uint32_t xwithleftoverlap= x - leftoverlap;
+	/* Resolved for each image rather than in mosaic_JPEG_quality,
+	 * which other images, maybe processed at the same time, share */
+	if (mosaiccompressionformat == COMPRESSION_JPEG_IN_JPEG_FILE &&
+	    quality <= 0) {
+		uint16_t in_compression;
+
+		TIFFGetField(in, TIFFTAG_COMPRESSION, &in_compression);
+		if (in_compression == COMPRESSION_JPEG) {
+			int in_jpegquality;
+			TIFFGetField(in, TIFFTAG_JPEGQUALITY, &in_jpegquality);
+			quality = in_jpegquality;
+		} else
+			quality = default_JPEG_quality;
+	}
 
-		uint32_t outwidthwithrightoverlap = outwidth + hoverlap;
-		uint32_t xrightboundary = x + outwidthwithrightoverlap;
-		    /* equal to xwithleftoverlap + outwidth + 2*hoverlap */
-		assert(xrightboundary >= x); /* detect overflows */
-		if (xrightboundary > inimagewidth)
-			outwidthwithrightoverlap = inimagewidth - x;
-		outwidthwithoverlap = leftoverlap + outwidthwithrightoverlap;
+	/* The pieces of a previous run are only kept if they were made
+	 * with the same parameters. Pieces written into an archive are
+	 * listed in its index instead. */
+	manifest.filename = NULL;
+	manifest.f = NULL;
+	manifest.records = NULL;
+	manifest.numberofrecords = 0;
+	if (mosaicarchive.f == NULL) {
+		my_asprintf(&manifestheader,
+		    "# ndpisplit mosaic manifest: image " TIFF_UINT32_FORMAT "x" TIFF_UINT32_FORMAT "+"
+		    TIFF_UINT32_FORMAT "+" TIFF_UINT32_FORMAT ", pieces "
+		    TIFF_UINT32_FORMAT "x" TIFF_UINT32_FORMAT ", overlaps "
+		    TIFF_UINT32_FORMAT "," TIFF_UINT32_FORMAT
+		    ", compression %u, quality %d, JPEG data copied %d;"
+		    " x y width length size hash name\n",
+		    inimagewidth, inimagelength, inxmin, inymin, outwidth, outlength,
+		    hoverlap, voverlap, (unsigned) mosaiccompressionformat,
+		    quality, hasgrid);
+		if (! openMosaicManifest(&manifest, infilename, manifestheader))
+			fprintf(stderr, "Unable to write manifest \"%s\" of mosaic, its pieces can't be kept by a later run with --resume.\n",
+				manifest.filename);
+		_TIFFfree(manifestheader);
+	}
 
-		assert(xwithleftoverlap < inimagewidth); /* xwol would be < 0 */
-		assert(xwithleftoverlap + outwidthwithoverlap <= inimagewidth);
+	/* When in is not tiled, decode it only once: the scanlines of
+	 * each row of pieces are read into a band as wide as the mosaic
+	 * (columns inxmin to inxmin+inimagewidth-1), from which all the
+	 * pieces of that row are cut. */
+	if (! TIFFIsTiled(in) && ! useband && verbose)
+		fprintf(stderr, "File \"%s\": a band of " TIFF_UINT64_FORMAT " bytes would exceed the memory limit, the image will be decoded once for each column of mosaic pieces.\n",
+			TIFFFileName(in), (uint64_t) bandmemorysize);
+	if (useband) {
+		band = _TIFFmalloc(bandmemorysize);
+		if (band == NULL && verbose)
+			fprintf(stderr, "File \"%s\": not enough memory for a band of " TIFF_UINT64_FORMAT " bytes, the image will be decoded once for each column of mosaic pieces.\n",
+				TIFFFileName(in), (uint64_t) bandmemorysize);
+		else if (verbose >= 3)
+			fprintf(stderr, " using a band of " TIFF_UINT64_FORMAT
+				" bytes (%0.3f MiB) of decoded scanlines\n",
+				(uint64_t) bandmemorysize,
+				bandmemorysize / 1048576.);
+		if (band != NULL) {
+			uint16_t in_compression;
+
+			/* as in cpStrips2Strip */
+			TIFFGetField(in, TIFFTAG_COMPRESSION, &in_compression);
+			if (in_compression == COMPRESSION_JPEG)
+				TIFFSetField(in, TIFFTAG_JPEGCOLORMODE,
+				    JPEGCOLORMODE_RGB);
+			TIFFJPEGSetDecodeWindow(in, inxmin,
+			    inimagewidth < infilewidth ? inimagewidth : 0);
+		}
+	}
 
-		for (y = 0 ; y < inimagelength ; y += outlength) {
-			char * outfilename;
-			void * out; /* TIFF* or FILE* */
-			uint32_t outlengthwithoverlap;
+	/* With several threads, pieces cut from the band or read from the
+	 * tiles are encoded by the threads while the next ones are read.
+	 * A second band, if there is enough memory, allows to read the
+	 * next row of pieces while the last pieces of a row are encoded.
+	 * The pieces held by the pool, each one in its own buffer unless it
+	 * is a JPEG file encoded straight from the band, with the TIFF file
+	 * of a TIFF piece, and the bands must fit into the memory limit
+	 * together, unless -g overrides it. */
+	memorylimit = requestedpiecewidth && requestedpiecelength ? 0 :
+	    mosaicpiecesizelimit;
+	numberofpieces = band != NULL || TIFFIsTiled(in) ?
+	    numberofencodingthreads : 1;
+	piecememorysize = mosaiccompressionformat ==
+	    COMPRESSION_JPEG_IN_JPEG_FILE ? (band != NULL ? 0 :
+	    ouroutmemorysize) : 2 * ouroutmemorysize;
+	poolmemorysize = band != NULL ? bandmemorysize : 0;
+	while (memorylimit && numberofpieces > 1 &&
+	    poolmemorysize + numberofpieces * piecememorysize > memorylimit)
+		numberofpieces--;
+	if (verbose >= 3 && numberofpieces < (unsigned) numberofencodingthreads &&
+	    (band != NULL || TIFFIsTiled(in)))
+		fprintf(stderr, " encoding at most %u pieces at once to fit into the memory limit\n",
+			numberofpieces);
+	initEncodingPool(&pool, numberofpieces, ouroutmemorysize, &manifest);
+	if (pool.numberofpieces > 0) {
+		poolmemorysize += numberofpieces * piecememorysize;
+		if (band != NULL && (memorylimit == 0 ||
+		    poolmemorysize + bandmemorysize <= memorylimit))
+			otherband = _TIFFmalloc(bandmemorysize);
+		if (verbose >= 3)
+			fprintf(stderr, " encoding up to %u pieces at once%s\n",
+				pool.numberofpieces, otherband != NULL ?
+				", with a second band" : "");
+	}
 
-			uint32_t topoverlap = y < voverlap ? y : voverlap;
-			uint32_t ywithtopoverlap= y-topoverlap;
+	/* Consecutive pieces of a column share 2*voverlap rows. With a
+	 * band, they are carried from one band to the next one. Without a
+	 * band, they are kept in a ring of decoded rows as wide as a piece,
+	 * so that the next piece of the column does not need to read the
+	 * image again from its beginning to get them. */
+	ring.rows = NULL;
+	if (band != NULL)
+		overlapmemorysize = (tmsize_t) 2 * voverlap * bandrowsizeinbytes;
+	else if (! TIFFIsTiled(in) && voverlap > 0) {
+		ring.capacity = 2 * voverlap;
+		ring.bytesperpixel = bytesperpixel;
+		ring.rowsizeinbytes = (tmsize_t) (outwidth + 2 * hoverlap <
+		    inimagewidth ? outwidth + 2 * hoverlap : inimagewidth) *
+		    bytesperpixel;
+		ring.count = 0;
+		ring.rows = _TIFFmalloc(ring.capacity * ring.rowsizeinbytes);
+		if (ring.rows != NULL)
+			overlapmemorysize = ring.capacity * ring.rowsizeinbytes;
+		else if (verbose)
+			fprintf(stderr, "File \"%s\": not enough memory to keep overlap rows, the image will be decoded again from its beginning for each piece.\n",
+				TIFFFileName(in));
+	}
+	if (verbose >= 3 && overlapmemorysize > 0)
+		fprintf(stderr, " keeping up to " TIFF_UINT64_FORMAT
+			" bytes (%0.3f MiB) of decoded overlap rows\n",
+			(uint64_t) overlapmemorysize,
+			overlapmemorysize / 1048576.);
+	if (printcontroldata)
+		printControlData("Memory for overlap rows of mosaic pieces:"
+		    TIFF_UINT64_FORMAT "\n", (uint64_t) overlapmemorysize);
+
+	/* Without a band, loop over x, loop over y in that order, so
+	 * that, when in is not tiled, TIFFReadScanline calls are done
+	 * sequentially from 0 to H-1 then 0 to H-1 then... Otherwise (0
+	 * to h-1 then 0 to h-1 then h to 2*h-1 then... with h<H),,
+	 * reading fails. With a band, loop over y, loop over x.
+	 * The pieces kept from a previous run are neither decoded nor
+	 * encoded: with a restart marker index, the decoding starts at
+	 * the first band where a piece is missing. */
+	for (i = 0 ; i < (band ? vnpieces : hnpieces) ; i++) {
+		uint32_t y_of_last_read_scanline= 0;
 
-			uint32_t outlengthwithbottomoverlap= outlength + voverlap;
-			uint32_t ybottomboundary = y + outlengthwithbottomoverlap;
+		for (j = 0 ; j < (band ? hnpieces : vnpieces) ; j++) {
+			char * outfilename;
+			void * out; /* TIFF* or FILE* */
+			uint32_t outwidthwithoverlap, outlengthwithoverlap;
+			uint32_t leftoverlap, xwithleftoverlap;
+			uint32_t outwidthwithrightoverlap, xrightboundary;
+			uint32_t topoverlap, ywithtopoverlap;
+			uint32_t outlengthwithbottomoverlap, ybottomboundary;
+			MosaicPieceRecord record;
+			MemoryFile * memout = NULL;
+			int success;
+
+			x = (band ? j : i) * outwidth;
+			y = (band ? i : j) * outlength;
+
+			leftoverlap = x < hoverlap ? x : hoverlap;
+			xwithleftoverlap= x - leftoverlap;
+
+			outwidthwithrightoverlap = outwidth + hoverlap;
+			xrightboundary = x + outwidthwithrightoverlap;
+			    /* equal to xwithleftoverlap + outwidth + 2*hoverlap */
+			assert(xrightboundary >= x); /* detect overflows */
+			if (xrightboundary > inimagewidth)
+				outwidthwithrightoverlap = inimagewidth - x;
+			outwidthwithoverlap = leftoverlap +
+				outwidthwithrightoverlap;
+
+			assert(xwithleftoverlap < inimagewidth); /* xwol would be < 0 */
+			assert(xwithleftoverlap + outwidthwithoverlap <=
+				inimagewidth);
+
+			topoverlap = y < voverlap ? y : voverlap;
+			ywithtopoverlap= y-topoverlap;
+
+			outlengthwithbottomoverlap= outlength + voverlap;
+			ybottomboundary = y + outlengthwithbottomoverlap;
 			assert(ybottomboundary >= y); /* detect overflows */
 			if (ybottomboundary > inimagelength)
 			    outlengthwithbottomoverlap = inimagelength - y;
@@ -1528,51 +4062,219 @@ tiffMakeMosaic(TIFF* in, uint16_t mosaiccompressionformat,
 			    mosaiccompressionformat == COMPRESSION_JPEG_IN_JPEG_FILE ?
 				JPEG_SUFFIX : TIFF_SUFFIX);
 
-			out = mosaiccompressionformat == COMPRESSION_JPEG_IN_JPEG_FILE ?
-			    fopen(outfilename, "wb") :
-			    (void *) TIFFOpen(outfilename,
-				TIFFIsBigEndian(in)?"wb":"wl");
+			if (tissuemask.istissue != NULL &&
+			    ! showsTissue(&tissuemask,
+			    ndpixmin + xwithleftoverlap,
+			    ndpiymin + ywithtopoverlap,
+			    outwidthwithoverlap, outlengthwithoverlap)) {
+				if (verbose >= 2)
+					fprintf(stderr, " Skipping mosaic tile \"%s\" without tissue\n",
+						outfilename);
+				if (printcontroldata)
+					printControlData("Mosaic piece without tissue, not made:%s\n",
+					    outfilename);
+				_TIFFfree(outfilename);
+				numberofpieceswithouttissue++;
+				continue;
+			}
+
+			if (isInBlankColumns(&blankcolumns,
+			    ndpixmin + xwithleftoverlap, outwidthwithoverlap)) {
+				if (verbose >= 2)
+					fprintf(stderr, " Skipping mosaic tile \"%s\" in blank lanes\n",
+						outfilename);
+				if (printcontroldata)
+					printControlData("Mosaic piece in blank lanes, not made:%s\n",
+					    outfilename);
+				_TIFFfree(outfilename);
+				numberofpiecesinblanklanes++;
+				continue;
+			}
+
+			record.name = outfilename;
+			record.x = inxmin + xwithleftoverlap;
+			record.y = inymin + ywithtopoverlap;
+			record.width = outwidthwithoverlap;
+			record.length = outlengthwithoverlap;
+			if (isMosaicPieceAlreadyMade(&manifest, &record)) {
+				if (verbose >= 2)
+					fprintf(stderr, " Keeping mosaic tile \"%s\" made by a previous run\n",
+						outfilename);
+				if (printcontroldata)
+					printControlData("Mosaic piece already made, kept:%s\n",
+					    outfilename);
+				_TIFFfree(outfilename);
+				numberofpiecesalreadymade++;
+				continue;
+			}
+
+			/* A piece is written into memory, then into the
+			 * archive (a JPEG piece has no FILE* then) or, for a
+			 * TIFF piece, which libtiff does not write in order,
+			 * into its file; its size and hash are computed along
+			 * the way */
+			out = NULL;
+			record.size = 0;
+			record.hash = FNV_OFFSET_BASIS;
+			if (mosaiccompressionformat == COMPRESSION_JPEG_IN_JPEG_FILE &&
+			    mosaicarchive.f == NULL)
+				out = fopen(outfilename, "wb");
+			else {
+				memout = newMemoryFile();
+				if (memout != NULL && mosaiccompressionformat !=
+				    COMPRESSION_JPEG_IN_JPEG_FILE &&
+				    (out = openMemoryTIFF(outfilename,
+				    TIFFIsBigEndian(in)?"wb":"wl", memout)) ==
+				    NULL) {
+					freeMemoryFile(memout);
+					memout = NULL;
+				}
+			}
 			if (verbose >= 2)
 				fprintf(stderr, " Writing mosaic tile \"%s\"\n",
 					outfilename);
-			_TIFFfree(outfilename);
-			if (out == NULL)
+			if (out == NULL && memout == NULL) {
+				_TIFFfree(outfilename);
 				continue;
+			}
+
+			copyjpegdata = hasgrid && isOnRestartIntervalGrid(&grid,
+			    ndpixmin + xwithleftoverlap,
+			    ndpiymin + ywithtopoverlap,
+			    outwidthwithoverlap, outlengthwithoverlap);
+
+			if (band != NULL && ! copyjpegdata &&
+			    bandy != inymin + ywithtopoverlap) {
+				const unsigned char * prevband = band;
+				uint32_t prevbandy = bandy;
+				uint32_t prevbandlength = bandlength;
+				uint32_t ncarriedrows;
+
+				if (otherband != NULL) {
+					unsigned char * b = band;
+					uint32_t by = bandy, bl = bandlength;
+
+					band = otherband;
+					bandy = otherbandy;
+					bandlength = otherbandlength;
+					otherband = b;
+					otherbandy = by;
+					otherbandlength = bl;
+				}
+				/* pieces being encoded may still be in it */
+				if (! finishEncodingPieces(&pool, band))
+					status = 0;
+				/* The overlap rows are carried over from the
+				 * previous band rather than decoded again, which
+				 * for most compression methods would mean
+				 * restarting from the top of the strip */
+				ncarriedrows = carryOverlapRows(band,
+				    inymin + ywithtopoverlap, outlengthwithoverlap,
+				    prevband, prevbandy, prevbandlength,
+				    bandrowsizeinbytes);
+				bandy = (uint32_t) -1;
+				if (verbose >= 4)
+					fprintf(stderr, "Reading scanlines "
+					    TIFF_UINT32_FORMAT " to "
+					    TIFF_UINT32_FORMAT
+					    " of \"%s\" into band (%u rows "
+					    "already decoded)\n",
+					    inymin + ywithtopoverlap,
+					    inymin + ywithtopoverlap +
+					    outlengthwithoverlap - 1,
+					    TIFFFileName(in), ncarriedrows);
+				if (ncarriedrows < outlengthwithoverlap &&
+				    ! readContigStripColumnsIntoBuffer(in,
+				    band + ncarriedrows * bandrowsizeinbytes,
+				    inymin + ywithtopoverlap + ncarriedrows,
+				    outlengthwithoverlap - ncarriedrows,
+				    inxmin, inimagewidth, bandmemorysize -
+				    ncarriedrows * bandrowsizeinbytes)) {
+					if (mosaiccompressionformat !=
+					    COMPRESSION_JPEG_IN_JPEG_FILE)
+						TIFFClose(out);
+					else if (out != NULL)
+						fclose(out);
+					freeMemoryFile(memout);
+					_TIFFfree(outfilename);
+					continue;
+				}
+				bandy = inymin + ywithtopoverlap;
+				bandlength = outlengthwithoverlap;
+			}
 
-			if (mosaiccompressionformat ==
+			if (copyjpegdata) {
+				if (verbose >= 4)
+					fprintf(stderr, "Copying JPEG data of portion at ("
+						TIFF_UINT32_FORMAT ", "
+						TIFF_UINT32_FORMAT
+						") of size " TIFF_UINT32_FORMAT
+						" x " TIFF_UINT32_FORMAT
+						" from NDPI file \"%s\"\n",
+						ndpixmin + xwithleftoverlap,
+						ndpiymin + ywithtopoverlap,
+						outwidthwithoverlap,
+						outlengthwithoverlap,
+						TIFFFileName(ndpi));
+				success = writeJPEGFromRestartIntervals(ndpi,
+				    &grid, out, memout, &record,
+				    ndpixmin + xwithleftoverlap,
+				    ndpiymin + ywithtopoverlap,
+				    outwidthwithoverlap, outlengthwithoverlap);
+				if (out != NULL && fclose(out) != 0)
+					success = 0;
+				if (!success)
+					fprintf(stderr, "Error while copying JPEG data into mosaic piece of file \"%s\".\n",
+						TIFFFileName(in));
+			} else if (mosaiccompressionformat ==
 			    COMPRESSION_JPEG_IN_JPEG_FILE) {
-				struct jpeg_compress_struct cinfo;
-				struct jpeg_error_mgr jerr;
-
-				cinfo.err = jpeg_std_error(&jerr);
-				jpeg_create_compress(&cinfo);
-				jpeg_stdio_dest(&cinfo, out);
-				cinfo.image_width = outwidthwithoverlap;
-				cinfo.image_height = outlengthwithoverlap;
-				cinfo.input_components = spp; /* # of
+				struct jpeg_compress_struct cinfo, * p_cinfo = &cinfo;
+				struct jpeg_error_mgr jerr, * p_jerr = &jerr;
+				uint16_t hsamp, vsamp;
+				/* JPEG tiles are copied as planar YCbCr,
+				 * without color conversion nor chroma
+				 * resampling, when they are suitably
+				 * aligned */
+				int copyycbcr = canCopyYCbCrTiles2JPEG(in,
+				    inxmin + xwithleftoverlap,
+				    inymin + ywithtopoverlap,
+				    &hsamp, &vsamp);
+				EncodingPiece * piece = copyycbcr ? NULL :
+				    acquireEncodingPiece(&pool, band == NULL);
+
+				if (piece != NULL) {
+					p_cinfo = &piece->cinfo;
+					p_jerr = &piece->jerr;
+				}
+
+				p_cinfo->err = jpeg_std_error(p_jerr);
+				jpeg_create_compress(p_cinfo);
+				if (memout != NULL)
+					setMemoryDestination(p_cinfo, memout);
+				else
+					setHashingDestination(p_cinfo, out);
+				p_cinfo->image_width = outwidthwithoverlap;
+				p_cinfo->image_height = outlengthwithoverlap;
+				p_cinfo->input_components = spp; /* # of
 					color components per pixel */
-				cinfo.in_color_space = JCS_RGB; /* colorspace
-					of input image */
-				jpeg_set_defaults(&cinfo);
-				if (mosaic_JPEG_quality <= 0) {
-					uint16_t in_compression;
-
-					TIFFGetField(in, TIFFTAG_COMPRESSION, &in_compression);
-					if (in_compression == COMPRESSION_JPEG) {
-						int in_jpegquality;
-						TIFFGetField(in,
-						    TIFFTAG_JPEGQUALITY,
-						    &in_jpegquality);
-						mosaic_JPEG_quality = in_jpegquality;
-					} else
-						mosaic_JPEG_quality = default_JPEG_quality;
+				p_cinfo->in_color_space = copyycbcr ? JCS_YCbCr :
+					JCS_RGB; /* colorspace of input image */
+				jpeg_set_defaults(p_cinfo);
+				if (copyycbcr) {
+					p_cinfo->raw_data_in = TRUE;
+					p_cinfo->comp_info[0].h_samp_factor = hsamp;
+					p_cinfo->comp_info[0].v_samp_factor = vsamp;
+					p_cinfo->comp_info[1].h_samp_factor = 1;
+					p_cinfo->comp_info[1].v_samp_factor = 1;
+					p_cinfo->comp_info[2].h_samp_factor = 1;
+					p_cinfo->comp_info[2].v_samp_factor = 1;
 				}
 				if (verbose >= 3)
 					fprintf(stderr, "JPEG quality set to %d.\n",
-						mosaic_JPEG_quality);
-				jpeg_set_quality(&cinfo, mosaic_JPEG_quality,
+						quality);
+				jpeg_set_quality(p_cinfo, quality,
 				    TRUE /* limit to baseline-JPEG values */);
-				jpeg_start_compress(&cinfo, TRUE);
+				jpeg_start_compress(p_cinfo, TRUE);
 
 				if (verbose >= 4)
 					fprintf(stderr, "Copying portion at ("
@@ -1581,61 +4283,166 @@ tiffMakeMosaic(TIFF* in, uint16_t mosaiccompressionformat,
 						") of size " TIFF_UINT32_FORMAT
 						" x " TIFF_UINT32_FORMAT
 						" from TIFF file \"%s\"\n",
-						xwithleftoverlap, ywithtopoverlap,
+						inxmin + xwithleftoverlap,
+						inymin + ywithtopoverlap,
 						outwidthwithoverlap,
 						outlengthwithoverlap,
 						TIFFFileName(in));
 
-				if (TIFFIsTiled(in))
-					cpTiles2Strip(in, &cinfo, 1,
-					    xwithleftoverlap, ywithtopoverlap,
+				if (piece != NULL) {
+					piece->jpegout = out;
+					piece->memout = memout;
+					if (fillEncodingPiece(piece, in,
+					    inxmin + xwithleftoverlap,
+					    inymin + ywithtopoverlap,
+					    outwidthwithoverlap,
+					    outlengthwithoverlap, band, bandy,
+					    inxmin, bandrowsizeinbytes,
+					    bytesperpixel)) {
+						piece->record = record;
+						startEncodingPiece(piece);
+					} else {
+						jpeg_abort_compress(p_cinfo);
+						if (out != NULL)
+							fclose(out);
+						jpeg_destroy_compress(p_cinfo);
+						freeMemoryFile(memout);
+						_TIFFfree(outfilename);
+					}
+					continue;
+				}
+
+				if (copyycbcr)
+					success = cpYCbCrTiles2JPEG(in, p_cinfo,
+					    inxmin + xwithleftoverlap,
+					    inymin + ywithtopoverlap,
+					    outwidthwithoverlap,
+					    outlengthwithoverlap);
+				else if (TIFFIsTiled(in))
+					success = cpTiles2Strip(in, p_cinfo, 1,
+					    inxmin + xwithleftoverlap,
+					    inymin + ywithtopoverlap,
 					    outwidthwithoverlap,
 					    outlengthwithoverlap,
 					    outbuf, mosaiccompressionformat);
 				else
-					cpStrips2Strip(in, &cinfo, 1,
-					    xwithleftoverlap, ywithtopoverlap,
+					success = cpStrips2Strip(in, p_cinfo, 1,
+					    inxmin + xwithleftoverlap,
+					    inymin + ywithtopoverlap,
 					    outwidthwithoverlap,
 					    outlengthwithoverlap,
 					    outbuf, mosaiccompressionformat,
 					    &y_of_last_read_scanline,
-					    inimagelength);
-
-				jpeg_finish_compress(&cinfo);
-				fclose(out);
-				jpeg_destroy_compress(&cinfo);
+					    infilelength, band, bandy, inxmin,
+					    bandrowsizeinbytes,
+					    ring.rows != NULL ? &ring : NULL);
+
+				jpeg_finish_compress(p_cinfo);
+				if (out != NULL) {
+					getHashingDestinationHash(p_cinfo,
+					    &record);
+					if (fclose(out) != 0)
+						success = 0;
+				}
+				jpeg_destroy_compress(p_cinfo);
 			} else {
+				EncodingPiece * piece;
+
 				TIFFSetField(out, TIFFTAG_IMAGEWIDTH, outwidthwithoverlap);
 				TIFFSetField(out, TIFFTAG_IMAGELENGTH, outlengthwithoverlap);
 				TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, outlengthwithoverlap);
 				tiffCopyFieldsButDimensions(in, out);
 
+				piece = acquireEncodingPiece(&pool, 1);
+				if (piece != NULL) {
+					setMosaicPieceCompression(in, out,
+					    mosaiccompressionformat);
+					piece->tiffout = out;
+					piece->memout = memout;
+					if (fillEncodingPiece(piece, in,
+					    inxmin + xwithleftoverlap,
+					    inymin + ywithtopoverlap,
+					    outwidthwithoverlap,
+					    outlengthwithoverlap, band, bandy,
+					    inxmin, bandrowsizeinbytes,
+					    bytesperpixel)) {
+						piece->record = record;
+						startEncodingPiece(piece);
+					} else {
+						TIFFClose(out);
+						freeMemoryFile(memout);
+						_TIFFfree(outfilename);
+					}
+					continue;
+				}
+
 				if (TIFFIsTiled(in))
-					cpTiles2Strip(in, out, 0,
-						xwithleftoverlap,
-						ywithtopoverlap,
+					success = cpTiles2Strip(in, out, 0,
+						inxmin + xwithleftoverlap,
+						inymin + ywithtopoverlap,
 						outwidthwithoverlap,
 						outlengthwithoverlap,
 						outbuf,
 						mosaiccompressionformat);
 				else
-					cpStrips2Strip(in, out, 0,
-						xwithleftoverlap,
-						ywithtopoverlap,
+					success = cpStrips2Strip(in, out, 0,
+						inxmin + xwithleftoverlap,
+						inymin + ywithtopoverlap,
 						outwidthwithoverlap,
 						outlengthwithoverlap,
 						outbuf,
 						mosaiccompressionformat,
 						&y_of_last_read_scanline,
-						inimagelength);
+						infilelength, band, bandy, inxmin,
+						bandrowsizeinbytes,
+						ring.rows != NULL ? &ring : NULL);
 
 				TIFFClose(out);
 			}
+
+			if (! success)
+				status = 0;
+			else if (completeMosaicPiece(&record, memout))
+				recordMosaicPiece(&manifest, &record, memout);
+			else
+				status = 0;
+			freeMemoryFile(memout);
+			_TIFFfree(outfilename);
 		}
 	}
 
+	if (verbose >= 3 && numberofpieceswithouttissue > 0)
+		fprintf(stderr, " skipped " TIFF_UINT32_FORMAT " of "
+			TIFF_UINT32_FORMAT " pieces without tissue\n",
+			numberofpieceswithouttissue,
+			(uint32_t) (hnpieces * vnpieces));
+	if (verbose >= 3 && numberofpiecesinblanklanes > 0)
+		fprintf(stderr, " skipped " TIFF_UINT32_FORMAT " of "
+			TIFF_UINT32_FORMAT " pieces in blank lanes\n",
+			numberofpiecesinblanklanes,
+			(uint32_t) (hnpieces * vnpieces));
+
+	if (! freeEncodingPool(&pool))
+		status = 0;
+	if (verbose >= 3 && numberofpiecesalreadymade > 0)
+		fprintf(stderr, " kept " TIFF_UINT32_FORMAT " of "
+			TIFF_UINT32_FORMAT " pieces made by a previous run\n",
+			numberofpiecesalreadymade,
+			(uint32_t) (hnpieces * vnpieces));
+	closeMosaicManifest(&manifest);
 	_TIFFfree(infilename);
 	_TIFFfree(outbuf);
+	if (otherband != NULL)
+		_TIFFfree(otherband);
+	if (ring.rows != NULL)
+		_TIFFfree(ring.rows);
+	if (band != NULL)
+		_TIFFfree(band);
+	/* set by the band, or left by cpStrips2Strip for the next piece */
+	TIFFJPEGSetDecodeWindow(in, 0, 0);
+	if (hasgrid)
+		freeRestartIntervalGrid(&grid);
+	return status;
 }
 
 static void
@@ -1643,8 +4450,9 @@ computeMaxPieceMemorySize(uint32_t inimagewidth, uint32_t inimagelength,
 	uint16_t spp, uint16_t bitspersample,
 	uint32_t outpiecewidth, uint32_t outpiecelength,
 	uint32_t overlapinpixels, long double overlapinpercent,
+	uint32_t hunit, uint32_t vunit,
 	tmsize_t * maxoutmemorysize, tmsize_t * ourmaxoutmemorysize,
-	uint32_t * hnpieces, uint32_t * vnpieces,
+	tmsize_t * bandmemorysize, uint32_t * hnpieces, uint32_t * vnpieces,
 	uint32_t * hoverlap, uint32_t * voverlap)
 {
 	uint32_t maxpiecewidthwithoverlap, maxpiecelengthwithoverlap;
@@ -1658,6 +4466,11 @@ computeMaxPieceMemorySize(uint32_t inimagewidth, uint32_t inimagelength,
 		*voverlap= overlapinpixels;
 	}
 
+	/* Overlaps are whole numbers of units so that pieces stay on the
+	 * grid of units when the piece dimensions are multiples of them */
+	*hoverlap= (*hoverlap + hunit - 1) / hunit * hunit;
+	*voverlap= (*voverlap + vunit - 1) / vunit * vunit;
+
 	if (*hoverlap > outpiecewidth)
 		*hoverlap= outpiecewidth;
 	if (*voverlap > outpiecelength)
@@ -1675,6 +4488,11 @@ computeMaxPieceMemorySize(uint32_t inimagewidth, uint32_t inimagelength,
 		maxpiecelengthwithoverlap * (bitspersample/8);
 	*maxoutmemorysize= *ourmaxoutmemorysize * (spp == 3 ? 4 : spp);
 	*ourmaxoutmemorysize *= spp;
+	/* Row band of decoded scanlines, as tall as the tallest piece and
+	 * as wide as the mosaic, from which the pieces of a
+	 * strip-organized image are cut (see tiffMakeMosaic) */
+	*bandmemorysize= (tmsize_t) inimagewidth *
+		maxpiecelengthwithoverlap * (bitspersample/8) * spp;
 
 	if (verbose >= 3)
 		fprintf(stderr, "Trying with pieces of "
@@ -1686,6 +4504,285 @@ computeMaxPieceMemorySize(uint32_t inimagewidth, uint32_t inimagelength,
 			*voverlap, *maxoutmemorysize / 1048576.0);
 }
 
+	/* Lossless mosaic pieces (-J with -mJ or -MJ): the restart
+	 * intervals of the JPEG strip of an NDPI image are MCU-aligned
+	 * pieces of the bitstream which can be decoded independently. A
+	 * piece whose edges lie on their grid is written as the JPEG header
+	 * of the NDPI image with new dimensions, followed by the restart
+	 * intervals it covers with renumbered restart markers. */
+#define	JPEGMARKER_SOI	0xD8
+#define	JPEGMARKER_SOS	0xDA
+#define	JPEGMARKER_DRI	0xDD
+#define	JPEGMARKER_DHT	0xC4
+#define	JPEGMARKER_SOF0	0xC0
+#define	JPEGMARKER_SOF1	0xC1
+
+static void
+freeRestartIntervalGrid(RestartIntervalGrid* grid)
+{
+	_TIFFfree(grid->header);
+	_TIFFfree(grid->offsets);
+	grid->header = NULL;
+	grid->offsets = NULL;
+}
+
+	/* Returns 1 if the current image of "in" has a usable grid of
+	 * restart intervals, 0 otherwise (giving the reason if verbose) */
+static int
+getRestartIntervalGrid(TIFF* in, RestartIntervalGrid* grid)
+{
+	uint16_t compression;
+	uint32_t count, k, p;
+	uint32_t* mcustarts;
+	uint64_t stripoffset, stripbytecount, high = 0;
+	uint8_t tail[16];
+	uint32_t width = 0, length = 0, restartinterval = 0;
+	uint32_t mcuwidth, mculength, mcusperrow;
+	int ncomponents = 0, c;
+	const char * reason = NULL;
+
+	memset(grid, 0, sizeof(RestartIntervalGrid));
+	TIFFGetFieldDefaulted(in, TIFFTAG_COMPRESSION, &compression);
+	if (compression != COMPRESSION_JPEG || TIFFIsTiled(in) ||
+	    TIFFNumberOfStrips(in) != 1) {
+		reason = "not a single JPEG strip";
+		goto bad;
+	}
+	if (!TIFFGetField(in, NDPITAG_MCUSTARTS, &count, &mcustarts) ||
+	    count < 2) {
+		reason = "no known restart marker positions, see -R";
+		goto bad;
+	}
+	stripoffset = TIFFGetStrileOffset(in, 0);
+	stripbytecount = TIFFGetStrileByteCount(in, 0);
+	grid->headerlength = mcustarts[0];
+	if (grid->headerlength < 4 || grid->headerlength > (1 << 20) ||
+	    grid->headerlength >= stripbytecount) {
+		reason = "unexpected JPEG header";
+		goto bad;
+	}
+	grid->header = (uint8_t *) _TIFFmalloc(grid->headerlength);
+	grid->offsets = (uint64_t *) _TIFFmalloc(
+		((uint64_t) count + 1) * sizeof(uint64_t));
+	if (grid->header == NULL || grid->offsets == NULL) {
+		reason = "insufficient memory";
+		goto bad;
+	}
+	if (!readRawBytes(in, stripoffset, grid->header, grid->headerlength) ||
+	    grid->header[0] != 0xFF || grid->header[1] != JPEGMARKER_SOI) {
+		reason = "unexpected JPEG header";
+		goto bad;
+	}
+
+	for (p = 2; p + 4 <= grid->headerlength; ) {
+		uint8_t * segment = grid->header + p;
+		uint32_t segmentlength = 2 + ((segment[2] << 8) | segment[3]);
+
+		if (segment[0] != 0xFF ||
+		    p + segmentlength > grid->headerlength) {
+			reason = "unexpected JPEG header";
+			goto bad;
+		}
+		if (segment[1] == JPEGMARKER_SOS) {
+			if (p + segmentlength != grid->headerlength) {
+				reason = "unexpected JPEG header";
+				goto bad;
+			}
+			break;
+		} else if (segment[1] == JPEGMARKER_DRI && segmentlength >= 6)
+			restartinterval = (segment[4] << 8) | segment[5];
+		else if (segment[1] == JPEGMARKER_SOF0 ||
+		    segment[1] == JPEGMARKER_SOF1) {
+			if (segmentlength < 10) {
+				reason = "unexpected JPEG header";
+				goto bad;
+			}
+			length = (segment[5] << 8) | segment[6];
+			width = (segment[7] << 8) | segment[8];
+			ncomponents = segment[9];
+			if (segmentlength != 10 + 3 * (uint32_t) ncomponents) {
+				reason = "unexpected JPEG header";
+				goto bad;
+			}
+			grid->sofposition = p;
+			grid->hmax = grid->vmax = 1;
+			for (c = 0; c < ncomponents; c++) {
+				int h = segment[11+3*c] >> 4;
+				int v = segment[11+3*c] & 15;
+				if (h > grid->hmax)
+					grid->hmax = h;
+				if (v > grid->vmax)
+					grid->vmax = v;
+			}
+		} else if (segment[1] >= 0xC0 && segment[1] <= 0xCF &&
+		    segment[1] != JPEGMARKER_DHT && segment[1] != 0xC8 &&
+		    segment[1] != 0xCC) {
+			reason = "not a baseline JPEG image";
+			goto bad;
+		}
+		p += segmentlength;
+	}
+	if (grid->sofposition == 0 || restartinterval == 0 || width == 0 ||
+	    length == 0) {
+		reason = "no restart intervals";
+		goto bad;
+	}
+
+	if (ncomponents == 1)
+		mcuwidth = mculength = 8;
+	else {
+		mcuwidth = 8 * grid->hmax;
+		mculength = 8 * grid->vmax;
+	}
+	mcusperrow = (width + mcuwidth - 1) / mcuwidth;
+	if (mcusperrow % restartinterval != 0) {
+		reason = "restart intervals not aligned on rows";
+		goto bad;
+	}
+	grid->imagewidth = width;
+	grid->imagelength = length;
+	grid->intervalwidth = restartinterval * mcuwidth;
+	grid->mculength = mculength;
+	grid->intervalsperrow = mcusperrow / restartinterval;
+	grid->nintervals = grid->intervalsperrow *
+		((length + mculength - 1) / mculength);
+	if (count != grid->nintervals) {
+		reason = "restart marker positions not matching the image";
+		goto bad;
+	}
+
+	/* The tag holds the 32 low-order bits of the offsets relative to
+	 * the strip, in increasing order. The last interval ends with
+	 * EOI, possibly before some padding. */
+	for (k = 0; k < count; k++) {
+		if (k > 0 && mcustarts[k] <= mcustarts[k-1])
+			high += (uint64_t) 1 << 32;
+		grid->offsets[k] = stripoffset + high + mcustarts[k];
+	}
+	if (grid->offsets[count-1] + sizeof(tail) > stripoffset + stripbytecount ||
+	    !readRawBytes(in, stripoffset + stripbytecount - sizeof(tail),
+		tail, sizeof(tail))) {
+		reason = "restart marker positions not matching the image";
+		goto bad;
+	}
+	for (k = sizeof(tail) - 1; k > 0; k--)
+		if (tail[k-1] == 0xFF && tail[k] == JPEG_EOI)
+			break;
+	if (k == 0) {
+		reason = "no end of JPEG data";
+		goto bad;
+	}
+	grid->offsets[count] = stripoffset + stripbytecount -
+		sizeof(tail) + k + 1;
+	return 1;
+
+bad:
+	if (verbose)
+		fprintf(stderr, "Mosaic pieces will be re-encoded (%s).\n",
+			reason);
+	freeRestartIntervalGrid(grid);
+	return 0;
+}
+
+	/* Returns 1 if the box of the image at x, y (in pixels) of size
+	 * width x length is made of whole restart intervals */
+static int
+isOnRestartIntervalGrid(const RestartIntervalGrid* grid, uint32_t x,
+	uint32_t y, uint32_t width, uint32_t length)
+{
+	return x % grid->intervalwidth == 0 &&
+	    y % grid->mculength == 0 &&
+	    ((x + width) % grid->intervalwidth == 0 ||
+	     x + width == grid->imagewidth) &&
+	    ((y + length) % grid->mculength == 0 ||
+	     y + length == grid->imagelength) &&
+	    width > 0 && length > 0 &&
+	    x + width <= grid->imagewidth &&
+	    y + length <= grid->imagelength;
+}
+
+	/* Writes into "out" (into memout if not NULL) a JPEG file made
+	 * from the restart intervals of the box, which must satisfy
+	 * isOnRestartIntervalGrid, updating the size and hash of record as
+	 * for writeToPieceFile */
+static int
+writeJPEGFromRestartIntervals(TIFF* in, const RestartIntervalGrid* grid,
+	FILE* out, MemoryFile* memout, MosaicPieceRecord* record, uint32_t x, uint32_t y, uint32_t width,
+	uint32_t length)
+{
+	uint32_t firstcolumn = x / grid->intervalwidth;
+	uint32_t ncolumns = (width + grid->intervalwidth - 1) /
+		grid->intervalwidth;
+	uint32_t firstrow = y / grid->mculength;
+	uint32_t nrows = (length + grid->mculength - 1) / grid->mculength;
+	uint8_t * buf = NULL;
+	uint64_t bufsize = 0;
+	uint32_t row, i, q = 0;
+	uint8_t sofdimensions[4];
+	int status = 1;
+
+	sofdimensions[0] = (uint8_t) (length >> 8);
+	sofdimensions[1] = (uint8_t) length;
+	sofdimensions[2] = (uint8_t) (width >> 8);
+	sofdimensions[3] = (uint8_t) width;
+	if (!writeToPieceFile(out, memout, record, grid->header,
+	    grid->sofposition + 5) ||
+	    !writeToPieceFile(out, memout, record, sofdimensions, 4) ||
+	    !writeToPieceFile(out, memout, record,
+	    grid->header + grid->sofposition + 9,
+	    grid->headerlength - grid->sofposition - 9))
+		return 0;
+
+	for (row = firstrow; status && row < firstrow + nrows; row++) {
+		uint32_t first = row * grid->intervalsperrow + firstcolumn;
+		uint64_t start = grid->offsets[first];
+		uint64_t end = grid->offsets[first + ncolumns];
+
+		if (end <= start + 2 ||
+		    (uint64_t) (tmsize_t) (end - start) != end - start) {
+			status = 0;
+			break;
+		}
+		if (end - start > bufsize) {
+			_TIFFfree(buf);
+			bufsize = end - start;
+			buf = (uint8_t *) _TIFFmalloc((tmsize_t) bufsize);
+			if (buf == NULL) {
+				fprintf(stderr, "Error: insufficient memory for JPEG data.\n");
+				status = 0;
+				break;
+			}
+		}
+		if (!readRawBytes(in, start, buf, (tmsize_t) (end - start))) {
+			fprintf(stderr, "Unable to read JPEG data in file \"%s\".\n",
+				TIFFFileName(in));
+			status = 0;
+			break;
+		}
+		for (i = 0; i < ncolumns; i++, q++) {
+			uint32_t n = first + i;
+			uint8_t * marker = buf + (grid->offsets[n+1] - start) - 2;
+
+			if (marker[0] != 0xFF || marker[1] !=
+			    (n + 1 == grid->nintervals ? JPEG_EOI :
+			    JPEG_RST0 + (n & 7))) {
+				fprintf(stderr, "Unexpected end of restart interval " TIFF_UINT32_FORMAT " in file \"%s\".\n",
+					n, TIFFFileName(in));
+				status = 0;
+				break;
+			}
+			marker[1] = row + 1 == firstrow + nrows &&
+			    i + 1 == ncolumns ? JPEG_EOI :
+			    JPEG_RST0 + (q & 7);
+		}
+		if (status && !writeToPieceFile(out, memout, record, buf,
+		    (tmsize_t) (end - start)))
+			status = 0;
+	}
+	_TIFFfree(buf);
+	return status;
+}
+
 static void
 tiffCopyFieldsButDimensions(TIFF* in, TIFF* out)
 {
@@ -1898,8 +4995,6 @@ static int readContigStripsIntoBuffer(TIFF* in, uint8_t* buf,
 	uint32_t firstrow, uint32_t lengthtoread, tmsize_t bufsize)
 {
 	tmsize_t scanlinesize = TIFFRasterScanlineSize(in);
-	uint8_t* bufp = buf;
-	uint32_t row;
 
 	if (lengthtoread * scanlinesize > bufsize) {
 		/* stderr rather than TIFFError since there may be
@@ -1910,19 +5005,137 @@ static int readContigStripsIntoBuffer(TIFF* in, uint8_t* buf,
 		lengthtoread = bufsize / scanlinesize;
 	}
 
+	if (scanlinesize != TIFFScanlineSize(in)) {
+		uint8_t* bufp = buf;
+		uint32_t row;
+
+		for (row = firstrow; row < firstrow + lengthtoread; row++) {
+			if (TIFFReadScanline(in, (tdata_t) bufp, row, 0) < 0) {
+				TIFFError(TIFFFileName(in),
+				    "Error, can't read scanline "
+				    TIFF_UINT32_FORMAT, row);
+				return 0;
+			}
+			bufp += scanlinesize;
+		}
+	} else if (TIFFReadScanlines(in, buf, firstrow, lengthtoread) < 0) {
+		TIFFError(TIFFFileName(in),
+		    "Error, can't read scanlines " TIFF_UINT32_FORMAT
+		    " to " TIFF_UINT32_FORMAT,
+		    firstrow, firstrow + lengthtoread - 1);
+		return 0;
+	}
+
+	return 1;
+}
+
+	/* Like readContigStripsIntoBuffer, but keeps only the columns xmin
+	 * to xmin+width-1 of each scanline, which are packed into buf */
+static int readContigStripColumnsIntoBuffer(TIFF* in, uint8_t* buf,
+	uint32_t firstrow, uint32_t lengthtoread, uint32_t xmin,
+	uint32_t width, tmsize_t bufsize)
+{
+	tmsize_t scanlinesize = TIFFRasterScanlineSize(in);
+	tmsize_t rowsize, xoffset;
+	uint32_t imagewidth, row;
+	uint8_t* scanline;
+
+	TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &imagewidth);
+	if (xmin == 0 && width == imagewidth)
+		return readContigStripsIntoBuffer(in, buf, firstrow,
+		    lengthtoread, bufsize);
+
+	rowsize = scanlinesize / imagewidth * width;
+	xoffset = scanlinesize / imagewidth * xmin;
+	if (lengthtoread * rowsize > bufsize) {
+		fprintf(stderr,
+			"%s: Error in calculating dimensions --- resulting image may be corrupted.\nConsider sending the input NDPI file to the author of ndpisplit for improvement.\n",
+			TIFFFileName(in));
+		lengthtoread = bufsize / rowsize;
+	}
+
+	scanline = _TIFFmalloc(TIFFScanlineSize(in) > scanlinesize ?
+	    TIFFScanlineSize(in) : scanlinesize);
+	if (scanline == NULL) {
+		TIFFError(TIFFFileName(in),
+		    "Error, can't allocate space for scanline");
+		return 0;
+	}
 	for (row = firstrow; row < firstrow + lengthtoread; row++) {
-		if (TIFFReadScanline(in, (tdata_t) bufp, row, 0) < 0) {
+		if (TIFFReadScanline(in, (tdata_t) scanline, row, 0) < 0) {
 			TIFFError(TIFFFileName(in),
-			    "Error, can't read scanline " TIFF_UINT32_FORMAT,
-			    row);
+			    "Error, can't read scanline "
+			    TIFF_UINT32_FORMAT, row);
+			_TIFFfree(scanline);
 			return 0;
 		}
-		bufp += scanlinesize;
+		_TIFFmemcpy(buf, scanline + xoffset, rowsize);
+		buf += rowsize;
 	}
+	_TIFFfree(scanline);
+	return 1;
+}
+
+	/* Copies to the top of band (for rows firstrow to firstrow+length-1)
+	 * the first of these rows that are already in prevband, which holds
+	 * prevlength rows from prevfirstrow on and may be band itself.
+	 * Returns the number of rows copied. */
+static uint32_t
+carryOverlapRows(unsigned char * band, uint32_t firstrow, uint32_t length,
+	const unsigned char * prevband, uint32_t prevfirstrow,
+	uint32_t prevlength, tmsize_t rowsizeinbytes)
+{
+	uint32_t n;
+
+	if (prevband == NULL || prevfirstrow == (uint32_t) -1 ||
+	    firstrow < prevfirstrow || firstrow >= prevfirstrow + prevlength)
+		return 0;
+	n = prevfirstrow + prevlength - firstrow;
+	if (n > length)
+		n = length;
+	memmove(band, prevband + (firstrow - prevfirstrow) * rowsizeinbytes,
+	    n * rowsizeinbytes);
+	return n;
+}
 
+	/* Copies row y, from xmin on and of the given width, into dest if it
+	 * is in the ring. Returns 0 if it isn't. */
+static int
+getRowFromRing(DecodedRowRing* ring, uint32_t y, uint32_t xmin,
+	uint32_t width, unsigned char * dest)
+{
+	if (ring->count == 0 || xmin != ring->xmin || width != ring->width ||
+	    y < ring->firstrow || y >= ring->firstrow + ring->count)
+		return 0;
+	_TIFFmemcpy(dest, ring->rows + (y % ring->capacity) *
+	    ring->rowsizeinbytes, (tmsize_t) width * ring->bytesperpixel);
 	return 1;
 }
 
+	/* Keeps row y, from xmin on and of the given width, in the ring,
+	 * in place of the oldest one. The ring is emptied if the row does
+	 * not follow the ones it holds. */
+static void
+putRowIntoRing(DecodedRowRing* ring, uint32_t y, uint32_t xmin,
+	uint32_t width, const unsigned char * src)
+{
+	if ((tmsize_t) width * ring->bytesperpixel > ring->rowsizeinbytes)
+		return;
+	if (ring->count == 0 || xmin != ring->xmin ||
+	    width != ring->width || y != ring->firstrow + ring->count) {
+		ring->xmin = xmin;
+		ring->width = width;
+		ring->firstrow = y;
+		ring->count = 0;
+	}
+	_TIFFmemcpy(ring->rows + (y % ring->capacity) * ring->rowsizeinbytes,
+	    src, (tmsize_t) width * ring->bytesperpixel);
+	if (ring->count < ring->capacity)
+		ring->count++;
+	else
+		ring->firstrow++;
+}
+
 static void cpBufToBuf(uint8_t* out, uint8_t* in, uint32_t rows,
 	uint32_t bytesperline, int outskew, int inskew)
 {
@@ -1935,11 +5148,15 @@ static void cpBufToBuf(uint8_t* out, uint8_t* in, uint32_t rows,
 	}
 }
 
+	/* Writes the tiles of out from the rows in buf, writing the tiles
+	 * in blank columns as blanktile unless it is NULL. With several
+	 * encoding threads, each row of tiles is encoded by the threads,
+	 * then written in the same order as one tile at a time. */
 static int
 writeBufferToContigTiles(TIFF* out, uint8_t* buf,
 	uint32_t inimagerowsizeinbytes, uint32_t firstrow,
 	uint32_t lengthtowrite, uint32_t firstcol,
-	uint32_t widthtowrite, uint16_t bytesperpixel)
+	uint32_t widthtowrite, uint16_t bytesperpixel, BlankTile* blanktile)
 {
 	tmsize_t tilew = TIFFTileRowSize(out); /* in bytes */
 	int iskew = inimagerowsizeinbytes - tilew; /* in bytes */
@@ -1948,6 +5165,7 @@ writeBufferToContigTiles(TIFF* out, uint8_t* buf,
 	uint8_t* bufp = (uint8_t*) buf;
 	uint32_t tl, tw;
 	uint32_t row;
+	TileRowEncoder encoder;
 
 	if (widthtowrite * bytesperpixel > inimagerowsizeinbytes) {
 		/* stderr rather than TIFFError since there may be
@@ -1964,6 +5182,8 @@ writeBufferToContigTiles(TIFF* out, uint8_t* buf,
 	_TIFFmemset(obuf, 0, tilesize);
 	(void) TIFFGetField(out, TIFFTAG_TILELENGTH, &tl);
 	(void) TIFFGetField(out, TIFFTAG_TILEWIDTH, &tw);
+	initTileRowEncoder(&encoder, out, (widthtowrite + tw - 1) / tw,
+	    numberofencodingthreads);
 	for (row = firstrow; row < firstrow+lengthtowrite; row += tl) {
 		uint32_t nrow = (row+tl > firstrow+lengthtowrite) ?
 			firstrow+lengthtowrite-row : tl;
@@ -1971,6 +5191,18 @@ writeBufferToContigTiles(TIFF* out, uint8_t* buf,
 		uint32_t col;
 
 		for (col = 0; col < widthtowrite; col += tw) {
+			if (blanktile != NULL && isInBlankColumns(&blankcolumns,
+			    blanktile->ndpixmin + col,
+			    col + tw > widthtowrite ? widthtowrite - col : tw)) {
+				if (!holdTile(&encoder, NULL, col, row,
+				    blanktile)) {
+					freeTileRowEncoder(&encoder);
+					_TIFFfree(obuf);
+					return 0;
+				}
+				colb += tilew;
+				continue;
+			}
 			/*
 			 * Tile is clipped horizontally.  Calculate
 			 * visible portion and skewing factors.
@@ -1985,41 +5217,74 @@ writeBufferToContigTiles(TIFF* out, uint8_t* buf,
 			} else
 				cpBufToBuf(obuf, bufp + colb, nrow, tilew,
 				    0, iskew);
-			if (TIFFWriteTile(out, obuf, col, row, 0, 0) < 0) {
-				TIFFError(TIFFFileName(out),
-				    "Error, can't write tile at "
-				    TIFF_UINT32_FORMAT " " TIFF_UINT32_FORMAT,
-				    col, row);
+			if (!holdTile(&encoder, obuf, col, row, blanktile)) {
+				freeTileRowEncoder(&encoder);
 				_TIFFfree(obuf);
 				return 0;
 			}
 			colb += tilew;
 		}
+		if (!writeHeldTiles(&encoder, row, blanktile)) {
+			freeTileRowEncoder(&encoder);
+			_TIFFfree(obuf);
+			return 0;
+		}
 		bufp += nrow * inimagerowsizeinbytes;
 	}
+	freeTileRowEncoder(&encoder);
 	_TIFFfree(obuf);
 	return 1;
 }
 
-static int
-cpStrips2Tiles(TIFF* in, TIFF* out, uint32_t xmin, uint32_t ymin,
-	uint32_t width, uint32_t length, uint16_t requestedcompression)
+	/* Sets the tiles and the compression of out, whose pixels are to be
+	 * copied from the scanlines of in, and returns the tile length */
+static uint32_t
+setUpStrips2Tiles(TIFF* in, TIFF* out, uint16_t requestedcompression)
 {
 	uint32_t tilewidth = (uint32_t) -1, tilelength = (uint32_t) -1;
-	uint16_t spp, bitspersample, bytesperpixel;
-	uint32_t inimagelength, bufferlength;
-	tmsize_t inimagerowsizeinbytes, bufsize;
-	unsigned char *buf;
+	uint16_t spp;
 
 	TIFFDefaultTileSize(out, &tilewidth, &tilelength);
 		/* NDPI images are acquired through 128 pixel-wide 
 		 columns, thus try to align the tiles' limits on the 
 		 columns -- this is useful at least for the highest 
 		 resolution images */
-	tilewidth = 128;
+	tilewidth = NDPI_LANE_WIDTH;
 	TIFFSetField(out, TIFFTAG_TILEWIDTH, tilewidth);
 	TIFFSetField(out, TIFFTAG_TILELENGTH, tilelength);
 
+	if (requestedcompression == (uint16_t) -1)
+		TIFFGetField(out, TIFFTAG_COMPRESSION, &requestedcompression);
+	else
+		TIFFSetField(out, TIFFTAG_COMPRESSION, requestedcompression);
+	TIFFSetField(in, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
+	if (requestedcompression == COMPRESSION_JPEG) {
+		/* like in tiffcp.c -- otherwise the reserved size for
+		 the tiles is too small and the program segfaults */
+		TIFFSetField(out, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
+	} else if (TIFFGetFieldDefaulted(in, TIFFTAG_SAMPLESPERPIXEL, &spp) &&
+	    spp == 3)
+		/* the pixels are read from "in" as RGB, hence a YCbCr
+		 photometric copied from "in" would not fit them */
+		TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+	return tilelength;
+}
+
+static int
+cpStrips2Tiles(TIFF* in, TIFF* out, uint32_t xmin, uint32_t ymin,
+	uint32_t width, uint32_t length, uint16_t requestedcompression)
+{
+	uint16_t spp, bitspersample, bytesperpixel;
+	uint32_t inimagelength, bufferlength;
+	tmsize_t inimagerowsizeinbytes, bufsize;
+	unsigned char *buf;
+	BlankTile blanktile;
+
+	bufferlength = setUpStrips2Tiles(in, out, requestedcompression);
+	blanktile.ndpixmin = xmin;
+	blanktile.data = NULL;
+	blanktile.size = 0;
+
 	TIFFGetField(in, TIFFTAG_SAMPLESPERPIXEL, &spp);
 	TIFFGetField(in, TIFFTAG_BITSPERSAMPLE, &bitspersample);
 	assert( bitspersample % 8 == 0 );
@@ -2032,126 +5297,629 @@ cpStrips2Tiles(TIFF* in, TIFF* out, uint32_t xmin, uint32_t ymin,
 		return (0);
 	}
 
+	inimagerowsizeinbytes= TIFFRasterScanlineSize(in);
+	bufsize = inimagerowsizeinbytes * bufferlength;
+
+	buf = (unsigned char *)_TIFFmalloc(bufsize);
+	if (!buf) {
+		TIFFError(TIFFFileName(in),
+				"Error, can't allocate space for image buffer");
+		return (0);
+	} else {
+		int success = 1;
+		uint32_t row, lengthtodo;
+		uint16_t incompression;
+		uint32_t decodexmin = xmin, decodewidth = width;
+
+		/* Only decode the columns we copy (if JPEG-compressed),
+		 but not the tiles in blank lanes */
+		leaveOutBlankTiles(&blankcolumns, NDPI_LANE_WIDTH, &decodexmin, &decodewidth);
+		TIFFJPEGSetDecodeWindow(in, decodexmin, decodewidth);
+
+		/* Skip unwanted lines but read them to avoid error 
+		 "Compression algorithm does not support random access".
+		 The JPEG codec seeks by itself, using the NDPI MCU starts
+		 to restart decoding close to ymin. */
+		TIFFGetFieldDefaulted(in, TIFFTAG_COMPRESSION, &incompression);
+		for (row = 0 ; incompression != COMPRESSION_JPEG && row < ymin ;
+		    row++) {
+			if (verbose >= 1 &&
+			    (ymin-row) % bufferlength == 0)
+				fprintf(stderr, "  cpStrips2Tiles remaining lines: " TIFF_UINT32_FORMAT " \r",
+					length + ymin-row);
+			if (TIFFReadScanline(in, (tdata_t) buf, row, 0) < 0) {
+				TIFFError(TIFFFileName(in),
+				    "Error, can't read scanline " 
+				    TIFF_UINT32_FORMAT,
+				    row);
+			}
+		}
+
+		/* Now process wanted lines */
+		for (lengthtodo = length ; lengthtodo >= bufferlength ;
+		    lengthtodo -= bufferlength) {
+			if (readContigStripsIntoBuffer(in, (uint8_t*)buf, 
+					ymin+length-lengthtodo,
+					bufferlength, bufsize)) {
+				success = writeBufferToContigTiles(out,
+						(uint8_t*)buf,
+						inimagerowsizeinbytes,
+						length-lengthtodo,
+						bufferlength, xmin,
+						width, bytesperpixel,
+						&blanktile);
+			}
+
+		if (verbose >= 1)
+			fprintf(stderr, "  cpStrips2Tiles remaining lines: " TIFF_UINT32_FORMAT " \r",
+				lengthtodo);
+		}
+
+		if (success && lengthtodo > 0) {
+			if (readContigStripsIntoBuffer(in, (uint8_t*)buf,
+				ymin+length-lengthtodo, lengthtodo, bufsize)) {
+
+				success = writeBufferToContigTiles(out,
+					(uint8_t*)buf,
+					inimagerowsizeinbytes,
+					length-lengthtodo,
+					lengthtodo, xmin, width, bytesperpixel,
+					&blanktile);
+			}
+
+		if (verbose >= 1)
+			fprintf(stderr, "  cpStrips2Tiles remaining lines: " TIFF_UINT32_FORMAT " \r",
+				lengthtodo);
+		}
+		if (verbose >= 2)
+			fprintf(stderr, "  cpStrips2Tiles completed.        \n");
+		TIFFJPEGSetDecodeWindow(in, 0, 0);
+		freeBlankTile(&blanktile);
+		_TIFFfree(buf);
+		return (success);
+	}
+	return (0);
+}
+
+static void
+initStripSource(j_decompress_ptr cinfo)
+{
+	(void) cinfo;
+}
+
+static boolean
+fillStripSourceBuffer(j_decompress_ptr cinfo)
+{
+	StripSourceManager * src = (StripSourceManager *) cinfo->src;
+	tmsize_t n = src->remaining < sizeof(src->buffer) ?
+		(tmsize_t) src->remaining : (tmsize_t) sizeof(src->buffer);
+
+	if (n == 0 || !readRawBytes(src->in, src->offset, src->buffer, n)) {
+		/* Like libjpeg's own source managers, insert a fake EOI
+		 marker rather than fail on truncated data */
+		src->buffer[0] = 0xFF;
+		src->buffer[1] = JPEG_EOI;
+		n = 2;
+		src->remaining = 0;
+	} else {
+		src->offset += n;
+		src->remaining -= n;
+	}
+	src->pub.next_input_byte = src->buffer;
+	src->pub.bytes_in_buffer = n;
+	return TRUE;
+}
+
+static void
+skipStripSourceData(j_decompress_ptr cinfo, long nbytes)
+{
+	StripSourceManager * src = (StripSourceManager *) cinfo->src;
+
+	if (nbytes <= 0)
+		return;
+	if ((size_t) nbytes <= src->pub.bytes_in_buffer) {
+		src->pub.next_input_byte += nbytes;
+		src->pub.bytes_in_buffer -= nbytes;
+		return;
+	}
+	nbytes -= (long) src->pub.bytes_in_buffer;
+	src->pub.bytes_in_buffer = 0;
+	if ((uint64_t) nbytes > src->remaining)
+		nbytes = (long) src->remaining;
+	src->offset += nbytes;
+	src->remaining -= nbytes;
+}
+
+static void
+termStripSource(j_decompress_ptr cinfo)
+{
+	(void) cinfo;
+}
+
+	/* Returns 1 if the current image of "in" can be decoded by
+	 * cpScaledStrips2Tiles at 1/scaledenom scale */
+static int
+canDecodeScaledStrips(TIFF* in, unsigned scaledenom)
+{
+	uint16_t compression, spp, bitspersample, planarconfig;
+	uint32_t rowsperstrip;
+
+	TIFFGetFieldDefaulted(in, TIFFTAG_COMPRESSION, &compression);
+	TIFFGetFieldDefaulted(in, TIFFTAG_SAMPLESPERPIXEL, &spp);
+	TIFFGetFieldDefaulted(in, TIFFTAG_BITSPERSAMPLE, &bitspersample);
+	TIFFGetFieldDefaulted(in, TIFFTAG_PLANARCONFIG, &planarconfig);
+	TIFFGetFieldDefaulted(in, TIFFTAG_ROWSPERSTRIP, &rowsperstrip);
+	if (TIFFIsTiled(in) || compression != COMPRESSION_JPEG ||
+	    (spp != 1 && spp != 3) || bitspersample != 8 ||
+	    planarconfig != PLANARCONFIG_CONTIG)
+		return 0;
+		/* Each strip must give a whole number of scaled rows */
+	return TIFFNumberOfStrips(in) == 1 || rowsperstrip % scaledenom == 0;
+}
+
+	/* Decodes the JPEG strips of "in" at 1/scaledenom scale, letting
+	 * libjpeg do the downscaling inside its inverse DCT, and writes
+	 * the part of the scaled image at xmin, ymin of size width x
+	 * length as the tiles of "out". */
+static int
+cpScaledStrips2Tiles(TIFF* in, TIFF* out, unsigned scaledenom,
+	uint32_t xmin, uint32_t ymin, uint32_t width, uint32_t length,
+	uint16_t requestedcompression)
+{
+	struct jpeg_decompress_struct dinfo;
+	struct jpeg_error_mgr jerr;
+	StripSourceManager * src;
+	uint32_t tilewidth = (uint32_t) -1, tilelength = (uint32_t) -1;
+	uint32_t inimagewidth, inimagelength, rowsperstrip;
+	uint32_t tablescount = 0, row, bufrow = 0;
+	void * tables = NULL;
+	uint16_t spp;
+	tmsize_t bufrowsize, rowbufsize = 0;
+	uint8_t * buf, * rowbuf = NULL;
+	tstrip_t s, ns = TIFFNumberOfStrips(in);
+	int success = 1;
+	BlankTile blanktile;
+
+	blanktile.ndpixmin = xmin;
+	blanktile.data = NULL;
+	blanktile.size = 0;
+	TIFFDefaultTileSize(out, &tilewidth, &tilelength);
+	tilewidth = NDPI_LANE_WIDTH; /* as in cpStrips2Tiles */
+	TIFFSetField(out, TIFFTAG_TILEWIDTH, tilewidth);
+	TIFFSetField(out, TIFFTAG_TILELENGTH, tilelength);
+
+	TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &inimagewidth);
+	TIFFGetField(in, TIFFTAG_IMAGELENGTH, &inimagelength);
+	TIFFGetFieldDefaulted(in, TIFFTAG_ROWSPERSTRIP, &rowsperstrip);
+	TIFFGetField(in, TIFFTAG_SAMPLESPERPIXEL, &spp);
+	if (rowsperstrip > inimagelength)
+		rowsperstrip = inimagelength;
+
 	if (requestedcompression == (uint16_t) -1)
 		TIFFGetField(out, TIFFTAG_COMPRESSION, &requestedcompression);
 	else
 		TIFFSetField(out, TIFFTAG_COMPRESSION, requestedcompression);
-	TIFFSetField(in, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
-	if (requestedcompression == COMPRESSION_JPEG) {
-		/* like in tiffcp.c -- otherwise the reserved size for
-		 the tiles is too small and the program segfaults */
+	if (spp == 3)
+		TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+	if (requestedcompression == COMPRESSION_JPEG && spp == 3) {
+		TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_YCBCR);
 		TIFFSetField(out, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
 	}
 
-	inimagerowsizeinbytes= TIFFRasterScanlineSize(in);
-	bufferlength = tilelength;
-	bufsize = inimagerowsizeinbytes * bufferlength;
-
-	buf = (unsigned char *)_TIFFmalloc(bufsize);
-	if (!buf) {
+	/* Only the wanted columns are kept, tilelength rows at a time */
+	bufrowsize = (tmsize_t) width * spp;
+	buf = (uint8_t *) _TIFFmalloc(bufrowsize * tilelength);
+	src = (StripSourceManager *) _TIFFmalloc(sizeof(StripSourceManager));
+	if (buf == NULL || src == NULL) {
 		TIFFError(TIFFFileName(in),
 				"Error, can't allocate space for image buffer");
+		if (buf != NULL)
+			_TIFFfree(buf);
+		if (src != NULL)
+			_TIFFfree(src);
 		return (0);
-	} else {
-		int success = 1;
-		uint32_t row, lengthtodo;
+	}
+	src->pub.init_source = initStripSource;
+	src->pub.fill_input_buffer = fillStripSourceBuffer;
+	src->pub.skip_input_data = skipStripSourceData;
+	src->pub.resync_to_restart = jpeg_resync_to_restart;
+	src->pub.term_source = termStripSource;
+	src->in = in;
+
+	dinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_decompress(&dinfo);
+	if (TIFFGetField(in, TIFFTAG_JPEGTABLES, &tablescount, &tables) &&
+	    tablescount > 0 && tables != NULL) {
+		jpeg_mem_src(&dinfo, tables, tablescount);
+		(void) jpeg_read_header(&dinfo, FALSE);
+	}
 
-		/* Skip unwanted lines but read them to avoid error 
-		 "Compression algorithm does not support random access" */
-		for (row = 0 ; row < ymin ; row++) {
-			if (verbose >= 1 &&
-			    (ymin-row) % bufferlength == 0)
-				fprintf(stderr, "  cpStrips2Tiles remaining lines: " TIFF_UINT32_FORMAT " \r",
-					length + ymin-row);
-			if (TIFFReadScanline(in, (tdata_t) buf, row, 0) < 0) {
+	row = ymin;
+	for (s = 0 ; success && s < ns && row < ymin+length ; s++) {
+		/* Rows of the scaled image given by strip s */
+		uint32_t stripfirstrow = s * (rowsperstrip / scaledenom);
+		uint32_t striprows = inimagelength - s * rowsperstrip;
+		uint32_t firstcol = xmin;
+
+		if (striprows > rowsperstrip)
+			striprows = rowsperstrip;
+		if (stripfirstrow + (striprows+scaledenom-1) / scaledenom <=
+		    ymin)
+			continue;
+
+		src->offset = TIFFGetStrileOffset(in, s);
+		src->remaining = TIFFGetStrileByteCount(in, s);
+		src->pub.next_input_byte = NULL;
+		src->pub.bytes_in_buffer = 0;
+		dinfo.src = &src->pub;
+			/* as in JPEGPreDecode for NDPI files, whose JPEG
+			 headers can't hold such dimensions */
+		dinfo.image_width = inimagewidth >= ORDINARY_JPEG_MAX_DIMENSION ?
+			inimagewidth : 0;
+		dinfo.image_height = striprows >= ORDINARY_JPEG_MAX_DIMENSION ?
+			striprows : 0;
+		if (jpeg_read_header(&dinfo, TRUE) != JPEG_HEADER_OK) {
+			success = 0;
+			break;
+		}
+		dinfo.scale_num = 1;
+		dinfo.scale_denom = scaledenom;
+		dinfo.out_color_space = spp == 3 ? JCS_RGB : JCS_GRAYSCALE;
+		(void) jpeg_start_decompress(&dinfo);
+		if ((tmsize_t) dinfo.output_width * spp > rowbufsize) {
+			if (rowbuf != NULL)
+				_TIFFfree(rowbuf);
+			rowbufsize = (tmsize_t) dinfo.output_width * spp;
+			rowbuf = (uint8_t *) _TIFFmalloc(rowbufsize);
+			if (rowbuf == NULL) {
 				TIFFError(TIFFFileName(in),
-				    "Error, can't read scanline " 
-				    TIFF_UINT32_FORMAT,
-				    row);
+				    "Error, can't allocate space for image buffer");
+				success = 0;
+				break;
 			}
 		}
+		if (xmin + width > dinfo.output_width) {
+			TIFFError(TIFFFileName(in),
+			    "Error, scaled JPEG strip is narrower than expected");
+			success = 0;
+			break;
+		}
 
-		/* Now process wanted lines */
-		for (lengthtodo = length ; lengthtodo >= bufferlength ;
-		    lengthtodo -= bufferlength) {
-			if (readContigStripsIntoBuffer(in, (uint8_t*)buf, 
-					ymin+length-lengthtodo,
-					bufferlength, bufsize)) {
-				success = writeBufferToContigTiles(out,
-						(uint8_t*)buf,
-						inimagerowsizeinbytes,
-						length-lengthtodo,
-						bufferlength, xmin,
-						width, bytesperpixel);
-			}
+#if defined(LIBJPEG_TURBO_VERSION_NUMBER) && \
+    LIBJPEG_TURBO_VERSION_NUMBER >= 1005000
+		/* Only decode the columns we copy, and skip the rows
+		 above the wanted ones without decoding them */
+		if (width < dinfo.output_width) {
+			JDIMENSION xoffset = xmin, cropwidth = width;
 
-		if (verbose >= 1)
-			fprintf(stderr, "  cpStrips2Tiles remaining lines: " TIFF_UINT32_FORMAT " \r",
-				lengthtodo);
+			jpeg_crop_scanline(&dinfo, &xoffset, &cropwidth);
+			firstcol = xmin - xoffset;
+		}
+		if (row > stripfirstrow)
+			(void) jpeg_skip_scanlines(&dinfo,
+			    row - stripfirstrow);
+#endif
+		while (dinfo.output_scanline < row - stripfirstrow) {
+			JSAMPROW rowpointer = rowbuf;
+			(void) jpeg_read_scanlines(&dinfo, &rowpointer, 1);
 		}
 
-		if (success && lengthtodo > 0) {
-			if (readContigStripsIntoBuffer(in, (uint8_t*)buf,
-				ymin+length-lengthtodo, lengthtodo, bufsize)) {
+		while (dinfo.output_scanline < dinfo.output_height &&
+		    row < ymin+length) {
+			JSAMPROW rowpointer = rowbuf;
 
-				success = writeBufferToContigTiles(out,
-					(uint8_t*)buf,
-					inimagerowsizeinbytes,
-					length-lengthtodo,
-					lengthtodo, xmin, width, bytesperpixel);
+			if (jpeg_read_scanlines(&dinfo, &rowpointer, 1) != 1) {
+				success = 0;
+				break;
+			}
+			_TIFFmemcpy(buf + bufrow * bufrowsize,
+			    rowbuf + (tmsize_t) firstcol * spp, bufrowsize);
+			row++;
+			bufrow++;
+			if (bufrow == tilelength || row == ymin+length) {
+				success = writeBufferToContigTiles(out, buf,
+				    bufrowsize, row - ymin - bufrow, bufrow,
+				    0, width, spp, &blanktile);
+				bufrow = 0;
+				if (!success)
+					break;
 			}
 
-		if (verbose >= 1)
-			fprintf(stderr, "  cpStrips2Tiles remaining lines: " TIFF_UINT32_FORMAT " \r",
-				lengthtodo);
+			if (verbose >= 1 && (ymin+length-row) % tilelength == 0)
+				fprintf(stderr, "  cpScaledStrips2Tiles remaining lines: " TIFF_UINT32_FORMAT " \r",
+					ymin+length-row);
 		}
-		if (verbose >= 2)
-			fprintf(stderr, "  cpStrips2Tiles completed.        \n");
-		_TIFFfree(buf);
-		return (success);
+		jpeg_abort_decompress(&dinfo);
 	}
-	return (0);
+
+	if (success && row < ymin+length) {
+		TIFFError(TIFFFileName(in),
+		    "Error, JPEG data ended before row " TIFF_UINT32_FORMAT
+		    " of the scaled image", row);
+		success = 0;
+	}
+	if (verbose >= 2)
+		fprintf(stderr, "  cpScaledStrips2Tiles completed.        \n");
+
+	jpeg_destroy_decompress(&dinfo);
+	if (rowbuf != NULL)
+		_TIFFfree(rowbuf);
+	freeBlankTile(&blanktile);
+	_TIFFfree(src);
+	_TIFFfree(buf);
+	return (success);
 }
 
+	/* Returns 1 if the part of "in" starting at xmin, ymin can be
+	 * copied into a JPEG file with cpYCbCrTiles2JPEG, i.e. if "in" has
+	 * JPEG-compressed YCbCr tiles and the part starts on a chroma
+	 * sample; gives then the chroma subsampling in *hsamp and *vsamp. */
 static int
-cpTiles2Strip(TIFF* in, void * ambiguous_out,
-    int output_to_jpeg_rather_than_tiff, uint32_t xmin, uint32_t ymin,
+canCopyYCbCrTiles2JPEG(TIFF* in, uint32_t xmin, uint32_t ymin,
+	uint16_t * hsamp, uint16_t * vsamp)
+{
+	uint16_t compression, photometric, spp, bitspersample, planarconfig;
+	uint32_t tilewidth, tilelength;
+
+	if (!TIFFIsTiled(in))
+		return 0;
+	TIFFGetFieldDefaulted(in, TIFFTAG_COMPRESSION, &compression);
+	TIFFGetFieldDefaulted(in, TIFFTAG_PHOTOMETRIC, &photometric);
+	TIFFGetFieldDefaulted(in, TIFFTAG_SAMPLESPERPIXEL, &spp);
+	TIFFGetFieldDefaulted(in, TIFFTAG_BITSPERSAMPLE, &bitspersample);
+	TIFFGetFieldDefaulted(in, TIFFTAG_PLANARCONFIG, &planarconfig);
+	TIFFGetFieldDefaulted(in, TIFFTAG_YCBCRSUBSAMPLING, hsamp, vsamp);
+	TIFFGetField(in, TIFFTAG_TILEWIDTH, &tilewidth);
+	TIFFGetField(in, TIFFTAG_TILELENGTH, &tilelength);
+	if (compression != COMPRESSION_JPEG ||
+	    photometric != PHOTOMETRIC_YCBCR || spp != 3 ||
+	    bitspersample != 8 || planarconfig != PLANARCONFIG_CONTIG)
+		return 0;
+	if ((*hsamp != 1 && *hsamp != 2) || (*vsamp != 1 && *vsamp != 2) ||
+	    tilewidth % (DCTSIZE * *hsamp) != 0 ||
+	    tilelength % (DCTSIZE * *vsamp) != 0)
+		return 0;
+	return xmin % *hsamp == 0 && ymin % *vsamp == 0;
+}
+
+	/* Copies the part of "in" at xmin, ymin of size width x length into
+	 * a JPEG file whose compression has been started with the
+	 * subsampling of "in" and raw_data_in. The tiles are decoded into
+	 * planar subsampled YCbCr, which is cropped and handed as is to
+	 * libjpeg: no color conversion nor chroma resampling is done. */
+static int
+cpYCbCrTiles2JPEG(TIFF* in, struct jpeg_compress_struct * p_cinfo,
+	uint32_t xmin, uint32_t ymin, uint32_t width, uint32_t length)
+{
+	struct jpeg_decompress_struct dinfo;
+	struct jpeg_error_mgr jerr;
+	uint32_t tilewidth, tilelength;
+	uint32_t x, y, planewidth[3], planelength[3], tileplanewidth[3];
+	uint32_t tileplanelength[3], groupheight;
+	uint16_t hsamp, vsamp;
+	uint32_t tablescount = 0;
+	void * tables = NULL;
+	JSAMPLE * plane[3] = { NULL, NULL, NULL };
+	JSAMPLE * tileplane[3] = { NULL, NULL, NULL };
+	JSAMPROW * rows[3] = { NULL, NULL, NULL };
+	JSAMPROW * tilerows[3] = { NULL, NULL, NULL };
+	uint8_t * tilebuf = NULL;
+	tmsize_t tilebufsize = 0;
+	int ci, success = 0;
+
+	TIFFGetField(in, TIFFTAG_TILEWIDTH, &tilewidth);
+	TIFFGetField(in, TIFFTAG_TILELENGTH, &tilelength);
+	TIFFGetFieldDefaulted(in, TIFFTAG_YCBCRSUBSAMPLING, &hsamp, &vsamp);
+	TIFFGetField(in, TIFFTAG_JPEGTABLES, &tablescount, &tables);
+
+	/* Planes of the piece, padded to whole iMCU row groups as
+	 * expected by jpeg_write_raw_data, and of a tile */
+	groupheight = p_cinfo->max_v_samp_factor * DCTSIZE;
+	for (ci = 0; ci < 3; ci++) {
+		jpeg_component_info * compptr = p_cinfo->comp_info + ci;
+		uint32_t r;
+
+		planewidth[ci] = compptr->width_in_blocks * DCTSIZE;
+		planelength[ci] = (length + groupheight - 1) / groupheight *
+			compptr->v_samp_factor * DCTSIZE;
+		tileplanewidth[ci] = ci == 0 ? tilewidth : tilewidth / hsamp;
+		tileplanelength[ci] = ci == 0 ? tilelength :
+			tilelength / vsamp;
+		plane[ci] = _TIFFmalloc((tmsize_t) planewidth[ci] *
+			planelength[ci]);
+		rows[ci] = _TIFFmalloc(planelength[ci] * sizeof(JSAMPROW));
+		tileplane[ci] = _TIFFmalloc((tmsize_t) tileplanewidth[ci] *
+			tileplanelength[ci]);
+		tilerows[ci] = _TIFFmalloc(tileplanelength[ci] *
+			sizeof(JSAMPROW));
+		if (plane[ci] == NULL || rows[ci] == NULL ||
+		    tileplane[ci] == NULL || tilerows[ci] == NULL) {
+			TIFFError(TIFFFileName(in),
+			    "Error, can't allocate space for YCbCr planes");
+			goto done;
+		}
+		for (r = 0; r < planelength[ci]; r++)
+			rows[ci][r] = plane[ci] + (tmsize_t) r * planewidth[ci];
+		for (r = 0; r < tileplanelength[ci]; r++)
+			tilerows[ci][r] = tileplane[ci] +
+				(tmsize_t) r * tileplanewidth[ci];
+	}
+
+	dinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_decompress(&dinfo);
+	if (tables != NULL && tablescount > 0) {
+		jpeg_mem_src(&dinfo, tables, tablescount);
+		jpeg_read_header(&dinfo, FALSE);
+	}
+
+	for (y = ymin / tilelength * tilelength; y < ymin + length;
+	    y += tilelength)
+		for (x = xmin / tilewidth * tilewidth; x < xmin + width;
+		    x += tilewidth) {
+			ttile_t tile = TIFFComputeTile(in, x, y, 0, 0);
+			uint64_t bytecount = TIFFGetStrileByteCount(in, tile);
+			uint32_t x0 = x > xmin ? x : xmin;
+			uint32_t y0 = y > ymin ? y : ymin;
+			uint32_t x1 = x + tilewidth < xmin + width ?
+				x + tilewidth : xmin + width;
+			uint32_t y1 = y + tilelength < ymin + length ?
+				y + tilelength : ymin + length;
+			uint32_t r;
+
+			if (bytecount > (uint64_t) tilebufsize) {
+				_TIFFfree(tilebuf);
+				tilebufsize = (tmsize_t) bytecount;
+				tilebuf = _TIFFmalloc(tilebufsize);
+				if (tilebuf == NULL) {
+					TIFFError(TIFFFileName(in),
+					    "Error, can't allocate space for tile");
+					goto destroy;
+				}
+			}
+			if (TIFFReadRawTile(in, tile, tilebuf,
+			    (tmsize_t) bytecount) < 0) {
+				TIFFError(TIFFFileName(in),
+				    "Error, can't read tile at "
+				    TIFF_UINT32_FORMAT " " TIFF_UINT32_FORMAT,
+				    x, y);
+				goto destroy;
+			}
+			jpeg_mem_src(&dinfo, tilebuf, (unsigned long) bytecount);
+			jpeg_read_header(&dinfo, TRUE);
+			if (dinfo.num_components != 3 ||
+			    dinfo.image_width != tilewidth ||
+			    dinfo.image_height != tilelength ||
+			    dinfo.comp_info[0].h_samp_factor != hsamp ||
+			    dinfo.comp_info[0].v_samp_factor != vsamp ||
+			    dinfo.comp_info[1].h_samp_factor != 1 ||
+			    dinfo.comp_info[1].v_samp_factor != 1 ||
+			    dinfo.comp_info[2].h_samp_factor != 1 ||
+			    dinfo.comp_info[2].v_samp_factor != 1) {
+				TIFFError(TIFFFileName(in),
+				    "Error, unexpected JPEG data in tile at "
+				    TIFF_UINT32_FORMAT " " TIFF_UINT32_FORMAT,
+				    x, y);
+				jpeg_abort_decompress(&dinfo);
+				goto destroy;
+			}
+			dinfo.raw_data_out = TRUE;
+			jpeg_start_decompress(&dinfo);
+			for (r = 0; r < tilelength; r += vsamp * DCTSIZE) {
+				JSAMPARRAY planes[3];
+
+				for (ci = 0; ci < 3; ci++)
+					planes[ci] = tilerows[ci] +
+					    (ci == 0 ? r : r / vsamp);
+				jpeg_read_raw_data(&dinfo, planes,
+				    vsamp * DCTSIZE);
+			}
+			jpeg_finish_decompress(&dinfo);
+
+			/* Copy the part of the tile inside the piece */
+			for (ci = 0; ci < 3; ci++) {
+				uint32_t h = ci == 0 ? 1 : hsamp;
+				uint32_t v = ci == 0 ? 1 : vsamp;
+				uint32_t cx0 = x0 / h, cx1 = (x1 + h - 1) / h;
+				uint32_t cy0 = y0 / v, cy1 = (y1 + v - 1) / v;
+
+				for (r = cy0; r < cy1; r++)
+					memcpy(rows[ci][r - ymin / v] +
+					    (cx0 - xmin / h),
+					    tilerows[ci][r - y / v] +
+					    (cx0 - x / h), cx1 - cx0);
+			}
+		}
+
+	/* Pad by replicating the last column and row, as libjpeg does */
+	for (ci = 0; ci < 3; ci++) {
+		uint32_t h = ci == 0 ? 1 : hsamp;
+		uint32_t v = ci == 0 ? 1 : vsamp;
+		uint32_t cwidth = (width + h - 1) / h;
+		uint32_t clength = (length + v - 1) / v;
+		uint32_t r;
+
+		for (r = 0; r < clength; r++)
+			memset(rows[ci][r] + cwidth, rows[ci][r][cwidth-1],
+			    planewidth[ci] - cwidth);
+		for (r = clength; r < planelength[ci]; r++)
+			memcpy(rows[ci][r], rows[ci][clength-1],
+			    planewidth[ci]);
+	}
+
+	for (y = 0; y < planelength[0]; y += groupheight) {
+		JSAMPARRAY planes[3];
+
+		for (ci = 0; ci < 3; ci++)
+			planes[ci] = rows[ci] + y / groupheight *
+			    p_cinfo->comp_info[ci].v_samp_factor * DCTSIZE;
+		jpeg_write_raw_data(p_cinfo, planes, groupheight);
+	}
+	success = 1;
+
+destroy:
+	jpeg_destroy_decompress(&dinfo);
+done:
+	for (ci = 0; ci < 3; ci++) {
+		_TIFFfree(plane[ci]);
+		_TIFFfree(rows[ci]);
+		_TIFFfree(tileplane[ci]);
+		_TIFFfree(tilerows[ci]);
+	}
+	_TIFFfree(tilebuf);
+	return success;
+}
+
+	/* Sets the compression of the TIFF mosaic piece "out" cut from "in" */
+static void
+setMosaicPieceCompression(TIFF* in, TIFF* out, uint16_t compressionformat)
+{
+	uint16_t in_photometric;
+
+	TIFFGetFieldDefaulted(in, TIFFTAG_PHOTOMETRIC, &in_photometric);
+	switch (compressionformat) {
+	case COMPRESSION_LZW:
+		TIFFSetField(out, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
+		TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+		break;
+	case COMPRESSION_JPEG:
+		TIFFSetField(out, TIFFTAG_COMPRESSION, COMPRESSION_JPEG);
+		TIFFSetField(out, TIFFTAG_PHOTOMETRIC, in_photometric);
+		TIFFSetField(out, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
+		break;
+	case COMPRESSION_NONE:
+		TIFFSetField(out, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
+		TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+		break;
+	default:
+		fprintf(stderr, "Bug: unknown compression method in setMosaicPieceCompression.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+	/* Reads the portion of the tiled image "in" at xmin, ymin of size
+	 * width x length into outbuf, whose rows are outscanlinesizeinbytes
+	 * apart */
+static int
+readTilesIntoBuffer(TIFF* in, uint32_t xmin, uint32_t ymin,
     uint32_t width, uint32_t length, unsigned char * outbuf,
-    uint16_t compressionformat)
+    tmsize_t outscanlinesizeinbytes)
 {
-	struct jpeg_compress_struct * p_cinfo;
-	TIFF* TIFFout;
 	tmsize_t inbufsize;
-	uint16_t in_compression, in_photometric;
+	uint16_t in_compression;
 	uint16_t spp, bitspersample, bytesperpixel;
 	uint32_t intilewidth = (uint32_t) -1, intilelength = (uint32_t) -1;
 	tmsize_t intilewidthinbytes = TIFFTileRowSize(in);
 	uint32_t y;
-	tmsize_t outscanlinesizeinbytes;
 	unsigned char * inbuf, * bufp= outbuf;
 	int success = 1;
 
-	if (output_to_jpeg_rather_than_tiff) {
-		p_cinfo = (struct jpeg_compress_struct *) ambiguous_out;
-		TIFFout = NULL;
-	} else {
-		p_cinfo = NULL;
-		TIFFout = (TIFF*) ambiguous_out;
-	}
-
 	TIFFGetField(in, TIFFTAG_TILEWIDTH, &intilewidth);
 	TIFFGetField(in, TIFFTAG_TILELENGTH, &intilelength);
 	TIFFGetField(in, TIFFTAG_SAMPLESPERPIXEL, &spp);
 	TIFFGetField(in, TIFFTAG_BITSPERSAMPLE, &bitspersample);
-	if (output_to_jpeg_rather_than_tiff) {
-		assert( bitspersample == 8 );
-		assert( spp == 3 );
-	} else
-		assert( bitspersample % 8 == 0 );
 	bytesperpixel = (bitspersample/8) * spp;
 
 	TIFFGetField(in, TIFFTAG_COMPRESSION, &in_compression);
-	TIFFGetFieldDefaulted(in, TIFFTAG_PHOTOMETRIC, &in_photometric);
 	if (in_compression == COMPRESSION_JPEG) {
 		/* "in" is a file we have just written. If it was not 
 		 * closed and reopen, then it is tiled and we have
@@ -2172,54 +5940,6 @@ cpTiles2Strip(TIFF* in, void * ambiguous_out,
 			TIFFSetField(in, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
 	}
 
-	if (output_to_jpeg_rather_than_tiff) {
-		outscanlinesizeinbytes = width * bytesperpixel;
-	} else {
-
-		switch (compressionformat) {
-		case COMPRESSION_LZW:
-			TIFFSetField(TIFFout, TIFFTAG_COMPRESSION,
-				COMPRESSION_LZW);
-			TIFFSetField(TIFFout, TIFFTAG_PHOTOMETRIC,
-				PHOTOMETRIC_RGB);
-			break;
-		case COMPRESSION_JPEG:
-			TIFFSetField(TIFFout, TIFFTAG_COMPRESSION,
-				COMPRESSION_JPEG);
-			TIFFSetField(TIFFout, TIFFTAG_PHOTOMETRIC,
-				in_photometric);
-			TIFFSetField(TIFFout, TIFFTAG_JPEGCOLORMODE,
-				JPEGCOLORMODE_RGB);
-			break;
-		case COMPRESSION_NONE:
-			TIFFSetField(TIFFout, TIFFTAG_COMPRESSION,
-				COMPRESSION_NONE);
-			TIFFSetField(TIFFout, TIFFTAG_PHOTOMETRIC,
-				PHOTOMETRIC_RGB);
-			break;
-		default:
-			fprintf(stderr, "Bug: unknown compression method in cpTiles2Strip.\n");
-			exit(EXIT_FAILURE);
-		}
-
-		/* To be done *after* setting compression -- otherwise,
-		 * ScanlineSize may be wrong */
-		outscanlinesizeinbytes= TIFFRasterScanlineSize(TIFFout);
-
-/*{
-uint16_t out_compression= -1, out_photometric= -1;
-
-TIFFGetField(TIFFout, TIFFTAG_COMPRESSION, &out_compression);
-TIFFGetField(TIFFout, TIFFTAG_PHOTOMETRIC, &out_photometric);
-fprintf(stderr, "Infile had compression %u and photometric %u ; outfile will have compression %u and photometric %u\n",
-	in_compression, in_photometric, out_compression, out_photometric);
-}
-
-fprintf(stderr, "Outfile \"%s\": compression set scanlinesize=%lld or %lld\n", 
-TIFFFileName(TIFFout), outscanlinesizeinbytes, TIFFScanlineSize(TIFFout));*/
-
-	}
-
 	inbufsize= TIFFTileSize(in);
 	inbuf = (unsigned char *)_TIFFmalloc(inbufsize);
 	if (!inbuf) {
@@ -2279,6 +5999,68 @@ TIFFFileName(TIFFout), outscanlinesizeinbytes, TIFFScanlineSize(TIFFout));*/
 		bufp += outscanlinesizeinbytes * lengthtocopy;
 	}
 
+	done:
+	_TIFFfree(inbuf);
+	return success;
+}
+
+static int
+cpTiles2Strip(TIFF* in, void * ambiguous_out,
+    int output_to_jpeg_rather_than_tiff, uint32_t xmin, uint32_t ymin,
+    uint32_t width, uint32_t length, unsigned char * outbuf,
+    uint16_t compressionformat)
+{
+	struct jpeg_compress_struct * p_cinfo;
+	TIFF* TIFFout;
+	uint16_t spp, bitspersample, bytesperpixel;
+	uint32_t y;
+	tmsize_t outscanlinesizeinbytes;
+
+	if (output_to_jpeg_rather_than_tiff) {
+		p_cinfo = (struct jpeg_compress_struct *) ambiguous_out;
+		TIFFout = NULL;
+	} else {
+		p_cinfo = NULL;
+		TIFFout = (TIFF*) ambiguous_out;
+	}
+
+	TIFFGetField(in, TIFFTAG_SAMPLESPERPIXEL, &spp);
+	TIFFGetField(in, TIFFTAG_BITSPERSAMPLE, &bitspersample);
+	if (output_to_jpeg_rather_than_tiff) {
+		assert( bitspersample == 8 );
+		assert( spp == 3 );
+	} else
+		assert( bitspersample % 8 == 0 );
+	bytesperpixel = (bitspersample/8) * spp;
+
+	if (output_to_jpeg_rather_than_tiff) {
+		outscanlinesizeinbytes = width * bytesperpixel;
+	} else {
+
+		setMosaicPieceCompression(in, TIFFout, compressionformat);
+
+		/* To be done *after* setting compression -- otherwise,
+		 * ScanlineSize may be wrong */
+		outscanlinesizeinbytes= TIFFRasterScanlineSize(TIFFout);
+
+/*{
+uint16_t out_compression= -1, out_photometric= -1;
+
+TIFFGetField(TIFFout, TIFFTAG_COMPRESSION, &out_compression);
+TIFFGetField(TIFFout, TIFFTAG_PHOTOMETRIC, &out_photometric);
+fprintf(stderr, "Infile had compression %u and photometric %u ; outfile will have compression %u and photometric %u\n",
+	in_compression, in_photometric, out_compression, out_photometric);
+}
+
+fprintf(stderr, "Outfile \"%s\": compression set scanlinesize=%lld or %lld\n", 
+TIFFFileName(TIFFout), outscanlinesizeinbytes, TIFFScanlineSize(TIFFout));*/
+
+	}
+
+	if (!readTilesIntoBuffer(in, xmin, ymin, width, length, outbuf,
+	    outscanlinesizeinbytes))
+		return (0);
+
 	if (output_to_jpeg_rather_than_tiff) {
 		JSAMPROW row_pointer;
 		JSAMPROW* row_pointers =
@@ -2287,8 +6069,7 @@ TIFFFileName(TIFFout), outscanlinesizeinbytes, TIFFScanlineSize(TIFFout));*/
 		if (row_pointers == NULL) {
 			TIFFError(TIFFFileName(in),
 				"Error, can't allocate space for row_pointers");
-			success = 0;
-			goto done;
+			return (0);
 		}
 
 		for (y = 0, row_pointer = outbuf ; y < length ;
@@ -2302,13 +6083,11 @@ TIFFFileName(TIFFout), outscanlinesizeinbytes, TIFFScanlineSize(TIFFout));*/
 		    outbuf, TIFFStripSize(TIFFout)) < 0) {
 			TIFFError(TIFFFileName(TIFFout),
 			    "Error, can't write strip");
-			success = 0;
+			return (0);
 		}
 	}
 
-	done:
-	_TIFFfree(inbuf);
-	return success;
+	return (1);
 }
 
 static int
@@ -2316,15 +6095,17 @@ cpStrips2Strip(TIFF* in, void * ambiguous_out,
     int output_to_jpeg_rather_than_tiff, uint32_t xmin, uint32_t ymin,
     uint32_t width, uint32_t length, unsigned char * outbuf,
     uint16_t compressionformat, uint32_t * y_of_last_read_scanline,
-    uint32_t inimagelength)
+    uint32_t inimagelength, const unsigned char * band,
+    uint32_t bandfirstrow, uint32_t bandxmin, tmsize_t bandrowsizeinbytes,
+    DecodedRowRing * ring)
 {
 	struct jpeg_compress_struct * p_cinfo;
 	TIFF* TIFFout;
 	tmsize_t inbufsize;
-	uint16_t in_compression, in_photometric;
+	uint16_t in_compression;
 	uint16_t spp, bitspersample, bytesperpixel;
 	tmsize_t inwidthinbytes = TIFFRasterScanlineSize(in);
-	uint32_t y;
+	uint32_t y, firstrowtodecode = ymin;
 	tmsize_t outscanlinesizeinbytes;
 	unsigned char * inbuf, * bufp= outbuf;
 	int success = 1;
@@ -2347,7 +6128,6 @@ cpStrips2Strip(TIFF* in, void * ambiguous_out,
 	bytesperpixel = (bitspersample/8) * spp;
 
 	TIFFGetField(in, TIFFTAG_COMPRESSION, &in_compression);
-	TIFFGetFieldDefaulted(in, TIFFTAG_PHOTOMETRIC, &in_photometric);
 	if (in_compression == COMPRESSION_JPEG) {
 		/* "in" is a file we have just written. If it was not 
 		 * closed and reopen, then it is tiled and we have
@@ -2366,31 +6146,7 @@ cpStrips2Strip(TIFF* in, void * ambiguous_out,
 		outscanlinesizeinbytes = width * bytesperpixel;
 	} else {
 
-		switch (compressionformat) {
-		case COMPRESSION_LZW:
-			TIFFSetField(TIFFout, TIFFTAG_COMPRESSION,
-				COMPRESSION_LZW);
-			TIFFSetField(TIFFout, TIFFTAG_PHOTOMETRIC,
-				PHOTOMETRIC_RGB);
-			break;
-		case COMPRESSION_JPEG:
-			TIFFSetField(TIFFout, TIFFTAG_COMPRESSION,
-				COMPRESSION_JPEG);
-			TIFFSetField(TIFFout, TIFFTAG_PHOTOMETRIC,
-				in_photometric);
-			TIFFSetField(TIFFout, TIFFTAG_JPEGCOLORMODE,
-				JPEGCOLORMODE_RGB);
-			break;
-		case COMPRESSION_NONE:
-			TIFFSetField(TIFFout, TIFFTAG_COMPRESSION,
-				COMPRESSION_NONE);
-			TIFFSetField(TIFFout, TIFFTAG_PHOTOMETRIC,
-				PHOTOMETRIC_RGB);
-			break;
-		default:
-			fprintf(stderr, "Bug: unknown compression method in cpTiles2Strip.\n");
-			exit(EXIT_FAILURE);
-		}
+		setMosaicPieceCompression(in, TIFFout, compressionformat);
 
 		/* To be done *after* setting compression -- otherwise,
 		 * ScanlineSize may be wrong */
@@ -2410,6 +6166,35 @@ fprintf(stderr, "Outfile \"%s\": compression set scanlinesize="
 
 	}
 
+	if (band != NULL) {
+		/* The scanlines have already been read into the band, which
+		 * starts at column bandxmin */
+		const unsigned char * bandp = band +
+		    (ymin - bandfirstrow) * bandrowsizeinbytes +
+		    (tmsize_t) (xmin - bandxmin) * bytesperpixel;
+
+		if (output_to_jpeg_rather_than_tiff) {
+			for (y = 0 ; y < length ; y++) {
+				JSAMPROW row_pointer = (JSAMPROW) bandp;
+
+				jpeg_write_scanlines(p_cinfo, &row_pointer, 1);
+				bandp += bandrowsizeinbytes;
+			}
+			return 1;
+		}
+		cpBufToBuf(outbuf, (uint8_t*) bandp, length,
+		    outscanlinesizeinbytes, 0,
+		    bandrowsizeinbytes - outscanlinesizeinbytes);
+		if (TIFFWriteEncodedStrip(TIFFout,
+			TIFFComputeStrip(TIFFout, 0, 0),
+		    outbuf, TIFFStripSize(TIFFout)) < 0) {
+			TIFFError(TIFFFileName(TIFFout),
+			    "Error, can't write strip");
+			return 0;
+		}
+		return 1;
+	}
+
 	inbufsize= TIFFRasterScanlineSize(in);
 	inbuf = (unsigned char *)_TIFFmalloc(inbufsize);
 	if (!inbuf) {
@@ -2418,11 +6203,26 @@ fprintf(stderr, "Outfile \"%s\": compression set scanlinesize="
 		return (0);
 	}
 
+	/* Only decode the columns we copy (if JPEG-compressed). The window
+	 * is kept afterwards, so that the next piece of the same column of
+	 * the mosaic goes on decoding from where this one stopped. */
+	TIFFJPEGSetDecodeWindow(in, xmin, width);
+
+	/* The first rows, which overlap the previous piece of the column,
+	 * may still be in the ring of the last decoded rows */
+	if (ring != NULL)
+		while (firstrowtodecode < ymin + length &&
+		    getRowFromRing(ring, firstrowtodecode, xmin, width, bufp)) {
+			bufp += outscanlinesizeinbytes;
+			firstrowtodecode++;
+		}
+
 	/* Restart reading from the beginning if we need to go back
 	 * (e.g. because we read more to give some overlap between
 	 * pieces), since some compression methods don't support random
-	 * access. */
-	if (*y_of_last_read_scanline > ymin) {
+	 * access. The JPEG codec seeks backwards by itself. */
+	if (*y_of_last_read_scanline > firstrowtodecode &&
+	    in_compression != COMPRESSION_JPEG) {
 		/* Finish reading to the end, then a restart will be
 		 * automatic, then read up to the point we want to start
 		 * copying at */
@@ -2439,7 +6239,7 @@ fprintf(stderr, "Outfile \"%s\": compression set scanlinesize="
 			} else
 				*y_of_last_read_scanline= y;
 
-		for (y = 0 ; y < ymin ; y++)
+		for (y = 0 ; y < firstrowtodecode ; y++)
 			if (TIFFReadScanline(in, inbuf, y, 0) < 0) {
 				TIFFError(TIFFFileName(in),
 				    "Error, can't read scanline at "
@@ -2451,7 +6251,7 @@ fprintf(stderr, "Outfile \"%s\": compression set scanlinesize="
 				*y_of_last_read_scanline= y;
 	}
 
-	for (y = ymin ; y < ymin + length ; y++) {
+	for (y = firstrowtodecode ; y < ymin + length ; y++) {
 		unsigned char * inbufrow = inbuf;
 		uint32_t xmintocopyinscanline = xmin;
 		tmsize_t widthtocopyinbytes = outscanlinesizeinbytes;
@@ -2471,6 +6271,8 @@ fprintf(stderr, "Outfile \"%s\": compression set scanlinesize="
 		    1, widthtocopyinbytes,
 		    outscanlinesizeinbytes - widthtocopyinbytes,
 		    inwidthinbytes - widthtocopyinbytes);
+		if (ring != NULL)
+			putRowIntoRing(ring, y, xmin, width, bufp);
 		bufp += outscanlinesizeinbytes;
 	}
 
@@ -2506,6 +6308,768 @@ fprintf(stderr, "Outfile \"%s\": compression set scanlinesize="
 	return success;
 }
 
+	/* Encodes and writes the piece, then closes it */
+static void*
+encodeMosaicPiece(void* arg)
+{
+	EncodingPiece* piece = (EncodingPiece*) arg;
+	const unsigned char * rowp = piece->rows;
+	uint32_t y;
+
+	piece->status = 1;
+	if (piece->tiffout == NULL) {
+		for (y = 0 ; y < piece->length ; y++) {
+			JSAMPROW row_pointer = (JSAMPROW) rowp;
+
+			jpeg_write_scanlines(&piece->cinfo, &row_pointer, 1);
+			rowp += piece->rowsizeinbytes;
+		}
+		jpeg_finish_compress(&piece->cinfo);
+		if (piece->jpegout != NULL) {
+			if (piece->record.name != NULL)
+				getHashingDestinationHash(&piece->cinfo,
+				    &piece->record);
+			if (fclose(piece->jpegout) != 0)
+				piece->status = 0;
+		}
+		jpeg_destroy_compress(&piece->cinfo);
+	} else {
+		tmsize_t outscanlinesizeinbytes =
+		    TIFFRasterScanlineSize(piece->tiffout);
+
+		if (rowp != piece->buf)
+			cpBufToBuf(piece->buf, (uint8_t*) rowp, piece->length,
+			    outscanlinesizeinbytes, 0,
+			    piece->rowsizeinbytes - outscanlinesizeinbytes);
+		if (TIFFWriteEncodedStrip(piece->tiffout,
+			TIFFComputeStrip(piece->tiffout, 0, 0),
+		    piece->buf, TIFFStripSize(piece->tiffout)) < 0) {
+			TIFFError(TIFFFileName(piece->tiffout),
+			    "Error, can't write strip");
+			piece->status = 0;
+		}
+		TIFFClose(piece->tiffout);
+	}
+	if (piece->status && piece->record.name != NULL &&
+	    ! completeMosaicPiece(&piece->record, piece->memout))
+		piece->status = 0;
+	return NULL;
+}
+
+static void
+initEncodingPool(EncodingPool* pool, unsigned numberofpieces,
+	tmsize_t bufsize, MosaicManifest* manifest)
+{
+	unsigned u;
+
+	pool->next = 0;
+	pool->bufsize = bufsize;
+	pool->manifest = manifest;
+	pool->status = 1;
+	pool->numberofpieces = 0;
+	pool->pieces = NULL;
+	if (numberofpieces <= 1)
+		return;
+	pool->pieces = _TIFFmalloc(numberofpieces * sizeof(EncodingPiece));
+	if (pool->pieces == NULL) {
+		fprintf(stderr, "Not enough memory for encoding threads, mosaic pieces will be encoded one by one.\n");
+		return;
+	}
+	_TIFFmemset(pool->pieces, 0, numberofpieces * sizeof(EncodingPiece));
+	for (u = 0 ; u < numberofpieces ; u++)
+		pool->pieces[u].status = 1;
+	pool->numberofpieces = numberofpieces;
+}
+
+	/* Waits for the pieces being encoded, then frees the pool. Returns
+	 * 0 if a piece encoded by the pool could not be written. */
+static int
+freeEncodingPool(EncodingPool* pool)
+{
+	unsigned u;
+
+	finishEncodingPieces(pool, NULL);
+	for (u = 0 ; u < pool->numberofpieces ; u++)
+		if (pool->pieces[u].buf != NULL)
+			_TIFFfree(pool->pieces[u].buf);
+	if (pool->pieces != NULL)
+		_TIFFfree(pool->pieces);
+	pool->pieces = NULL;
+	pool->numberofpieces = 0;
+	return pool->status;
+}
+
+	/* Waits for the piece to be written, then records it into the
+	 * manifest, or, if it could not be written, makes the status of the
+	 * pool 0 */
+static int
+finishEncodingPiece(EncodingPool* pool, EncodingPiece* piece)
+{
+#ifdef HAVE_PTHREAD
+	if (piece->isrunning) {
+		pthread_join(piece->thread, NULL);
+		piece->isrunning = 0;
+	}
+#endif
+	if (! piece->status)
+		pool->status = 0;
+	if (piece->record.name != NULL) {
+		if (piece->status)
+			recordMosaicPiece(pool->manifest, &piece->record,
+			    piece->memout);
+		_TIFFfree(piece->record.name);
+		piece->record.name = NULL;
+	}
+	freeMemoryFile(piece->memout);
+	piece->memout = NULL;
+	return piece->status;
+}
+
+	/* Waits for the pieces whose rows are in band (all pieces if band
+	 * is NULL), in the order they were started so that they are
+	 * recorded in that order. Returns 0 if a piece encoded by the pool,
+	 * one of these or an earlier one, could not be written. */
+static int
+finishEncodingPieces(EncodingPool* pool, const unsigned char * band)
+{
+	unsigned k;
+
+	for (k = 0 ; k < pool->numberofpieces ; k++) {
+		EncodingPiece* piece = &pool->pieces[(pool->next + k) %
+		    pool->numberofpieces];
+
+		if (band == NULL || piece->band == band)
+			finishEncodingPiece(pool, piece);
+	}
+	return pool->status;
+}
+
+	/* Returns the next slot of the pool, once the piece it held has
+	 * been written (if it could not be, the status of the pool keeps
+	 * it), or NULL if pieces can't be encoded by threads (then the
+	 * caller encodes the piece itself) */
+static EncodingPiece*
+acquireEncodingPiece(EncodingPool* pool, int shouldhavebuffer)
+{
+	EncodingPiece* piece;
+
+	if (pool->numberofpieces == 0)
+		return NULL;
+	piece = &pool->pieces[pool->next];
+	finishEncodingPiece(pool, piece);
+	if (shouldhavebuffer && piece->buf == NULL) {
+		piece->buf = _TIFFmalloc(pool->bufsize);
+		if (piece->buf == NULL)
+			return NULL;
+	}
+	pool->next = (pool->next + 1) % pool->numberofpieces;
+	piece->band = NULL;
+	piece->jpegout = NULL;
+	piece->tiffout = NULL;
+	piece->memout = NULL;
+	piece->status = 1;
+	return piece;
+}
+
+	/* Points the rows of the piece to its portion of the band of
+	 * decoded scanlines, whose first column is bandxmin, or reads them
+	 * from the tiles of "in" into the buffer of the piece */
+static int
+fillEncodingPiece(EncodingPiece* piece, TIFF* in, uint32_t xmin,
+	uint32_t ymin, uint32_t width, uint32_t length,
+	const unsigned char * band, uint32_t bandfirstrow, uint32_t bandxmin,
+	tmsize_t bandrowsizeinbytes, uint16_t bytesperpixel)
+{
+	piece->length = length;
+	if (band != NULL) {
+		piece->band = band;
+		piece->rows = band + (ymin - bandfirstrow) * bandrowsizeinbytes +
+		    (tmsize_t) (xmin - bandxmin) * bytesperpixel;
+		piece->rowsizeinbytes = bandrowsizeinbytes;
+		return 1;
+	}
+	piece->rows = piece->buf;
+	piece->rowsizeinbytes = (tmsize_t) width * bytesperpixel;
+	return readTilesIntoBuffer(in, xmin, ymin, width, length, piece->buf,
+	    piece->rowsizeinbytes);
+}
+
+static void
+startEncodingPiece(EncodingPiece* piece)
+{
+#ifdef HAVE_PTHREAD
+	if (pthread_create(&piece->thread, NULL, encodeMosaicPiece,
+	    piece) == 0) {
+		piece->isrunning = 1;
+		return;
+	}
+#endif
+	encodeMosaicPiece(piece);
+}
+
+	/* Opens the manifest of the mosaic whose pieces are named after
+	 * infilename and writes header as its first line. With --resume,
+	 * the records of a previous run of the same mosaic (with the same
+	 * header) are read and the new records are appended after them.
+	 * Returns 1 on success, 0 if the manifest can't be written. */
+static int
+openMosaicManifest(MosaicManifest* manifest, const char* infilename,
+	const char* header)
+{
+	FILE * f;
+	int samemosaic = 0, isunfinished = 0;
+
+	manifest->records = NULL;
+	manifest->numberofrecords = 0;
+	my_asprintf(&manifest->filename, "%s%s", infilename,
+		MOSAIC_MANIFEST_SUFFIX);
+
+	if (shouldresumemosaic &&
+	    (f = fopen(manifest->filename, "r")) != NULL) {
+		char line[4096];
+
+		samemosaic = fgets(line, sizeof(line), f) != NULL &&
+		    strcmp(line, header) == 0;
+		while (samemosaic && fgets(line, sizeof(line), f) != NULL) {
+			MosaicPieceRecord * record;
+			size_t l = strcspn(line, "\r\n");
+			int consumedcharacters = 0;
+
+			if (line[l] == 0) {
+				/* last line left unfinished by a killed run */
+				isunfinished = 1;
+				break;
+			}
+			line[l] = 0;
+			record = extendArrayOfMosaicPieceRecords(
+			    &manifest->records, &manifest->numberofrecords,
+			    "manifest of mosaic");
+			if (record == NULL) {
+				manifest->numberofrecords = 0;
+				break;
+			}
+			if (sscanf(line, TIFF_UINT32_FORMAT " "
+			    TIFF_UINT32_FORMAT " " TIFF_UINT32_FORMAT " "
+			    TIFF_UINT32_FORMAT " %" SCNu64 " %" SCNx64 " %n",
+			    &record->x, &record->y, &record->width,
+			    &record->length, &record->size, &record->hash,
+			    &consumedcharacters) != 6 ||
+			    line[consumedcharacters] == 0) {
+				manifest->numberofrecords--;
+				if (verbose)
+					fprintf(stderr, "Ignoring unexpected line in manifest \"%s\": %s\n",
+						manifest->filename, line);
+				continue;
+			}
+			my_asprintf(&record->name, "%s",
+			    line + consumedcharacters);
+		}
+		fclose(f);
+		if (! samemosaic)
+			fprintf(stderr, "Manifest \"%s\" was made for another mosaic, all pieces will be made again\n",
+				manifest->filename);
+		else {
+			qsort(manifest->records, manifest->numberofrecords,
+			    sizeof(MosaicPieceRecord),
+			    compareMosaicPieceRecords);
+			if (verbose >= 2)
+				fprintf(stderr, "Read %u records from manifest \"%s\"\n",
+					manifest->numberofrecords,
+					manifest->filename);
+		}
+	}
+
+	manifest->f = fopen(manifest->filename, samemosaic ? "a" : "w");
+	if (manifest->f == NULL)
+		return 0;
+	if (! samemosaic)
+		fputs(header, manifest->f);
+	else if (isunfinished)
+		putc('\n', manifest->f);
+	fflush(manifest->f);
+	return 1;
+}
+
+	/* Tells whether the piece described by record (apart from its size
+	 * and hash) has been made by a previous run, that is whether its
+	 * file is unchanged since it was recorded into the manifest. */
+static int
+isMosaicPieceAlreadyMade(const MosaicManifest* manifest,
+	const MosaicPieceRecord* record)
+{
+	const MosaicPieceRecord * r;
+	uint64_t size, hash;
+
+	if (manifest->numberofrecords == 0)
+		return 0;
+	r = bsearch(record, manifest->records, manifest->numberofrecords,
+	    sizeof(MosaicPieceRecord), compareMosaicPieceRecords);
+	if (r == NULL)
+		return 0;
+	if (! hashFile(record->name, &size, &hash)) {
+		if (verbose >= 2)
+			fprintf(stderr, " Mosaic tile \"%s\" of the manifest is missing\n",
+				record->name);
+		return 0;
+	}
+	/* A piece made again by a resumed run has several records */
+	while (r > manifest->records &&
+	    compareMosaicPieceRecords(r-1, record) == 0)
+		r--;
+	for ( ; r < manifest->records + manifest->numberofrecords &&
+	    compareMosaicPieceRecords(r, record) == 0 ; r++)
+		if (r->x == record->x && r->y == record->y &&
+		    r->width == record->width &&
+		    r->length == record->length &&
+		    r->size == size && r->hash == hash)
+			return 1;
+	if (verbose)
+		fprintf(stderr, " Mosaic tile \"%s\" differs from its record in the manifest, it will be made again\n",
+			record->name);
+	return 0;
+}
+
+	/* Appends the record of a piece whose file is complete to the
+	 * manifest, at once so that it is there if the run is killed, or
+	 * writes the piece into the archive if memfile is its file */
+static void
+recordMosaicPiece(MosaicManifest* manifest, const MosaicPieceRecord* record,
+	const MemoryFile* memfile)
+{
+	if (mosaicarchive.f != NULL) {
+		(void) addToMosaicArchive(record, memfile);
+		return;
+	}
+	if (manifest->f == NULL)
+		return;
+	fprintf(manifest->f, TIFF_UINT32_FORMAT " " TIFF_UINT32_FORMAT " "
+	    TIFF_UINT32_FORMAT " " TIFF_UINT32_FORMAT " " TIFF_UINT64_FORMAT
+	    " %016" PRIx64 " %s\n", record->x, record->y, record->width,
+	    record->length, record->size, record->hash, record->name);
+	fflush(manifest->f);
+}
+
+static void
+closeMosaicManifest(MosaicManifest* manifest)
+{
+	unsigned u;
+
+	if (manifest->f != NULL && fclose(manifest->f) != 0)
+		fprintf(stderr, "Error while writing manifest \"%s\" of mosaic\n",
+			manifest->filename);
+	manifest->f = NULL;
+	for (u = 0 ; u < manifest->numberofrecords ; u++)
+		_TIFFfree(manifest->records[u].name);
+	if (manifest->records != NULL)
+		_TIFFfree(manifest->records);
+	manifest->records = NULL;
+	manifest->numberofrecords = 0;
+	_TIFFfree(manifest->filename);
+}
+
+static int
+compareMosaicPieceRecords(const void* a, const void* b)
+{
+	return strcmp(((const MosaicPieceRecord*) a)->name,
+	    ((const MosaicPieceRecord*) b)->name);
+}
+
+	/* Computes the size and hash of a piece written into memfile and,
+	 * unless it goes to the archive, writes memfile into the file of
+	 * the piece. Those of a piece written straight into its file (when
+	 * memfile is NULL) were computed while it was written. Returns 1 on
+	 * success, 0 on failure. */
+static int
+completeMosaicPiece(MosaicPieceRecord* record, const MemoryFile* memfile)
+{
+	FILE * f;
+	int status;
+
+	if (memfile == NULL)
+		return 1;
+	record->size = (uint64_t) memfile->size;
+	record->hash = hashBytes(FNV_OFFSET_BASIS, memfile->data,
+	    memfile->size);
+	if (mosaicarchive.f != NULL)
+		return 1;
+	f = fopen(record->name, "wb");
+	if (f == NULL) {
+		fprintf(stderr, "Unable to create file \"%s\".\n",
+			record->name);
+		return 0;
+	}
+	status = fwrite(memfile->data, 1, (size_t) memfile->size, f) ==
+	    (size_t) memfile->size;
+	if (fclose(f) != 0)
+		status = 0;
+	if (! status)
+		fprintf(stderr, "Error while writing mosaic tile \"%s\".\n",
+			record->name);
+	return status;
+}
+
+	/* Computes the size and the 64-bit FNV-1a hash of the content of
+	 * a file. Returns 1 on success, 0 if it can't be read. */
+static int
+hashFile(const char* filename, uint64_t* size, uint64_t* hash)
+{
+	FILE * f = fopen(filename, "rb");
+	uint8_t buf[65536];
+	uint64_t h = FNV_OFFSET_BASIS, s = 0;
+	size_t n;
+	int error;
+
+	if (f == NULL)
+		return 0;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+		h = hashBytes(h, buf, (tmsize_t) n);
+		s += n;
+	}
+	error = ferror(f);
+	fclose(f);
+	if (error)
+		return 0;
+	*size = s;
+	*hash = h;
+	return 1;
+}
+
+	/* Continues the 64-bit FNV-1a hash h with n bytes */
+static uint64_t
+hashBytes(uint64_t h, const uint8_t* buf, tmsize_t n)
+{
+	tmsize_t k;
+
+	for (k = 0 ; k < n ; k++) {
+		h ^= buf[k];
+		h *= FNV_PRIME;
+	}
+	return h;
+}
+
+	/* Opens the archive given with -a. Returns 1 on success, 0 on
+	 * failure. */
+static int
+openMosaicArchive(void)
+{
+	MosaicArchive * a = &mosaicarchive;
+
+	if (strcmp(a->filename, "-") == 0)
+		a->f = stdout;
+	else
+		a->f = fopen(a->filename, "wb");
+	if (a->f == NULL)
+		return 0;
+	a->offset = 0;
+	a->mtime = time(NULL);
+	a->numberofpieces = 0;
+	a->status = 1;
+	_TIFFmemset(&a->index, 0, sizeof(a->index));
+	return 1;
+}
+
+	/* Writes a complete mosaic piece as a member of the archive and
+	 * adds it to the index. Returns 1 on success, 0 on failure. */
+static int
+addToMosaicArchive(const MosaicPieceRecord* record, const MemoryFile* memfile)
+{
+	MosaicArchive * a = &mosaicarchive;
+	static const char zeros[512];
+	char * line;
+	uint64_t dataoffset;
+
+	if (! a->status)
+		return 0;
+	if (! writeTarHeader(record->name, (uint64_t) memfile->size, '0'))
+		return 0;
+	dataoffset = a->offset;
+	if (! writeToMosaicArchive(memfile->data, memfile->size) ||
+	    ! writeToMosaicArchive(zeros, (512 - memfile->size % 512) % 512))
+		return 0;
+
+	my_asprintf(&line, TIFF_UINT64_FORMAT " " TIFF_UINT32_FORMAT " "
+	    TIFF_UINT32_FORMAT " " TIFF_UINT32_FORMAT " " TIFF_UINT32_FORMAT
+	    " " TIFF_UINT64_FORMAT " %016" PRIx64 " %s\n", dataoffset,
+	    record->x, record->y, record->width, record->length,
+	    record->size, record->hash, record->name);
+	if (! writeToMemoryFile(&a->index, line, strlen(line))) {
+		fprintf(stderr, "Error: insufficient memory for the index of archive \"%s\".\n",
+			a->filename);
+		a->status = 0;
+	}
+	_TIFFfree(line);
+	a->numberofpieces++;
+	return a->status;
+}
+
+	/* Ends the archive with its index and closes it. Returns 1 on
+	 * success, 0 if the archive could not be completely written. */
+static int
+closeMosaicArchive(void)
+{
+	MosaicArchive * a = &mosaicarchive;
+	static const char zeros[1024];
+	char * header;
+	int status;
+
+	my_asprintf(&header, "# ndpisplit mosaic archive index: %u pieces;"
+	    " offset x y width length size hash name\n", a->numberofpieces);
+	if (a->status && writeTarHeader(MOSAIC_ARCHIVE_INDEX_NAME,
+	    strlen(header) + a->index.size, '0')) {
+		uint64_t size = strlen(header) + a->index.size;
+
+		if (writeToMosaicArchive(header, strlen(header)) &&
+		    writeToMosaicArchive(a->index.data, a->index.size) &&
+		    writeToMosaicArchive(zeros, (512 - size % 512) % 512))
+			/* two zero blocks end the archive */
+			(void) writeToMosaicArchive(zeros, 1024);
+	}
+	_TIFFfree(header);
+	_TIFFfree(a->index.data);
+	_TIFFmemset(&a->index, 0, sizeof(a->index));
+	status = a->status;
+	if ((a->f == stdout ? fflush(a->f) : fclose(a->f)) != 0)
+		status = 0;
+	a->f = NULL;
+	if (! status)
+		fprintf(stderr, "Error while writing archive \"%s\"\n",
+			a->filename);
+	return status;
+}
+
+	/* Writes the ustar header of a member of the archive, preceded by
+	 * a pax header if the name does not fit into the ustar header.
+	 * Returns 1 on success, 0 on failure. */
+static int
+writeTarHeader(const char* name, uint64_t size, char typeflag)
+{
+	static const char zeros[512];
+	char h[512];
+	size_t l, k, split = 0;
+	unsigned checksum = 0, u;
+
+	while (*name == '/') /* as tar does */
+		name++;
+	l = strlen(name);
+	if (l > 100) /* split at a '/' into prefix and name if possible */
+		for (k = l - 2 < 155 ? l - 2 : 155 ; k > 0 &&
+		    l - k - 1 <= 100 ; k--)
+			if (name[k] == '/') {
+				split = k;
+				break;
+			}
+	if (l > 100 && split == 0) {
+		/* pax header with a "%d path=%s\n" record, where %d is
+		 * the length of the record */
+		char * record;
+		size_t n = l + 7;
+		int digits = snprintf(NULL, 0, "%lu", (unsigned long) n), ok;
+
+		if (snprintf(NULL, 0, "%lu", (unsigned long) (n + digits)) >
+		    digits)
+			digits++;
+		my_asprintf(&record, "%lu path=%s\n",
+		    (unsigned long) (n + digits), name);
+		n = strlen(record);
+		ok = writeTarHeader("PaxHeader", n, 'x') &&
+		    writeToMosaicArchive(record, n) &&
+		    writeToMosaicArchive(zeros, (512 - n % 512) % 512);
+		_TIFFfree(record);
+		if (! ok)
+			return 0;
+		l = 100; /* truncated for readers without pax support */
+	}
+	if (size >= ((uint64_t) 1) << 33) {
+		fprintf(stderr, "Error: mosaic piece \"%s\" too large for the archive.\n",
+			name);
+		return 0;
+	}
+
+	_TIFFmemset(h, 0, sizeof(h));
+	if (split > 0) {
+		memcpy(h + 345, name, split); /* prefix */
+		memcpy(h, name + split + 1, l - split - 1);
+	} else
+		memcpy(h, name, l);
+	snprintf(h + 100, 8, "%07o", 0644); /* mode */
+	snprintf(h + 108, 8, "%07o", 0); /* uid */
+	snprintf(h + 116, 8, "%07o", 0); /* gid */
+	snprintf(h + 124, 12, "%011" PRIo64, size);
+	snprintf(h + 136, 12, "%011lo", (unsigned long) mosaicarchive.mtime);
+	memset(h + 148, ' ', 8); /* checksum, counted as spaces */
+	h[156] = typeflag;
+	memcpy(h + 257, "ustar", 6);
+	memcpy(h + 263, "00", 2);
+	for (u = 0 ; u < sizeof(h) ; u++)
+		checksum += (unsigned char) h[u];
+	snprintf(h + 148, 8, "%06o", checksum);
+	return writeToMosaicArchive(h, sizeof(h));
+}
+
+static int
+writeToMosaicArchive(const void* buf, tmsize_t n)
+{
+	MosaicArchive * a = &mosaicarchive;
+
+	if (! a->status)
+		return 0;
+	if (n > 0 && fwrite(buf, 1, (size_t) n, a->f) != (size_t) n) {
+		fprintf(stderr, "Error while writing archive \"%s\": %s\n",
+			a->filename, strerror(errno));
+		a->status = 0;
+		return 0;
+	}
+	a->offset += (uint64_t) n;
+	return 1;
+}
+
+	/* libjpeg needs some room in the buffer at any time */
+static void
+initMemoryDestination(j_compress_ptr cinfo)
+{
+	MemoryDestinationManager * dest =
+		(MemoryDestinationManager *) cinfo->dest;
+
+	if (! growMemoryFile(dest->memfile, dest->memfile->size + 1))
+		ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 10);
+	dest->pub.next_output_byte = dest->memfile->data +
+		dest->memfile->size;
+	dest->pub.free_in_buffer = dest->memfile->capacity -
+		dest->memfile->size;
+}
+
+	/* The whole buffer of the MemoryFile has been filled: make it
+	 * grow */
+static boolean
+emptyMemoryDestinationBuffer(j_compress_ptr cinfo)
+{
+	MemoryDestinationManager * dest =
+		(MemoryDestinationManager *) cinfo->dest;
+
+	dest->memfile->size = dest->memfile->capacity;
+	initMemoryDestination(cinfo);
+	return TRUE;
+}
+
+static void
+termMemoryDestination(j_compress_ptr cinfo)
+{
+	MemoryDestinationManager * dest =
+		(MemoryDestinationManager *) cinfo->dest;
+
+	dest->memfile->size = dest->memfile->capacity -
+		dest->pub.free_in_buffer;
+	dest->memfile->position = dest->memfile->size;
+}
+
+	/* Like jpeg_stdio_dest, but for a MemoryFile */
+static void
+setMemoryDestination(j_compress_ptr cinfo, MemoryFile* memfile)
+{
+	MemoryDestinationManager * dest;
+
+	if (cinfo->dest == NULL)
+		cinfo->dest = (struct jpeg_destination_mgr *)
+		    (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo,
+		    JPOOL_PERMANENT, sizeof(MemoryDestinationManager));
+	dest = (MemoryDestinationManager *) cinfo->dest;
+	dest->pub.init_destination = initMemoryDestination;
+	dest->pub.empty_output_buffer = emptyMemoryDestinationBuffer;
+	dest->pub.term_destination = termMemoryDestination;
+	dest->memfile = memfile;
+}
+
+static void
+initHashingDestination(j_compress_ptr cinfo)
+{
+	HashingDestinationManager * dest =
+		(HashingDestinationManager *) cinfo->dest;
+
+	dest->pub.next_output_byte = dest->buffer;
+	dest->pub.free_in_buffer = STRIP_SOURCE_BUFFER_SIZE;
+}
+
+static boolean
+emptyHashingDestinationBuffer(j_compress_ptr cinfo)
+{
+	HashingDestinationManager * dest =
+		(HashingDestinationManager *) cinfo->dest;
+
+	if (fwrite(dest->buffer, 1, STRIP_SOURCE_BUFFER_SIZE, dest->f) !=
+	    STRIP_SOURCE_BUFFER_SIZE)
+		ERREXIT(cinfo, JERR_FILE_WRITE);
+	dest->size += STRIP_SOURCE_BUFFER_SIZE;
+	dest->hash = hashBytes(dest->hash, dest->buffer,
+	    STRIP_SOURCE_BUFFER_SIZE);
+	initHashingDestination(cinfo);
+	return TRUE;
+}
+
+static void
+termHashingDestination(j_compress_ptr cinfo)
+{
+	HashingDestinationManager * dest =
+		(HashingDestinationManager *) cinfo->dest;
+	size_t n = STRIP_SOURCE_BUFFER_SIZE - dest->pub.free_in_buffer;
+
+	if (n > 0 && fwrite(dest->buffer, 1, n, dest->f) != n)
+		ERREXIT(cinfo, JERR_FILE_WRITE);
+	dest->size += n;
+	dest->hash = hashBytes(dest->hash, dest->buffer, (tmsize_t) n);
+	dest->pub.free_in_buffer = STRIP_SOURCE_BUFFER_SIZE;
+	fflush(dest->f);
+	if (ferror(dest->f))
+		ERREXIT(cinfo, JERR_FILE_WRITE);
+}
+
+	/* Like jpeg_stdio_dest, but also computes the size and hash of
+	 * what is written, for getHashingDestinationHash */
+static void
+setHashingDestination(j_compress_ptr cinfo, FILE* f)
+{
+	HashingDestinationManager * dest;
+
+	if (cinfo->dest == NULL)
+		cinfo->dest = (struct jpeg_destination_mgr *)
+		    (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo,
+		    JPOOL_PERMANENT, sizeof(HashingDestinationManager));
+	dest = (HashingDestinationManager *) cinfo->dest;
+	dest->pub.init_destination = initHashingDestination;
+	dest->pub.empty_output_buffer = emptyHashingDestinationBuffer;
+	dest->pub.term_destination = termHashingDestination;
+	dest->f = f;
+	dest->size = 0;
+	dest->hash = FNV_OFFSET_BASIS;
+}
+
+	/* Gives the size and hash of what was written through the
+	 * destination set by setHashingDestination, once the compression
+	 * is finished */
+static void
+getHashingDestinationHash(j_compress_ptr cinfo, MosaicPieceRecord* record)
+{
+	HashingDestinationManager * dest =
+		(HashingDestinationManager *) cinfo->dest;
+
+	record->size = dest->size;
+	record->hash = dest->hash;
+}
+
+	/* Writes n bytes into the file of a mosaic piece, which is out or,
+	 * if not NULL, memout. The size and hash of the record of the piece
+	 * are updated as out is written. Returns 1 on success, 0 on
+	 * failure. */
+static int
+writeToPieceFile(FILE* out, MemoryFile* memout, MosaicPieceRecord* record,
+	const void* buf, tmsize_t n)
+{
+	if (memout != NULL)
+		return writeToMemoryFile(memout, buf, n);
+	record->size += (uint64_t) n;
+	record->hash = hashBytes(record->hash, (const uint8_t*) buf, n);
+	return fwrite(buf, 1, (size_t) n, out) == (size_t) n;
+}
+
 static int
 getNumberOfBlankLanes(TIFF* in)
 {
@@ -2633,6 +7197,123 @@ getScannedZonesFromMap(TIFF* in, ScannedZoneBox ** ppboxes)
 	return numberscannedzones;
 }
 
+	/* Thresholds the image at magnification lowestmagnification, the
+	 * lowest one of "in", into a mask of tissue: a pixel shows tissue
+	 * unless it is light and gray like the glass of the slide. "in" must
+	 * be on its first directory, and is left there. Returns 0, 1 if
+	 * there is no mask, or -1 if "in" can't be rewound and has been
+	 * closed. */
+static int
+buildTissueMask(TIFF* in, float lowestmagnification, TissueMask* mask)
+{
+	uint16_t spp, bitspersample;
+	tmsize_t scanlinesize;
+	uint8_t * buf = NULL;
+	uint32_t x, y;
+	unsigned char * p;
+	int success = 0;
+
+	freeTissueMask(mask);
+	if (lowestmagnification == 0)
+		return (1);
+	/* TIFFSetDirectory can't reach the directories of NDPI files that
+	 * are beyond 4 GiB: read them from the first one */
+	while (getNDPIMagnification(in) != lowestmagnification &&
+	    TIFFReadDirectory(in))
+		;
+	if (getNDPIMagnification(in) != lowestmagnification ||
+	    getWidthAndLength(in, &mask->width, &mask->length,
+	    lowestmagnification))
+		goto done;
+	TIFFGetFieldDefaulted(in, TIFFTAG_SAMPLESPERPIXEL, &spp);
+	TIFFGetFieldDefaulted(in, TIFFTAG_BITSPERSAMPLE, &bitspersample);
+	if (TIFFIsTiled(in) || bitspersample != 8 || (spp != 1 && spp != 3))
+		goto done;
+	if (verbose >= 2)
+		fprintf(stderr, "Finding tissue on the image at magnification x%g (" TIFF_UINT32_FORMAT "x" TIFF_UINT32_FORMAT ")\n",
+			lowestmagnification, mask->width, mask->length);
+
+	TIFFSetField(in, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
+	scanlinesize = TIFFRasterScanlineSize(in);
+	buf = _TIFFmalloc(scanlinesize);
+	mask->istissue = _TIFFmalloc((tmsize_t) mask->width * mask->length);
+	if (buf == NULL || mask->istissue == NULL) {
+		TIFFError(TIFFFileName(in),
+			"Error, can't allocate memory for the mask of tissue");
+		goto done;
+	}
+	for (y = 0, p = mask->istissue ; y < mask->length ; y++) {
+		uint8_t * q = buf;
+
+		if (! readContigStripsIntoBuffer(in, buf, y, 1, scanlinesize))
+			goto done;
+		for (x = 0 ; x < mask->width ; x++, p++, q += spp) {
+			uint8_t min = q[0], max = q[0];
+
+			if (spp == 3) {
+				MIN(min, q[1]); MIN(min, q[2]);
+				MAX(max, q[1]); MAX(max, q[2]);
+			}
+			/* Stained tissue is colored, dense tissue dark */
+			*p = max - min >= 20 || min < 200;
+		}
+	}
+	success = 1;
+
+done:
+	if (buf != NULL)
+		_TIFFfree(buf);
+	if (! success)
+		freeTissueMask(mask);
+	/* Offsets of NDPI directories are fixed relative to the current
+	 * one: go past the last directory before rewinding */
+	while (TIFFReadDirectory(in))
+		;
+	if (rewindToBeginningOfTIFF(in)) {
+		freeTissueMask(mask);
+		return (-1);
+	}
+	return success ? 0 : 1;
+}
+
+	/* Returns 1 if tissue covers at least the requested fraction of the
+	 * part of the current image at x, y of size width x length */
+static int
+showsTissue(const TissueMask* mask, uint32_t x, uint32_t y, uint32_t width,
+	uint32_t length)
+{
+	uint32_t mxmin, mymin, mxmax, mymax, mx, my;
+	uint64_t count = 0;
+
+	if (mask->imagewidth == 0 || mask->imagelength == 0)
+		return 1;
+	mxmin = (uint64_t) x * mask->width / mask->imagewidth;
+	mymin = (uint64_t) y * mask->length / mask->imagelength;
+	mxmax = ((uint64_t) (x + width) * mask->width + mask->imagewidth-1) /
+		mask->imagewidth;
+	mymax = ((uint64_t) (y + length) * mask->length +
+		mask->imagelength-1) / mask->imagelength;
+	MIN(mxmax, mask->width);
+	MIN(mymax, mask->length);
+	if (mxmax <= mxmin || mymax <= mymin)
+		return 1;
+	for (my = mymin ; my < mymax ; my++)
+		for (mx = mxmin ; mx < mxmax ; mx++)
+			count += mask->istissue[(tmsize_t) my * mask->width + mx];
+	return count >= tissuefractionthreshold *
+		(uint64_t) (mxmax - mxmin) * (mymax - mymin);
+}
+
+static void
+freeTissueMask(TissueMask* mask)
+{
+	if (mask->istissue != NULL)
+		_TIFFfree(mask->istissue);
+	mask->istissue = NULL;
+	mask->imagewidth = 0;
+	mask->imagelength = 0;
+}
+
 static void
 findUnitsAtMagnification(TIFF* in, float ndpimagnification, uint32_t* xunit, uint32_t* yunit)
 {
@@ -2678,8 +7359,14 @@ extendArrayOf##nameOfTypeS(type ** array, unsigned * numberofelems, const char *
 
 extendArrayOf(Floats, float)
 extendArrayOf(MagnificationDescriptions, MagnificationDescription)
+extendArrayOf(SynthesizedMagnifications, SynthesizedMagnification)
 extendArrayOf(Int32s, int32_t)
 extendArrayOf(Boxes, BoxToExtract)
+extendArrayOf(BoxCrops, BoxCrop)
+extendArrayOf(Strings, char *)
+extendArrayOf(MosaicPieceRecords, MosaicPieceRecord)
+extendArrayOf(DeepZoomSources, DeepZoomSource)
+extendArrayOf(ImageTasks, ImageTask)
 
 #define addToSetOf(nameOfTypeS, type) static int \
 addToSetOf##nameOfTypeS(type ** set, unsigned * numberofelems, \
@@ -2750,6 +7437,28 @@ buildFileNameForExtract(const char * NDPIfilename,
 	}
 }
 
+	/* Removes the empty files created by buildFileNameForExtract to
+	 * reserve the names of boxes whose mosaic was made directly from
+	 * the NDPI file. They are kept until the NDPI file has been
+	 * processed so that the next boxes don't get the same names */
+static void
+releaseReservedFileNames(void)
+{
+	unsigned u;
+
+	for (u = 0 ; u < numberofreservedfilenames ; u++) {
+		if (verbose >= 4)
+			fprintf(stderr, "Removing \"%s\"\n",
+				reservedfilenames[u]);
+		unlink(reservedfilenames[u]);
+		_TIFFfree(reservedfilenames[u]);
+	}
+	if (reservedfilenames != NULL)
+		_TIFFfree(reservedfilenames);
+	reservedfilenames = NULL;
+	numberofreservedfilenames = 0;
+}
+
 static void
 greetings()
 {
@@ -2786,29 +7495,44 @@ usage(const char* errorMessage, ...)
 	fprintf(stderr, " -v        verbose monitoring (-v -v, -vvv... for more messages)\n");
 	fprintf(stderr, " -K        print control data under the form Key:value on stdout\n");
 	fprintf(stderr, " -TE       report TIFF errors (with dialog boxes under Windows)\n");
+	fprintf(stderr, " -R        scan images without usable restart marker positions and save them in file.ndpi.rstidx for faster random access (reused by later runs)\n");
+	fprintf(stderr, " -A        have the system read NDPI files ahead of the decoding of their images (for slow or network storage)\n");
 	fprintf(stderr, " -s        subdivide image into scanned zones (remove blank filling)\n");
 	fprintf(stderr, " -x[m1[,m2...]]  extract only images at the specified magnification(s) m1,...\n");
+	fprintf(stderr, "  a magnification which is not in the NDPI file is synthesized from an available one 2, 4 or 8 times larger\n");
 	fprintf(stderr, " -z[o1[,o2...]]  extract only images at the specified z-offsets o1,...\n");
 	fprintf(stderr, " -ex1,y1,W1,L1[,label1][:x2,...]  extract only specified box(es), ignoring -s\n");
 	fprintf(stderr, "  xn,yn: relative coordinates of the top left corner of rectangle to extract; real numbers (x=0: left edge of slide, x=1: right edge of slide, y=0: top edge of slide, ...)\n");
 	fprintf(stderr, "  Wn,Ln: relative width and length to extract (e.g. W=0.25: one fourth of the width, L=1: whole length)\n");
 	fprintf(stderr, "  labeln: optional label that will be part of the name(s) of file(s) where extracted box will be stored\n");
 	fprintf(stderr, " -ExM1[,zO1a[,zO1b...]],x1,y1,W1,L1[,label1][:M2,...]  like -e with px units\n");
-	fprintf(stderr, "  Mn: magnification to extract (mandatory) -- note the 'x' prefix\n");
+	fprintf(stderr, "  Mn: magnification to extract (mandatory; synthesized as with -x if not available) -- note the 'x' prefix\n");
 	fprintf(stderr, "  Onk: z-offsets to extract -- note the 'z' prefix\n");
 	fprintf(stderr, "  xn,yn: absolute coordinates of the top left corner of rectangle to extract in pixels (x=0: left edge of slide, y=0: top edge of slide)\n");
 	fprintf(stderr, "  Wn,Ln: absolute width and length to extract in pixels\n");
+	fprintf(stderr, " -E@file   like -E with the boxes read from file, one per line (lines starting with '#' are ignored)\n");
+	fprintf(stderr, "  the boxes of an image are extracted together, in a single pass over the image\n");
 	fprintf(stderr, " -m[#][c]  make in addition mosaic of largest images\n");
-	fprintf(stderr, "  #: memory size limit in MiB on each mosaic piece (default 1024.000; 0 for no limit)\n");
+	fprintf(stderr, "  #: memory size limit in MiB on each mosaic piece, and on the band of decoded scanlines the pieces of a row are cut from when the image is not tiled (default 1024.000; 0 for no limit)\n");
 	fprintf(stderr, "  c: compression format of mosaic pieces ('n'one, 'l'zw,\n");
 	fprintf(stderr, "       'j'peg in TIFF file (default), 'J'PEG stand-alone file;\n");
 	fprintf(stderr, "       j and J may be followed by quality in range 1-100, default = input quality if applicable, 75 if not)\n");
 	fprintf(stderr, " -g[w]x[h] width and height in pixels of each piece of the mosaic (overrides memory limit given with -m or -M if both width and height are given; 0 or no value for either dimension means default; default are largest dimensions that satisfy memory limit, divide the full image in equal pieces by powers of 2, and are close to each other)\n");
 	fprintf(stderr, " -o#[%%]    overlap amount between adjacent mosaic pieces (in pixels or %%, default 0)\n");
 	fprintf(stderr, " -M[#][c]  same as -m but a mosaic is always made (even for small images)\n");
+	fprintf(stderr, " -d        with -m or -M, make mosaic pieces straight from the NDPI file, without writing the split TIFF images (except for synthesized magnifications)\n");
+	fprintf(stderr, " -B[#]     with -m or -M, don't make the mosaic pieces where less than # %% of the surface shows tissue on the image at the lowest magnification (default 5)\n");
+	fprintf(stderr, " -N        don't decode nor encode what is in the blank lanes of the NDPI file, where nothing was scanned: mosaic pieces there are not made, tiles there in split images are blank\n");
+	fprintf(stderr, " -afile    with -m or -M, write the mosaic pieces one after the other into the uncompressed tar archive file ('-' for stdout) instead of one file each; its last member %s gives the offset in the archive, position, size and hash of each piece\n", MOSAIC_ARCHIVE_INDEX_NAME);
+	fprintf(stderr, " --resume  with -m or -M, keep the mosaic pieces of a previous run that are listed in its manifest file_mosaic.txt and unchanged, and make only the other ones (the NDPI file is then decoded from the first missing band on if it has restart marker positions)\n");
+	fprintf(stderr, " -Z[s[,o]] instead of splitting, make a Deep Zoom pyramid (file_xM_zO.dzi and directory file_xM_zO_files of JPEG tiles) of the image at the highest magnification of each z-offset, with tiles of s x s pixels (default 254) overlapping by o pixels (default 1); levels are read from the images of the NDPI file where they exist and the other ones are made by halving the level above; -mJ# sets the JPEG quality and -t# the number of threads\n");
+	fprintf(stderr, " -j#[,m]   process # files at once, as long as the memory they may need, estimated from the size of their largest image and the limits of -m and -c, fits into m MiB (default: the larger of these limits; 0 for no limit); control data of -K are printed file after file as without -j\n");
+	fprintf(stderr, " -i#       process up to # images (magnifications and z-offsets) of each file at once, the largest first, each one with a clone of the handle on the file; the memory they may need adds up, which -j takes into account\n");
+	fprintf(stderr, " -t#       encode mosaic pieces, and the tiles of split images row by row, with # threads (up to # pieces are then held in memory at once, fewer if they would not fit, with the band of decoded scanlines they are cut from, into the limit of -m; default 1)\n");
+	fprintf(stderr, " -J        with -mJ or -MJ, copy the JPEG data of the NDPI file into mosaic pieces without re-encoding where possible (piece sizes and overlaps are then rounded to the restart interval grid unless given with -g)\n");
 	fprintf(stderr, " -cC  specify the compression format of split images\n");
 	fprintf(stderr, "  C: compression format (as for mosaic pieces except that J isn't supported)\n");
-	fprintf(stderr, " -p[s[,WxL]]     extract preview image(s) only (image(s) at lowest available magnification, or macroscopic image of the slide), of maximum size / width / length s / W / L pixels (default 1 Mpx for s and no limits on W and L; 0 for any dimension means no limit) and print a few parameters (useful to prepare selection of zones to extract at large magnification)\n\n");
+	fprintf(stderr, " -p[s[,WxL]]     extract preview image(s) only (image(s) at the largest available magnification that fits the size limits, or if none does, at the largest one synthesized from an available one 2, 4 or 8 times larger that fits them, or macroscopic image of the slide), of maximum size / width / length s / W / L pixels (default 1 Mpx for s and no limits on W and L; 0 for any dimension means no limit) and print a few parameters (useful to prepare selection of zones to extract at large magnification)\n\n");
 
 	fprintf(stderr, "Examples: ndpisplit -e0,0.75,0.25,0.25 -m500J60 -o30 to split the lower left quarter of the images inside the NDPI file into separate TIFF files (one for each magnification and each z level), then produce a mosaic from each TIFF file that would require more than 500 MiB of memory to open. Mosaic pieces will require less than 500 MiB to open and be stored into JPEG files with quality level 60. There will be an overlap of 30 pixels between adjacent mosaic pieces.\n");
 	fprintf(stderr, "    ndpisplit -Ex40,z-100,z100,1000,0,3000,2000 to extract, from the images at magnification 40x and z-offsets -100 or 100, a rectangle of 3000x2000 pixels with top left corner at position (1000,0).\n");
@@ -2849,23 +7573,30 @@ my_ceil(double x)
 	return c - x > 0.999 ? c-1 : c;
 }
 
+	/* Each message is written by a single call, so that the messages
+	 * of threads processing files at once aren't mixed */
 static void
 stderrErrorHandler(const char* module, const char* fmt, va_list ap)
 {
+	char message[1024];
+
+	vsnprintf(message, sizeof(message), fmt, ap);
 	if (module != NULL)
-		fprintf(stderr, "%s: ", module);
-	vfprintf(stderr, fmt, ap);
-	fprintf(stderr, ".\n");
+		fprintf(stderr, "%s: %s.\n", module, message);
+	else
+		fprintf(stderr, "%s.\n", message);
 }
 
 static void
 stderrWarningHandler(const char* module, const char* fmt, va_list ap)
 {
+	char message[1024];
+
+	vsnprintf(message, sizeof(message), fmt, ap);
 	if (module != NULL)
-		fprintf(stderr, "%s: ", module);
-	fprintf(stderr, "Warning, ");
-	vfprintf(stderr, fmt, ap);
-	fprintf(stderr, ".\n");
+		fprintf(stderr, "%s: Warning, %s.\n", module, message);
+	else
+		fprintf(stderr, "Warning, %s.\n", message);
 }
 
 /* vim: set ts=8 sts=8 sw=8 noet: */